@@ -17,10 +17,13 @@
  */
 
 #include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <unistd.h>
+#include <linux/falloc.h>
 #include <math.h>
 #define max(a, b) (((a) > (b)) ? (a) : (b))
 // Using 2.9.x FUSE API
@@ -62,12 +65,40 @@ static bool a1fs_init(fs_ctx *fs, a1fs_opts *opts)
 	if (opts->help)
 		return true;
 
-	size_t size;
-	void *image = map_file(opts->img_path, A1FS_BLOCK_SIZE, &size);
-	if (!image)
-		return false;
+	return fs_mount(fs, opts);
+}
+
+/** Get file system context. */
+static fs_ctx *get_fs(void)
+{
+	return (fs_ctx *)fuse_get_context()->private_data;
+}
 
-	return fs_ctx_init(fs, image, size);
+/** Get the handle of an open file; see a1fs_open(). */
+static fhandle *get_handle(struct fuse_file_info *fi)
+{
+	return (fhandle *)(uintptr_t)fi->fh;
+}
+
+/**
+ * Start the background work of the file system.
+ *
+ * Called by FUSE once it is running, after it has gone into the background;
+ * threads started in a1fs_init() would not survive that.
+ *
+ * @param conn  connection parameters; asks for splicing if it is available.
+ * @return      the file system context, passed on as the private data.
+ */
+static void *a1fs_start(struct fuse_conn_info *conn)
+{
+	fs_ctx *fs = get_fs();
+	//File data can be spliced between /dev/fuse and the image file
+	conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+	if (fs->online_discard && !discard_start(&fs->discard, discard_blks_cb, fs))
+		fprintf(stderr, "Failed to start the discard thread\n");
+	if (!journal_start(&fs->journal))
+		fprintf(stderr, "Failed to start the journal thread\n");
+	return fs;
 }
 
 /**
@@ -78,18 +109,13 @@ static bool a1fs_init(fs_ctx *fs, a1fs_opts *opts)
  */
 static void a1fs_destroy(void *ctx)
 {
-	fs_ctx *fs = (fs_ctx *)ctx;
-	if (fs->image)
-	{
-		munmap(fs->image, fs->size);
-		fs_ctx_destroy(fs);
-	}
+	fs_unmount((fs_ctx *)ctx);
 }
 
-/** Get file system context. */
-static fs_ctx *get_fs(void)
+/** Start a new request on the file system context. */
+static void get_req(fs_req *rq)
 {
-	return (fs_ctx *)fuse_get_context()->private_data;
+	fs_req_init(rq, get_fs());
 }
 
 /**
@@ -110,19 +136,7 @@ static fs_ctx *get_fs(void)
 static int a1fs_statfs(const char *path, struct statvfs *st)
 {
 	(void)path; // unused
-	fs_ctx *fs = get_fs();
-
-	memset(st, 0, sizeof(*st));
-	st->f_bsize = A1FS_BLOCK_SIZE;
-	st->f_frsize = A1FS_BLOCK_SIZE;
-	st->f_ffree = fs->bblk->num_free_inodes;
-	st->f_favail = fs->bblk->num_free_inodes;
-	st->f_blocks = fs->size / A1FS_BLOCK_SIZE;
-	st->f_bfree = fs->bblk->num_free_blocks;
-	st->f_bavail = fs->bblk->num_free_blocks;
-	st->f_files = fs->bblk->num_inodes;
-	st->f_namemax = A1FS_NAME_MAX;
-
+	fs_statfs(get_fs(), st);
 	return 0;
 }
 
@@ -153,81 +167,73 @@ static int a1fs_getattr(const char *path, struct stat *st)
 {
 	if (strlen(path) >= A1FS_PATH_MAX)
 		return -ENAMETOOLONG;
-	fs_ctx *fs = get_fs();
+	fs_req rq;
+	get_req(&rq);
 
 	memset(st, 0, sizeof(*st));
 
-	//Clear err_node
-	fs->err_code = 0;
-	//TODO: lookup the inode for given path and, if it exists, fill in the
+	//Lookup the inode for given path and, if it exists, fill in the
 	// required fields based on the information stored in the inode
-
-	// a1fs_inode *inode;
-	// find_path(path, &inode, fs);
-	find_path_inode(path, fs);
-	if (fs->err_code == 0)
+	find_path_inode(path, &rq);
+	if (rq.err_code == 0)
 	{
-
-		//NOTE: all the fields set below are required and must be set according
-		// to the information stored in the corresponding inode
-
-		st->st_nlink = fs->path_inode->links;
-		st->st_size = fs->path_inode->size;
-		st->st_mtim = fs->path_inode->mtime;
-		st->st_ino = fs->path_inode->hz_inode_pos;
-		st->st_mode = fs->path_inode->mode;
-		unsigned int result = 1 + st->st_size / A1FS_BLOCK_SIZE;
-		if (st->st_size % A1FS_BLOCK_SIZE == 0)
-		{
-			result = result - 1;
-		}
-		result *= A1FS_BLOCK_SIZE;
-		st->st_blocks = result / 512;
+		a1fs_inode *inode = rq.path_inode;
+		inode_rdlock(rq.fs, inode->hz_inode_pos);
+		inode_stat(&rq, inode, st);
+		inode_unlock(rq.fs, inode->hz_inode_pos);
 	}
-	return fs->err_code;
+	return rq.err_code;
+}
+
+/** Where a1fs_readdir() passes the entries that fill_dir() finds. */
+typedef struct readdir_buf {
+	void *buf;
+	fuse_fill_dir_t filler;
+} readdir_buf;
+
+static bool readdir_fill(void *arg, const char *name, a1fs_ino_t ino, off_t next)
+{
+	(void)ino; // FUSE numbers the inodes itself
+	readdir_buf *rb = arg;
+	return rb->filler(rb->buf, name, NULL, next) != 0;
 }
 
 /**
  * Read a directory.
  *
- * Implements the readdir() system call. Should call filler(buf, name, NULL, 0)
- * for each directory entry. See fuse.h in libfuse source code for details.
+ * Implements the readdir() system call. Entries are passed to filler straight
+ * from the dentry blocks, each with the offset of the entry that follows it,
+ * until filler's buffer is full; FUSE then calls again with that offset. See
+ * fuse.h in libfuse source code for details.
  *
  * Assumptions (already verified by FUSE using getattr() calls):
  *   "path" exists and is a directory.
  *
- * Errors:
- *   ENOMEM  not enough memory (e.g. a filler() call failed).
- *
  * @param path    path to the directory.
  * @param buf     buffer that receives the result.
  * @param filler  function that needs to be called for each directory entry.
- *                Pass 0 as offset (4th argument). 3rd argument can be NULL.
- * @param offset  unused.
+ * @param offset  offset to resume from; 0 for the first call.
  * @param fi      unused.
  * @return        0 on success; -errno on error.
  */
 static int a1fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 						off_t offset, struct fuse_file_info *fi)
 {
-	(void)offset; // unused
 	(void)fi;	  // unused
-	fs_ctx *fs = get_fs();
+	fs_req rq;
+	get_req(&rq);
 
-	fs->err_code = 0;
 	//Lookup the directory inode for given path and iterate through its
 	// directory entries
 
-	find_path_inode(path, fs);
-	fs->ent = malloc(fs->path_inode->size);
-	if (fs->ent == NULL || filler(buf, ".", NULL, 0) || filler(buf, "..", NULL, 0))
-		return -ENOMEM;
-	find_ent_in_ext(fs->path_inode, fs, "", true);
-	//Check whether calling filler generates error
-	//Check if error occurs and Update fs->err_code
-	check_filler_err(fs, fs->path_inode->size, buf, filler, fs->ent);
-	free(fs->ent);
-	return fs->err_code;
+	if (find_path_inode(path, &rq) != 0)
+		return rq.err_code;
+	a1fs_inode *dir = rq.path_inode;
+	readdir_buf rb = { .buf = buf, .filler = filler };
+	inode_rdlock(rq.fs, dir->hz_inode_pos);
+	int ret = fill_dir(&rq, dir, &rb, readdir_fill, offset);
+	inode_unlock(rq.fs, dir->hz_inode_pos);
+	return ret;
 }
 
 /**
@@ -251,11 +257,10 @@ static int a1fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 static int a1fs_mkdir(const char *path, mode_t mode)
 {
 	mode = mode | S_IFDIR;
-	fs_ctx *fs = get_fs();
-	//Clear error_code
-	fs->err_code = 0;
+	fs_req rq;
+	get_req(&rq);
 
-	return create_file_dir(fs, path, mode, false);
+	return create_file_dir(&rq, path, mode, false);
 }
 
 /**
@@ -274,9 +279,10 @@ static int a1fs_mkdir(const char *path, mode_t mode)
  */
 static int a1fs_rmdir(const char *path)
 {
-	fs_ctx *fs = get_fs();
-	//TODO: remove the directory at given path (only if it's empty)
-	return rm_dir_file(fs, path, true);
+	fs_req rq;
+	get_req(&rq);
+	//Remove the directory at given path (only if it's empty)
+	return rm_dir_file(&rq, path, true);
 }
 
 /**
@@ -295,17 +301,56 @@ static int a1fs_rmdir(const char *path)
  *
  * @param path  path to the file to create.
  * @param mode  file mode bits.
- * @param fi    unused.
+ * @param fi    receives the handle of the new file, as from a1fs_open().
  * @return      0 on success; -errno on error.
  */
 static int a1fs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
 {
-	(void)fi; // unused
 	assert(S_ISREG(mode));
-	fs_ctx *fs = get_fs();
+	fs_req rq;
+	get_req(&rq);
 
+	fhandle *fh = handle_new(NULL);
+	if (fh == NULL)
+		return -ENOMEM;
 	//Create a file at given path with given mode
-	return create_file_dir(fs, path, mode, true);
+	if (create_file_dir(&rq, path, mode, true) != 0)
+	{
+		handle_free(fh);
+		return rq.err_code;
+	}
+	fh->inode = rq.path_inode;
+	fi->fh = (uintptr_t)fh;
+	return 0;
+}
+
+/**
+ * Open a file.
+ *
+ * The path is resolved once, here, into a handle kept in fi->fh that the
+ * other operations on the open file use instead of the path: it holds the
+ * inode, the extent a read or write touched last and whether the file is
+ * read or written sequentially. See fhandle.
+ *
+ * Errors:
+ *   ENOMEM  not enough memory (e.g. a malloc() call failed).
+ *
+ * @param path  path to the file to open.
+ * @param fi    receives the handle of the file.
+ * @return      0 on success; -errno on error.
+ */
+static int a1fs_open(const char *path, struct fuse_file_info *fi)
+{
+	fs_req rq;
+	get_req(&rq);
+
+	if (find_path_inode(path, &rq) != 0)
+		return rq.err_code;
+	fhandle *fh = handle_new(rq.path_inode);
+	if (fh == NULL)
+		return -ENOMEM;
+	fi->fh = (uintptr_t)fh;
+	return 0;
 }
 
 /**
@@ -323,9 +368,10 @@ static int a1fs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
  */
 static int a1fs_unlink(const char *path)
 {
-	fs_ctx *fs = get_fs();
+	fs_req rq;
+	get_req(&rq);
 	//remove the file at given path
-	return rm_dir_file(fs, path, false);
+	return rm_dir_file(&rq, path, false);
 }
 
 /**
@@ -347,24 +393,16 @@ static int a1fs_unlink(const char *path)
  */
 static int a1fs_utimens(const char *path, const struct timespec times[2])
 {
-	fs_ctx *fs = get_fs();
+	fs_req rq;
+	get_req(&rq);
 
-	//TODO: update the modification timestamp (mtime) in the inode for given
+	//Update the modification timestamp (mtime) in the inode for given
 	// path with either the time passed as argument or the current time,
 	// according to the utimensat man page
 
-	//Clear error code
-	fs->err_code = 0;
-
-	find_path_inode(path, fs);
-	const struct timespec last_time = times[1];
-	if (last_time.tv_nsec != UTIME_NOW)
-		fs->path_inode->mtime = last_time;
-	else
-	{
-		clock_gettime(CLOCK_REALTIME, &(fs->path_inode->mtime));
-	}
-
+	if (find_path_inode(path, &rq) != 0)
+		return rq.err_code;
+	inode_set_mtime(&rq, rq.path_inode, &times[1]);
 	return 0;
 }
 
@@ -388,24 +426,12 @@ static int a1fs_utimens(const char *path, const struct timespec times[2])
  */
 static int a1fs_truncate(const char *path, off_t size)
 {
-	fs_ctx *fs = get_fs();
-
-	//Clear err_node
-	fs->err_code = 0;
-	find_path_inode(path, fs);
-	unsigned int unsign_size = (unsigned int)size;
-	if (unsign_size == fs->path_inode->size)
-	{
-		return 0;
-	}
-	check_byte(fs, size, unsign_size - fs->path_inode->size);
-	if (fs->err_code == 0 && unsign_size < fs->path_inode->size)
-	{
+	fs_req rq;
+	get_req(&rq);
 
-		blk_deallocation(fs, size);
-	}
-
-	return fs->err_code;
+	if (find_path_inode(path, &rq) != 0)
+		return rq.err_code;
+	return file_truncate(&rq, rq.path_inode, size);
 }
 
 /**
@@ -413,8 +439,8 @@ static int a1fs_truncate(const char *path, off_t size)
  *
  * Implements the pread() system call. Must return exactly the number of bytes
  * requested except on EOF (end of file). Reads from file ranges that have not
- * been written to must return ranges filled with zeros. You can assume that the
- * byte range from offset to offset + size is contained within a single block.
+ * been written to must return ranges filled with zeros. The byte range may
+ * span any number of blocks, up to max_read.
  *
  * Assumptions (already verified by FUSE using getattr() calls):
  *   "path" exists and is a file.
@@ -425,62 +451,18 @@ static int a1fs_truncate(const char *path, off_t size)
  * @param buf     pointer to the buffer that receives the data.
  * @param size    buffer size (number of bytes requested).
  * @param offset  offset from the beginning of the file to read from.
- * @param fi      unused.
+ * @param fi      the open file.
  * @return        number of bytes read on success; 0 if offset is beyond EOF;
  *                -errno on error.
  */
 static int a1fs_read(const char *path, char *buf, size_t size, off_t offset,
 					 struct fuse_file_info *fi)
 {
-	(void)fi; // unused
-	fs_ctx *fs = get_fs();
-
-	//Clear Error code
-	fs->err_code = 0;
-
-	find_path_inode(path, fs);
-	a1fs_inode *inode = fs->path_inode;
-	if (offset > (int)inode->size || inode->size == 0)
-		return 0;
-	int result_blk = 1;
-	if (offset)
-	{
-		result_blk = 1 + offset / A1FS_BLOCK_SIZE;
-		if (offset % A1FS_BLOCK_SIZE == 0)
-		{
-			result_blk = result_blk - 1;
-		}
-	}
-	//Update extent
-	update_ext_blk(false, fs, fs->path_inode->hz_extent_p);
-	int trace = 0;
-	int k = 0;
-	//Loop over extent until find the target block
-	while (k < fs->path_inode->hz_extent_size)
-	{
-		trace += fs->ext[k].count;
-		if (trace >= result_blk)
-		{
-			break;
-		}
-		k++;
-	}
-	//Get Data block
-	int db = (trace >= result_blk) ? (int)(fs->ext[k].start + (trace - result_blk)) : -1;
-
-	void *byte = (void *)update_ext_blk(true, fs, db) + offset % A1FS_BLOCK_SIZE;
-
-	int rest_byte = point_to_end(fs->path_inode, fs) - byte;
-	int result_size = max(rest_byte, (int)size);
-	//Using memcpy to improve efficiency
-	memcpy(buf, byte, result_size);
-	if (result_size != (int)size)
-	{
-		unsigned int temp = size - rest_byte;
-		memset(buf + rest_byte, 0, temp);
-	}
+	(void)path; // unused
+	fs_req rq;
+	get_req(&rq);
 
-	return result_size;
+	return file_read(&rq, get_handle(fi), buf, size, offset);
 }
 
 /**
@@ -489,8 +471,9 @@ static int a1fs_read(const char *path, char *buf, size_t size, off_t offset,
  * Implements the pwrite() system call. Must return exactly the number of bytes
  * requested except on error. If the offset is beyond EOF (end of file), the
  * file must be extended. If the write creates a "hole" of uninitialized data,
- * the new uninitialized range must filled with zeros. You can assume that the
- * byte range from offset to offset + size is contained within a single block.
+ * the new uninitialized range must read as zeros; whole blocks of it are left
+ * without disk blocks. The byte range may span any number of blocks, up to
+ * max_write.
  *
  * Assumptions (already verified by FUSE using getattr() calls):
  *   "path" exists and is a file.
@@ -498,79 +481,217 @@ static int a1fs_read(const char *path, char *buf, size_t size, off_t offset,
  * Errors:
  *   ENOMEM  not enough memory (e.g. a malloc() call failed).
  *   ENOSPC  not enough free space in the file system.
- *   ENOSPC  too many extents (a1fs only needs to support 512 extents per file)
  *
  * @param path    path to the file to write to.
  * @param buf     pointer to the buffer containing the data.
  * @param size    buffer size (number of bytes requested).
  * @param offset  offset from the beginning of the file to write to.
- * @param fi      unused.
+ * @param fi      the open file.
  * @return        number of bytes written on success; -errno on error.
  */
 static int a1fs_write(const char *path, const char *buf, size_t size,
 					  off_t offset, struct fuse_file_info *fi)
 {
-	(void)fi; // unused
-	fs_ctx *fs = get_fs();
-	fs->err_code = 0;
-	//Check if size is empty
-	if (size == 0)
-		return 0;
-	//Find correponding path inode
-	find_path_inode(path, fs);
-
-	if (fs->path_inode->hz_extent_p == -1)
-	{
-		load_datablock(fs->path_inode, 0, fs);
-	}
-	//Check if the space is empty
-	if (fs->err_code == 0)
-	{
-		//Perform byte addition
-		check_byte(fs, get_num_byte(fs, offset), offset - fs->path_inode->size);
-		if (fs->err_code == 0)
-		{
-			if (get_num_byte(fs, offset + size) > 0)
-			{
-				byte_addition(fs, fs->path_inode, (int)size);
-			}
-		}
-		if (fs->err_code == 0)
-		{
-			int result_blk = 1;
-			if (offset)
-			{
-				result_blk = 1 + offset / A1FS_BLOCK_SIZE;
-				if (offset % A1FS_BLOCK_SIZE == 0)
-				{
-					result_blk = result_blk - 1;
-				}
-			}
-			//Update extent
-			update_ext_blk(false, fs, fs->path_inode->hz_extent_p);
-			int trace = 0;
-			int k = 0;
-			//Loop over extent until find the target block
-			while (k < fs->path_inode->hz_extent_size)
-			{
-				trace += fs->ext[k].count;
-				if (trace >= result_blk)
-				{
-					break;
-				}
-				k++;
-			}
-			//Get Data block
-			int db = (trace >= result_blk) ? (int)(fs->ext[k].start + (trace - result_blk)) : -1;
-			void *byte = (void *)update_ext_blk(true, fs, db) + offset % A1FS_BLOCK_SIZE;
-			memcpy(byte, buf, size);
-			return size;
-		}
-	}
-	return fs->err_code;
+	(void)path; // unused
+	fs_req rq;
+	get_req(&rq);
+
+	return file_write(&rq, get_handle(fi), buf, size, offset);
+}
+
+/**
+ * Read data from a file as a list of buffers.
+ *
+ * Like a1fs_read(), but the data is returned as a list of buffers that FUSE
+ * sends to the kernel itself. FUSE only sends them once this returns and the
+ * inode is unlocked, when a truncate could already have freed the blocks of
+ * the file and given them to another one, so the data is copied to memory
+ * rather than described as ranges of the image file.
+ *
+ * Errors:
+ *   ENOMEM  not enough memory (e.g. a malloc() call failed).
+ *
+ * @param path    path to the file to read from.
+ * @param bufp    pointer to the variable that receives the buffer list.
+ * @param size    number of bytes requested.
+ * @param offset  offset from the beginning of the file to read from.
+ * @param fi      the open file.
+ * @return        0 on success; -errno on error.
+ */
+static int a1fs_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset,
+						 struct fuse_file_info *fi)
+{
+	(void)path; // unused
+	fs_req rq;
+	get_req(&rq);
+
+	buf_list l;
+	int ret = file_read_buf(&rq, get_handle(fi), &l, size, offset, false);
+	//FUSE frees the list and the memory buffers in it
+	if (ret == 0)
+		*bufp = l.vec;
+	return ret;
+}
+
+/**
+ * Write data to a file without copying it.
+ *
+ * Like a1fs_write(), but the data comes as a list of buffers, usually a pipe
+ * filled from /dev/fuse. The file is extended and the range given disk
+ * blocks as for a write, and then the data is spliced straight into the
+ * extents in the image file. With -o zero_holes, the data has to be looked
+ * at, so it is copied to memory and written with a1fs_write().
+ *
+ * Errors:
+ *   ENOMEM  not enough memory (e.g. a malloc() call failed).
+ *   ENOSPC  not enough free space in the file system.
+ *
+ * @param path    path to the file to write to.
+ * @param buf     the data.
+ * @param offset  offset from the beginning of the file to write to.
+ * @param fi      the open file.
+ * @return        number of bytes written on success; -errno on error.
+ */
+static int a1fs_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset,
+						  struct fuse_file_info *fi)
+{
+	(void)path; // unused
+	fs_req rq;
+	get_req(&rq);
+
+	return file_write_buf(&rq, get_handle(fi), buf, offset);
+}
+
+/** Hand the open file to file_sync(). */
+static int sync_file(struct fuse_file_info *fi, int mode)
+{
+	fs_req rq;
+	get_req(&rq);
+
+	return file_sync(&rq, get_handle(fi)->inode, mode);
+}
+
+/**
+ * Flush a file; called on each close() of the file.
+ *
+ * Blocks written to a file get disk blocks here, once the size of the file
+ * is known, rather than in write(). Nothing is forced to disk; that is left
+ * to a1fs_fsync().
+ *
+ * Errors:
+ *   ENOSPC  not enough free space in the file system.
+ *
+ * @param path  path to the file.
+ * @param fi    the open file.
+ * @return      0 on success; -errno on error.
+ */
+static int a1fs_flush(const char *path, struct fuse_file_info *fi)
+{
+	(void)path; // unused
+	return sync_file(fi, SYNC_FLUSH);
+}
+
+/**
+ * Release a file; called when it is closed for the last time.
+ *
+ * Also gives back the blocks allocated past the end of the file in case it
+ * kept growing, unless they were allocated with fallocate(). Frees the
+ * handle made by a1fs_open() or a1fs_create().
+ *
+ * @param path  path to the file.
+ * @param fi    the open file.
+ * @return      0 on success; -errno on error.
+ */
+static int a1fs_release(const char *path, struct fuse_file_info *fi)
+{
+	(void)path; // unused
+	int ret = sync_file(fi, SYNC_RELEASE);
+	handle_free(get_handle(fi));
+	return ret;
+}
+
+/**
+ * Synchronize the contents of a file.
+ *
+ * Errors:
+ *   ENOSPC  not enough free space in the file system.
+ *
+ * @param path      path to the file.
+ * @param datasync  unused.
+ * @param fi        the open file.
+ * @return          0 on success; -errno on error.
+ */
+static int a1fs_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+	(void)path; // unused
+	(void)datasync; // unused
+	return sync_file(fi, SYNC_FSYNC);
+}
+
+/**
+ * Allocate space for a file.
+ *
+ * Implements the fallocate() system call for mode 0, FALLOC_FL_KEEP_SIZE and
+ * FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE. Punching a hole frees the whole
+ * blocks in the range and zeroes the rest of it. Otherwise, holes in the range and the range past the end of the file get blocks that
+ * are allocated unwritten: they are not zeroed on disk but read as zeros
+ * until they are written, so the call takes time proportional to the number
+ * of extents rather than to the length of the range. Blocks
+ * allocated past the end of the file with FALLOC_FL_KEEP_SIZE are kept when
+ * the file is closed, until the file is truncated.
+ *
+ * Errors:
+ *   EINVAL      offset is negative or length is not positive.
+ *   EOPNOTSUPP  unsupported mode.
+ *   ENOSPC      not enough free space in the file system.
+ *
+ * @param path    path to the file.
+ * @param mode    0, FALLOC_FL_KEEP_SIZE, or FALLOC_FL_PUNCH_HOLE |
+ *                FALLOC_FL_KEEP_SIZE.
+ * @param offset  start of the range to allocate.
+ * @param length  length of the range to allocate.
+ * @param fi      the open file.
+ * @return        0 on success; -errno on error.
+ */
+static int a1fs_fallocate(const char *path, int mode, off_t offset,
+						  off_t length, struct fuse_file_info *fi)
+{
+	(void)path; // unused
+	fs_req rq;
+	get_req(&rq);
+
+	return file_fallocate(&rq, get_handle(fi)->inode, mode, offset, length);
+}
+
+/**
+ * Get an extended attribute.
+ *
+ * a1fs has no user-settable extended attributes. A few read-only attributes,
+ * available on every path, report run-time statistics of the file system:
+ *   user.a1fs.dcache_hits    lookups answered by the dentry cache
+ *   user.a1fs.dcache_misses  lookups that had to scan a directory
+ *   user.a1fs.discarded_blocks  blocks punched out of the image file
+ * The value is a decimal number without a trailing newline.
+ *
+ * Errors:
+ *   ENODATA  the attribute does not exist.
+ *   ERANGE   the buffer is too small for the value.
+ *
+ * @param path   path to any file in the file system. Can be ignored.
+ * @param name   attribute name.
+ * @param value  buffer that receives the value.
+ * @param size   buffer size; 0 to only query the size of the value.
+ * @return       size of the value on success; -errno on error.
+ */
+static int a1fs_getxattr(const char *path, const char *name, char *value,
+						 size_t size)
+{
+	(void)path; // unused
+	return fs_getxattr(get_fs(), name, value, size);
 }
 
 static struct fuse_operations a1fs_ops = {
+	.init = a1fs_start,
 	.destroy = a1fs_destroy,
 	.statfs = a1fs_statfs,
 	.getattr = a1fs_getattr,
@@ -578,11 +699,19 @@ static struct fuse_operations a1fs_ops = {
 	.mkdir = a1fs_mkdir,
 	.rmdir = a1fs_rmdir,
 	.create = a1fs_create,
+	.open = a1fs_open,
 	.unlink = a1fs_unlink,
 	.utimens = a1fs_utimens,
 	.truncate = a1fs_truncate,
 	.read = a1fs_read,
 	.write = a1fs_write,
+	.read_buf = a1fs_read_buf,
+	.write_buf = a1fs_write_buf,
+	.flush = a1fs_flush,
+	.release = a1fs_release,
+	.fsync = a1fs_fsync,
+	.fallocate = a1fs_fallocate,
+	.getxattr = a1fs_getxattr,
 };
 
 int main(int argc, char *argv[])
@@ -591,6 +720,27 @@ int main(int argc, char *argv[])
 	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
 	if (!a1fs_opt_parse(&args, &opts))
 		return 1;
+	// Let reads and writes span many blocks, so that large sequential I/O
+	// doesn't pay the per-request cost every 4K; the kernel may cap these
+	fuse_opt_add_arg(&args, "-o");
+	fuse_opt_add_arg(&args, "big_writes");
+	fuse_opt_add_arg(&args, "-o");
+	fuse_opt_add_arg(&args, "max_read=" A1FS_IO_MAX_STR);
+	fuse_opt_add_arg(&args, "-o");
+	fuse_opt_add_arg(&args, "max_write=" A1FS_IO_MAX_STR);
+	// Changes made here are not sent to the kernel as they are by a1fs_ll,
+	// since the kernel knows files by node IDs that libfuse hands out
+	char timeouts[96];
+	snprintf(timeouts, sizeof(timeouts), "entry_timeout=%g,negative_timeout=%g,attr_timeout=%g",
+	         opts.cache_timeout, opts.cache_timeout, opts.cache_timeout);
+	fuse_opt_add_arg(&args, "-o");
+	fuse_opt_add_arg(&args, timeouts);
+	if (opts.writeback_cache || opts.pin_workers)
+	{
+		fprintf(stderr, "-o %s needs a1fs_ll\n", opts.writeback_cache ? "writeback_cache" : "pin_workers");
+		fuse_opt_free_args(&args);
+		return 1;
+	}
 
 	fs_ctx fs = {0};
 	if (!a1fs_init(&fs, &opts))
@@ -21,6 +21,7 @@
 #include <assert.h>
 #include <stdint.h>
 #include <limits.h>
+#include <stddef.h>
 #include <sys/stat.h>
 
 /**
@@ -44,6 +45,22 @@ typedef uint32_t a1fs_ino_t;
 /** Magic value that can be used to identify an a1fs image. */
 #define A1FS_MAGIC 0xC5C369A1C5C369A1ul
 
+/** Feature flags stored in a1fs_superblock.hz_features, chosen at mkfs time. */
+/** Large directories get an on-disk hash index (see hz_dir_index). */
+#define A1FS_FEATURE_DIR_INDEX 0x1
+/** Directories hold a1fs_cdentry records instead of a1fs_dentry. */
+#define A1FS_FEATURE_COMPACT_DIRS 0x2
+/** Data blocks and inodes are split into allocation groups (see a1fs_group). */
+#define A1FS_FEATURE_GROUPS 0x4
+/** Inodes are hz_inode_size bytes, with room for inline extents (see a1fs_inode). */
+#define A1FS_FEATURE_LARGE_INODES 0x8
+/** Small regular files keep their data in the inline area of the inode. */
+#define A1FS_FEATURE_INLINE_DATA 0x10
+/** Small regular files share data blocks in fragments (see hz_frag_map). */
+#define A1FS_FEATURE_FRAGMENTS 0x20
+/** Metadata changes are logged to a journal first (see a1fs_journal_block). */
+#define A1FS_FEATURE_JOURNAL 0x40
+
 /** a1fs superblock. */
 typedef struct a1fs_superblock {
 	/** Must match A1FS_MAGIC. */
@@ -66,6 +83,25 @@ typedef struct a1fs_superblock {
 	unsigned int num_inodes;
 	// Number of datablocks in total
 	unsigned int num_blocks;
+	// A1FS_FEATURE_* flags
+	uint32_t hz_features;
+	// A1FS_FEATURE_GROUPS only: first block of the group descriptor table
+	a1fs_blk_t hz_group_desc;
+	// Number of allocation groups
+	uint32_t hz_groups;
+	// Data blocks per group; a multiple of 64
+	uint32_t hz_group_blocks;
+	// Inodes per group; a multiple of 64
+	uint32_t hz_group_inodes;
+	// Data block where the last allocation ended; the next search starts here
+	a1fs_blk_t hz_alloc_cursor;
+	// A1FS_FEATURE_LARGE_INODES only: size of an inode in bytes
+	uint32_t hz_inode_size;
+	// A1FS_FEATURE_FRAGMENTS only: first block of the fragment occupancy map
+	a1fs_blk_t hz_frag_map;
+	// A1FS_FEATURE_JOURNAL only: first block and number of blocks of the journal
+	a1fs_blk_t hz_journal;
+	uint32_t hz_journal_blocks;
 
 } a1fs_superblock;
 
@@ -73,16 +109,170 @@ typedef struct a1fs_superblock {
 static_assert(sizeof(a1fs_superblock) <= A1FS_BLOCK_SIZE,
 			  "superblock is too large");
 
-/** Extent - a contiguous range of blocks. */
+/**
+ * Allocation group descriptor, used with A1FS_FEATURE_GROUPS.
+ *
+ * Group g owns data blocks [g * hz_group_blocks, (g + 1) * hz_group_blocks)
+ * and inodes [g * hz_group_inodes, (g + 1) * hz_group_inodes), and the words
+ * of the two bitmaps that track them. The bitmaps and the inode table are
+ * still stored in one piece, so block numbers mean the same with or without
+ * groups. The last group may have fewer data blocks, or none.
+ *
+ * With groups, the free counters of the superblock are only brought up to
+ * date at unmount; the counters here are the ones that are kept current.
+ */
+typedef struct a1fs_group {
+	/** Number of free data blocks in the group. */
+	uint32_t free_blocks;
+	/** Number of free inodes in the group. */
+	uint32_t free_inodes;
+	/** Data block where the last allocation in the group ended. */
+	a1fs_blk_t alloc_cursor;
+
+} a1fs_group;
+
+/**
+ * Extent - a contiguous range of blocks.
+ *
+ * The blocks of an unwritten extent are allocated but have never been
+ * written; they read as zeros whatever is on disk. Writing a block of such
+ * an extent zeroes the rest of the block and splits it off as a written
+ * extent. Images made before the flag existed never have it set, since
+ * counts always fit in 31 bits.
+ *
+ * An extent that starts at A1FS_EXT_HOLE is a hole: count blocks of the file
+ * that have no blocks on disk and read as zeros.
+ */
 typedef struct a1fs_extent {
 	/** Starting block of the extent. */
 	a1fs_blk_t start;
 	/** Number of blocks in the extent. */
-	a1fs_blk_t count;
+	a1fs_blk_t count : 31;
+	/** 1 if the blocks have not been written yet. */
+	a1fs_blk_t unwritten : 1;
 
 } a1fs_extent;
 
-/** a1fs inode. */
+static_assert(sizeof(a1fs_extent) == 8, "invalid extent size");
+
+/** Largest number of blocks of an extent. */
+#define A1FS_EXT_COUNT_MAX 0x7FFFFFFFu
+
+/** Start of a hole extent; never a valid data block number. */
+#define A1FS_EXT_HOLE 0xFFFFFFFFu
+
+/** Largest file size; logical block numbers are 32 bits. */
+#define A1FS_FILE_SIZE_MAX ((uint64_t)UINT32_MAX * A1FS_BLOCK_SIZE)
+
+/** Number of extents that fit in the extent block of an inode. */
+#define A1FS_MAX_EXTENTS (A1FS_BLOCK_SIZE / sizeof(a1fs_extent))
+
+/**
+ * Number of extents past which the extents of an inode move from the extent
+ * block into a B+tree (see A1FS_INODE_EXTENT_TREE).
+ */
+#define A1FS_EXTENT_TREE_MIN 64
+
+/**
+ * Fragments, used with A1FS_FEATURE_FRAGMENTS.
+ *
+ * A regular file of at most A1FS_FRAG_FILE_MAX bytes that doesn't fit in its
+ * inode keeps its data in a run of fragments of a data block shared with
+ * other small files. The occupancy map, from hz_frag_map on, has a uint16_t
+ * per data block with bit i set if fragment i of the block is in use; a
+ * block whose word is 0 is not a fragment block.
+ */
+#define A1FS_FRAG_SIZE 256
+#define A1FS_BLOCK_FRAGS (A1FS_BLOCK_SIZE / A1FS_FRAG_SIZE)
+#define A1FS_FRAG_FILE_MAX (A1FS_BLOCK_SIZE / 2)
+
+static_assert(A1FS_EXTENT_TREE_MIN <= A1FS_MAX_EXTENTS, "invalid extent tree threshold");
+
+/**
+ * Journal, used with A1FS_FEATURE_JOURNAL.
+ *
+ * The hz_journal_blocks blocks from hz_journal on, between the inode table
+ * and the data blocks, are a redo log of metadata blocks. The first one is
+ * the header; the log starts right after it with transaction seq of the
+ * header, and the transactions that follow have consecutive numbers. A
+ * transaction is one or more descriptor blocks, each followed by the images
+ * of the blocks its tags name, and then a commit block with a checksum of
+ * all of them. Mounting writes the images of every complete transaction to
+ * their blocks, in order, and empties the log; the first transaction that is
+ * incomplete or doesn't match its checksum ends it.
+ */
+#define A1FS_JOURNAL_MAGIC 0xC5C369A1A1F5109Cul
+#define A1FS_JOURNAL_HEADER 1
+#define A1FS_JOURNAL_DESC 2
+#define A1FS_JOURNAL_COMMIT 3
+
+/** Start of the header, a descriptor or a commit block of the journal. */
+typedef struct a1fs_journal_block {
+	/** Must match A1FS_JOURNAL_MAGIC. */
+	uint64_t magic;
+	/** Transaction; in the header, the first one in the log. */
+	uint64_t seq;
+	/** A1FS_JOURNAL_HEADER, A1FS_JOURNAL_DESC or A1FS_JOURNAL_COMMIT. */
+	uint32_t type;
+	/** Descriptor: number of tags; commit: number of blocks before it. */
+	uint32_t count;
+	/** Commit: checksum of the descriptors and images of the transaction. */
+	uint64_t sum;
+
+} a1fs_journal_block;
+
+/** The image of blk follows, or blk was freed (A1FS_JOURNAL_REVOKE). */
+typedef struct a1fs_journal_tag {
+	/** Block number in the image, counted from the superblock. */
+	a1fs_blk_t blk;
+	/** A1FS_JOURNAL_* tag flags. */
+	uint32_t flags;
+
+} a1fs_journal_tag;
+
+/**
+ * No image follows: blk was freed, and the images of it in this transaction
+ * and the ones before are not replayed, since it may hold file data now.
+ */
+#define A1FS_JOURNAL_REVOKE 0x1
+
+/** Number of tags that fit in a descriptor block, after its header. */
+#define A1FS_JOURNAL_TAGS ((A1FS_BLOCK_SIZE - sizeof(a1fs_journal_block)) / sizeof(a1fs_journal_tag))
+
+/** Blocks past the end of the file were allocated on purpose (fallocate). */
+#define A1FS_INODE_KEEP_PREALLOC 0x1
+/**
+ * The extents are in a B+tree rooted at hz_extent_p instead of an array.
+ * Each record is keyed by the logical block the extent starts at, and its
+ * value is the a1fs_extent; hz_extent_size is 0.
+ */
+#define A1FS_INODE_EXTENT_TREE 0x2
+/**
+ * The extents are in the inode itself, right after the a1fs_inode fields
+ * (A1FS_FEATURE_LARGE_INODES); hz_extent_p is -1.
+ */
+#define A1FS_INODE_INLINE_EXTENTS 0x4
+/**
+ * The file's data is in the inode itself, right after the a1fs_inode fields
+ * (A1FS_FEATURE_INLINE_DATA); the file has no extents.
+ */
+#define A1FS_INODE_INLINE_DATA 0x8
+/**
+ * The file's data is in fragments hz_frag_start on of data block
+ * hz_frag_blk (A1FS_FEATURE_FRAGMENTS); the file has no extents.
+ */
+#define A1FS_INODE_FRAGMENTS 0x10
+
+/**
+ * a1fs inode.
+ *
+ * With A1FS_FEATURE_LARGE_INODES, each inode in the table takes hz_inode_size
+ * bytes: these fields, which fill exactly the first cache line, followed by
+ * an inline area. The inline area holds the first extents of the file
+ * (A1FS_INODE_INLINE_EXTENTS), so that most files need no extent block, or
+ * the whole contents of a small file (A1FS_INODE_INLINE_DATA), so that it
+ * needs no data block either.
+ */
 typedef struct a1fs_inode {
 	/** File mode. */
 	mode_t mode;
@@ -111,14 +301,28 @@ typedef struct a1fs_inode {
 
 	//TODO: add necessary fields
 
-	// Size of the extent : block counts
+	// Size of the extent : block counts (0 with A1FS_INODE_EXTENT_TREE)
 	uint16_t hz_extent_size;
-	// Pointer to the extents inside the data block
+	// Pointer to the extents inside the data block, or root of the extent tree
 	int hz_extent_p;
 	//The position of the inode in the bitmap
 	uint32_t hz_inode_pos;
+	//Directories only: root block of the hash index B+tree, or -1
+	int32_t hz_dir_index;
+	union {
+		//Directories only: first block that may have room for an entry
+		uint32_t hz_dir_free;
+		//Files with A1FS_INODE_FRAGMENTS only: data block holding the fragments
+		a1fs_blk_t hz_frag_blk;
+	};
+	//Data block right after the last run allocated for this inode
+	a1fs_blk_t hz_alloc_goal;
+	//A1FS_INODE_* flags
+	uint32_t hz_flags;
+	//Files with A1FS_INODE_FRAGMENTS only: first fragment of the data
+	uint8_t hz_frag_start;
 	//Padding
-	uint8_t padding[20];
+	uint8_t padding[3];
 
 	// NOTE: You might have to add padding (e.g. a dummy char array field)
 	// at the end of the struct in order to satisfy the assertion below.
@@ -129,6 +333,14 @@ typedef struct a1fs_inode {
 
 // A single block must fit an integral number of inodes
 static_assert(A1FS_BLOCK_SIZE % sizeof(a1fs_inode) == 0, "invalid inode size");
+// The fields of a large inode must stay in one cache line
+static_assert(sizeof(a1fs_inode) == 64, "invalid inode size");
+
+/** Largest inode size for A1FS_FEATURE_LARGE_INODES. */
+#define A1FS_INODE_SIZE_MAX 1024
+
+// Files move from inline data to fragments as they grow
+static_assert(A1FS_INODE_SIZE_MAX - sizeof(a1fs_inode) <= A1FS_FRAG_FILE_MAX, "inline data larger than fragments");
 
 /** Maximum file name (path component) length. Includes the null terminator. */
 #define A1FS_NAME_MAX 252
@@ -140,9 +352,38 @@ static_assert(A1FS_BLOCK_SIZE % sizeof(a1fs_inode) == 0, "invalid inode size");
 typedef struct a1fs_dentry {
 	/** Inode number. */
 	a1fs_ino_t ino;
-	/** File name. A null-terminated string. */
+	/** File name. A null-terminated string; empty in an unused slot. */
 	char name[A1FS_NAME_MAX];
 
 } a1fs_dentry;
 
 static_assert(sizeof(a1fs_dentry) == 256, "invalid dentry size");
+
+/**
+ * Variable-length directory entry, used with A1FS_FEATURE_COMPACT_DIRS.
+ *
+ * Entries are packed into the blocks of a directory and never cross a block
+ * boundary, and the size of a directory is a multiple of the block size.
+ * rec_len is the distance to the next entry in the block, so it includes any
+ * free space after the name; the last entry of a block extends to the end of
+ * the block. A removed entry is merged into the previous entry of its block,
+ * or just marked unused (name_len == 0) if it is the first one.
+ */
+typedef struct a1fs_cdentry {
+	/** Inode number. */
+	a1fs_ino_t ino;
+	/** Hash of the name (name_hash() in util.h). */
+	uint32_t hash;
+	/** Length of the record in bytes; a multiple of 4. */
+	uint16_t rec_len;
+	/** Length of the name without the null terminator; 0 if unused. */
+	uint8_t name_len;
+	/** File name. A null-terminated string. */
+	char name[];
+
+} a1fs_cdentry;
+
+/** Smallest record that holds a name of len bytes. */
+#define A1FS_CDENTRY_LEN(len) ((offsetof(a1fs_cdentry, name) + (len) + 1 + 3) & ~3u)
+
+static_assert(A1FS_CDENTRY_LEN(A1FS_NAME_MAX - 1) <= A1FS_BLOCK_SIZE, "invalid cdentry size");
@@ -0,0 +1,717 @@
+/**
+ * a1fs driver on the libfuse 3 low-level API.
+ *
+ * The kernel addresses files by node ID here, not by path, so a request
+ * touches only the inode it is about instead of every directory from the
+ * root down: the node ID of a file is its a1fs inode number plus one, since
+ * FUSE_ROOT_ID is 1 and the a1fs root directory is inode 0. The operations
+ * themselves are the ones a1fs.c uses, in helper_func_file.c.
+ *
+ * Every entry sent to the kernel and every open file holds a reference on
+ * its inode (see inode_ref()), dropped by forget() and release(). An inode
+ * whose last name is removed while it has references stays allocated as an
+ * orphan, so that its node ID is not handed out again while the kernel or a
+ * file handle still uses it.
+ *
+ * Names and attributes are cached by the kernel for -o cache_timeout
+ * seconds, misses included. That can be long, because every change to a
+ * directory or an inode is also sent to the kernel as an invalidation notice
+ * by the notify thread.
+ *
+ * With -o pin_workers, every worker thread reads requests from its own clone
+ * of /dev/fuse (FUSE_DEV_IOC_CLONE, done by libfuse with -o clone_fd) and
+ * runs on a CPU of its own, so that the workers don't all wait on one file
+ * descriptor and a request stays on the CPU that picked it up.
+ */
+
+//For SEEK_DATA, SEEK_HOLE and pthread_setaffinity_np()
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define FUSE_USE_VERSION 34
+#include <fuse_lowlevel.h>
+#include "helper_func_file.c"
+
+#include "a1fs.h"
+#include "fs_ctx.h"
+#include "options.h"
+
+
+/** Inode number of a directory entry that is not known, as libfuse reports it. */
+#define LL_UNKNOWN_INO 0xffffffff
+
+/** The session, for the notices sent to the kernel. */
+static struct fuse_session *ll_session;
+
+/** CPUs the worker threads are pinned to, one each in turn; empty if they are not. */
+static cpu_set_t ll_cpus;
+static unsigned int ll_next_cpu;
+
+/**
+ * Pin the calling worker thread to the next CPU in ll_cpus, the first time it
+ * serves a request. libfuse starts workers as they are needed, from other
+ * workers, so a new one can't be pinned any earlier.
+ */
+static void ll_pin_worker(void)
+{
+	static __thread bool pinned;
+	if (pinned)
+		return;
+	pinned = true;
+	int count = CPU_COUNT(&ll_cpus);
+	if (count == 0)
+		return;
+
+	int k = __atomic_fetch_add(&ll_next_cpu, 1, __ATOMIC_RELAXED) % count;
+	for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+	{
+		if (CPU_ISSET(cpu, &ll_cpus) && k-- == 0)
+		{
+			cpu_set_t set;
+			CPU_ZERO(&set);
+			CPU_SET(cpu, &set);
+			pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+			return;
+		}
+	}
+}
+
+/** Start a new request on the file system context. */
+static void get_req(fs_req *rq, fuse_req_t req)
+{
+	ll_pin_worker();
+	fs_req_init(rq, fuse_req_userdata(req));
+}
+
+/** Node ID of an inode. */
+static fuse_ino_t ll_ino(a1fs_inode *inode)
+{
+	return (fuse_ino_t)inode->hz_inode_pos + 1;
+}
+
+/**
+ * Inode of a node ID. Replies ESTALE to req and returns NULL if there is no
+ * such inode.
+ */
+static a1fs_inode *ll_inode(fs_req *rq, fuse_req_t req, fuse_ino_t ino)
+{
+	if (ino == 0 || ino > rq->fs->bblk->num_inodes)
+	{
+		fuse_reply_err(req, ESTALE);
+		return NULL;
+	}
+	return get_node(rq->fs, ino - 1);
+}
+
+/** Attributes of an inode, with its node ID as st_ino. */
+static void ll_stat(fs_req *rq, a1fs_inode *inode, struct stat *st)
+{
+	inode_rdlock(rq->fs, inode->hz_inode_pos);
+	inode_stat(rq, inode, st);
+	inode_unlock(rq->fs, inode->hz_inode_pos);
+	st->st_ino = ll_ino(inode);
+}
+
+/** Reply to a lookup, mkdir() or create() with inode. */
+static void ll_entry(fs_req *rq, a1fs_inode *inode, struct fuse_entry_param *e)
+{
+	memset(e, 0, sizeof(*e));
+	e->ino = ll_ino(inode);
+	e->attr_timeout = rq->fs->cache_timeout;
+	e->entry_timeout = rq->fs->cache_timeout;
+	ll_stat(rq, inode, &e->attr);
+}
+
+/** Handle of an open file; see a1fs_ll_open(). */
+static fhandle *ll_handle(struct fuse_file_info *fi)
+{
+	return (fhandle *)(uintptr_t)fi->fh;
+}
+
+/** Reply with the result of an operation that returns only an error code. */
+static void ll_reply(fuse_req_t req, int ret)
+{
+	fuse_reply_err(req, -ret);
+}
+
+/** Send a notice to the kernel; it may have nothing cached to drop. */
+static void ll_notify(void *arg, const notice *n)
+{
+	struct fuse_session *se = arg;
+	if (n->entry)
+		fuse_lowlevel_notify_inval_entry(se, n->ino + 1, n->name, strlen(n->name));
+	else
+		fuse_lowlevel_notify_inval_inode(se, n->ino + 1, n->off, 0);
+}
+
+/**
+ * Start the background work of the file system.
+ *
+ * Called once the session is up, after the daemon has gone into the
+ * background; threads started before would not survive that.
+ */
+static void a1fs_ll_init(void *userdata, struct fuse_conn_info *conn)
+{
+	fs_ctx *fs = userdata;
+	//File data can be spliced between /dev/fuse and the image file
+	conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+	//Listing a directory gives the kernel the attributes of its entries too
+	conn->want |= conn->capable & FUSE_CAP_READDIRPLUS;
+	if (conn->max_write > A1FS_IO_MAX)
+		conn->max_write = A1FS_IO_MAX;
+	//Written data stays in the page cache until the kernel writes it back
+	if (fs->writeback_cache)
+	{
+		if (conn->capable & FUSE_CAP_WRITEBACK_CACHE)
+			conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+		else
+			fprintf(stderr, "The kernel has no writeback cache for FUSE\n");
+	}
+	if (!notify_start(&fs->notify, ll_notify, ll_session))
+		fprintf(stderr, "Failed to start the notify thread\n");
+	if (fs->online_discard && !discard_start(&fs->discard, discard_blks_cb, fs))
+		fprintf(stderr, "Failed to start the discard thread\n");
+	if (!journal_start(&fs->journal))
+		fprintf(stderr, "Failed to start the journal thread\n");
+}
+
+static void a1fs_ll_destroy(void *userdata)
+{
+	fs_unmount(userdata);
+}
+
+/** Look up name in directory parent; one directory scan at most, whatever the depth. */
+static void a1fs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	fs_req rq;
+	get_req(&rq, req);
+	a1fs_inode *dir = ll_inode(&rq, req, parent);
+	if (dir == NULL)
+		return;
+
+	int pos;
+	struct fuse_entry_param e;
+	rq.take_ref = true;
+	if (dir_lookup(&rq, dir->hz_inode_pos, name, &pos) != 0)
+	{
+		if (rq.err_code != -ENOENT)
+		{
+			ll_reply(req, rq.err_code);
+			return;
+		}
+		//The kernel keeps the miss for as long as it would keep a name
+		memset(&e, 0, sizeof(e));
+		e.entry_timeout = rq.fs->cache_timeout;
+		fuse_reply_entry(req, &e);
+		return;
+	}
+	ll_entry(&rq, get_node(rq.fs, pos), &e);
+	fuse_reply_entry(req, &e);
+}
+
+/** Drop nlookup references of the kernel to a node; see inode_unref(). */
+static void ll_forget(fs_req *rq, fuse_ino_t ino, uint64_t nlookup)
+{
+	if (ino > FUSE_ROOT_ID && ino <= rq->fs->bblk->num_inodes)
+		inode_unref(rq, ino - 1, nlookup);
+}
+
+static void a1fs_ll_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup)
+{
+	fs_req rq;
+	get_req(&rq, req);
+	ll_forget(&rq, ino, nlookup);
+	fuse_reply_none(req);
+}
+
+static void a1fs_ll_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets)
+{
+	fs_req rq;
+	get_req(&rq, req);
+	for (size_t i = 0; i < count; i++)
+		ll_forget(&rq, forgets[i].ino, forgets[i].nlookup);
+	fuse_reply_none(req);
+}
+
+static void a1fs_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	(void)fi; // unused
+	fs_req rq;
+	get_req(&rq, req);
+	a1fs_inode *inode = ll_inode(&rq, req, ino);
+	if (inode == NULL)
+		return;
+
+	struct stat st;
+	ll_stat(&rq, inode, &st);
+	fuse_reply_attr(req, &st, rq.fs->cache_timeout);
+}
+
+/**
+ * Change the size or the modification time of a file; a1fs keeps no other
+ * attributes that can be set.
+ */
+static void a1fs_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+							int to_set, struct fuse_file_info *fi)
+{
+	(void)fi; // unused
+	fs_req rq;
+	get_req(&rq, req);
+	a1fs_inode *inode = ll_inode(&rq, req, ino);
+	if (inode == NULL)
+		return;
+
+	if (to_set & (FUSE_SET_ATTR_MODE | FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID))
+	{
+		fuse_reply_err(req, ENOSYS);
+		return;
+	}
+	if (to_set & FUSE_SET_ATTR_SIZE)
+	{
+		int ret = file_truncate(&rq, inode, attr->st_size);
+		if (ret != 0)
+		{
+			ll_reply(req, ret);
+			return;
+		}
+	}
+	if (to_set & (FUSE_SET_ATTR_MTIME | FUSE_SET_ATTR_MTIME_NOW))
+	{
+		struct timespec mtime = attr->st_mtim;
+		if (to_set & FUSE_SET_ATTR_MTIME_NOW)
+			mtime.tv_nsec = UTIME_NOW;
+		inode_set_mtime(&rq, inode, &mtime);
+	}
+	struct stat st;
+	ll_stat(&rq, inode, &st);
+	fuse_reply_attr(req, &st, rq.fs->cache_timeout);
+}
+
+/** A reply buffer for readdir() and readdirplus() being filled by fill_dir(). */
+typedef struct ll_dirbuf {
+	fuse_req_t req;
+	fs_req *rq;
+	/** The directory; it is locked, so its own attributes are read as they are. */
+	a1fs_inode *dir;
+	bool plus;
+	char *buf;
+	size_t size;
+	size_t len;
+} ll_dirbuf;
+
+static bool ll_dir_fill(void *arg, const char *name, a1fs_ino_t ino, off_t next)
+{
+	ll_dirbuf *db = arg;
+	struct fuse_entry_param e;
+	memset(&e, 0, sizeof(e));
+	e.attr.st_ino = LL_UNKNOWN_INO;
+	e.attr.st_mode = S_IFDIR;
+	if (ino == db->dir->hz_inode_pos)
+	{
+		//"." gets no entry: the kernel doesn't look it up
+		inode_stat(db->rq, db->dir, &e.attr);
+		e.attr.st_ino = ll_ino(db->dir);
+	}
+	else if (ino != DIR_INO_UNKNOWN)
+	{
+		a1fs_inode *inode = get_node(db->rq->fs, ino);
+		if (db->plus)
+			ll_entry(db->rq, inode, &e);
+		else
+			e.attr.st_mode = inode->mode;
+		e.attr.st_ino = ll_ino(inode);
+	}
+
+	size_t rest = db->size - db->len;
+	size_t need = db->plus ? fuse_add_direntry_plus(db->req, db->buf + db->len, rest, name, &e, next)
+						   : fuse_add_direntry(db->req, db->buf + db->len, rest, name, &e.attr, next);
+	if (need > rest)
+		return true;
+	db->len += need;
+	//The kernel counts a lookup for every entry but "." and ".."
+	if (e.ino != 0 && strcmp(name, "..") != 0)
+		inode_ref(db->rq->fs, e.ino - 1, 1);
+	return false;
+}
+
+/** List a directory into a reply buffer of size bytes, from readdir offset off. */
+static void ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, bool plus)
+{
+	fs_req rq;
+	get_req(&rq, req);
+	a1fs_inode *dir = ll_inode(&rq, req, ino);
+	if (dir == NULL)
+		return;
+
+	ll_dirbuf db = { .req = req, .rq = &rq, .dir = dir, .plus = plus, .size = size, .len = 0 };
+	db.buf = malloc(size);
+	if (db.buf == NULL)
+	{
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	inode_rdlock(rq.fs, dir->hz_inode_pos);
+	int ret = fill_dir(&rq, dir, &db, ll_dir_fill, off);
+	inode_unlock(rq.fs, dir->hz_inode_pos);
+	//Entries found before a corrupt block are still returned; the next call fails
+	if (ret != 0 && db.len == 0)
+		fuse_reply_err(req, -ret);
+	else
+		fuse_reply_buf(req, db.buf, db.len);
+	free(db.buf);
+}
+
+static void a1fs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+							struct fuse_file_info *fi)
+{
+	(void)fi; // unused
+	ll_readdir(req, ino, size, off, false);
+}
+
+/**
+ * Read a directory along with the attributes of its entries, so that the
+ * kernel doesn't have to look each of them up after listing it.
+ */
+static void a1fs_ll_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+								struct fuse_file_info *fi)
+{
+	(void)fi; // unused
+	ll_readdir(req, ino, size, off, true);
+}
+
+/** Create name in directory parent and reply with its entry; fi is NULL for mkdir(). */
+static void ll_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode,
+					  struct fuse_file_info *fi)
+{
+	fs_req rq;
+	get_req(&rq, req);
+	a1fs_inode *dir = ll_inode(&rq, req, parent);
+	if (dir == NULL)
+		return;
+
+	if (strlen(name) >= A1FS_NAME_MAX)
+	{
+		fuse_reply_err(req, ENAMETOOLONG);
+		return;
+	}
+	fhandle *fh = NULL;
+	if (fi != NULL && (fh = handle_new(NULL)) == NULL)
+	{
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	rq.take_ref = true;
+	if (create_in_dir(&rq, dir, name, mode, S_ISREG(mode)) != 0)
+	{
+		if (fh != NULL)
+			handle_free(fh);
+		ll_reply(req, rq.err_code);
+		return;
+	}
+	struct fuse_entry_param e;
+	ll_entry(&rq, rq.path_inode, &e);
+	if (fi != NULL)
+	{
+		inode_ref(rq.fs, rq.path_inode->hz_inode_pos, 1);
+		fh->inode = rq.path_inode;
+		fi->fh = (uintptr_t)fh;
+		fuse_reply_create(req, &e, fi);
+	}
+	else
+	{
+		fuse_reply_entry(req, &e);
+	}
+}
+
+static void a1fs_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
+{
+	ll_create(req, parent, name, mode | S_IFDIR, NULL);
+}
+
+static void a1fs_ll_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode,
+						   struct fuse_file_info *fi)
+{
+	ll_create(req, parent, name, mode, fi);
+}
+
+static void a1fs_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	fs_req rq;
+	get_req(&rq, req);
+	a1fs_inode *dir = ll_inode(&rq, req, parent);
+	if (dir == NULL)
+		return;
+	ll_reply(req, rm_in_dir(&rq, dir, name, true));
+}
+
+static void a1fs_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	fs_req rq;
+	get_req(&rq, req);
+	a1fs_inode *dir = ll_inode(&rq, req, parent);
+	if (dir == NULL)
+		return;
+	ll_reply(req, rm_in_dir(&rq, dir, name, false));
+}
+
+/**
+ * Open a file: the handle in fi->fh keeps the inode and where the last read
+ * or write left off. The kernel may keep the pages it has cached from an
+ * earlier open, since it is told whenever they go stale.
+ */
+static void a1fs_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	fs_req rq;
+	get_req(&rq, req);
+	a1fs_inode *inode = ll_inode(&rq, req, ino);
+	if (inode == NULL)
+		return;
+
+	fhandle *fh = handle_new(inode);
+	if (fh == NULL)
+	{
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	inode_ref(rq.fs, inode->hz_inode_pos, 1);
+	fi->fh = (uintptr_t)fh;
+	fi->keep_cache = 1;
+	fuse_reply_open(req, fi);
+}
+
+/** Read data from a file as a list of buffers, most of them ranges of the image file. */
+static void a1fs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+						 struct fuse_file_info *fi)
+{
+	(void)ino; // unused
+	fs_req rq;
+	get_req(&rq, req);
+
+	buf_list l;
+	int ret = file_read_buf(&rq, ll_handle(fi), &l, size, off, true);
+	if (ret != 0)
+	{
+		ll_reply(req, ret);
+		return;
+	}
+	//The inode stays locked until the ranges of the image file are sent
+	fuse_reply_data(req, l.vec, FUSE_BUF_SPLICE_MOVE);
+	file_read_buf_done(&rq, ll_handle(fi), &l);
+}
+
+static void a1fs_ll_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv,
+							  off_t off, struct fuse_file_info *fi)
+{
+	(void)ino; // unused
+	fs_req rq;
+	get_req(&rq, req);
+
+	int ret = file_write_buf(&rq, ll_handle(fi), bufv, off);
+	if (ret < 0)
+		ll_reply(req, ret);
+	else
+		fuse_reply_write(req, ret);
+}
+
+static void a1fs_ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	(void)ino; // unused
+	fs_req rq;
+	get_req(&rq, req);
+	ll_reply(req, file_sync(&rq, ll_handle(fi)->inode, SYNC_FLUSH));
+}
+
+/**
+ * Trims the blocks allocated past the end of the file, as a1fs_release()
+ * does, frees the handle and drops its reference on the inode.
+ */
+static void a1fs_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	(void)ino; // unused
+	fs_req rq;
+	get_req(&rq, req);
+	a1fs_inode *inode = ll_handle(fi)->inode;
+	int ret = file_sync(&rq, inode, SYNC_RELEASE);
+	handle_free(ll_handle(fi));
+	inode_unref(&rq, inode->hz_inode_pos, 1);
+	ll_reply(req, ret);
+}
+
+static void a1fs_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+						  struct fuse_file_info *fi)
+{
+	(void)ino; // unused
+	(void)datasync; // unused
+	fs_req rq;
+	get_req(&rq, req);
+	ll_reply(req, file_sync(&rq, ll_handle(fi)->inode, SYNC_FSYNC));
+}
+
+static void a1fs_ll_fallocate(fuse_req_t req, fuse_ino_t ino, int mode, off_t offset,
+							  off_t length, struct fuse_file_info *fi)
+{
+	(void)ino; // unused
+	fs_req rq;
+	get_req(&rq, req);
+	ll_reply(req, file_fallocate(&rq, ll_handle(fi)->inode, mode, offset, length));
+}
+
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(3, 8)
+static void a1fs_ll_lseek(fuse_req_t req, fuse_ino_t ino, off_t off, int whence,
+						  struct fuse_file_info *fi)
+{
+	(void)ino; // unused
+	fs_req rq;
+	get_req(&rq, req);
+	a1fs_inode *inode = ll_handle(fi)->inode;
+
+	if (whence != SEEK_DATA && whence != SEEK_HOLE)
+	{
+		fuse_reply_err(req, EINVAL);
+		return;
+	}
+	off_t res = file_seek(&rq, inode, off, whence == SEEK_DATA);
+	if (res < 0)
+		ll_reply(req, res);
+	else
+		fuse_reply_lseek(req, res);
+}
+#endif
+
+static void a1fs_ll_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+	(void)ino; // unused
+	struct statvfs st;
+	fs_statfs(fuse_req_userdata(req), &st);
+	fuse_reply_statfs(req, &st);
+}
+
+/** The read-only user.a1fs.* statistics; see a1fs_getxattr(). */
+static void a1fs_ll_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name, size_t size)
+{
+	(void)ino; // unused
+	char value[32];
+	int len = fs_getxattr(fuse_req_userdata(req), name, value, min(size, sizeof(value)));
+	if (len < 0)
+		ll_reply(req, len);
+	else if (size == 0)
+		fuse_reply_xattr(req, len);
+	else
+		fuse_reply_buf(req, value, len);
+}
+
+static const struct fuse_lowlevel_ops a1fs_ll_ops = {
+	.init = a1fs_ll_init,
+	.destroy = a1fs_ll_destroy,
+	.lookup = a1fs_ll_lookup,
+	.forget = a1fs_ll_forget,
+	.forget_multi = a1fs_ll_forget_multi,
+	.getattr = a1fs_ll_getattr,
+	.setattr = a1fs_ll_setattr,
+	.readdir = a1fs_ll_readdir,
+	.readdirplus = a1fs_ll_readdirplus,
+	.mkdir = a1fs_ll_mkdir,
+	.rmdir = a1fs_ll_rmdir,
+	.create = a1fs_ll_create,
+	.unlink = a1fs_ll_unlink,
+	.open = a1fs_ll_open,
+	.read = a1fs_ll_read,
+	.write_buf = a1fs_ll_write_buf,
+	.flush = a1fs_ll_flush,
+	.release = a1fs_ll_release,
+	.fsync = a1fs_ll_fsync,
+	.fallocate = a1fs_ll_fallocate,
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(3, 8)
+	.lseek = a1fs_ll_lseek,
+#endif
+	.statfs = a1fs_ll_statfs,
+	.getxattr = a1fs_ll_getxattr,
+};
+
+int main(int argc, char *argv[])
+{
+	a1fs_opts opts = {0}; // defaults are all 0
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	if (!a1fs_opt_parse(&args, &opts))
+		return 1;
+	if (opts.help)
+	{
+		fuse_cmdline_help();
+		fuse_lowlevel_help();
+		return 0;
+	}
+	// Let reads span many blocks; writes are capped in a1fs_ll_init()
+	fuse_opt_add_arg(&args, "-o");
+	fuse_opt_add_arg(&args, "max_read=" A1FS_IO_MAX_STR);
+
+	struct fuse_cmdline_opts cmd;
+	if (fuse_parse_cmdline(&args, &cmd) != 0)
+		return 1;
+	if (cmd.show_version)
+	{
+		fuse_lowlevel_version();
+		return 0;
+	}
+	int ret = 1;
+	if (cmd.mountpoint == NULL)
+	{
+		fprintf(stderr, "Missing mount point\n");
+		goto out_args;
+	}
+	// Taken before any thread is pinned; new threads inherit the CPUs of the
+	// thread that starts them
+	if (opts.pin_workers && !cmd.singlethread)
+	{
+		cmd.clone_fd = 1;
+		if (sched_getaffinity(0, sizeof(ll_cpus), &ll_cpus) != 0)
+			CPU_ZERO(&ll_cpus);
+		//Workers past max_idle_threads exit when idle, and new ones move on to other CPUs
+		if (cmd.max_idle_threads < (unsigned int)CPU_COUNT(&ll_cpus))
+			cmd.max_idle_threads = CPU_COUNT(&ll_cpus);
+	}
+
+	fs_ctx fs = {0};
+	if (!fs_mount(&fs, &opts))
+	{
+		fprintf(stderr, "Failed to mount the file system\n");
+		goto out_args;
+	}
+	struct fuse_session *se = fuse_session_new(&args, &a1fs_ll_ops, sizeof(a1fs_ll_ops), &fs);
+	if (se == NULL)
+		goto out_fs;
+	ll_session = se;
+	if (fuse_set_signal_handlers(se) == 0)
+	{
+		if (fuse_session_mount(se, cmd.mountpoint) == 0)
+		{
+			fuse_daemonize(cmd.foreground);
+			if (cmd.singlethread)
+			{
+				ret = fuse_session_loop(se);
+			}
+			else
+			{
+				struct fuse_loop_config cfg = { .clone_fd = cmd.clone_fd, .max_idle_threads = cmd.max_idle_threads };
+				ret = fuse_session_loop_mt(se, &cfg);
+			}
+			fuse_session_unmount(se);
+		}
+		fuse_remove_signal_handlers(se);
+	}
+	//Calls a1fs_ll_destroy() if the session got as far as a1fs_ll_init()
+	fuse_session_destroy(se);
+out_fs:
+	fs_unmount(&fs);
+out_args:
+	free(cmd.mountpoint);
+	fuse_opt_free_args(&args);
+	return ret ? 1 : 0;
+}
@@ -0,0 +1,187 @@
+/**
+ * Microbenchmarks of the bitmap operations in bitmap.c against the bit at a
+ * time loops that a1fs used before.
+ *
+ * Usage: ./bench_bitmap [number of blocks]
+ *
+ * The default of 1048576 blocks is the data bitmap of a 4 GiB image.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bitmap.h"
+
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int free_blocks;
+
+/* The old code: one bit per iteration, carrying the current run across bytes */
+static void old_update_ext(uint32_t *best_start, uint32_t *best, uint32_t head, uint32_t sum)
+{
+	if (*best < sum)
+	{
+		*best_start = head;
+		*best = sum;
+	}
+}
+
+static uint32_t old_find_zero_run(const unsigned char *bm, uint32_t nbits, uint32_t len, uint32_t *start)
+{
+	uint32_t head = 0, count = 0, best_start = 0, best = 0;
+	for (uint32_t ub = 0; ub < nbits; ub += 8)
+	{
+		int bit = (nbits - ub >= 8) ? 8 : (int)(nbits - ub);
+		for (int k = 0; k < bit; k++)
+		{
+			if (bm[ub / 8] & (1 << (7 - k)))
+			{
+				count = 0;
+				continue;
+			}
+			head = (count == 0) ? ub + k : head;
+			count++;
+			old_update_ext(&best_start, &best, head, count);
+			if (count == len)
+			{
+				*start = best_start;
+				return best;
+			}
+		}
+	}
+	*start = best_start;
+	return best;
+}
+
+/* The old free path: switch_bit() per block, each taking the lock */
+static void old_free_range(unsigned char *bm, uint32_t start, uint32_t len)
+{
+	for (uint32_t b = start; b < start + len; b++)
+	{
+		pthread_mutex_lock(&lock);
+		free_blocks++;
+		bm[b / 8] &= ~(1 << (7 - b % 8));
+		pthread_mutex_unlock(&lock);
+	}
+}
+
+static void new_free_range(unsigned char *bm, uint32_t start, uint32_t len)
+{
+	pthread_mutex_lock(&lock);
+	bitmap_clear_range(bm, start, len);
+	free_blocks += len;
+	pthread_mutex_unlock(&lock);
+}
+
+static void old_alloc_range(unsigned char *bm, uint32_t start, uint32_t len)
+{
+	pthread_mutex_lock(&lock);
+	for (uint32_t b = start; b < start + len; b++)
+	{
+		free_blocks--;
+		bm[b / 8] |= 1 << (7 - b % 8);
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+static void new_alloc_range(unsigned char *bm, uint32_t start, uint32_t len)
+{
+	pthread_mutex_lock(&lock);
+	bitmap_set_range(bm, start, len);
+	free_blocks -= len;
+	pthread_mutex_unlock(&lock);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/** Fill the first 90% of the bitmap, leaving every 97th block free. */
+static void fragment(unsigned char *bm, uint32_t nbits)
+{
+	memset(bm, 0, (nbits + 63) / 64 * 8);
+	bitmap_set_range(bm, 0, nbits / 10 * 9);
+	for (uint32_t b = 0; b < nbits / 10 * 9; b += 97)
+		bitmap_clear_range(bm, b, 1);
+}
+
+static void report(const char *name, double old_t, double new_t, int iters)
+{
+	printf("%-36s %12.1f %12.1f %8.1fx\n", name, old_t / iters * 1e6, new_t / iters * 1e6, old_t / new_t);
+}
+
+int main(int argc, char *argv[])
+{
+	uint32_t nbits = (argc > 1) ? strtoul(argv[1], NULL, 10) : 1048576;
+	unsigned char *bm = malloc((nbits + 255) / 256 * 32);
+	if (bm == NULL)
+		return 1;
+	const int iters = 20;
+	uint32_t s_old = 0, s_new = 0, r_old = 0, r_new = 0;
+	double t0, t_old, t_new;
+
+	printf("%u blocks; times in microseconds per operation\n", nbits);
+	printf("%-36s %12s %12s %9s\n", "", "old", "new", "speedup");
+
+	fragment(bm, nbits);
+	t0 = now();
+	for (int i = 0; i < iters; i++)
+		r_old = old_find_zero_run(bm, nbits, 64, &s_old);
+	t_old = now() - t0;
+	t0 = now();
+	for (int i = 0; i < iters; i++)
+		r_new = bitmap_find_zero_run(bm, nbits, 0, 64, &s_new);
+	t_new = now() - t0;
+	if (r_old != r_new || s_old != s_new)
+	{
+		fprintf(stderr, "results differ: %u@%u vs %u@%u\n", r_old, s_old, r_new, s_new);
+		return 1;
+	}
+	report("find 64 free blocks, 90% full", t_old, t_new, iters);
+
+	memset(bm, 0xff, (nbits + 255) / 256 * 32);
+	t0 = now();
+	for (int i = 0; i < iters; i++)
+		r_old = old_find_zero_run(bm, nbits, 1, &s_old);
+	t_old = now() - t0;
+	t0 = now();
+	for (int i = 0; i < iters; i++)
+		r_new = bitmap_find_zero_run(bm, nbits, 0, 1, &s_new);
+	t_new = now() - t0;
+	report("find a free block, 100% full", t_old, t_new, iters);
+
+	uint32_t len = nbits / 4;
+	double t_old_free = 0, t_new_free = 0;
+	t_old = 0;
+	t_new = 0;
+	memset(bm, 0, (nbits + 255) / 256 * 32);
+	for (int i = 0; i < iters; i++)
+	{
+		t0 = now();
+		old_alloc_range(bm, 3, len);
+		t_old += now() - t0;
+		t0 = now();
+		old_free_range(bm, 3, len);
+		t_old_free += now() - t0;
+		t0 = now();
+		new_alloc_range(bm, 3, len);
+		t_new += now() - t0;
+		t0 = now();
+		new_free_range(bm, 3, len);
+		t_new_free += now() - t0;
+	}
+	char name[64];
+	snprintf(name, sizeof(name), "allocate %u blocks", len);
+	report(name, t_old, t_new, iters);
+	snprintf(name, sizeof(name), "free %u blocks", len);
+	report(name, t_old_free, t_new_free, iters);
+
+	free(bm);
+	return 0;
+}
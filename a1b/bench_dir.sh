@@ -0,0 +1,39 @@
+#!/usr/bin/env bash
+# Create a large number of entries in a single directory and time it.
+#
+# Usage: ./bench_dir.sh mountpoint [entries] [mkfs options]
+#   entries       number of files to create (default 1000000)
+#   mkfs options  extra mkfs.a1fs options (default -x, i.e. hashed index);
+#                 add -c for compact directory entries, or pass "" to compare
+#                 with plain linear directories, ideally with a smaller
+#                 number of entries
+mnt=$1
+n=${2:-1000000}
+opts=${3--x}
+if [ -z "${mnt}" ]; then
+	echo "Usage: $0 mountpoint [entries] [mkfs options]"
+	exit 1
+fi
+make -s || exit 1
+
+echo 'create a 1G image with room for '${n}' inodes'
+truncate -s 1G bench.img
+./mkfs.a1fs -f -i $((n + 16)) ${opts} bench.img || exit 1
+./a1fs bench.img ${mnt} || exit 1
+mkdir ${mnt}/big
+
+echo 'create '${n}' entries in one directory'
+time (seq 1 ${n} | sed 's/^/f/' | (cd ${mnt}/big && xargs touch))
+
+echo 'remount to start with a cold dentry cache'
+fusermount -u ${mnt}
+./a1fs bench.img ${mnt}
+
+echo 'stat every entry'
+time (seq 1 ${n} | sed "s#^#${mnt}/big/f#" | xargs stat -c %i > /dev/null)
+echo 'stat entries that do not exist'
+time (seq 1 10000 | sed "s#^#${mnt}/big/missing#" | xargs stat -c %i > /dev/null 2>&1)
+
+echo 'unmount and remove the image'
+fusermount -u ${mnt}
+rm bench.img
@@ -0,0 +1,69 @@
+#!/usr/bin/env bash
+# Time a1fs_ll serving 1 to N client threads at once, with every worker
+# reading requests from the one /dev/fuse, then with a clone of /dev/fuse per
+# worker (-o clone_fd), then with the clones and the workers pinned to CPUs
+# (-o pin_workers).
+#
+# Usage: ./bench_threads.sh mountpoint [threads] [MB per thread]
+#   threads        largest number of client threads (default: number of CPUs);
+#                  the runs double the count from 1 up to it
+#   MB per thread  data each client thread writes and reads back (default 64)
+#
+# Names and attributes are not cached by the kernel (-o cache_timeout=0) and
+# the data is read with O_DIRECT, so every stat() and read() is a request.
+mnt=$1
+max=${2:-$(nproc)}
+mb=${3:-64}
+if [ -z "${mnt}" ]; then
+	echo "Usage: $0 mountpoint [threads] [MB per thread]"
+	exit 1
+fi
+make -s a1fs_ll mkfs.a1fs || exit 1
+
+# Run "$@" for thread numbers 1..t at once and print the seconds it took
+run() {
+	local t=$1
+	shift
+	local start=$(date +%s.%N)
+	for i in $(seq 1 ${t}); do
+		"$@" ${i} &
+	done
+	wait
+	echo "$(date +%s.%N) - ${start}" | bc
+}
+
+write_file() {
+	dd if=/dev/zero of=${mnt}/f$1 bs=1M count=${mb} conv=fsync status=none
+}
+
+read_file() {
+	dd if=${mnt}/f$1 of=/dev/null bs=128k iflag=direct status=none
+}
+
+stat_files() {
+	for j in $(seq 1 20); do
+		stat -c %s ${mnt}/d$1/* > /dev/null
+	done
+}
+
+truncate -s $(( (max * mb + 256) * 1024 * 1024 )) bench.img
+printf '%-12s %8s %10s %10s %10s\n' mode threads write read stat
+for mode in shared clone_fd pin_workers; do
+	opts=cache_timeout=0
+	[ ${mode} != shared ] && opts=${opts},${mode}
+	t=1
+	while [ ${t} -le ${max} ]; do
+		./mkfs.a1fs -f -i $(( max * 128 + 64 )) bench.img > /dev/null || exit 1
+		./a1fs_ll bench.img ${mnt} -o ${opts} || exit 1
+		for i in $(seq 1 ${t}); do
+			mkdir ${mnt}/d${i} && (cd ${mnt}/d${i} && touch $(seq 1 100))
+		done
+		w=$(run ${t} write_file)
+		r=$(run ${t} read_file)
+		s=$(run ${t} stat_files)
+		printf '%-12s %8d %10.2f %10.2f %10.2f\n' ${mode} ${t} ${w} ${r} ${s}
+		fusermount3 -u ${mnt}
+		t=$(( t * 2 ))
+	done
+done
+rm bench.img
@@ -0,0 +1,203 @@
+/**
+ * a1fs bitmap operations implementation.
+ */
+
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "bitmap.h"
+
+
+/** Load 64 bits starting at bit 64 * w, so that bit 64 * w is the MSB. */
+static inline uint64_t load_word(const unsigned char *bm, uint32_t w)
+{
+	uint64_t v;
+	memcpy(&v, bm + (size_t)w * 8, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	v = __builtin_bswap64(v);
+#endif
+	return v;
+}
+
+/** Index of the first word at or after w that has a clear bit, or nwords. */
+static uint32_t skip_used_words(const unsigned char *bm, uint32_t w, uint32_t nwords)
+{
+	while (w < nwords && load_word(bm, w) == ~0ull)
+		w++;
+	return w;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("avx2")))
+static uint32_t skip_used_words_avx2(const unsigned char *bm, uint32_t w, uint32_t nwords)
+{
+	const __m256i ones = _mm256_set1_epi32(-1);
+	while (w + 4 <= nwords)
+	{
+		__m256i v = _mm256_loadu_si256((const __m256i *)(bm + (size_t)w * 8));
+		if (!_mm256_testc_si256(v, ones))
+			break;
+		w += 4;
+	}
+	return skip_used_words(bm, w, nwords);
+}
+#endif
+
+/** Skip the words that have all bits set, with AVX2 if available. */
+static uint32_t skip_used(const unsigned char *bm, uint32_t w, uint32_t nwords)
+{
+#if defined(__x86_64__)
+	if (__builtin_cpu_supports("avx2"))
+		return skip_used_words_avx2(bm, w, nwords);
+#endif
+	return skip_used_words(bm, w, nwords);
+}
+
+bool bitmap_test(const unsigned char *bm, uint32_t bit)
+{
+	return bm[bit / 8] & (0x80 >> (bit % 8));
+}
+
+/** Mask of bits [from, to) of a byte, MSB first. */
+static inline unsigned char byte_mask(uint32_t from, uint32_t to)
+{
+	return (0xff >> from) & ~(0xff >> to);
+}
+
+void bitmap_set_range(unsigned char *bm, uint32_t start, uint32_t len)
+{
+	uint32_t end = start + len;
+	if (len == 0)
+		return;
+	if (start / 8 == (end - 1) / 8)
+	{
+		bm[start / 8] |= byte_mask(start % 8, (end - 1) % 8 + 1);
+		return;
+	}
+	if (start % 8 != 0)
+	{
+		bm[start / 8] |= byte_mask(start % 8, 8);
+		start += 8 - start % 8;
+	}
+	memset(bm + start / 8, 0xff, (end - start) / 8);
+	if (end % 8 != 0)
+		bm[end / 8] |= byte_mask(0, end % 8);
+}
+
+void bitmap_clear_range(unsigned char *bm, uint32_t start, uint32_t len)
+{
+	uint32_t end = start + len;
+	if (len == 0)
+		return;
+	if (start / 8 == (end - 1) / 8)
+	{
+		bm[start / 8] &= ~byte_mask(start % 8, (end - 1) % 8 + 1);
+		return;
+	}
+	if (start % 8 != 0)
+	{
+		bm[start / 8] &= ~byte_mask(start % 8, 8);
+		start += 8 - start % 8;
+	}
+	memset(bm + start / 8, 0, (end - start) / 8);
+	if (end % 8 != 0)
+		bm[end / 8] &= ~byte_mask(0, end % 8);
+}
+
+uint32_t bitmap_find_zero_run(const unsigned char *bm, uint32_t nbits, uint32_t from, uint32_t len, uint32_t *start)
+{
+	uint32_t nwords = (nbits + 63) / 64;
+	uint32_t run_start = 0;
+	uint32_t run = 0;
+	uint32_t best_start = 0;
+	uint32_t best = 0;
+
+	uint32_t w = from / 64;
+	while (w < nwords)
+	{
+		uint64_t v = load_word(bm, w);
+		//Bits before from and past the end count as used
+		if (w == from / 64 && from % 64 != 0)
+			v |= ~(~0ull >> (from % 64));
+		if (w == nwords - 1 && nbits % 64 != 0)
+			v |= ~0ull >> (nbits % 64);
+		if (v == ~0ull)
+		{
+			run = 0;
+			w = skip_used(bm, w + 1, nwords);
+			continue;
+		}
+
+		//Alternate between runs of clear and set bits inside the word
+		uint32_t p = 0;
+		while (p < 64)
+		{
+			uint64_t rest = v << p;
+			uint32_t zeros = (rest == 0) ? 64 - p : (uint32_t)__builtin_clzll(rest);
+			if (zeros > 0)
+			{
+				if (run == 0)
+					run_start = w * 64 + p;
+				if (run + zeros >= len)
+				{
+					*start = run_start;
+					return len;
+				}
+				run += zeros;
+				if (run > best)
+				{
+					best = run;
+					best_start = run_start;
+				}
+				p += zeros;
+				if (p == 64)
+					break;
+			}
+			run = 0;
+			p += __builtin_clzll(~(v << p));
+		}
+		w++;
+	}
+	*start = best_start;
+	return best;
+}
+
+uint32_t bitmap_find_next(const unsigned char *bm, uint32_t nbits, uint32_t from, bool set)
+{
+	uint32_t nwords = (nbits + 63) / 64;
+	for (uint32_t w = from / 64; w < nwords; w++)
+	{
+		//Look for a set bit in v
+		uint64_t v = load_word(bm, w);
+		if (!set)
+			v = ~v;
+		if (w == from / 64)
+			v &= ~0ull >> (from % 64);
+		if (v != 0)
+		{
+			uint32_t bit = w * 64 + __builtin_clzll(v);
+			return (bit < nbits) ? bit : nbits;
+		}
+		if (!set)
+			w = skip_used(bm, w + 1, nwords) - 1;
+	}
+	return nbits;
+}
+
+int64_t bitmap_find_last_zero(const unsigned char *bm, uint32_t from, uint32_t nbits)
+{
+	for (int64_t w = (int64_t)(nbits + 63) / 64 - 1; w >= from / 64; w--)
+	{
+		uint64_t v = load_word(bm, w);
+		if (w == (int64_t)(nbits + 63) / 64 - 1 && nbits % 64 != 0)
+			v |= ~0ull >> (nbits % 64);
+		if (w == from / 64)
+			v |= ~(~0ull >> (from % 64));
+		if (v != ~0ull)
+			return w * 64 + 63 - __builtin_ctzll(~v);
+	}
+	return -1;
+}
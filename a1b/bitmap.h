@@ -0,0 +1,47 @@
+/**
+ * a1fs bitmap operations header file.
+ *
+ * a1fs bitmaps are MSB first: bit i is (0x80 >> (i % 8)) in byte i / 8. The
+ * functions here work on 64 bits at a time, and skip fully used areas 256
+ * bits at a time with AVX2 when the CPU has it. A bitmap must be readable up
+ * to the next multiple of 8 bytes; a1fs bitmaps occupy whole blocks, so this
+ * always holds.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+
+/** Check if a bit is set. */
+bool bitmap_test(const unsigned char *bm, uint32_t bit);
+
+/** Set the len bits starting at bit start. */
+void bitmap_set_range(unsigned char *bm, uint32_t start, uint32_t len);
+
+/** Clear the len bits starting at bit start. */
+void bitmap_clear_range(unsigned char *bm, uint32_t start, uint32_t len);
+
+/**
+ * Find the first run of len clear bits in bits [from, nbits). If there is
+ * none, the longest run of clear bits is returned instead.
+ *
+ * @param start  pointer to the variable that receives the first bit of the run.
+ * @return       length of the run (len if one was found); 0 if all bits are set.
+ */
+uint32_t bitmap_find_zero_run(const unsigned char *bm, uint32_t nbits, uint32_t from, uint32_t len, uint32_t *start);
+
+/**
+ * Find the first bit in [from, nbits) that is set (or clear, if set is false).
+ *
+ * @return  the index of the bit; nbits if there is none.
+ */
+uint32_t bitmap_find_next(const unsigned char *bm, uint32_t nbits, uint32_t from, bool set);
+
+/**
+ * Find the last clear bit in bits [from, nbits).
+ *
+ * @return  the index of the bit; -1 if all of them are set.
+ */
+int64_t bitmap_find_last_zero(const unsigned char *bm, uint32_t from, uint32_t nbits);
@@ -0,0 +1,133 @@
+/**
+ * a1fs in-memory negative lookup filter implementation.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "bloom.h"
+#include "util.h"
+
+
+/** Second hash of a name, derived from the first one (splitmix64 finalizer). */
+static uint64_t bloom_hash2(uint32_t h)
+{
+	uint64_t x = h + 0x9E3779B97F4A7C15ull;
+	x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+	x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+	return x ^ (x >> 31);
+}
+
+/**
+ * Return the filter block that holds the bits of a name. Each 9-bit slice of
+ * *h2 then picks one of the bits in the block.
+ */
+static uint64_t *bloom_block(bloom *bf, const char *name, uint64_t *h2)
+{
+	uint32_t h = name_hash(name, strlen(name));
+	*h2 = bloom_hash2(h);
+	return &bf->bits[(h & bf->mask) * BLOOM_BLOCK_WORDS];
+}
+
+bool bloom_table_init(bloom_table *bt, uint32_t num_inodes)
+{
+	bt->filters = calloc(num_inodes, sizeof(bloom *));
+	bt->count = num_inodes;
+	bt->negatives = 0;
+	return bt->filters != NULL;
+}
+
+void bloom_table_destroy(bloom_table *bt)
+{
+	if (bt->filters == NULL)
+		return;
+	for (uint32_t i = 0; i < bt->count; i++)
+		free(bt->filters[i]);
+	free(bt->filters);
+	bt->filters = NULL;
+}
+
+bloom *bloom_new(uint32_t nentries)
+{
+	uint64_t capacity = 2 * (uint64_t)(nentries < 32 ? 32 : nentries);
+	if (capacity > UINT32_MAX)
+		capacity = UINT32_MAX;
+	uint64_t nblocks = 1;
+	while (nblocks * BLOOM_BLOCK_WORDS * 64 < capacity * BLOOM_BITS_PER_KEY)
+		nblocks <<= 1;
+
+	bloom *bf = calloc(1, sizeof(bloom) + nblocks * BLOOM_BLOCK_WORDS * sizeof(uint64_t));
+	if (bf == NULL)
+		return NULL;
+	bf->mask = nblocks - 1;
+	bf->capacity = capacity;
+	return bf;
+}
+
+void bloom_add(bloom *bf, const char *name)
+{
+	uint64_t h2;
+	uint64_t *blk = bloom_block(bf, name, &h2);
+	for (int i = 0; i < BLOOM_HASHES; i++, h2 >>= 9)
+		blk[(h2 & 511) / 64] |= 1ull << (h2 & 63);
+	bf->nkeys++;
+}
+
+void bloom_install(bloom_table *bt, a1fs_ino_t dir, bloom *bf)
+{
+	bloom *expected = NULL;
+	if (!__atomic_compare_exchange_n(&bt->filters[dir], &expected, bf, false,
+	                                 __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		free(bf);
+}
+
+bool bloom_present(bloom_table *bt, a1fs_ino_t dir)
+{
+	return __atomic_load_n(&bt->filters[dir], __ATOMIC_ACQUIRE) != NULL;
+}
+
+bool bloom_absent(bloom_table *bt, a1fs_ino_t dir, const char *name)
+{
+	bloom *bf = __atomic_load_n(&bt->filters[dir], __ATOMIC_ACQUIRE);
+	if (bf == NULL)
+		return false;
+	uint64_t h2;
+	uint64_t *blk = bloom_block(bf, name, &h2);
+	for (int i = 0; i < BLOOM_HASHES; i++, h2 >>= 9)
+	{
+		if (!(blk[(h2 & 511) / 64] & (1ull << (h2 & 63))))
+		{
+			__atomic_fetch_add(&bt->negatives, 1, __ATOMIC_RELAXED);
+			return true;
+		}
+	}
+	return false;
+}
+
+void bloom_insert(bloom_table *bt, a1fs_ino_t dir, const char *name)
+{
+	bloom *bf = bt->filters[dir];
+	if (bf == NULL)
+		return;
+	if (bf->nkeys >= bf->capacity)
+	{
+		bloom_drop(bt, dir);
+		return;
+	}
+	bloom_add(bf, name);
+}
+
+void bloom_remove(bloom_table *bt, a1fs_ino_t dir)
+{
+	bloom *bf = bt->filters[dir];
+	if (bf != NULL && ++bf->stale > bf->capacity / 4)
+		bloom_drop(bt, dir);
+}
+
+void bloom_drop(bloom_table *bt, a1fs_ino_t dir)
+{
+	// No reader can be using the filter since we hold the write lock on dir
+	bloom *bf = bt->filters[dir];
+	__atomic_store_n(&bt->filters[dir], NULL, __ATOMIC_RELAXED);
+	free(bf);
+}
@@ -0,0 +1,105 @@
+/**
+ * a1fs in-memory negative lookup filter header file.
+ *
+ * Keeps a Bloom filter of the names in each large directory, so that looking
+ * up a name that doesn't exist (which FUSE does before every create and
+ * mkdir) can usually fail without reading any dentry blocks.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "a1fs.h"
+
+/** Filter bits per name; with 7 hashes this gives about 1% false positives. */
+#define BLOOM_BITS_PER_KEY 10
+
+/** Number of bits set per name. */
+#define BLOOM_HASHES 7
+
+/** All the bits of a name are in one 512-bit (cache line sized) block. */
+#define BLOOM_BLOCK_WORDS 8
+
+/** Bloom filter of the names in one directory. */
+typedef struct bloom {
+	/** Number of blocks minus one; the number of blocks is a power of 2. */
+	uint32_t mask;
+	/** Number of names the filter is sized for. */
+	uint32_t capacity;
+	/** Number of names added, including ones that were removed since. */
+	uint32_t nkeys;
+	/** Number of names removed since the filter was built. */
+	uint32_t stale;
+	/** Filter bits. */
+	uint64_t bits[];
+
+} bloom;
+
+/** Filters of all directories. */
+typedef struct bloom_table {
+	/** Filter of each directory indexed by inode number, or NULL. */
+	bloom **filters;
+	/** Number of inodes. */
+	uint32_t count;
+	/** Number of lookups that a filter answered without a scan. */
+	uint64_t negatives;
+
+} bloom_table;
+
+/**
+ * Initialize the table; no directory has a filter yet.
+ *
+ * @return  true on success; false if out of memory.
+ */
+bool bloom_table_init(bloom_table *bt, uint32_t num_inodes);
+
+/** Free all the filters and the resources created in bloom_table_init(). */
+void bloom_table_destroy(bloom_table *bt);
+
+/**
+ * Create an empty filter for a directory with nentries entries. The filter
+ * has room for as many entries again before it has to be rebuilt.
+ *
+ * @return  the new filter; NULL if out of memory.
+ */
+bloom *bloom_new(uint32_t nentries);
+
+/** Add a name to a filter that is not installed yet. */
+void bloom_add(bloom *bf, const char *name);
+
+/**
+ * Install a filter built while holding (at least) a read lock on directory
+ * dir. If another thread has installed a filter in the meantime, bf is freed.
+ */
+void bloom_install(bloom_table *bt, a1fs_ino_t dir, bloom *bf);
+
+/** Check if directory dir has a filter. */
+bool bloom_present(bloom_table *bt, a1fs_ino_t dir);
+
+/**
+ * Check if name is definitely not in directory dir. Must be called while
+ * holding (at least) a read lock on dir.
+ *
+ * @return  true if name is not in dir; false if it may be or dir has no filter.
+ */
+bool bloom_absent(bloom_table *bt, a1fs_ino_t dir, const char *name);
+
+/**
+ * Record that name was added to directory dir. The filter is dropped when it
+ * is full, and rebuilt at a bigger size by the next lookup. Must be called
+ * while holding the write lock on dir.
+ */
+void bloom_insert(bloom_table *bt, a1fs_ino_t dir, const char *name);
+
+/**
+ * Record that a name was removed from directory dir. The bits of a name can't
+ * be cleared, so the name stays a false positive until the filter is rebuilt;
+ * the filter is dropped once too many names are stale. Must be called while
+ * holding the write lock on dir.
+ */
+void bloom_remove(bloom_table *bt, a1fs_ino_t dir);
+
+/** Drop the filter of directory dir. Must be called while holding its write lock. */
+void bloom_drop(bloom_table *bt, a1fs_ino_t dir);
@@ -0,0 +1,311 @@
+/**
+ * a1fs on-disk B+tree implementation.
+ */
+
+#include <errno.h>
+#include <string.h>
+
+#include "btree.h"
+
+
+static btree_node *get_node_blk(btree *bt, uint32_t blk)
+{
+	return (btree_node *)bt->blk(bt->arg, blk);
+}
+
+/** Node at block blk, which the caller is about to change. */
+static btree_node *get_node_dirty(btree *bt, uint32_t blk)
+{
+	if (bt->dirty != NULL)
+		bt->dirty(bt->arg, blk);
+	return get_node_blk(bt, blk);
+}
+
+/** Index of the first record with a key >= key. */
+static int lower_bound(const btree_node *node, uint64_t key)
+{
+	int lo = 0;
+	int hi = node->nrecs;
+	while (lo < hi)
+	{
+		int mid = (lo + hi) / 2;
+		if (node->recs[mid].key < key)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/** Index of the child of an internal node whose subtree may contain key. */
+static int child_index(const btree_node *node, uint64_t key)
+{
+	int i = lower_bound(node, key);
+	if (i < node->nrecs && node->recs[i].key == key)
+		return i;
+	return (i == 0) ? 0 : i - 1;
+}
+
+/** Insert rec at pos into a node that has room for it. */
+static void node_insert(btree_node *node, int pos, btree_rec rec)
+{
+	memmove(&node->recs[pos + 1], &node->recs[pos], (node->nrecs - pos) * sizeof(btree_rec));
+	node->recs[pos] = rec;
+	node->nrecs++;
+}
+
+/**
+ * Insert rec at pos into a full node, moving the upper half of the records
+ * into the empty node right (block number right_blk). Returns the record that
+ * must be added to the parent to reference the new node.
+ */
+static btree_rec node_split(btree_node *node, btree_node *right, uint32_t right_blk, int pos, btree_rec rec)
+{
+	btree_rec all[BTREE_FANOUT + 1];
+	int total = node->nrecs + 1;
+	memcpy(all, node->recs, pos * sizeof(btree_rec));
+	all[pos] = rec;
+	memcpy(&all[pos + 1], &node->recs[pos], (node->nrecs - pos) * sizeof(btree_rec));
+
+	int left_n = total / 2;
+	memset(right, 0, sizeof(*right));
+	right->level = node->level;
+	right->nrecs = total - left_n;
+	memcpy(right->recs, &all[left_n], right->nrecs * sizeof(btree_rec));
+	node->nrecs = left_n;
+	memcpy(node->recs, all, left_n * sizeof(btree_rec));
+	if (node->level == 0)
+	{
+		right->next = node->next;
+		node->next = right_blk;
+	}
+	else
+	{
+		right->next = -1;
+	}
+
+	btree_rec up = {right->recs[0].key, right_blk};
+	return up;
+}
+
+int btree_insert(btree *bt, uint64_t key, uint64_t val)
+{
+	btree_rec rec = {key, val};
+
+	if (*bt->root == -1)
+	{
+		int64_t blk = bt->alloc(bt->arg);
+		if (blk < 0)
+			return (int)blk;
+		btree_node *leaf = get_node_dirty(bt, blk);
+		memset(leaf, 0, sizeof(*leaf));
+		leaf->next = -1;
+		node_insert(leaf, 0, rec);
+		*bt->root = blk;
+		return 0;
+	}
+
+	// Walk down to the leaf, remembering the path
+	uint32_t path[BTREE_MAX_DEPTH];
+	int idx[BTREE_MAX_DEPTH];
+	int depth = 0;
+	uint32_t blk = *bt->root;
+	btree_node *node = get_node_blk(bt, blk);
+	while (node->level > 0)
+	{
+		path[depth] = blk;
+		idx[depth] = child_index(node, key);
+		blk = node->recs[idx[depth]].val;
+		depth++;
+		node = get_node_blk(bt, blk);
+	}
+	path[depth] = blk;
+	idx[depth] = lower_bound(node, key);
+	if (idx[depth] < node->nrecs && node->recs[idx[depth]].key == key)
+		return -EEXIST;
+
+	// Count the splits: every full node from the leaf up, plus a new root
+	int need = 0;
+	for (int d = depth; d >= 0 && get_node_blk(bt, path[d])->nrecs == BTREE_FANOUT; d--)
+		need++;
+	if (need == depth + 1)
+		need++;
+	if (need > depth + 1 && depth + 2 > BTREE_MAX_DEPTH)
+		return -ENOSPC;
+
+	int64_t spare[BTREE_MAX_DEPTH + 1];
+	for (int i = 0; i < need; i++)
+	{
+		spare[i] = bt->alloc(bt->arg);
+		if (spare[i] < 0)
+		{
+			int err = (int)spare[i];
+			while (i-- > 0)
+				bt->release(bt->arg, spare[i]);
+			return err;
+		}
+	}
+
+	// Insert bottom-up, splitting full nodes with the preallocated blocks
+	int used = 0;
+	int pos = idx[depth];
+	for (int d = depth; d >= 0; d--)
+	{
+		node = get_node_dirty(bt, path[d]);
+		if (node->nrecs < BTREE_FANOUT)
+		{
+			node_insert(node, pos, rec);
+			return 0;
+		}
+		uint32_t right_blk = spare[used++];
+		rec = node_split(node, get_node_dirty(bt, right_blk), right_blk, pos, rec);
+		if (d > 0)
+			pos = idx[d - 1] + 1;
+	}
+
+	// The root was split; grow the tree by one level
+	uint32_t root_blk = spare[used];
+	btree_node *old_root = get_node_blk(bt, *bt->root);
+	btree_node *root = get_node_dirty(bt, root_blk);
+	memset(root, 0, sizeof(*root));
+	root->level = old_root->level + 1;
+	// The first key of an internal node stays 0 so that binary search works
+	// even after smaller keys have gone into the leftmost subtree
+	root->next = -1;
+	root->nrecs = 2;
+	root->recs[0].key = 0;
+	root->recs[0].val = *bt->root;
+	root->recs[1] = rec;
+	*bt->root = root_blk;
+	return 0;
+}
+
+int btree_delete(btree *bt, uint64_t key)
+{
+	if (*bt->root == -1)
+		return -ENOENT;
+
+	uint32_t blk = *bt->root;
+	btree_node *node = get_node_blk(bt, blk);
+	while (node->level > 0)
+	{
+		blk = node->recs[child_index(node, key)].val;
+		node = get_node_blk(bt, blk);
+	}
+
+	int pos = lower_bound(node, key);
+	if (pos == node->nrecs || node->recs[pos].key != key)
+		return -ENOENT;
+	get_node_dirty(bt, blk);
+	memmove(&node->recs[pos], &node->recs[pos + 1], (node->nrecs - pos - 1) * sizeof(btree_rec));
+	node->nrecs--;
+	return 0;
+}
+
+int btree_update(btree *bt, uint64_t key, uint64_t val)
+{
+	if (*bt->root == -1)
+		return -ENOENT;
+
+	uint32_t blk = *bt->root;
+	btree_node *node = get_node_blk(bt, blk);
+	while (node->level > 0)
+	{
+		blk = node->recs[child_index(node, key)].val;
+		node = get_node_blk(bt, blk);
+	}
+
+	int pos = lower_bound(node, key);
+	if (pos == node->nrecs || node->recs[pos].key != key)
+		return -ENOENT;
+	get_node_dirty(bt, blk);
+	node->recs[pos].val = val;
+	return 0;
+}
+
+/**
+ * Find the record with the largest key <= key under block blk. Subtrees to
+ * the left are tried in turn when the one for key has no such record, which
+ * happens when its leaves were emptied by deletes.
+ */
+static bool floor_in(btree *bt, uint32_t blk, uint64_t key, btree_rec *rec)
+{
+	btree_node *node = get_node_blk(bt, blk);
+	if (node->level == 0)
+	{
+		int i = (key == UINT64_MAX) ? node->nrecs : lower_bound(node, key + 1);
+		if (i == 0)
+			return false;
+		*rec = node->recs[i - 1];
+		return true;
+	}
+	for (int i = child_index(node, key); i >= 0; i--)
+	{
+		if (floor_in(bt, node->recs[i].val, key, rec))
+			return true;
+	}
+	return false;
+}
+
+bool btree_floor(btree *bt, uint64_t key, uint64_t *found, uint64_t *val)
+{
+	btree_rec rec;
+	if (*bt->root == -1 || !floor_in(bt, *bt->root, key, &rec))
+		return false;
+	*found = rec.key;
+	*val = rec.val;
+	return true;
+}
+
+void btree_seek(btree *bt, uint64_t key, btree_iter *it)
+{
+	it->bt = bt;
+	it->leaf = *bt->root;
+	it->idx = 0;
+	if (it->leaf == -1)
+		return;
+
+	btree_node *node = get_node_blk(bt, it->leaf);
+	while (node->level > 0)
+	{
+		it->leaf = node->recs[child_index(node, key)].val;
+		node = get_node_blk(bt, it->leaf);
+	}
+	it->idx = lower_bound(node, key);
+}
+
+bool btree_next(btree_iter *it, uint64_t *key, uint64_t *val)
+{
+	while (it->leaf != -1)
+	{
+		btree_node *node = get_node_blk(it->bt, it->leaf);
+		if (it->idx < node->nrecs)
+		{
+			*key = node->recs[it->idx].key;
+			*val = node->recs[it->idx].val;
+			it->idx++;
+			return true;
+		}
+		it->leaf = node->next;
+		it->idx = 0;
+	}
+	return false;
+}
+
+static void free_subtree(btree *bt, uint32_t blk)
+{
+	btree_node *node = get_node_blk(bt, blk);
+	if (node->level > 0)
+	{
+		for (int i = 0; i < node->nrecs; i++)
+			free_subtree(bt, node->recs[i].val);
+	}
+	bt->release(bt->arg, blk);
+}
+
+void btree_free(btree *bt)
+{
+	if (*bt->root != -1)
+		free_subtree(bt, *bt->root);
+	*bt->root = -1;
+}
@@ -0,0 +1,117 @@
+/**
+ * a1fs on-disk B+tree header file.
+ *
+ * A B+tree of (64-bit key, 64-bit value) records whose nodes are a1fs data
+ * blocks. Used for hashed directory indexes and for the extent maps of files
+ * with many extents. The tree doesn't know how blocks are allocated or
+ * addressed; the owner supplies that through callbacks.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "a1fs.h"
+
+/** A key/value pair. In internal nodes the value is a child block number. */
+typedef struct btree_rec {
+	uint64_t key;
+	uint64_t val;
+
+} btree_rec;
+
+/** Number of records in a node. */
+#define BTREE_FANOUT ((A1FS_BLOCK_SIZE - 16) / sizeof(btree_rec))
+
+/** Maximum height of a tree. 255^8 records is more than enough. */
+#define BTREE_MAX_DEPTH 8
+
+/** B+tree node; occupies exactly one block. */
+typedef struct btree_node {
+	/** 0 for leaves; the height above the leaves otherwise. */
+	uint16_t level;
+	/** Number of records in use. */
+	uint16_t nrecs;
+	/** Next leaf in key order, or -1. Unused in internal nodes. */
+	int32_t next;
+	uint64_t reserved;
+	/**
+	 * Records sorted by key. In an internal node, recs[i].key is a lower bound
+	 * of the keys under child i (recs[0].key is always 0).
+	 */
+	btree_rec recs[BTREE_FANOUT];
+
+} btree_node;
+
+static_assert(sizeof(btree_node) == A1FS_BLOCK_SIZE, "invalid btree node size");
+
+/** Handle on a tree; the root block number lives in the owner's structure. */
+typedef struct btree {
+	/** Root block number, or -1 if the tree is empty. */
+	int32_t *root;
+	/** Return a pointer to the contents of block blk. */
+	void *(*blk)(void *arg, uint32_t blk);
+	/** Allocate a block; returns its number or -errno. */
+	int64_t (*alloc)(void *arg);
+	/** Free a block returned by alloc(). */
+	void (*release)(void *arg, uint32_t blk);
+	/** Note that block blk is about to be changed; may be NULL. */
+	void (*dirty)(void *arg, uint32_t blk);
+	/** Passed to the callbacks. */
+	void *arg;
+
+} btree;
+
+/** Position of a record in the tree, used for range scans. */
+typedef struct btree_iter {
+	btree *bt;
+	/** Current leaf block, or -1 past the end. */
+	int32_t leaf;
+	/** Index of the current record in the leaf. */
+	int idx;
+
+} btree_iter;
+
+/**
+ * Insert a record. All blocks that a split might need are allocated before
+ * the tree is modified, so on error the tree is left unchanged.
+ *
+ * @return  0 on success; -EEXIST if the key is present; -ENOSPC.
+ */
+int btree_insert(btree *bt, uint64_t key, uint64_t val);
+
+/**
+ * Remove the record with the given key. Leaves that become empty are kept
+ * (the owner frees the whole tree when it is no longer useful).
+ *
+ * @return  0 on success; -ENOENT if the key is not present.
+ */
+int btree_delete(btree *bt, uint64_t key);
+
+/**
+ * Replace the value of the record with the given key.
+ *
+ * @return  0 on success; -ENOENT if the key is not present.
+ */
+int btree_update(btree *bt, uint64_t key, uint64_t val);
+
+/**
+ * Find the record with the largest key <= key.
+ *
+ * @return  true if there is one; false otherwise.
+ */
+bool btree_floor(btree *bt, uint64_t key, uint64_t *found, uint64_t *val);
+
+/** Position it on the first record with a key >= key. */
+void btree_seek(btree *bt, uint64_t key, btree_iter *it);
+
+/**
+ * Return the record at the iterator position and advance the iterator.
+ *
+ * @return  true if a record was returned; false at the end of the tree.
+ */
+bool btree_next(btree_iter *it, uint64_t *key, uint64_t *val);
+
+/** Free every node of the tree and mark it empty. */
+void btree_free(btree *bt);
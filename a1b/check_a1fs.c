@@ -0,0 +1,1202 @@
+/**
+ * a1fs checks on images made by mkfs.a1fs.
+ *
+ * Each check formats an image file with mkfs.a1fs, mounts it in this process
+ * with fs_mount() and goes through the operations that the drivers use, in
+ * helper_func_file.c, without FUSE or the kernel. Some of them mount the
+ * image again, or a copy of it as a crash would have left it, and check what
+ * is in it then. Run with "make check"; the first argument is the mkfs.a1fs
+ * to use, ./mkfs.a1fs by default.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Using 2.9.x FUSE API
+#define FUSE_USE_VERSION 29
+#include <fuse.h>
+#include "helper_func_file.c"
+
+#include "a1fs.h"
+#include "fs_ctx.h"
+#include "options.h"
+
+
+#define CHECK(cond)                                                              \
+	do {                                                                         \
+		if (!(cond)) {                                                           \
+			fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+			exit(1);                                                             \
+		}                                                                        \
+	} while (0)
+
+static const char *mkfs_path = "./mkfs.a1fs";
+static char img_path[] = "/tmp/a1fs-check-XXXXXX";
+static char crash_path[sizeof(img_path) + 6];
+
+
+/** Format the image file, of size bytes, with extra mkfs.a1fs options. */
+static void mkfs(size_t size, const char *opts)
+{
+	CHECK(truncate(img_path, 0) == 0 && truncate(img_path, size) == 0);
+	char cmd[1024];
+	snprintf(cmd, sizeof(cmd), "%s -f -i 4096 %s %s > /dev/null", mkfs_path, opts, img_path);
+	CHECK(system(cmd) == 0);
+}
+
+static void mount_image(fs_ctx *fs, const char *path)
+{
+	a1fs_opts opts = { .img_path = path, .cache_timeout = A1FS_CACHE_TIMEOUT };
+	memset(fs, 0, sizeof(*fs));
+	CHECK(fs_mount(fs, &opts));
+}
+
+/** Inode of path; NULL if there is none. */
+static a1fs_inode *lookup(fs_ctx *fs, const char *path)
+{
+	fs_req rq;
+	fs_req_init(&rq, fs);
+	return (find_path_inode(path, &rq) == 0) ? rq.path_inode : NULL;
+}
+
+static void create(fs_ctx *fs, const char *path, mode_t mode)
+{
+	fs_req rq;
+	fs_req_init(&rq, fs);
+	CHECK(create_file_dir(&rq, path, mode, S_ISREG(mode)) == 0);
+}
+
+static void unlink_path(fs_ctx *fs, const char *path, bool is_dir)
+{
+	fs_req rq;
+	fs_req_init(&rq, fs);
+	CHECK(rm_dir_file(&rq, path, is_dir) == 0);
+}
+
+/** Write to a file through a handle of its own, as a1fs_write() does. */
+static int write_path(fs_ctx *fs, const char *path, const void *buf, size_t size, off_t off)
+{
+	a1fs_inode *inode = lookup(fs, path);
+	CHECK(inode != NULL);
+	fs_req rq;
+	fs_req_init(&rq, fs);
+	fhandle *fh = handle_new(inode);
+	CHECK(fh != NULL);
+	int ret = file_write(&rq, fh, buf, size, off);
+	handle_free(fh);
+	return ret;
+}
+
+static int read_path(fs_ctx *fs, const char *path, void *buf, size_t size, off_t off)
+{
+	a1fs_inode *inode = lookup(fs, path);
+	CHECK(inode != NULL);
+	fs_req rq;
+	fs_req_init(&rq, fs);
+	fhandle *fh = handle_new(inode);
+	CHECK(fh != NULL);
+	int ret = file_read(&rq, fh, buf, size, off);
+	handle_free(fh);
+	return ret;
+}
+
+static void stat_path(fs_ctx *fs, const char *path, struct stat *st)
+{
+	fs_req rq;
+	fs_req_init(&rq, fs);
+	a1fs_inode *inode = lookup(fs, path);
+	CHECK(inode != NULL);
+	inode_stat(&rq, inode, st);
+}
+
+static int truncate_path(fs_ctx *fs, const char *path, off_t size)
+{
+	fs_req rq;
+	fs_req_init(&rq, fs);
+	return file_truncate(&rq, lookup(fs, path), size);
+}
+
+static int fallocate_path(fs_ctx *fs, const char *path, int mode, off_t off, off_t len)
+{
+	fs_req rq;
+	fs_req_init(&rq, fs);
+	return file_fallocate(&rq, lookup(fs, path), mode, off, len);
+}
+
+static void sync_path(fs_ctx *fs, const char *path, int mode)
+{
+	fs_req rq;
+	fs_req_init(&rq, fs);
+	CHECK(file_sync(&rq, lookup(fs, path), mode) == 0);
+}
+
+/** Check that the file at path holds exactly the size bytes of buf. */
+static void check_contents(fs_ctx *fs, const char *path, const char *buf, size_t size)
+{
+	char *got = malloc(size + 1);
+	CHECK(got != NULL);
+	CHECK(read_path(fs, path, got, size + 1, 0) == (int)size);
+	CHECK(memcmp(got, buf, size) == 0);
+	free(got);
+}
+
+/** Whole image file, as the disk has it. */
+static char *image_read(const char *path, size_t size)
+{
+	char *buf = malloc(size);
+	CHECK(buf != NULL);
+	int fd = open(path, O_RDONLY);
+	CHECK(fd >= 0 && pread(fd, buf, size, 0) == (ssize_t)size);
+	close(fd);
+	return buf;
+}
+
+static void image_write(const char *path, const char *buf, size_t size)
+{
+	int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	CHECK(fd >= 0 && pwrite(fd, buf, size, 0) == (ssize_t)size);
+	close(fd);
+}
+
+
+typedef struct tree_count {
+	fs_req *rq;
+	uint32_t inodes;
+
+} tree_count;
+
+static bool count_visit(fs_req *rq, const char *name, a1fs_ino_t ino, uint32_t pos, void *arg);
+
+/** Count the inodes reachable from dir, dir included. */
+static void count_tree(tree_count *tc, a1fs_inode *dir)
+{
+	tc->inodes++;
+	CHECK(dir_for_each(tc->rq, dir, count_visit, tc));
+}
+
+static bool count_visit(fs_req *rq, const char *name, a1fs_ino_t ino, uint32_t pos, void *arg)
+{
+	(void)name; // unused
+	(void)pos; // unused
+	tree_count *tc = arg;
+	CHECK(bitmap_test(rq->fs->bitmp_inode, ino));
+	a1fs_inode *inode = get_node(rq->fs, ino);
+	CHECK(inode->links > 0);
+	if (S_ISDIR(inode->mode))
+		count_tree(tc, inode);
+	else
+		tc->inodes++;
+	return true;
+}
+
+/**
+ * Check that the free counters agree with the bitmaps, and that every inode
+ * in use has a name.
+ */
+static void check_fs(fs_ctx *fs)
+{
+	uint64_t free_blocks, free_inodes;
+	fs_count_free(fs, &free_blocks, &free_inodes);
+	uint64_t clear_inodes = 0;
+	for (uint32_t i = 0; i < fs->bblk->num_inodes; i++)
+		clear_inodes += !bitmap_test(fs->bitmp_inode, i);
+	CHECK(clear_inodes == free_inodes);
+	uint64_t clear_blocks = 0;
+	for (uint32_t g = 0; g < fs->num_groups; g++)
+		for (uint32_t b = fs->groups[g].blk_start; b < fs->groups[g].blk_start + fs->groups[g].blk_count; b++)
+			clear_blocks += !bitmap_test(fs->bitmp_data, b);
+	CHECK(clear_blocks == free_blocks);
+
+	fs_req rq;
+	fs_req_init(&rq, fs);
+	tree_count tc = { .rq = &rq, .inodes = 0 };
+	count_tree(&tc, get_node(fs, 0));
+	CHECK(tc.inodes == fs->bblk->num_inodes - free_inodes);
+}
+
+/** Check fs, then unmount it and mount its image again. */
+static void remount(fs_ctx *fs)
+{
+	check_fs(fs);
+	fs_unmount(fs);
+	mount_image(fs, img_path);
+}
+
+
+/**
+ * What is not committed never reaches the image file, and a copy of the
+ * file taken at any time mounts as of the last commit, even if a checkpoint
+ * was writing the log to its place when it was taken.
+ */
+static void check_journal(void)
+{
+	static const char keep[] = "committed before the crash";
+	const size_t size = 8 << 20;
+	mkfs(size, "-j 64");
+	fs_ctx fs;
+	mount_image(&fs, img_path);
+	CHECK(fs.journal.enabled);
+	create(&fs, "/keep", S_IFREG | 0644);
+	create(&fs, "/gone", S_IFREG | 0644);
+	CHECK(write_path(&fs, "/keep", keep, sizeof(keep), 0) == sizeof(keep));
+	sync_path(&fs, "/keep", SYNC_FSYNC);
+	char *committed = image_read(img_path, size);
+
+	//A create and an unlink that are not committed
+	create(&fs, "/dir", S_IFDIR | 0755);
+	create(&fs, "/dir/new", S_IFREG | 0644);
+	unlink_path(&fs, "/gone", false);
+	//Whatever the kernel may write back, it has nothing newer
+	CHECK(msync(fs.image, fs.size, MS_SYNC) == 0);
+	char *now = image_read(img_path, size);
+	CHECK(memcmp(committed, now, size) == 0);
+	free(now);
+
+	image_write(crash_path, committed, size);
+	fs_ctx crashed;
+	mount_image(&crashed, crash_path);
+	check_contents(&crashed, "/keep", keep, sizeof(keep));
+	CHECK(lookup(&crashed, "/gone") != NULL);
+	CHECK(lookup(&crashed, "/dir") == NULL);
+	check_fs(&crashed);
+	fs_unmount(&crashed);
+
+	//Commit them, and tear the checkpoint: half the blocks get to their place
+	sync_path(&fs, "/keep", SYNC_FSYNC);
+	committed = realloc(committed, size);
+	char *log_only = image_read(img_path, size);
+	memcpy(committed, log_only, size);
+	uint32_t torn = 0, blocks = size / A1FS_BLOCK_SIZE;
+	uint32_t log_start = fs.journal.start, log_end = fs.journal.start + fs.journal.nblocks;
+	for (uint32_t b = 0; b < blocks; b++)
+	{
+		size_t off = (size_t)b * A1FS_BLOCK_SIZE;
+		if ((b >= log_start && b < log_end) || memcmp(committed + off, (char *)fs.image + off, A1FS_BLOCK_SIZE) == 0)
+			continue;
+		if (torn++ % 2 == 0)
+			memcpy(committed + off, (char *)fs.image + off, A1FS_BLOCK_SIZE);
+	}
+	CHECK(torn >= 2);
+	for (int pass = 0; pass < 2; pass++)
+	{
+		image_write(crash_path, pass ? committed : log_only, size);
+		mount_image(&crashed, crash_path);
+		check_contents(&crashed, "/keep", keep, sizeof(keep));
+		CHECK(lookup(&crashed, "/gone") == NULL);
+		CHECK(lookup(&crashed, "/dir/new") != NULL);
+		check_fs(&crashed);
+		fs_unmount(&crashed);
+	}
+	free(log_only);
+	free(committed);
+
+	fs_unmount(&fs);
+	mount_image(&fs, img_path);
+	CHECK(lookup(&fs, "/dir/new") != NULL);
+	check_fs(&fs);
+	fs_unmount(&fs);
+}
+
+/**
+ * A directory big enough to be indexed finds every name in it, and none of
+ * the removed ones, before and after a remount, with fixed size and compact
+ * entries.
+ */
+static void check_dir_index(void)
+{
+	static const char *const formats[] = { "-x", "-x -c" };
+	const int n = 3000;
+	char path[64];
+	for (int f = 0; f < 2; f++)
+	{
+		mkfs(16 << 20, formats[f]);
+		fs_ctx fs;
+		mount_image(&fs, img_path);
+		create(&fs, "/big", S_IFDIR | 0755);
+		for (int i = 0; i < n; i++)
+		{
+			snprintf(path, sizeof(path), "/big/file-%d", i);
+			create(&fs, path, S_IFREG | 0644);
+		}
+		for (int i = 0; i < n; i += 2)
+		{
+			snprintf(path, sizeof(path), "/big/file-%d", i);
+			unlink_path(&fs, path, false);
+		}
+
+		for (int pass = 0; pass < 2; pass++)
+		{
+			fs_req rq;
+			fs_req_init(&rq, &fs);
+			CHECK(dir_indexed(&rq, lookup(&fs, "/big")));
+			for (int i = 0; i < n; i++)
+			{
+				snprintf(path, sizeof(path), "/big/file-%d", i);
+				CHECK((lookup(&fs, path) != NULL) == (i % 2 == 1));
+			}
+			CHECK(lookup(&fs, "/big/file-") == NULL);
+			remount(&fs);
+		}
+		fs_unmount(&fs);
+	}
+}
+
+
+/**
+ * Sizes, offsets and allocations past 4 GiB, in a file on a small image, are
+ * kept whole, and so is the file after a remount.
+ */
+static void check_large_file(void)
+{
+	const off_t gib = (off_t)1 << 30;
+	struct stat st;
+	char buf[A1FS_BLOCK_SIZE];
+	mkfs(8 << 20, "");
+	fs_ctx fs;
+	mount_image(&fs, img_path);
+	create(&fs, "/huge", S_IFREG | 0644);
+	CHECK(fallocate_path(&fs, "/huge", 0, 5 * gib, 2 * A1FS_BLOCK_SIZE) == 0);
+	stat_path(&fs, "/huge", &st);
+	CHECK(st.st_size == 5 * gib + 2 * A1FS_BLOCK_SIZE);
+	CHECK(st.st_blocks == 2 * A1FS_BLOCK_SIZE / 512);
+	CHECK(read_path(&fs, "/huge", buf, sizeof(buf), 5 * gib) == sizeof(buf));
+	for (size_t i = 0; i < sizeof(buf); i++)
+		CHECK(buf[i] == 0);
+
+	CHECK(write_path(&fs, "/huge", "abc", 3, 4 * gib + 10) == 3);
+	CHECK(truncate_path(&fs, "/huge", 11 * gib) == 0);
+	stat_path(&fs, "/huge", &st);
+	CHECK(st.st_size == 11 * gib);
+	CHECK(truncate_path(&fs, "/huge", 4 * gib + 13) == 0);
+	for (int pass = 0; pass < 2; pass++)
+	{
+		stat_path(&fs, "/huge", &st);
+		CHECK(st.st_size == 4 * gib + 13);
+		CHECK(st.st_blocks == A1FS_BLOCK_SIZE / 512);
+		CHECK(read_path(&fs, "/huge", buf, sizeof(buf), 4 * gib) == 13);
+		CHECK(buf[9] == 0 && memcmp(buf + 10, "abc", 3) == 0);
+		remount(&fs);
+	}
+
+	CHECK(fallocate_path(&fs, "/huge", 0, A1FS_FILE_SIZE_MAX, A1FS_BLOCK_SIZE) == -EFBIG);
+	CHECK(truncate_path(&fs, "/huge", A1FS_FILE_SIZE_MAX + 1) == -EFBIG);
+	unlink_path(&fs, "/huge", false);
+	check_fs(&fs);
+	fs_unmount(&fs);
+}
+
+
+/** Check where SEEK_DATA and SEEK_HOLE from each offset in offs land. */
+static void check_seek(fs_ctx *fs, const char *path, const off_t offs[][3], int n)
+{
+	a1fs_inode *inode = lookup(fs, path);
+	CHECK(inode != NULL);
+	for (int i = 0; i < n; i++)
+	{
+		fs_req rq;
+		fs_req_init(&rq, fs);
+		CHECK(file_seek(&rq, inode, offs[i][0], true) == offs[i][1]);
+		CHECK(file_seek(&rq, inode, offs[i][0], false) == offs[i][2]);
+	}
+}
+
+/**
+ * Blocks that were never written, and written blocks of zeros with
+ * -o zero_holes, take no space, read as zeros and are found by SEEK_HOLE,
+ * before and after a remount.
+ */
+static void check_holes(void)
+{
+	const off_t b = A1FS_BLOCK_SIZE;
+	//Data in blocks 0 and 3 of 6; SEEK_DATA and SEEK_HOLE results
+	const off_t offs[][3] = {
+		{ 0, 0, b },
+		{ 7, 7, b },
+		{ b, 3 * b, b },
+		{ 2 * b + 1, 3 * b, 2 * b + 1 },
+		{ 3 * b + 7, 3 * b + 7, 4 * b },
+		{ 4 * b, -ENXIO, 4 * b },
+		{ 6 * b - 1, -ENXIO, 6 * b - 1 },
+		{ 6 * b, -ENXIO, -ENXIO },
+	};
+	char data[2 * A1FS_BLOCK_SIZE], buf[A1FS_BLOCK_SIZE];
+	struct stat st;
+	mkfs(8 << 20, "");
+	fs_ctx fs;
+	mount_image(&fs, img_path);
+	fs.zero_holes = true;
+	create(&fs, "/sparse", S_IFREG | 0644);
+	memset(data, 'a', sizeof(data));
+	//Flushed each time, since a gap right after buffered blocks is buffered too
+	CHECK(write_path(&fs, "/sparse", data, b, 0) == b);
+	sync_path(&fs, "/sparse", SYNC_FLUSH);
+	memset(buf, 0, sizeof(buf));
+	CHECK(write_path(&fs, "/sparse", buf, b, b) == b);
+	CHECK(write_path(&fs, "/sparse", data, 2 * b, 3 * b) == 2 * b);
+	sync_path(&fs, "/sparse", SYNC_FLUSH);
+	//An allocated block written over with zeros becomes a hole too
+	CHECK(write_path(&fs, "/sparse", buf, b, 4 * b) == b);
+	CHECK(truncate_path(&fs, "/sparse", 6 * b) == 0);
+	sync_path(&fs, "/sparse", SYNC_RELEASE);
+
+	for (int pass = 0; pass < 2; pass++)
+	{
+		stat_path(&fs, "/sparse", &st);
+		CHECK(st.st_size == 6 * b && st.st_blocks == 2 * b / 512);
+		check_seek(&fs, "/sparse", offs, sizeof(offs) / sizeof(offs[0]));
+		for (off_t off = 0; off < 6 * b; off += b)
+		{
+			CHECK(read_path(&fs, "/sparse", buf, b, off) == b);
+			for (off_t i = 0; i < b; i++)
+				CHECK(buf[i] == ((off == 0 || off == 3 * b) ? 'a' : 0));
+		}
+		remount(&fs);
+	}
+	fs_unmount(&fs);
+}
+
+
+/** Check block blk of the file that check_punch() fills, punched at [from, to). */
+static void check_punched_blk(fs_ctx *fs, off_t blk, off_t from, off_t to)
+{
+	char buf[A1FS_BLOCK_SIZE];
+	CHECK(read_path(fs, "/punch", buf, sizeof(buf), blk * A1FS_BLOCK_SIZE) == sizeof(buf));
+	for (off_t i = 0; i < A1FS_BLOCK_SIZE; i++)
+	{
+		off_t pos = blk * A1FS_BLOCK_SIZE + i;
+		CHECK(buf[i] == ((pos >= from && pos < to) ? 0 : 'a' + blk % 26));
+	}
+}
+
+/**
+ * Punching a hole frees the whole blocks in it and zeroes the rest, before
+ * and after a remount, and -o discard punches the freed blocks out of the
+ * image file, with and without a journal.
+ */
+static void check_punch(void)
+{
+	static const char *const formats[] = { "", "-j 64" };
+	const off_t b = A1FS_BLOCK_SIZE, from = 10 * b + 100, to = 200 * b + 5;
+	//Blocks 11 to 199 are punched whole
+	const int nblks = 300, punched = 189;
+	char buf[A1FS_BLOCK_SIZE];
+	struct stat st;
+	for (int f = 0; f < 2; f++)
+	{
+		mkfs(8 << 20, formats[f]);
+		fs_ctx fs;
+		mount_image(&fs, img_path);
+		fs.online_discard = true;
+		CHECK(discard_start(&fs.discard, discard_blks_cb, &fs));
+		create(&fs, "/punch", S_IFREG | 0644);
+		for (int i = 0; i < nblks; i++)
+		{
+			memset(buf, 'a' + i % 26, sizeof(buf));
+			CHECK(write_path(&fs, "/punch", buf, b, i * b) == b);
+		}
+		sync_path(&fs, "/punch", SYNC_RELEASE);
+		CHECK(journal_force(&fs.journal));
+		uint64_t free_blocks, free_inodes;
+		fs_count_free(&fs, &free_blocks, &free_inodes);
+
+		CHECK(fallocate_path(&fs, "/punch", FALLOC_FL_PUNCH_HOLE, from, to - from) == -EOPNOTSUPP);
+		CHECK(fallocate_path(&fs, "/punch", FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, from, to - from) == 0);
+		CHECK(journal_held(&fs.journal) == (fs.journal.enabled ? (uint64_t)punched : 0));
+		CHECK(journal_force(&fs.journal));
+		for (int pass = 0; pass < 2; pass++)
+		{
+			uint64_t now_free;
+			fs_count_free(&fs, &now_free, &free_inodes);
+			CHECK(now_free == free_blocks + punched);
+			stat_path(&fs, "/punch", &st);
+			CHECK(st.st_size == nblks * b && st.st_blocks == (nblks - punched) * b / 512);
+			const off_t offs[][3] = {
+				{ 0, 0, 11 * b },
+				{ from, from, 11 * b },
+				{ 11 * b, 200 * b, 11 * b },
+				{ 199 * b, 200 * b, 199 * b },
+			};
+			check_seek(&fs, "/punch", offs, sizeof(offs) / sizeof(offs[0]));
+			for (off_t blk = 9; blk <= 201; blk++)
+				check_punched_blk(&fs, blk, from, to);
+			remount(&fs);
+			fs.online_discard = true;
+			CHECK(discard_start(&fs.discard, discard_blks_cb, &fs));
+		}
+
+		//What is freed is punched out of the image file once the queue is drained
+		unlink_path(&fs, "/punch", false);
+		CHECK(journal_force(&fs.journal));
+		struct stat before, after;
+		CHECK(stat(img_path, &before) == 0);
+		discard_stop(&fs.discard);
+		CHECK(stat(img_path, &after) == 0);
+		CHECK(discard_count(&fs.discard) >= (uint64_t)(nblks - punched));
+		CHECK(after.st_blocks < before.st_blocks);
+		check_fs(&fs);
+		fs_unmount(&fs);
+	}
+}
+
+
+/**
+ * A file with too many extents for its inode keeps them in a B+tree, which
+ * maps every block to its data before and after a remount, and shrinks with
+ * the file.
+ */
+static void check_extent_tree(void)
+{
+	const int n = 1500;
+	const off_t b = A1FS_BLOCK_SIZE;
+	char buf[A1FS_BLOCK_SIZE];
+	struct stat st;
+	mkfs(32 << 20, "");
+	fs_ctx fs;
+	mount_image(&fs, img_path);
+	create(&fs, "/tree", S_IFREG | 0644);
+	//Every other block, each one flushed, is an extent of its own
+	for (int i = 0; i < n; i++)
+	{
+		memset(buf, 'a' + i % 26, sizeof(buf));
+		CHECK(write_path(&fs, "/tree", buf, b, 2 * i * b) == b);
+		sync_path(&fs, "/tree", SYNC_FLUSH);
+	}
+	sync_path(&fs, "/tree", SYNC_RELEASE);
+
+	for (int pass = 0; pass < 3; pass++)
+	{
+		//The last pass is after the file shrinks to half
+		int have = (pass < 2) ? n : n / 2;
+		CHECK(ext_tree(lookup(&fs, "/tree")));
+		stat_path(&fs, "/tree", &st);
+		CHECK(st.st_size == (2 * have - 1) * b && st.st_blocks == have * b / 512);
+		for (int i = 0; i < 2 * have - 1; i++)
+		{
+			CHECK(read_path(&fs, "/tree", buf, b, i * b) == b);
+			CHECK(buf[0] == ((i % 2 == 0) ? 'a' + i / 2 % 26 : 0) && buf[b - 1] == buf[0]);
+		}
+		remount(&fs);
+		if (pass == 1)
+			CHECK(truncate_path(&fs, "/tree", (n - 1) * b) == 0);
+	}
+
+	CHECK(truncate_path(&fs, "/tree", 0) == 0);
+	stat_path(&fs, "/tree", &st);
+	CHECK(st.st_blocks == 0);
+	unlink_path(&fs, "/tree", false);
+	check_fs(&fs);
+	fs_unmount(&fs);
+}
+
+
+/**
+ * Files small enough for their inode keep their data there and take no
+ * block, until they outgrow it, with and without a journal, before and after
+ * a remount.
+ */
+static void check_inline_data(void)
+{
+	static const char *const formats[] = { "-I 256", "-I 256 -j 64" };
+	char data[A1FS_BLOCK_SIZE], buf[A1FS_BLOCK_SIZE];
+	struct stat st;
+	for (int f = 0; f < 2; f++)
+	{
+		mkfs(8 << 20, formats[f]);
+		fs_ctx fs;
+		mount_image(&fs, img_path);
+		const size_t max = inline_data_max(&fs);
+		for (size_t i = 0; i < sizeof(data); i++)
+			data[i] = 'a' + i % 26;
+		create(&fs, "/small", S_IFREG | 0644);
+		create(&fs, "/full", S_IFREG | 0644);
+		create(&fs, "/grown", S_IFREG | 0644);
+		uint64_t free_blocks, free_inodes;
+		fs_count_free(&fs, &free_blocks, &free_inodes);
+		CHECK(write_path(&fs, "/small", data, 5, 0) == 5);
+		//Shrunk and grown again, the bytes past the old end read as zeros
+		CHECK(truncate_path(&fs, "/small", 2) == 0);
+		CHECK(truncate_path(&fs, "/small", 5) == 0);
+		CHECK(write_path(&fs, "/full", data, max, 0) == (int)max);
+		CHECK(write_path(&fs, "/grown", data, max, 0) == (int)max);
+		CHECK(write_path(&fs, "/grown", data + max, 1, max) == 1);
+		sync_path(&fs, "/grown", SYNC_RELEASE);
+
+		for (int pass = 0; pass < 2; pass++)
+		{
+			uint64_t now_free;
+			fs_count_free(&fs, &now_free, &free_inodes);
+			CHECK(now_free == free_blocks - 1);
+			CHECK(inline_data(lookup(&fs, "/small")) && inline_data(lookup(&fs, "/full")));
+			CHECK(!inline_data(lookup(&fs, "/grown")));
+			stat_path(&fs, "/full", &st);
+			CHECK(st.st_size == (off_t)max && st.st_blocks == 0);
+			stat_path(&fs, "/grown", &st);
+			CHECK(st.st_blocks == A1FS_BLOCK_SIZE / 512);
+			memcpy(buf, "ab\0\0\0", 5);
+			check_contents(&fs, "/small", buf, 5);
+			check_contents(&fs, "/full", data, max);
+			check_contents(&fs, "/grown", data, max + 1);
+			remount(&fs);
+		}
+		unlink_path(&fs, "/small", false);
+		unlink_path(&fs, "/full", false);
+		unlink_path(&fs, "/grown", false);
+		check_fs(&fs);
+		fs_unmount(&fs);
+	}
+}
+
+
+/** Data of file i of check_fragments(). */
+static void frag_file_data(char *buf, int i, size_t size)
+{
+	for (size_t k = 0; k < size; k++)
+		buf[k] = 'A' + (i + k) % 58;
+}
+
+/**
+ * Small files share fragment blocks, grow in them and leave them once they
+ * outgrow A1FS_FRAG_FILE_MAX, and a block is freed with its last fragment,
+ * before and after a remount.
+ */
+static void check_fragments(void)
+{
+	static const char *const formats[] = { "-F", "-F -I 256 -j 64" };
+	size_t sizes[40];
+	const int n = sizeof(sizes) / sizeof(sizes[0]);
+	char path[64], buf[2 * A1FS_FRAG_FILE_MAX];
+	for (int f = 0; f < 2; f++)
+	{
+		mkfs(8 << 20, formats[f]);
+		fs_ctx fs;
+		mount_image(&fs, img_path);
+		create(&fs, "/frags", S_IFDIR | 0755);
+		uint64_t free_blocks, free_inodes;
+		fs_count_free(&fs, &free_blocks, &free_inodes);
+		for (int i = 0; i < n; i++)
+		{
+			snprintf(path, sizeof(path), "/frags/%d", i);
+			create(&fs, path, S_IFREG | 0644);
+			sizes[i] = 300 + i * 37 % 700;
+			frag_file_data(buf, i, sizes[i]);
+			CHECK(write_path(&fs, path, buf, sizes[i], 0) == (int)sizes[i]);
+		}
+		//Grown in their fragments, and past them into blocks of their own
+		for (int i = 0; i < n; i += 5)
+		{
+			snprintf(path, sizeof(path), "/frags/%d", i);
+			sizes[i] = (i % 10 == 0) ? A1FS_FRAG_FILE_MAX : A1FS_FRAG_FILE_MAX + 1;
+			frag_file_data(buf, i, sizes[i]);
+			CHECK(write_path(&fs, path, buf, sizes[i], 0) == (int)sizes[i]);
+			sync_path(&fs, path, SYNC_RELEASE);
+		}
+
+		for (int pass = 0; pass < 2; pass++)
+		{
+			unsigned int frag_bytes = 0, own_blocks = 0;
+			for (int i = 0; i < n; i++)
+			{
+				snprintf(path, sizeof(path), "/frags/%d", i);
+				a1fs_inode *inode = lookup(&fs, path);
+				CHECK(frag_data(inode) == (sizes[i] <= A1FS_FRAG_FILE_MAX));
+				frag_bytes += frag_data(inode) ? frag_count(sizes[i]) * A1FS_FRAG_SIZE : 0;
+				own_blocks += frag_data(inode) ? 0 : 1;
+				frag_file_data(buf, i, sizes[i]);
+				check_contents(&fs, path, buf, sizes[i]);
+			}
+			uint64_t now_free;
+			fs_count_free(&fs, &now_free, &free_inodes);
+			//The fragments are packed into fewer blocks than there are files
+			CHECK(free_blocks - now_free - own_blocks < (uint64_t)n - own_blocks);
+			CHECK(free_blocks - now_free - own_blocks >= frag_bytes / A1FS_BLOCK_SIZE);
+			remount(&fs);
+		}
+
+		for (int i = 0; i < n; i++)
+		{
+			snprintf(path, sizeof(path), "/frags/%d", i);
+			unlink_path(&fs, path, false);
+		}
+		CHECK(journal_force(&fs.journal));
+		uint64_t now_free;
+		fs_count_free(&fs, &now_free, &free_inodes);
+		CHECK(now_free == free_blocks);
+		check_fs(&fs);
+		fs_unmount(&fs);
+	}
+}
+
+/**
+ * Each lookup counts once in the dentry cache counters: a miss the first
+ * time a name is looked up, a hit after that, with and without a reference
+ * taken on what is found.
+ */
+static void check_dcache(void)
+{
+	mkfs(8 << 20, "");
+	fs_ctx fs;
+	mount_image(&fs, img_path);
+	create(&fs, "/d", S_IFDIR | 0755);
+	create(&fs, "/d/f", S_IFREG | 0644);
+	remount(&fs);
+
+	for (int take_ref = 0; take_ref < 2; take_ref++)
+	{
+		uint64_t hits = fs.dcache.hits, misses = fs.dcache.misses;
+		fs_req rq;
+		fs_req_init(&rq, &fs);
+		rq.take_ref = take_ref;
+		int d, f, none;
+		//Cold only the first time round
+		CHECK(dir_lookup(&rq, 0, "d", &d) == 0);
+		CHECK(dir_lookup(&rq, d, "f", &f) == 0);
+		CHECK(fs.dcache.hits == hits + (take_ref ? 2 : 0));
+		CHECK(fs.dcache.misses == misses + (take_ref ? 0 : 2));
+		CHECK(dir_lookup(&rq, 0, "d", &d) == 0);
+		CHECK(dir_lookup(&rq, 0, "none", &none) == -ENOENT);
+		CHECK(fs.dcache.hits == hits + (take_ref ? 3 : 1));
+		CHECK(fs.dcache.misses == misses + (take_ref ? 1 : 3));
+		if (take_ref)
+		{
+			inode_unref(&rq, d, 2);
+			inode_unref(&rq, f, 1);
+		}
+	}
+	fs_unmount(&fs);
+}
+
+/** A readdir buffer that holds a few entries at a time. */
+typedef struct dir_batch {
+	char names[8][A1FS_NAME_MAX];
+	int count;
+	off_t next;
+
+} dir_batch;
+
+static bool batch_fill(void *buf, const char *name, a1fs_ino_t ino, off_t next)
+{
+	(void)ino; // unused
+	dir_batch *b = buf;
+	if (b->count == 8)
+		return true;
+	strcpy(b->names[b->count++], name);
+	b->next = next;
+	return false;
+}
+
+/**
+ * Removing what a readdir returned, batch by batch, as rm -r does, returns
+ * every entry once, even though the entries removed are before the offset
+ * that the next batch resumes from. The directory can then be removed.
+ */
+static void check_readdir_unlink(void)
+{
+	static const char *const formats[] = { "", "-c", "-x" };
+	const int n = 100;
+	char path[A1FS_NAME_MAX + 8];
+	for (int f = 0; f < 3; f++)
+	{
+		mkfs(8 << 20, formats[f]);
+		fs_ctx fs;
+		mount_image(&fs, img_path);
+		create(&fs, "/d", S_IFDIR | 0755);
+		for (int i = 0; i < n; i++)
+		{
+			snprintf(path, sizeof(path), "/d/entry-%d", i);
+			create(&fs, path, S_IFREG | 0644);
+		}
+
+		bool seen[100] = { false };
+		off_t off = 0;
+		for (;;)
+		{
+			dir_batch b = { .count = 0, .next = off };
+			fs_req rq;
+			fs_req_init(&rq, &fs);
+			a1fs_inode *dir = lookup(&fs, "/d");
+			inode_rdlock(&fs, dir->hz_inode_pos);
+			CHECK(fill_dir(&rq, dir, &b, batch_fill, off) == 0);
+			inode_unlock(&fs, dir->hz_inode_pos);
+			if (b.count == 0)
+				break;
+			for (int i = 0; i < b.count; i++)
+			{
+				int k;
+				if (strcmp(b.names[i], ".") == 0 || strcmp(b.names[i], "..") == 0)
+					continue;
+				CHECK(sscanf(b.names[i], "entry-%d", &k) == 1 && k >= 0 && k < n && !seen[k]);
+				seen[k] = true;
+				snprintf(path, sizeof(path), "/d/%s", b.names[i]);
+				unlink_path(&fs, path, false);
+			}
+			off = b.next;
+		}
+		for (int i = 0; i < n; i++)
+			CHECK(seen[i]);
+		unlink_path(&fs, "/d", true);
+		check_fs(&fs);
+		fs_unmount(&fs);
+	}
+}
+
+/**
+ * A read that sends ranges of the image file keeps the file locked until they
+ * are sent, so that a truncate cannot free and reuse their blocks first; one
+ * that copies the data leaves no ranges of the image file in the list.
+ */
+static void check_read_buf(void)
+{
+	static char buf[64 * 1024], got[sizeof(buf)];
+	for (size_t i = 0; i < sizeof(buf); i++)
+		buf[i] = (char)(i * 7 + 1);
+	mkfs(8 << 20, "");
+	fs_ctx fs;
+	mount_image(&fs, img_path);
+	create(&fs, "/f", S_IFREG | 0644);
+	CHECK(write_path(&fs, "/f", buf, sizeof(buf), 0) == (int)sizeof(buf));
+	sync_path(&fs, "/f", SYNC_RELEASE);
+	a1fs_inode *inode = lookup(&fs, "/f");
+	pthread_rwlock_t *lock = &fs.inode_locks[inode->hz_inode_pos];
+
+	for (int splice = 0; splice < 2; splice++)
+	{
+		fs_req rq;
+		fs_req_init(&rq, &fs);
+		fhandle *fh = handle_new(inode);
+		CHECK(fh != NULL);
+		buf_list l;
+		CHECK(file_read_buf(&rq, fh, &l, sizeof(buf), 0, splice) == 0);
+		size_t fd_bufs = 0;
+		for (size_t i = 0; i < l.vec->count; i++)
+			fd_bufs += (l.vec->buf[i].flags & FUSE_BUF_IS_FD) ? 1 : 0;
+		CHECK(splice ? fd_bufs > 0 : fd_bufs == 0);
+		CHECK((pthread_rwlock_trywrlock(lock) == 0) == !splice);
+		if (!splice)
+			pthread_rwlock_unlock(lock);
+
+		struct fuse_bufvec dst = FUSE_BUFVEC_INIT(sizeof(got));
+		dst.buf[0].mem = got;
+		CHECK(fuse_buf_copy(&dst, l.vec, 0) == (ssize_t)sizeof(got));
+		CHECK(memcmp(got, buf, sizeof(buf)) == 0);
+		if (splice)
+			file_read_buf_done(&rq, fh, &l);
+		else
+			buf_list_free(&l);
+		CHECK(pthread_rwlock_trywrlock(lock) == 0);
+		pthread_rwlock_unlock(lock);
+		handle_free(fh);
+	}
+	check_fs(&fs);
+	fs_unmount(&fs);
+}
+
+/** The places in the image that the data of a file is in; see range_map(). */
+typedef struct data_ranges {
+	char *data[16];
+	size_t len[16];
+	int count;
+
+} data_ranges;
+
+static void range_note(void *arg, char *data, size_t len)
+{
+	data_ranges *r = arg;
+	CHECK(data != NULL && r->count < 16);
+	r->data[r->count] = data;
+	r->len[r->count++] = len;
+}
+
+static void file_ranges(fs_ctx *fs, const char *path, data_ranges *r)
+{
+	a1fs_inode *inode = lookup(fs, path);
+	CHECK(inode != NULL);
+	fs_req rq;
+	fs_req_init(&rq, fs);
+	r->count = 0;
+	inode_rdlock(fs, inode->hz_inode_pos);
+	range_map(&rq, inode, 0, inode->size, range_note, r);
+	inode_unlock(fs, inode->hz_inode_pos);
+}
+
+/**
+ * With a journal, the blocks an unlink frees are neither given to another
+ * file nor discarded until the unlink is committed, and a write that runs
+ * out of space meanwhile commits to get them.
+ */
+static void check_held_frees(void)
+{
+	const off_t b = A1FS_BLOCK_SIZE;
+	const int nblks = 64;
+	static char buf[64 * A1FS_BLOCK_SIZE];
+	memset(buf, 'h', sizeof(buf));
+	mkfs(8 << 20, "-j 64");
+	fs_ctx fs;
+	mount_image(&fs, img_path);
+	fs.online_discard = true;
+	CHECK(discard_start(&fs.discard, discard_blks_cb, &fs));
+	//Keeps the block of the root directory
+	create(&fs, "/keep", S_IFREG | 0644);
+	create(&fs, "/a", S_IFREG | 0644);
+	CHECK(write_path(&fs, "/a", buf, sizeof(buf), 0) == sizeof(buf));
+	sync_path(&fs, "/a", SYNC_RELEASE);
+	CHECK(journal_force(&fs.journal));
+	data_ranges old, new;
+	file_ranges(&fs, "/a", &old);
+	uint64_t free_blocks, now_free, free_inodes;
+	fs_count_free(&fs, &free_blocks, &free_inodes);
+
+	unlink_path(&fs, "/a", false);
+	CHECK(journal_held(&fs.journal) == (uint64_t)nblks);
+	create(&fs, "/b", S_IFREG | 0644);
+	CHECK(write_path(&fs, "/b", buf, sizeof(buf), 0) == sizeof(buf));
+	sync_path(&fs, "/b", SYNC_RELEASE);
+	file_ranges(&fs, "/b", &new);
+	for (int i = 0; i < old.count; i++)
+		for (int k = 0; k < new.count; k++)
+			CHECK(new.data[k] + new.len[k] <= old.data[i] || old.data[i] + old.len[i] <= new.data[k]);
+	fs_count_free(&fs, &now_free, &free_inodes);
+	CHECK(now_free == free_blocks - nblks);
+	pthread_mutex_lock(&fs.discard.q.lock);
+	CHECK(fs.discard.q.count == 0 && discard_count(&fs.discard) == 0);
+	pthread_mutex_unlock(&fs.discard.q.lock);
+
+	CHECK(journal_force(&fs.journal));
+	CHECK(journal_held(&fs.journal) == 0);
+	fs_count_free(&fs, &now_free, &free_inodes);
+	CHECK(now_free == free_blocks);
+	discard_stop(&fs.discard);
+	CHECK(discard_count(&fs.discard) >= (uint64_t)nblks);
+
+	//More than the free blocks, but less than those and the ones held back
+	unlink_path(&fs, "/b", false);
+	fs_count_free(&fs, &now_free, &free_inodes);
+	size_t size = (now_free + nblks / 2) * b;
+	char *big = malloc(size);
+	CHECK(big != NULL);
+	memset(big, 'f', size);
+	create(&fs, "/full", S_IFREG | 0644);
+	CHECK(write_path(&fs, "/full", big, size, 0) == (int)size);
+	sync_path(&fs, "/full", SYNC_RELEASE);
+	check_contents(&fs, "/full", big, size);
+	free(big);
+	check_fs(&fs);
+	fs_unmount(&fs);
+}
+
+/**
+ * Names that are not in a large directory are mostly ruled out by its filter,
+ * which the first lookup builds, while a directory that fits in a block gets
+ * none. Names created later are found, removed ones are not, and once too
+ * many are stale the filter is dropped and rebuilt without them.
+ */
+static void check_bloom(void)
+{
+	const int n = 200;
+	char path[A1FS_NAME_MAX + 8];
+	mkfs(8 << 20, "");
+	fs_ctx fs;
+	mount_image(&fs, img_path);
+	create(&fs, "/small", S_IFDIR | 0755);
+	create(&fs, "/small/a", S_IFREG | 0644);
+	create(&fs, "/big", S_IFDIR | 0755);
+	for (int i = 0; i < n; i++)
+	{
+		snprintf(path, sizeof(path), "/big/name-%d", i);
+		create(&fs, path, S_IFREG | 0644);
+	}
+	remount(&fs);
+	a1fs_ino_t big = lookup(&fs, "/big")->hz_inode_pos, small = lookup(&fs, "/small")->hz_inode_pos;
+	CHECK(!bloom_present(&fs.bloom, big));
+
+	uint64_t negatives = fs.bloom.negatives;
+	for (int i = 0; i < 20; i++)
+	{
+		snprintf(path, sizeof(path), "/big/none-%d", i);
+		CHECK(lookup(&fs, path) == NULL);
+	}
+	CHECK(bloom_present(&fs.bloom, big) && fs.bloom.negatives - negatives >= 15);
+	CHECK(lookup(&fs, "/small/none") == NULL && !bloom_present(&fs.bloom, small));
+	create(&fs, "/big/none-0", S_IFREG | 0644);
+	//Found in the directory, not in the dentry cache
+	dcache_remove(&fs.dcache, big, "none-0");
+	CHECK(lookup(&fs, "/big/none-0") != NULL);
+
+	int stale_max = fs.bloom.filters[big]->capacity / 4;
+	CHECK(stale_max < n);
+	for (int i = 0; i <= stale_max; i++)
+	{
+		snprintf(path, sizeof(path), "/big/name-%d", i);
+		unlink_path(&fs, path, false);
+		CHECK(bloom_present(&fs.bloom, big) == (i < stale_max));
+		CHECK(lookup(&fs, path) == NULL);
+	}
+	negatives = fs.bloom.negatives;
+	for (int i = 0; i <= stale_max; i++)
+	{
+		snprintf(path, sizeof(path), "/big/name-%d", i);
+		CHECK(lookup(&fs, path) == NULL);
+	}
+	CHECK(fs.bloom.negatives - negatives >= (uint64_t)(stale_max + 1) * 3 / 4);
+	for (int i = stale_max + 1; i < n; i++)
+	{
+		snprintf(path, sizeof(path), "/big/name-%d", i);
+		CHECK(lookup(&fs, path) != NULL);
+	}
+	CHECK(lookup(&fs, "/big/none-0") != NULL);
+	check_fs(&fs);
+	fs_unmount(&fs);
+}
+
+/**
+ * A file that keeps growing gets blocks past its end, which are trimmed when
+ * it is released, unless fallocate() put them there, until a truncate.
+ */
+static void check_prealloc_trim(void)
+{
+	const off_t b = A1FS_BLOCK_SIZE;
+	const int nblks = 300, kept = 400;
+	char buf[A1FS_BLOCK_SIZE];
+	struct stat st;
+	mkfs(8 << 20, "");
+	fs_ctx fs;
+	mount_image(&fs, img_path);
+	create(&fs, "/grow", S_IFREG | 0644);
+	for (int i = 0; i < nblks; i++)
+	{
+		memset(buf, 'a' + i % 26, sizeof(buf));
+		CHECK(write_path(&fs, "/grow", buf, b, i * b) == b);
+	}
+	sync_path(&fs, "/grow", SYNC_FLUSH);
+	stat_path(&fs, "/grow", &st);
+	CHECK(st.st_size == nblks * b && st.st_blocks > nblks * b / 512);
+	sync_path(&fs, "/grow", SYNC_RELEASE);
+	stat_path(&fs, "/grow", &st);
+	CHECK(st.st_size == nblks * b && st.st_blocks == nblks * b / 512);
+
+	CHECK(fallocate_path(&fs, "/grow", FALLOC_FL_KEEP_SIZE, 0, kept * b) == 0);
+	sync_path(&fs, "/grow", SYNC_RELEASE);
+	stat_path(&fs, "/grow", &st);
+	CHECK(st.st_size == nblks * b && st.st_blocks == kept * b / 512);
+	remount(&fs);
+	sync_path(&fs, "/grow", SYNC_RELEASE);
+	stat_path(&fs, "/grow", &st);
+	CHECK(st.st_blocks == kept * b / 512);
+	CHECK(truncate_path(&fs, "/grow", nblks * b) == 0);
+	sync_path(&fs, "/grow", SYNC_RELEASE);
+	stat_path(&fs, "/grow", &st);
+	CHECK(st.st_size == nblks * b && st.st_blocks == nblks * b / 512);
+	for (int i = 0; i < nblks; i++)
+	{
+		CHECK(read_path(&fs, "/grow", buf, b, i * b) == b);
+		CHECK(buf[0] == 'a' + i % 26 && buf[b - 1] == 'a' + i % 26);
+	}
+	check_fs(&fs);
+	fs_unmount(&fs);
+}
+
+/** Read size bytes at off through the handle fh, as a1fs_read() does. */
+static int read_handle(fs_ctx *fs, fhandle *fh, void *buf, size_t size, off_t off)
+{
+	fs_req rq;
+	fs_req_init(&rq, fs);
+	return file_read(&rq, fh, buf, size, off);
+}
+
+/**
+ * A handle whose extent cursor is left in a file reads what the file holds
+ * after a truncate and a regrow with other extents, not what the cursor
+ * pointed to, with the extents in the inode and in a B+tree. With a journal,
+ * the blocks the truncate freed still hold the old data.
+ */
+static void check_cursor_truncate(void)
+{
+	static const int sizes[] = { 20, 200 };
+	const off_t b = A1FS_BLOCK_SIZE;
+	char buf[A1FS_BLOCK_SIZE];
+	for (int s = 0; s < 2; s++)
+	{
+		const int n = sizes[s], last = 2 * n - 1, mid = n + n / 3 * 2;
+		mkfs(32 << 20, "-j 64");
+		fs_ctx fs;
+		mount_image(&fs, img_path);
+		create(&fs, "/cur", S_IFREG | 0644);
+		//Every other block, each one flushed, is an extent of its own
+		for (int i = 0; i < n; i++)
+		{
+			memset(buf, 'a' + i % 26, sizeof(buf));
+			CHECK(write_path(&fs, "/cur", buf, b, 2 * i * b) == b);
+			sync_path(&fs, "/cur", SYNC_FLUSH);
+		}
+		sync_path(&fs, "/cur", SYNC_RELEASE);
+		CHECK(ext_tree(lookup(&fs, "/cur")) == (s == 1));
+
+		fhandle *fh = handle_new(lookup(&fs, "/cur"));
+		CHECK(fh != NULL);
+		for (int i = 0; i <= mid; i += 2)
+			CHECK(read_handle(&fs, fh, buf, b, i * b) == b && buf[0] == 'a' + i / 2 % 26);
+		CHECK(fh->cur.valid && fh->cur.lstart == (unsigned int)mid);
+
+		//Two blocks of data and a hole, over and over
+		CHECK(truncate_path(&fs, "/cur", n * b) == 0);
+		memset(buf, 'Z', sizeof(buf));
+		for (int i = n; i < last; i++)
+		{
+			if ((i - n) % 3 == 2)
+				continue;
+			CHECK(write_path(&fs, "/cur", buf, b, i * b) == b);
+			sync_path(&fs, "/cur", SYNC_FLUSH);
+		}
+		CHECK(truncate_path(&fs, "/cur", last * b) == 0);
+		sync_path(&fs, "/cur", SYNC_RELEASE);
+		for (int i = mid; i < last; i++)
+		{
+			CHECK(read_handle(&fs, fh, buf, b, i * b) == b);
+			CHECK(buf[0] == (((i - n) % 3 == 2) ? 0 : 'Z') && buf[b - 1] == buf[0]);
+		}
+		for (int i = 0; i < n; i++)
+		{
+			CHECK(read_handle(&fs, fh, buf, b, i * b) == b);
+			CHECK(buf[0] == ((i % 2 == 0) ? 'a' + i / 2 % 26 : 0) && buf[b - 1] == buf[0]);
+		}
+		handle_free(fh);
+		check_fs(&fs);
+		fs_unmount(&fs);
+	}
+}
+
+
+int main(int argc, char *argv[])
+{
+	if (argc > 1)
+		mkfs_path = argv[1];
+	int fd = mkstemp(img_path);
+	CHECK(fd >= 0);
+	close(fd);
+	snprintf(crash_path, sizeof(crash_path), "%s.crash", img_path);
+
+	check_dcache();
+	check_bloom();
+	check_readdir_unlink();
+	check_read_buf();
+	check_held_frees();
+	check_journal();
+	check_dir_index();
+	check_large_file();
+	check_holes();
+	check_prealloc_trim();
+	check_punch();
+	check_extent_tree();
+	check_cursor_truncate();
+	check_inline_data();
+	check_fragments();
+
+	unlink(img_path);
+	unlink(crash_path);
+	printf("All checks passed\n");
+	return 0;
+}
@@ -0,0 +1,129 @@
+/**
+ * a1fs in-memory directory entry cache implementation.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "dcache.h"
+#include "util.h"
+
+
+/** Hash of a (parent, name) pair. */
+static uint32_t dcache_hash(a1fs_ino_t parent, const char *name)
+{
+	return name_hash(name, strlen(name)) ^ (parent * 0x9E3779B1u);
+}
+
+bool dcache_init(dcache *dc, uint32_t capacity)
+{
+	uint32_t n = 1024;
+	while (n < capacity && n < (1u << 20))
+		n <<= 1;
+
+	dc->buckets = calloc(n, sizeof(dcache_ent *));
+	if (dc->buckets == NULL)
+		return false;
+	dc->mask = n - 1;
+	for (int i = 0; i < DCACHE_LOCKS; i++)
+		pthread_mutex_init(&dc->locks[i], NULL);
+	dc->hits = 0;
+	dc->misses = 0;
+	return true;
+}
+
+void dcache_destroy(dcache *dc)
+{
+	if (dc->buckets == NULL)
+		return;
+	for (uint32_t i = 0; i <= dc->mask; i++)
+	{
+		dcache_ent *e = dc->buckets[i];
+		while (e != NULL)
+		{
+			dcache_ent *next = e->next;
+			free(e);
+			e = next;
+		}
+	}
+	for (int i = 0; i < DCACHE_LOCKS; i++)
+		pthread_mutex_destroy(&dc->locks[i]);
+	free(dc->buckets);
+	dc->buckets = NULL;
+}
+
+bool dcache_lookup(dcache *dc, a1fs_ino_t parent, const char *name, a1fs_ino_t *ino)
+{
+	uint32_t hash = dcache_hash(parent, name);
+	uint32_t b = hash & dc->mask;
+	bool hit = false;
+
+	pthread_mutex_lock(&dc->locks[b % DCACHE_LOCKS]);
+	for (dcache_ent *e = dc->buckets[b]; e != NULL; e = e->next)
+	{
+		if (e->hash == hash && e->parent == parent && !strcmp(e->name, name))
+		{
+			*ino = e->ino;
+			hit = true;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&dc->locks[b % DCACHE_LOCKS]);
+
+	__atomic_fetch_add(hit ? &dc->hits : &dc->misses, 1, __ATOMIC_RELAXED);
+	return hit;
+}
+
+void dcache_insert(dcache *dc, a1fs_ino_t parent, const char *name, a1fs_ino_t ino)
+{
+	size_t len = strlen(name);
+	dcache_ent *ent = malloc(sizeof(dcache_ent) + len + 1);
+	// The cache is only an accelerator; silently skip the insert if out of memory
+	if (ent == NULL)
+		return;
+	ent->parent = parent;
+	ent->ino = ino;
+	ent->hash = dcache_hash(parent, name);
+	memcpy(ent->name, name, len + 1);
+
+	uint32_t b = ent->hash & dc->mask;
+	pthread_mutex_lock(&dc->locks[b % DCACHE_LOCKS]);
+	// Drop an older copy of the entry and trim the chain to its maximum length
+	dcache_ent **p = &dc->buckets[b];
+	int n = 1;
+	while (*p != NULL)
+	{
+		dcache_ent *e = *p;
+		bool same = e->hash == ent->hash && e->parent == parent && !strcmp(e->name, name);
+		if (same || n == DCACHE_CHAIN_MAX)
+		{
+			*p = e->next;
+			free(e);
+			continue;
+		}
+		n++;
+		p = &e->next;
+	}
+	ent->next = dc->buckets[b];
+	dc->buckets[b] = ent;
+	pthread_mutex_unlock(&dc->locks[b % DCACHE_LOCKS]);
+}
+
+void dcache_remove(dcache *dc, a1fs_ino_t parent, const char *name)
+{
+	uint32_t hash = dcache_hash(parent, name);
+	uint32_t b = hash & dc->mask;
+
+	pthread_mutex_lock(&dc->locks[b % DCACHE_LOCKS]);
+	for (dcache_ent **p = &dc->buckets[b]; *p != NULL; p = &(*p)->next)
+	{
+		dcache_ent *e = *p;
+		if (e->hash == hash && e->parent == parent && !strcmp(e->name, name))
+		{
+			*p = e->next;
+			free(e);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&dc->locks[b % DCACHE_LOCKS]);
+}
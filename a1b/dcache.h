@@ -0,0 +1,83 @@
+/**
+ * a1fs in-memory directory entry cache header file.
+ *
+ * Caches (parent inode, name) -> inode translations so that path lookups do
+ * not have to scan the dentry blocks of every directory on the way.
+ */
+
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "a1fs.h"
+
+/** Number of locks the hash buckets are striped over. */
+#define DCACHE_LOCKS 256
+
+/** Maximum number of entries kept in a single hash bucket. */
+#define DCACHE_CHAIN_MAX 8
+
+/** A cached directory entry. */
+typedef struct dcache_ent {
+	/** Next entry in the same bucket. */
+	struct dcache_ent *next;
+	/** Inode number of the directory that contains the entry. */
+	a1fs_ino_t parent;
+	/** Inode number the entry points to. */
+	a1fs_ino_t ino;
+	/** Hash of (parent, name). */
+	uint32_t hash;
+	/** File name. A null-terminated string. */
+	char name[];
+
+} dcache_ent;
+
+/** Directory entry cache. */
+typedef struct dcache {
+	/** Hash buckets; the number of buckets is a power of 2. */
+	dcache_ent **buckets;
+	/** Number of buckets minus one. */
+	uint32_t mask;
+	/** Bucket i is protected by locks[i % DCACHE_LOCKS]. */
+	pthread_mutex_t locks[DCACHE_LOCKS];
+	/** Number of lookups answered from the cache. */
+	uint64_t hits;
+	/** Number of lookups that had to scan the directory. */
+	uint64_t misses;
+
+} dcache;
+
+/**
+ * Initialize the cache.
+ *
+ * @param dc        pointer to the cache to initialize.
+ * @param capacity  expected number of cached entries (e.g. number of inodes).
+ * @return          true on success; false if out of memory.
+ */
+bool dcache_init(dcache *dc, uint32_t capacity);
+
+/** Free all the entries and the resources created in dcache_init(). */
+void dcache_destroy(dcache *dc);
+
+/**
+ * Look up name in directory parent.
+ *
+ * @param ino  pointer to the variable that receives the inode number.
+ * @return     true on a hit; false on a miss.
+ */
+bool dcache_lookup(dcache *dc, a1fs_ino_t parent, const char *name, a1fs_ino_t *ino);
+
+/**
+ * Add an entry, replacing any cached entry with the same name. Must be called
+ * while holding (at least) a read lock on the parent directory, so that the
+ * entry cannot be removed from the directory in the meantime.
+ */
+void dcache_insert(dcache *dc, a1fs_ino_t parent, const char *name, a1fs_ino_t ino);
+
+/**
+ * Drop the entry for name in directory parent, if any. Must be called while
+ * holding the write lock on the parent directory.
+ */
+void dcache_remove(dcache *dc, a1fs_ino_t parent, const char *name);
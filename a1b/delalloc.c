@@ -0,0 +1,99 @@
+/**
+ * a1fs delayed allocation buffer implementation.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "delalloc.h"
+
+
+bool delalloc_table_init(delalloc_table *dt, uint32_t num_inodes)
+{
+	dt->files = calloc(num_inodes, sizeof(pending *));
+	dt->count = num_inodes;
+	dt->reserved = 0;
+	return dt->files != NULL;
+}
+
+void delalloc_table_destroy(delalloc_table *dt)
+{
+	if (dt->files == NULL)
+		return;
+	for (uint32_t i = 0; i < dt->count; i++)
+	{
+		if (dt->files[i] != NULL)
+			free(dt->files[i]->data);
+		free(dt->files[i]);
+	}
+	free(dt->files);
+	dt->files = NULL;
+}
+
+pending *delalloc_get(delalloc_table *dt, a1fs_ino_t ino)
+{
+	return dt->files[ino];
+}
+
+pending *delalloc_grow(delalloc_table *dt, a1fs_ino_t ino, uint32_t n)
+{
+	pending *p = dt->files[ino];
+	if (p == NULL)
+	{
+		p = calloc(1, sizeof(pending));
+		if (p == NULL)
+			return NULL;
+		dt->files[ino] = p;
+	}
+	if (p->nblks + n > p->cap)
+	{
+		uint32_t cap = (p->cap > 0) ? p->cap : 4;
+		while (cap < p->nblks + n)
+			cap *= 2;
+		char *data = realloc(p->data, (size_t)cap * A1FS_BLOCK_SIZE);
+		if (data == NULL)
+			return NULL;
+		p->data = data;
+		p->cap = cap;
+	}
+	memset(p->data + (size_t)p->nblks * A1FS_BLOCK_SIZE, 0, (size_t)n * A1FS_BLOCK_SIZE);
+	p->nblks += n;
+	return p;
+}
+
+void delalloc_truncate(delalloc_table *dt, a1fs_ino_t ino, uint32_t nblks)
+{
+	pending *p = dt->files[ino];
+	if (p == NULL)
+		return;
+	if (p->nblks > nblks)
+	{
+		__atomic_fetch_sub(&dt->reserved, p->nblks - nblks, __ATOMIC_RELAXED);
+		p->nblks = nblks;
+	}
+	if (p->nblks == 0)
+	{
+		free(p->data);
+		free(p);
+		dt->files[ino] = NULL;
+	}
+}
+
+bool delalloc_reserve(delalloc_table *dt, uint64_t free_blks, uint32_t n)
+{
+	uint64_t reserved = __atomic_add_fetch(&dt->reserved, n, __ATOMIC_RELAXED);
+	if (reserved <= free_blks)
+		return true;
+	__atomic_fetch_sub(&dt->reserved, n, __ATOMIC_RELAXED);
+	return false;
+}
+
+void delalloc_unreserve(delalloc_table *dt, uint32_t n)
+{
+	__atomic_fetch_sub(&dt->reserved, n, __ATOMIC_RELAXED);
+}
+
+uint64_t delalloc_reserved(delalloc_table *dt)
+{
+	return __atomic_load_n(&dt->reserved, __ATOMIC_RELAXED);
+}
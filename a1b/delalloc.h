@@ -0,0 +1,89 @@
+/**
+ * a1fs delayed allocation buffer header file.
+ *
+ * Blocks appended to a regular file are kept in memory instead of getting
+ * disk blocks right away. Blocks are allocated for the whole buffer at once
+ * when the file is flushed, synced or closed (or the buffer gets full), so
+ * a file written by small appends, even interleaved with other writers,
+ * ends up in a few large extents.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "a1fs.h"
+
+/** Maximum number of blocks buffered for a file before it is flushed. */
+#define DELALLOC_MAX_BLKS 256
+
+/** Maximum number of blocks allocated past EOF for a growing file. */
+#define DELALLOC_PREALLOC_MAX 1024
+
+/** Buffered blocks of a file; they follow the allocated blocks of the file. */
+typedef struct pending {
+	/** Number of blocks in the buffer. */
+	uint32_t nblks;
+	/** Number of blocks the buffer has room for. */
+	uint32_t cap;
+	/** Contents of the blocks. */
+	char *data;
+
+} pending;
+
+/** Buffers of all files. */
+typedef struct delalloc_table {
+	/** Buffer of each file indexed by inode number, or NULL. */
+	pending **files;
+	/** Number of inodes. */
+	uint32_t count;
+	/** Number of free blocks promised to buffered blocks. */
+	uint64_t reserved;
+
+} delalloc_table;
+
+/**
+ * Initialize the table; no file has buffered blocks yet.
+ *
+ * @return  true on success; false if out of memory.
+ */
+bool delalloc_table_init(delalloc_table *dt, uint32_t num_inodes);
+
+/** Free all the buffers and the resources created in delalloc_table_init(). */
+void delalloc_table_destroy(delalloc_table *dt);
+
+/**
+ * The buffer of file ino, or NULL if it has none. Must be called while
+ * holding (at least) a read lock on the file.
+ */
+pending *delalloc_get(delalloc_table *dt, a1fs_ino_t ino);
+
+/**
+ * Add n zeroed blocks to the buffer of file ino. A block must be reserved for
+ * each of them with delalloc_reserve() first. Must be called while holding
+ * the write lock on the file.
+ *
+ * @return  the buffer; NULL if out of memory.
+ */
+pending *delalloc_grow(delalloc_table *dt, a1fs_ino_t ino, uint32_t n);
+
+/**
+ * Drop the blocks past the first nblks from the buffer of file ino, and give
+ * back their reservations. Must be called while holding the write lock on
+ * the file.
+ */
+void delalloc_truncate(delalloc_table *dt, a1fs_ino_t ino, uint32_t nblks);
+
+/**
+ * Reserve n blocks out of free_blks free blocks.
+ *
+ * @return  true on success; false if there are not enough free blocks left.
+ */
+bool delalloc_reserve(delalloc_table *dt, uint64_t free_blks, uint32_t n);
+
+/** Give back n blocks reserved with delalloc_reserve(). */
+void delalloc_unreserve(delalloc_table *dt, uint32_t n);
+
+/** Number of blocks reserved by buffers. */
+uint64_t delalloc_reserved(delalloc_table *dt);
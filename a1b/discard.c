@@ -0,0 +1,74 @@
+/**
+ * a1fs online discard implementation.
+ */
+
+#include <stdlib.h>
+
+#include "discard.h"
+
+
+static int range_cmp(const void *a, const void *b)
+{
+	uint32_t x = ((const discard_range *)a)->start;
+	uint32_t y = ((const discard_range *)b)->start;
+	return (x > y) - (x < y);
+}
+
+/** Discard a batch of ranges, merging the ones that touch. */
+static void discard_batch(void *arg, void *items, uint32_t count)
+{
+	discard_queue *dq = arg;
+	discard_range *ranges = items;
+	qsort(ranges, count, sizeof(discard_range), range_cmp);
+	uint64_t done = 0;
+	for (uint32_t i = 0; i < count;)
+	{
+		uint32_t start = ranges[i].start;
+		uint64_t end = (uint64_t)start + ranges[i].len;
+		for (i++; i < count && ranges[i].start <= end; i++)
+		{
+			if ((uint64_t)ranges[i].start + ranges[i].len > end)
+				end = (uint64_t)ranges[i].start + ranges[i].len;
+		}
+		done += dq->fn(dq->arg, start, (uint32_t)(end - start));
+	}
+	__atomic_fetch_add(&dq->discarded, done, __ATOMIC_RELAXED);
+}
+
+/** Blocks are often freed in order: extend the last range. */
+static bool discard_merge(void *last, const void *item)
+{
+	discard_range *l = last;
+	const discard_range *r = item;
+	if ((uint64_t)l->start + l->len != r->start)
+		return false;
+	l->len += r->len;
+	return true;
+}
+
+bool discard_start(discard_queue *dq, discard_fn fn, void *arg)
+{
+	dq->discarded = 0;
+	dq->fn = fn;
+	dq->arg = arg;
+	return workq_start(&dq->q, sizeof(discard_range), DISCARD_BATCH_BLKS, DISCARD_INTERVAL_MS,
+	                   discard_batch, discard_merge, dq);
+}
+
+void discard_stop(discard_queue *dq)
+{
+	workq_stop(&dq->q);
+}
+
+void discard_add(discard_queue *dq, uint32_t start, uint32_t len)
+{
+	if (len == 0)
+		return;
+	discard_range r = { .start = start, .len = len };
+	workq_add(&dq->q, &r, len);
+}
+
+uint64_t discard_count(discard_queue *dq)
+{
+	return __atomic_load_n(&dq->discarded, __ATOMIC_RELAXED);
+}
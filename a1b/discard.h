@@ -0,0 +1,69 @@
+/**
+ * a1fs online discard header file.
+ *
+ * Ranges of data blocks freed by the file system are queued and punched out
+ * of the image file by a background thread, in batches, so that the host
+ * gets the space back without slowing down the requests that free them.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "workq.h"
+
+
+/** How long freed ranges may wait in the queue, in milliseconds. */
+#define DISCARD_INTERVAL_MS 1000
+
+/** Number of queued blocks that wakes the thread up before the interval. */
+#define DISCARD_BATCH_BLKS 4096
+
+/**
+ * Discard blocks [start, start + len); called from the discard thread with
+ * the ranges sorted and merged.
+ *
+ * @return  number of blocks that were discarded.
+ */
+typedef uint32_t (*discard_fn)(void *arg, uint32_t start, uint32_t len);
+
+/** A run of freed blocks. */
+typedef struct discard_range {
+	uint32_t start;
+	uint32_t len;
+
+} discard_range;
+
+/** Queue of freed ranges and the thread that discards them. */
+typedef struct discard_queue {
+	/** Queued ranges, in the order they were freed; weighed in blocks. */
+	workq q;
+	/** Total number of blocks discarded so far. */
+	uint64_t discarded;
+	discard_fn fn;
+	void *arg;
+
+} discard_queue;
+
+/**
+ * Start the discard thread.
+ *
+ * @return  true on success; false if the thread could not be created.
+ */
+bool discard_start(discard_queue *dq, discard_fn fn, void *arg);
+
+/**
+ * Discard the queued ranges, stop the thread and free the resources created
+ * in discard_start(). Does nothing if the thread is not running.
+ */
+void discard_stop(discard_queue *dq);
+
+/**
+ * Queue blocks [start, start + len) to be discarded. Does nothing if the
+ * thread is not running; if out of memory, the range is not discarded.
+ */
+void discard_add(discard_queue *dq, uint32_t start, uint32_t len);
+
+/** Total number of blocks discarded so far. */
+uint64_t discard_count(discard_queue *dq);
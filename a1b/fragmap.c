@@ -0,0 +1,93 @@
+/**
+ * a1fs fragment occupancy map implementation.
+ */
+
+#include "fragmap.h"
+
+
+/** Mask of n fragments starting at first. */
+static inline uint16_t run_mask(unsigned int first, unsigned int n)
+{
+	return (uint16_t)(((1u << n) - 1) << first);
+}
+
+/** First fragment of a run of n free fragments in word w, or -1. */
+static int find_run(uint16_t w, unsigned int n)
+{
+	for (unsigned int i = 0; i + n <= A1FS_BLOCK_FRAGS; i++)
+	{
+		if ((w & run_mask(i, n)) == 0)
+			return i;
+	}
+	return -1;
+}
+
+void fragmap_init(fragmap *fm, uint16_t *map, uint32_t nblks)
+{
+	pthread_mutex_init(&fm->lock, NULL);
+	fm->map = map;
+	fm->nblks = nblks;
+	fm->cursor = 0;
+}
+
+void fragmap_destroy(fragmap *fm)
+{
+	pthread_mutex_destroy(&fm->lock);
+	fm->map = NULL;
+}
+
+bool fragmap_take(fragmap *fm, unsigned int n, uint32_t *blk, unsigned int *first)
+{
+	bool found = false;
+	pthread_mutex_lock(&fm->lock);
+	uint32_t scan = (fm->nblks < FRAGMAP_SCAN) ? fm->nblks : FRAGMAP_SCAN;
+	for (uint32_t i = 0; i < scan && !found; i++)
+	{
+		uint32_t b = (fm->cursor + i) % fm->nblks;
+		int at = (fm->map[b] != 0) ? find_run(fm->map[b], n) : -1;
+		if (at >= 0)
+		{
+			fm->map[b] |= run_mask(at, n);
+			fm->cursor = b;
+			*blk = b;
+			*first = at;
+			found = true;
+		}
+	}
+	pthread_mutex_unlock(&fm->lock);
+	return found;
+}
+
+void fragmap_add(fragmap *fm, uint32_t blk, unsigned int n)
+{
+	pthread_mutex_lock(&fm->lock);
+	fm->map[blk] = run_mask(0, n);
+	fm->cursor = blk;
+	pthread_mutex_unlock(&fm->lock);
+}
+
+bool fragmap_grow(fragmap *fm, uint32_t blk, unsigned int first, unsigned int have, unsigned int want)
+{
+	if (first + want > A1FS_BLOCK_FRAGS)
+		return false;
+	uint16_t more = run_mask(first + have, want - have);
+	pthread_mutex_lock(&fm->lock);
+	bool ok = (fm->map[blk] & more) == 0;
+	if (ok)
+		fm->map[blk] |= more;
+	pthread_mutex_unlock(&fm->lock);
+	return ok;
+}
+
+bool fragmap_release(fragmap *fm, uint32_t blk, unsigned int first, unsigned int n)
+{
+	pthread_mutex_lock(&fm->lock);
+	bool was_full = fm->map[blk] == 0xFFFF;
+	fm->map[blk] &= ~run_mask(first, n);
+	bool empty = fm->map[blk] == 0;
+	//A block that just got room is the best place for the next small file
+	if (was_full && !empty)
+		fm->cursor = blk;
+	pthread_mutex_unlock(&fm->lock);
+	return empty;
+}
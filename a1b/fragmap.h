@@ -0,0 +1,69 @@
+/**
+ * a1fs fragment occupancy map header file.
+ *
+ * With A1FS_FEATURE_FRAGMENTS, the data of small files is packed into
+ * A1FS_FRAG_SIZE-byte fragments of shared data blocks. The occupancy map
+ * has a word per data block with a bit per fragment; a word of 0 means the
+ * block is not a fragment block. The map is kept on disk next to the data
+ * bitmap, which has the fragment blocks marked as used.
+ */
+
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "a1fs.h"
+
+
+/** Number of map words after the cursor looked at for a block with room. */
+#define FRAGMAP_SCAN 1024
+
+/** Occupancy map of the fragment blocks. */
+typedef struct fragmap {
+	/** Protects the map and the cursor. */
+	pthread_mutex_t lock;
+	/** One word per data block, in the image. */
+	uint16_t *map;
+	/** Number of data blocks. */
+	uint32_t nblks;
+	/** Fragment block where the next search starts. */
+	uint32_t cursor;
+
+} fragmap;
+
+static_assert(A1FS_BLOCK_FRAGS == 16, "a map word must have a bit per fragment");
+
+/** Initialize the map of nblks data blocks stored at map. */
+void fragmap_init(fragmap *fm, uint16_t *map, uint32_t nblks);
+
+void fragmap_destroy(fragmap *fm);
+
+/**
+ * Take a run of n free fragments of a fragment block near the cursor.
+ *
+ * @param blk    pointer to the variable that receives the data block.
+ * @param first  pointer to the variable that receives the first fragment.
+ * @return       true on success; false if no block looked at has room.
+ */
+bool fragmap_take(fragmap *fm, unsigned int n, uint32_t *blk, unsigned int *first);
+
+/** Make blk, a newly allocated data block, a fragment block with its first n fragments taken. */
+void fragmap_add(fragmap *fm, uint32_t blk, unsigned int n);
+
+/**
+ * Extend the run of have fragments of blk starting at first to want
+ * fragments, if the fragments after it are free.
+ *
+ * @return  true on success; false, changing nothing, otherwise.
+ */
+bool fragmap_grow(fragmap *fm, uint32_t blk, unsigned int first, unsigned int have, unsigned int want);
+
+/**
+ * Free the n fragments of blk starting at first.
+ *
+ * @return  true if the block has no fragments left in use; it is no longer
+ *          a fragment block then, and the caller must free it.
+ */
+bool fragmap_release(fragmap *fm, uint32_t blk, unsigned int first, unsigned int n);
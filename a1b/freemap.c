@@ -0,0 +1,327 @@
+/**
+ * a1fs in-memory free extent index implementation.
+ */
+
+#include <stddef.h>
+#include <stdlib.h>
+
+#include "freemap.h"
+
+
+#define ext_of(n, member) ((free_ext *)((char *)(n) - offsetof(free_ext, member)))
+
+static inline uint64_t len_key(uint32_t start, uint32_t len)
+{
+	return (uint64_t)len << 32 | start;
+}
+
+/** Split t into the nodes with keys below key and the rest. */
+static void split(fm_node *t, uint64_t key, fm_node **lo, fm_node **hi)
+{
+	if (t == NULL)
+	{
+		*lo = *hi = NULL;
+	} else if (t->key < key) {
+		split(t->right, key, &t->right, hi);
+		*lo = t;
+	} else {
+		split(t->left, key, lo, &t->left);
+		*hi = t;
+	}
+}
+
+/** Join two treaps where all keys of a are below all keys of b. */
+static fm_node *join(fm_node *a, fm_node *b)
+{
+	if (a == NULL)
+		return b;
+	if (b == NULL)
+		return a;
+	if (a->prio > b->prio)
+	{
+		a->right = join(a->right, b);
+		return a;
+	}
+	b->left = join(a, b->left);
+	return b;
+}
+
+static void insert(fm_node **root, fm_node *n)
+{
+	fm_node *lo, *hi;
+	n->left = n->right = NULL;
+	split(*root, n->key, &lo, &hi);
+	*root = join(join(lo, n), hi);
+}
+
+static void erase(fm_node **root, uint64_t key)
+{
+	fm_node **p = root;
+	while (*p != NULL && (*p)->key != key)
+		p = (key < (*p)->key) ? &(*p)->left : &(*p)->right;
+	if (*p != NULL)
+		*p = join((*p)->left, (*p)->right);
+}
+
+/** First node with a key >= key, or NULL. */
+static fm_node *lower(fm_node *t, uint64_t key)
+{
+	fm_node *res = NULL;
+	while (t != NULL)
+	{
+		if (t->key >= key)
+		{
+			res = t;
+			t = t->left;
+		} else {
+			t = t->right;
+		}
+	}
+	return res;
+}
+
+/** Last node with a key <= key, or NULL. */
+static fm_node *floor_node(fm_node *t, uint64_t key)
+{
+	fm_node *res = NULL;
+	while (t != NULL)
+	{
+		if (t->key <= key)
+		{
+			res = t;
+			t = t->right;
+		} else {
+			t = t->left;
+		}
+	}
+	return res;
+}
+
+static fm_node *max_node(fm_node *t)
+{
+	while (t != NULL && t->right != NULL)
+		t = t->right;
+	return t;
+}
+
+static uint32_t next_prio(freemap *fm)
+{
+	//xorshift32
+	uint32_t x = fm->seed;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	fm->seed = x;
+	return x;
+}
+
+static void link_ext(freemap *fm, free_ext *e)
+{
+	e->by_start.key = e->start;
+	e->by_start.prio = next_prio(fm);
+	e->by_len.key = len_key(e->start, e->len);
+	e->by_len.prio = next_prio(fm);
+	insert(&fm->by_start, &e->by_start);
+	insert(&fm->by_len, &e->by_len);
+}
+
+static void unlink_ext(freemap *fm, free_ext *e)
+{
+	erase(&fm->by_start, e->start);
+	erase(&fm->by_len, len_key(e->start, e->len));
+}
+
+/** Change the bounds of an extent that is in the index. */
+static void resize_ext(freemap *fm, free_ext *e, uint32_t start, uint32_t len)
+{
+	unlink_ext(fm, e);
+	e->start = start;
+	e->len = len;
+	link_ext(fm, e);
+}
+
+/** The extent containing block b, or NULL. */
+static free_ext *containing(freemap *fm, uint32_t b)
+{
+	fm_node *n = floor_node(fm->by_start, b);
+	if (n == NULL)
+		return NULL;
+	free_ext *e = ext_of(n, by_start);
+	return (b - e->start < e->len) ? e : NULL;
+}
+
+static void free_tree(fm_node *t)
+{
+	if (t == NULL)
+		return;
+	free_tree(t->left);
+	free_tree(t->right);
+	free(ext_of(t, by_start));
+}
+
+void freemap_init(freemap *fm)
+{
+	fm->by_start = NULL;
+	fm->by_len = NULL;
+	fm->seed = 2463534242u;
+	fm->valid = true;
+}
+
+void freemap_destroy(freemap *fm)
+{
+	free_tree(fm->by_start);
+	fm->by_start = NULL;
+	fm->by_len = NULL;
+	fm->valid = false;
+}
+
+/** Give up on the index after an update that couldn't be applied. */
+static void invalidate(freemap *fm)
+{
+	freemap_destroy(fm);
+}
+
+void freemap_free(freemap *fm, uint32_t start, uint32_t len)
+{
+	if (!fm->valid || len == 0)
+		return;
+
+	free_ext *prev = NULL, *next = NULL;
+	fm_node *n = floor_node(fm->by_start, start);
+	if (n != NULL)
+	{
+		prev = ext_of(n, by_start);
+		if (prev->start + prev->len > start)
+		{
+			//Already free
+			invalidate(fm);
+			return;
+		}
+		if (prev->start + prev->len != start)
+			prev = NULL;
+	}
+	n = lower(fm->by_start, start);
+	if (n != NULL)
+	{
+		next = ext_of(n, by_start);
+		if (next->start < start + len)
+		{
+			invalidate(fm);
+			return;
+		}
+		if (next->start != start + len)
+			next = NULL;
+	}
+
+	if (prev != NULL && next != NULL)
+	{
+		uint32_t end = next->start + next->len;
+		unlink_ext(fm, next);
+		free(next);
+		resize_ext(fm, prev, prev->start, end - prev->start);
+	} else if (prev != NULL) {
+		resize_ext(fm, prev, prev->start, prev->len + len);
+	} else if (next != NULL) {
+		resize_ext(fm, next, start, next->len + len);
+	} else {
+		free_ext *e = malloc(sizeof(free_ext));
+		if (e == NULL)
+		{
+			invalidate(fm);
+			return;
+		}
+		e->start = start;
+		e->len = len;
+		link_ext(fm, e);
+	}
+}
+
+void freemap_alloc(freemap *fm, uint32_t start, uint32_t len)
+{
+	if (!fm->valid || len == 0)
+		return;
+
+	free_ext *e = containing(fm, start);
+	if (e == NULL || start + len > e->start + e->len)
+	{
+		invalidate(fm);
+		return;
+	}
+
+	uint32_t head = start - e->start;
+	uint32_t tail = e->start + e->len - (start + len);
+	if (head == 0 && tail == 0)
+	{
+		unlink_ext(fm, e);
+		free(e);
+	} else if (head == 0) {
+		resize_ext(fm, e, start + len, tail);
+	} else if (tail == 0) {
+		resize_ext(fm, e, e->start, head);
+	} else {
+		//Allocating from the middle splits the extent in two
+		free_ext *t = malloc(sizeof(free_ext));
+		if (t == NULL)
+		{
+			invalidate(fm);
+			return;
+		}
+		t->start = start + len;
+		t->len = tail;
+		resize_ext(fm, e, e->start, head);
+		link_ext(fm, t);
+	}
+}
+
+uint32_t freemap_find(freemap *fm, uint32_t goal, uint32_t len, uint32_t *start)
+{
+	//The extent holding the goal, then the ones right after it
+	free_ext *e = containing(fm, goal);
+	if (e != NULL && e->start + e->len - goal >= len)
+	{
+		*start = goal;
+		return len;
+	}
+	fm_node *n = lower(fm->by_start, (uint64_t)goal + 1);
+	for (int i = 0; i < FREEMAP_NEAR && n != NULL; i++)
+	{
+		e = ext_of(n, by_start);
+		if (e->len >= len)
+		{
+			*start = e->start;
+			return len;
+		}
+		n = lower(fm->by_start, (uint64_t)e->start + 1);
+	}
+
+	//Best fit, lowest start among equals
+	n = lower(fm->by_len, len_key(0, len));
+	if (n == NULL)
+		n = max_node(fm->by_len);
+	if (n == NULL)
+	{
+		*start = 0;
+		return 0;
+	}
+	e = ext_of(n, by_len);
+	*start = e->start;
+	return (e->len < len) ? e->len : len;
+}
+
+uint32_t freemap_run_at(freemap *fm, uint32_t b, uint32_t max)
+{
+	free_ext *e = containing(fm, b);
+	if (e == NULL)
+		return 0;
+	uint32_t n = e->start + e->len - b;
+	return (n < max) ? n : max;
+}
+
+int64_t freemap_last(freemap *fm)
+{
+	fm_node *n = max_node(fm->by_start);
+	if (n == NULL)
+		return -1;
+	free_ext *e = ext_of(n, by_start);
+	return (int64_t)e->start + e->len - 1;
+}
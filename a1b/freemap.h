@@ -0,0 +1,84 @@
+/**
+ * a1fs in-memory free extent index header file.
+ *
+ * Keeps the runs of free data blocks in two treaps, one ordered by start and
+ * one by length, so that finding a run of N free blocks near a goal block is
+ * O(log n) instead of a scan of the data bitmap. The index is rebuilt from
+ * the bitmap at mount time, and the bitmap stays the on-disk truth.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+
+/** Number of extents after the goal looked at before falling back to best fit. */
+#define FREEMAP_NEAR 8
+
+/** Treap node; embedded in free_ext once for each order. */
+typedef struct fm_node {
+	struct fm_node *left;
+	struct fm_node *right;
+	/** Sort key: start for the start order, (length << 32 | start) for length. */
+	uint64_t key;
+	/** Random heap priority. */
+	uint32_t prio;
+
+} fm_node;
+
+/** A maximal run of free blocks. */
+typedef struct free_ext {
+	uint32_t start;
+	uint32_t len;
+	fm_node by_start;
+	fm_node by_len;
+
+} free_ext;
+
+/** Free extent index. */
+typedef struct freemap {
+	/** Roots of the two treaps. */
+	fm_node *by_start;
+	fm_node *by_len;
+	/** State of the priority generator. */
+	uint32_t seed;
+	/**
+	 * False if the index has been given up on (out of memory, or an update
+	 * didn't match its contents); callers fall back to the bitmap.
+	 */
+	bool valid;
+
+} freemap;
+
+/** Initialize an empty index. */
+void freemap_init(freemap *fm);
+
+/** Free all the extents of the index and mark it invalid. */
+void freemap_destroy(freemap *fm);
+
+/** Record that blocks [start, start + len) became free. */
+void freemap_free(freemap *fm, uint32_t start, uint32_t len);
+
+/** Record that free blocks [start, start + len) became used. */
+void freemap_alloc(freemap *fm, uint32_t start, uint32_t len);
+
+/**
+ * Find len free blocks. Runs at or right after goal are preferred (up to
+ * FREEMAP_NEAR extents are looked at), then the smallest run that is long
+ * enough. If no run is long enough, the longest one is returned.
+ *
+ * @param start  pointer to the variable that receives the first block.
+ * @return       number of blocks found (len if a run was long enough).
+ */
+uint32_t freemap_find(freemap *fm, uint32_t goal, uint32_t len, uint32_t *start);
+
+/** Number of free blocks starting at block b, up to max; 0 if b is used. */
+uint32_t freemap_run_at(freemap *fm, uint32_t b, uint32_t max);
+
+/**
+ * Find the highest free block.
+ *
+ * @return  the block number; -1 if there are no free blocks.
+ */
+int64_t freemap_last(freemap *fm);
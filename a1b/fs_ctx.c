@@ -16,34 +16,185 @@
  * CSC369 Assignment 1 - File system runtime context implementation.
  */
 
+#include <stdlib.h>
+
 #include "fs_ctx.h"
 #include "a1fs.h"
+#include "bitmap.h"
+
+/** Build the free extent index of a group from the data bitmap. */
+static void freemap_build(fs_ctx *fs, fs_group *g)
+{
+	uint32_t end_blk = g->blk_start + g->blk_count;
+	freemap_init(&g->fm);
+	uint32_t b = bitmap_find_next(fs->bitmp_data, end_blk, g->blk_start, false);
+	while (b < end_blk && g->fm.valid)
+	{
+		uint32_t end = bitmap_find_next(fs->bitmp_data, end_blk, b, true);
+		freemap_free(&g->fm, b, end - b);
+		b = (end < end_blk) ? bitmap_find_next(fs->bitmp_data, end_blk, end, false) : end_blk;
+	}
+}
+
+/** Set up the allocation groups described by the superblock. */
+static bool groups_init(fs_ctx *fs)
+{
+	a1fs_superblock *sb = fs->bblk;
+	uint32_t data_blks = sb->num_blocks - sb->hz_datablk_head;
+	a1fs_group *desc = NULL;
+	if (sb->hz_features & A1FS_FEATURE_GROUPS)
+	{
+		fs->num_groups = sb->hz_groups;
+		fs->group_blocks = sb->hz_group_blocks;
+		fs->group_inodes = sb->hz_group_inodes;
+		desc = fs->image + sb->hz_group_desc * A1FS_BLOCK_SIZE;
+	} else {
+		fs->num_groups = 1;
+		fs->group_blocks = (data_blks > 0) ? data_blks : 1;
+		fs->group_inodes = sb->num_inodes;
+	}
+
+	fs->groups = calloc(fs->num_groups, sizeof(fs_group));
+	if (fs->groups == NULL)
+		return false;
+	for (uint32_t i = 0; i < fs->num_groups; i++)
+	{
+		fs_group *g = &fs->groups[i];
+		pthread_mutex_init(&g->lock, NULL);
+		g->free_blocks = desc ? &desc[i].free_blocks : &sb->num_free_blocks;
+		g->free_inodes = desc ? &desc[i].free_inodes : &sb->num_free_inodes;
+		g->cursor = desc ? &desc[i].alloc_cursor : &sb->hz_alloc_cursor;
+		g->blk_start = i * fs->group_blocks;
+		g->blk_count = 0;
+		if (g->blk_start < data_blks)
+			g->blk_count = (data_blks - g->blk_start < fs->group_blocks) ? data_blks - g->blk_start : fs->group_blocks;
+		g->ino_start = i * fs->group_inodes;
+		g->ino_count = (sb->num_inodes - g->ino_start < fs->group_inodes) ? sb->num_inodes - g->ino_start : fs->group_inodes;
+		freemap_build(fs, g);
+	}
+	return true;
+}
+
+static void groups_destroy(fs_ctx *fs)
+{
+	if (fs->groups == NULL)
+		return;
+	//Bring the superblock counters up to date
+	if (fs->bblk->hz_features & A1FS_FEATURE_GROUPS)
+	{
+		uint64_t blocks, inodes;
+		fs_count_free(fs, &blocks, &inodes);
+		fs->bblk->num_free_blocks = blocks;
+		fs->bblk->num_free_inodes = inodes;
+	}
+	for (uint32_t i = 0; i < fs->num_groups; i++)
+	{
+		pthread_mutex_destroy(&fs->groups[i].lock);
+		freemap_destroy(&fs->groups[i].fm);
+	}
+	free(fs->groups);
+	fs->groups = NULL;
+}
+
+void fs_count_free(fs_ctx *fs, uint64_t *blocks, uint64_t *inodes)
+{
+	*blocks = 0;
+	*inodes = 0;
+	for (uint32_t i = 0; i < fs->num_groups; i++)
+	{
+		fs_group *g = &fs->groups[i];
+		pthread_mutex_lock(&g->lock);
+		*blocks += *g->free_blocks;
+		*inodes += *g->free_inodes;
+		pthread_mutex_unlock(&g->lock);
+	}
+}
 
 bool fs_ctx_init(fs_ctx *fs, void *image, size_t size)
 {
 	fs->image = image;
 	fs->size = size;
+	fs->image_fd = -1;
 
 	fs->bblk = (a1fs_superblock *)image;
-	fs->ext = fs->image + (fs->bblk->hz_datablk_head) * A1FS_BLOCK_SIZE;
+	if (fs->bblk->magic != A1FS_MAGIC)
+		return false;
 	fs->tbl = fs->image + fs->bblk->hz_inode_table * A1FS_BLOCK_SIZE;
-	fs->err_code = 0;
+	fs->inode_size = (fs->bblk->hz_features & A1FS_FEATURE_LARGE_INODES) ? fs->bblk->hz_inode_size : sizeof(a1fs_inode);
 	fs->bitmp_inode = fs->image + (fs->bblk->hz_bitmap_inode) * A1FS_BLOCK_SIZE;
 	fs->bitmp_data = fs->image + fs->bblk->hz_bitmap_data * A1FS_BLOCK_SIZE;
-	fs->path_inode = 0;
-	return true;
+	fs->groups = NULL;
+	if (fs->bblk->hz_features & A1FS_FEATURE_FRAGMENTS)
+		fragmap_init(&fs->frags, fs->image + fs->bblk->hz_frag_map * A1FS_BLOCK_SIZE,
+		             fs->bblk->num_blocks - fs->bblk->hz_datablk_head);
+
+	fs->inode_locks = malloc(fs->bblk->num_inodes * sizeof(pthread_rwlock_t));
+	if (fs->inode_locks == NULL)
+		return false;
+	for (unsigned int i = 0; i < fs->bblk->num_inodes; i++)
+		pthread_rwlock_init(&fs->inode_locks[i], NULL);
+	fs->ext_gens = calloc(fs->bblk->num_inodes, sizeof(uint32_t));
+	if (fs->ext_gens == NULL)
+		return false;
+	fs->inode_refs = calloc(fs->bblk->num_inodes, sizeof(uint64_t));
+	if (fs->inode_refs == NULL)
+		return false;
+	if (!groups_init(fs))
+		return false;
+	if (!dcache_init(&fs->dcache, fs->bblk->num_inodes))
+		return false;
+	if (!bloom_table_init(&fs->bloom, fs->bblk->num_inodes))
+		return false;
+	return delalloc_table_init(&fs->delalloc, fs->bblk->num_inodes);
 }
 
 void fs_ctx_destroy(fs_ctx *fs)
 {
 	//Cleanup any resources allocated in fs_ctx_init()
+	if (fs->inode_locks)
+	{
+		for (unsigned int i = 0; i < fs->bblk->num_inodes; i++)
+			pthread_rwlock_destroy(&fs->inode_locks[i]);
+		free(fs->inode_locks);
+	}
+	fs->inode_locks = NULL;
+	free(fs->ext_gens);
+	fs->ext_gens = NULL;
+	free(fs->inode_refs);
+	fs->inode_refs = NULL;
+	dcache_destroy(&fs->dcache);
+	bloom_table_destroy(&fs->bloom);
+	delalloc_table_destroy(&fs->delalloc);
+	groups_destroy(fs);
+	if (fs->bblk->hz_features & A1FS_FEATURE_FRAGMENTS)
+		fragmap_destroy(&fs->frags);
 	fs->image = NULL;
 	fs->size = -1;
 	fs->bblk = NULL;
-	fs->ext = NULL;
 	fs->tbl = NULL;
-	fs->path_inode = NULL;
-	fs->err_code = -1;
 	fs->bitmp_data = NULL;
 	fs->bitmp_inode = NULL;
 }
+
+void inode_rdlock(fs_ctx *fs, a1fs_ino_t ino)
+{
+	journal_begin(&fs->journal);
+	pthread_rwlock_rdlock(&fs->inode_locks[ino]);
+}
+
+void inode_wrlock(fs_ctx *fs, a1fs_ino_t ino)
+{
+	journal_begin(&fs->journal);
+	pthread_rwlock_wrlock(&fs->inode_locks[ino]);
+}
+
+void inode_unlock(fs_ctx *fs, a1fs_ino_t ino)
+{
+	pthread_rwlock_unlock(&fs->inode_locks[ino]);
+	journal_end(&fs->journal);
+}
+
+void inode_ref(fs_ctx *fs, a1fs_ino_t ino, uint64_t n)
+{
+	__atomic_add_fetch(&fs->inode_refs[ino], n, __ATOMIC_SEQ_CST);
+}
@@ -18,38 +18,164 @@
 
 #pragma once
 
+#include <pthread.h>
 #include <stddef.h>
 #include "a1fs.h"
+#include "bloom.h"
+#include "dcache.h"
+#include "delalloc.h"
+#include "discard.h"
+#include "fragmap.h"
+#include "freemap.h"
+#include "journal.h"
+#include "notify.h"
 #include "options.h"
 
+/**
+ * Runtime state of an allocation group.
+ *
+ * An image made without groups is run as a single group that covers all data
+ * blocks and inodes, with the counters of the superblock.
+ */
+typedef struct fs_group {
+	/** Protects the counters, the group's words of both bitmaps and fm. */
+	pthread_mutex_t lock;
+	/** Free counters, in the group descriptor or the superblock. */
+	uint32_t *free_blocks;
+	uint32_t *free_inodes;
+	/** Where the last allocation ended, in the group descriptor or the superblock. */
+	a1fs_blk_t *cursor;
+	/** First data block and number of data blocks of the group. */
+	uint32_t blk_start;
+	uint32_t blk_count;
+	/** First inode and number of inodes of the group. */
+	uint32_t ino_start;
+	uint32_t ino_count;
+	/** Free runs of the group's data blocks. */
+	freemap fm;
+
+} fs_group;
+
 /**
  * Mounted file system runtime state - "fs context".
+ *
+ * Shared by all FUSE worker threads. Per-request scratch state lives in
+ * fs_req (see below); everything here is either read-only after mount or
+ * protected by one of the locks.
  */
 typedef struct fs_ctx {
 	/** Pointer to the start of the image. */
 	void *image;
 	/** Image size in bytes. */
 	size_t size;
+	/** Image file, to splice file data through; -1 if not open. */
+	int image_fd;
 
 	/**Pointer to Superblock */
 	a1fs_superblock *bblk;
-	/** array of extents in the file system*/
-	a1fs_extent *ext;
-	/** Pointer of entries*/
-	a1fs_dentry *ent;
-	/** Target inode of the path*/
-	a1fs_inode *path_inode;
 	/** inode table**/
 	a1fs_inode *tbl;
-	/** Error **/
-	int err_code;
+	/** Size of an inode in the table, in bytes. */
+	uint32_t inode_size;
 	/** Inode bitmap **/
 	unsigned char *bitmp_inode;
 	/**Data Bitmap **/
 	unsigned char *bitmp_data;
+	/** Fragment occupancy map (A1FS_FEATURE_FRAGMENTS). */
+	fragmap frags;
+
+	/** Reader/writer lock for each inode, indexed by inode number. */
+	pthread_rwlock_t *inode_locks;
+	/** Extent map generation of each inode; see ext_cursor. */
+	uint32_t *ext_gens;
+	/** Lookups and open handles of the kernel on each inode; see inode_ref(). */
+	uint64_t *inode_refs;
+	/** Allocation groups. */
+	fs_group *groups;
+	uint32_t num_groups;
+	/** Data blocks and inodes per group. */
+	uint32_t group_blocks;
+	uint32_t group_inodes;
+
+	/** (parent, name) -> inode lookup cache. */
+	dcache dcache;
+	/** Negative lookup filters of large directories. */
+	bloom_table bloom;
+	/** Blocks of files that have been written but not allocated yet. */
+	delalloc_table delalloc;
+	/** Store written blocks of zeros as holes (-o zero_holes). */
+	bool zero_holes;
+	/** Punch freed blocks out of the image file (-o discard). */
+	bool online_discard;
+	/** Freed blocks waiting to be punched out of the image file. */
+	discard_queue discard;
+	/** Seconds the kernel may cache names and attributes (-o cache_timeout). */
+	double cache_timeout;
+	/** Let the kernel cache written data (-o writeback_cache). */
+	bool writeback_cache;
+	/** Changes to tell the kernel about; only the low-level frontend sends them. */
+	notify_queue notify;
+	/** Metadata journal (A1FS_FEATURE_JOURNAL). */
+	journal journal;
 
 } fs_ctx;
 
+/**
+ * The extent of an inode that a file handle touched last, so that the next
+ * read or write near it doesn't have to find it from the first extent. It is
+ * good only while the extent map generation of the inode is still gen.
+ */
+typedef struct ext_cursor {
+	bool valid;
+	a1fs_ino_t ino;
+	uint32_t gen;
+	/** Index of the extent in the extent array; unused with an extent tree. */
+	int k;
+	/** The extent and its first logical block. */
+	a1fs_extent e;
+	unsigned int lstart;
+
+} ext_cursor;
+
+/**
+ * Per-request scratch state.
+ *
+ * Every FUSE callback keeps one of these on its own stack, so lookups done by
+ * concurrent callbacks never overwrite each other's results.
+ */
+typedef struct fs_req {
+	/** File system the request operates on. */
+	fs_ctx *fs;
+	/** array of extents of the inode being worked on*/
+	a1fs_extent *ext;
+	/** Pointer of entries*/
+	a1fs_dentry *ent;
+	/** Target inode of the path*/
+	a1fs_inode *path_inode;
+	/** Error **/
+	int err_code;
+	/** Extent cursor of the file handle the request came through, if any. */
+	ext_cursor cur;
+	/** Take a reference on the inode that a lookup finds or a create makes. */
+	bool take_ref;
+	/** Set once the request ran out of space and waited for a commit to free some. */
+	bool space_retried;
+
+} fs_req;
+
+/** Initialize the scratch state of a new request. */
+static inline void fs_req_init(fs_req *rq, fs_ctx *fs)
+{
+	rq->fs = fs;
+	rq->ext = NULL;
+	rq->ent = NULL;
+	rq->path_inode = NULL;
+	rq->err_code = 0;
+	rq->cur.valid = false;
+	rq->take_ref = false;
+	rq->space_retried = false;
+}
+
 /**
  * Initialize file system context.
  *
@@ -66,3 +192,37 @@ bool fs_ctx_init(fs_ctx *fs, void *image, size_t size);
  * Must cleanup all the resources created in fs_ctx_init().
  */
 void fs_ctx_destroy(fs_ctx *fs);
+
+/** Group that owns a data block. */
+static inline fs_group *blk_group(fs_ctx *fs, uint32_t blk)
+{
+	return &fs->groups[blk / fs->group_blocks];
+}
+
+/** Group that owns an inode. */
+static inline fs_group *ino_group(fs_ctx *fs, a1fs_ino_t ino)
+{
+	return &fs->groups[ino / fs->group_inodes];
+}
+
+/** Add up the free counters of all groups. */
+void fs_count_free(fs_ctx *fs, uint64_t *blocks, uint64_t *inodes);
+
+/**
+ * Lock an inode for reading (lookups, getattr, read, readdir). Holding any
+ * inode lock keeps a journal handle open; see journal_begin().
+ */
+void inode_rdlock(fs_ctx *fs, a1fs_ino_t ino);
+
+/** Lock an inode for writing (anything that modifies the inode or its data). */
+void inode_wrlock(fs_ctx *fs, a1fs_ino_t ino);
+
+/** Release a lock taken with inode_rdlock() or inode_wrlock(). */
+void inode_unlock(fs_ctx *fs, a1fs_ino_t ino);
+
+/**
+ * Take n references to an inode. An inode whose last name is removed while
+ * it has references is not freed; it is left with no links, as an orphan,
+ * until its last reference is dropped with inode_unref().
+ */
+void inode_ref(fs_ctx *fs, a1fs_ino_t ino, uint64_t n);
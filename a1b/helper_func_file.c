@@ -7,17 +7,32 @@
 #include <time.h>
 #include <math.h>
 #define max(a, b) (((a) > (b)) ? (a) : (b))
+#define min(a, b) (((a) < (b)) ? (a) : (b))
 #include <libgen.h>
 #include <fuse.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <linux/falloc.h>
 #include "a1fs.h"
+#include "bitmap.h"
+#include "freemap.h"
+#include "btree.h"
+#include "delalloc.h"
 #include "fs_ctx.h"
 #include "options.h"
 #include "map.h"
+#include "util.h"
+
+//NOTE: Locking rules. Every inode has a reader/writer lock in fs->inode_locks;
+// the free counters, the bitmaps and the free extent index of an allocation
+// group are protected by the lock of the group.
+// Locks on inodes are always taken parent before child, and group locks are
+// always the innermost locks, held one at a time. Functions that work on
+// rq->path_inode expect the caller to hold the lock of that inode.
 
 a1fs_inode *get_node(fs_ctx *fs, int pos)
 {
-    return &(fs->tbl[pos]);
+    return (void *)fs->tbl + (size_t)pos * fs->inode_size;
 }
 unsigned int mkfs_helper(unsigned int a, unsigned int b)
 {
@@ -67,26 +82,36 @@ void init_dir(a1fs_inode *head_node, mode_t mode, int pos)
     clock_gettime(CLOCK_REALTIME, &(head_node->mtime));
     head_node->links = 2;
     head_node->hz_extent_p = -1;
+    head_node->hz_dir_index = -1;
+    head_node->hz_dir_free = 0;
+    head_node->hz_alloc_goal = 0;
+    head_node->hz_flags = 0;
+}
+
+/** Number of blocks tracked by the data bitmap. */
+unsigned int num_data_blks(fs_ctx *fs)
+{
+    return fs->bblk->num_blocks - fs->bblk->hz_datablk_head;
 }
 
-a1fs_dentry *update_ext_blk(bool is_blk, fs_ctx *fs, int node)
+a1fs_dentry *update_ext_blk(bool is_blk, fs_req *rq, int node)
 {
-    a1fs_dentry *result = fs->image + (node + fs->bblk->hz_datablk_head) * A1FS_BLOCK_SIZE;
+    a1fs_dentry *result = rq->fs->image + ((size_t)node + rq->fs->bblk->hz_datablk_head) * A1FS_BLOCK_SIZE;
     if (!is_blk)
     {
-        fs->ext = (void *)result;
+        rq->ext = (void *)result;
     }
     return result;
 }
 
-/* Loop over db in extent*/
-a1fs_dentry *find_entry(a1fs_dentry *ent, size_t ent_blk_count, fs_ctx *fs, a1fs_dentry *head_blk, char *name)
+/* Loop over entries in a single data block */
+a1fs_dentry *find_entry(a1fs_dentry *ent, size_t ent_blk_count, fs_req *rq, a1fs_dentry *head_blk, const char *name)
 {
     for (unsigned int d = 0; d < ent_blk_count / sizeof(a1fs_dentry); d++)
     {
         if (!strcmp(head_blk[d].name, name))
         {
-            fs->err_code = 0;
+            rq->err_code = 0;
             ent = &head_blk[d];
             break;
         }
@@ -94,194 +119,208 @@ a1fs_dentry *find_entry(a1fs_dentry *ent, size_t ent_blk_count, fs_ctx *fs, a1fs
     return ent;
 }
 
-a1fs_dentry *blk_allocation(unsigned int a, unsigned int m, uint16_t ext_size, a1fs_dentry *ent, a1fs_inode *dir, fs_ctx *fs, char *name, bool allocate)
-{
-    size_t length = fs->ext[m].start + fs->ext[m].count;
-    size_t ent_blk_count = A1FS_BLOCK_SIZE;
-    a1fs_dentry *head_blk = update_ext_blk(true, fs, a);
-    if (a == (length - 1))
-    {
-        if (m + 1 == (ext_size))
-            ent_blk_count = dir->size % ent_blk_count;
-    }
-    if (allocate)
-    {
-        memcpy((void *)ent, (void *)head_blk, ent_blk_count);
-        ent += A1FS_BLOCK_SIZE;
-    }
-    else
-    {
-        ent = find_entry(ent, ent_blk_count, fs, head_blk, name);
-    }
-    return ent;
-}
-a1fs_dentry *loop_db(a1fs_dentry *ent, a1fs_blk_t length, int start, fs_ctx *fs, unsigned int m, a1fs_inode *dir, bool allocate, char *name)
+/**
+ * Loop over the data blocks of extent ext of a directory. lblk is the logical
+ * block number of the first block of the extent inside the directory.
+ */
+a1fs_dentry *loop_db(a1fs_dentry *ent, unsigned int lblk, fs_req *rq, a1fs_extent ext, a1fs_inode *dir, const char *name)
 {
-    unsigned int a = start;
+    unsigned int a = 0;
 
-    while (a < length && fs->err_code == PROCESS)
+    while (a < ext.count && rq->err_code == PROCESS)
     {
-        size_t ent_blk_count = A1FS_BLOCK_SIZE;
-        a1fs_dentry *head_blk = update_ext_blk(true, fs, a);
-        if (m + 1 == (dir->hz_extent_size) && a == (length - 1))
-        {
-            ent_blk_count = dir->size % ent_blk_count;
-        }
-        if (allocate)
-        {
-            memcpy((void *)ent, (const void *)head_blk, ent_blk_count);
-            ent += A1FS_BLOCK_SIZE;
-        }
-        else
-        {
-            ent = find_entry(ent, ent_blk_count, fs, head_blk, name);
-        }
+        size_t done = (size_t)(lblk + a) * A1FS_BLOCK_SIZE;
+        size_t ent_blk_count = min((size_t)A1FS_BLOCK_SIZE, dir->size - done);
+        a1fs_dentry *head_blk = update_ext_blk(true, rq, ext.start + a);
+        ent = find_entry(ent, ent_blk_count, rq, head_blk, name);
         a++;
     }
     return ent;
 }
 
-char *init_path(const char *path, bool is_first)
+/**
+ * Return the next component of a path. Reentrant: all parsing state lives in
+ * the caller supplied buffer new_p and save pointer.
+ */
+char *init_path(const char *path, char *new_p, char **save, bool is_first)
 {
-    char new_p[A1FS_PATH_MAX];
     if (is_first)
     {
         strncpy(new_p, path, A1FS_PATH_MAX);
         new_p[A1FS_PATH_MAX - 1] = '\0';
-        return strtok(new_p, "/");
+        return strtok_r(new_p, "/", save);
     }
     else
     {
-        return strtok(NULL, "/");
+        return strtok_r(NULL, "/", save);
     }
 }
-void load_inode(a1fs_dentry *ent, int *pos, fs_ctx *fs)
+void load_inode(a1fs_dentry *ent, int *pos, fs_req *rq)
 {
-    if (ent != NULL && fs->err_code == 0)
+    if (ent != NULL && rq->err_code == 0)
     {
         *pos = ent->ino;
-        fs->err_code = 0;
+        rq->err_code = 0;
     }
 }
-a1fs_dentry *find_ent_in_ext(a1fs_inode *dir, fs_ctx *fs, char *name, bool allocate)
+
+bool dir_indexed(fs_req *rq, a1fs_inode *dir);
+void *dir_index_find(fs_req *rq, a1fs_inode *dir, const char *name, uint64_t *key);
+bool dir_filter_absent(fs_req *rq, a1fs_inode *dir, const char *name);
+bool dir_compact(fs_req *rq);
+a1fs_cdentry *cdentry_find(fs_req *rq, a1fs_inode *dir, const char *name, uint32_t *pos);
+
+/** Position in the extent map of an inode, for scans in logical order. */
+typedef struct ext_iter
 {
-    //Update fs->ext to point to the head of the extent array
-    update_ext_blk(false, fs, dir->hz_extent_p);
-    //loop through extents
-    unsigned int m = 0;
-    uint16_t ext_size = dir->hz_extent_size;
-    if (fs->err_code == 0)
+    a1fs_inode *inode;
+    //Extent tree and position in it, or index in the extent array
+    btree bt;
+    btree_iter it;
+    int k;
+    //Current extent and its first logical block; e.count is 0 past the end
+    a1fs_extent e;
+    unsigned int lstart;
+    //Started from a cursor: it is not positioned in the tree yet
+    bool seek;
+} ext_iter;
+
+bool ext_iter_start(fs_req *rq, a1fs_inode *inode, unsigned int lblk, ext_iter *it);
+bool ext_iter_next(fs_req *rq, ext_iter *it);
+
+/**
+ * Look up name in directory dir and point rq->ent to its entry. For compact
+ * entries, rq->ent points to an a1fs_cdentry; both formats start with the
+ * inode number, which is all that callers read.
+ *
+ * The caller must hold the lock of dir.
+ */
+a1fs_dentry *find_ent_in_ext(a1fs_inode *dir, fs_req *rq, const char *name)
+{
+    if (dir_filter_absent(rq, dir, name))
     {
-        fs->err_code = PROCESS;
+        rq->err_code = -ENOENT;
+        rq->ent = NULL;
+        return NULL;
     }
-    while (m < ext_size && fs->err_code == PROCESS)
+    if (dir_indexed(rq, dir))
     {
-        size_t length = fs->ext[m].start + fs->ext[m].count;
-        unsigned int a = fs->ext[m].start;
-        a1fs_dentry *k = loop_db(fs->ent, length, a, fs, m, dir, allocate, name);
-        if (!allocate)
-        {
-            fs->ent = k;
-        }
-        m++;
+        uint64_t key;
+        rq->ent = dir_index_find(rq, dir, name, &key);
+        rq->err_code = (rq->ent == NULL) ? -ENOENT : 0;
+        return rq->ent;
+    }
+    if (dir_compact(rq))
+    {
+        uint32_t pos;
+        rq->ent = (a1fs_dentry *)cdentry_find(rq, dir, name, &pos);
+        return rq->ent;
+    }
+    //loop through extents
+    ext_iter it;
+    bool more = ext_iter_start(rq, dir, 0, &it);
+    a1fs_dentry *found = NULL;
+    rq->err_code = PROCESS;
+    while (more && rq->err_code == PROCESS)
+    {
+        found = loop_db(found, it.lstart, rq, it.e, dir, name);
+        more = ext_iter_next(rq, &it);
     }
 
-    if (!allocate && fs->err_code != 0)
+    if (rq->err_code != 0)
     {
-        fs->err_code = -ENOENT;
-        fs->ent = NULL;
+        rq->err_code = -ENOENT;
+        rq->ent = NULL;
     }
     else
     {
-        fs->err_code = 0;
+        rq->ent = found;
     }
 
-    return fs->ent;
+    return rq->ent;
 }
 
-int find_path_inode(const char *path, fs_ctx *fs)
+/**
+ * Look up name in the directory with inode number dir and store the inode
+ * number of its entry in *pos. The translation comes from the dentry cache
+ * if it is there; otherwise dir is read-locked only while its entries are
+ * being scanned, and the translation is cached. With rq->take_ref, dir is
+ * locked either way, so that the reference is taken before the entry can be
+ * removed.
+ */
+int dir_lookup(fs_req *rq, int dir, const char *name, int *pos)
 {
-    int pos = 0;
-    if (path[0] == '/')
+    rq->err_code = 0;
+    // Check if the directory exists.
+    if ((get_node(rq->fs, dir)->mode & S_IFDIR) != S_IFDIR)
     {
-        char *name = init_path(path, true);
-        while (name != NULL)
-        {
-            // Check if the directory exists.
-            if ((get_node(fs, pos)->mode & S_IFDIR) != S_IFDIR)
-            {
-                fs->err_code = -ENOTDIR;
-                break;
-            }
-            find_ent_in_ext(get_node(fs, pos), fs, name, false);
-            load_inode(fs->ent, &pos, fs);
-            name = init_path(path, false);
-        }
-        if (fs->err_code == 0)
-        {
-            fs->path_inode = get_node(fs, pos);
-        }
+        rq->err_code = -ENOTDIR;
+        return rq->err_code;
     }
-    else
+    if (strlen(name) >= A1FS_NAME_MAX)
     {
-        //Not an absolute path
-        fs->err_code = -ENASDIR;
+        rq->err_code = -ENAMETOOLONG;
+        return rq->err_code;
     }
-    return fs->err_code;
-}
-void check_filler_err(fs_ctx *fs, size_t size, void *buf, fuse_fill_dir_t filler, a1fs_dentry *entries)
-{
-    unsigned int b = 0;
-    //Failed at calling filler
-    while (b < (size / sizeof(a1fs_dentry)))
+    a1fs_ino_t ino;
+    //The cache is probed once either way, so that each lookup counts once
+    bool probed = !rq->take_ref;
+    if (probed && dcache_lookup(&rq->fs->dcache, dir, name, &ino))
     {
-        if (filler(buf, entries[b].name, NULL, 0) == 1)
-        {
-            fs->err_code = -ENOMEM;
-            break;
-        }
-
-        b++;
+        *pos = ino;
+        return 0;
     }
-}
-
-int update_ext(bool success, a1fs_extent *ext, int head, unsigned int sum, unsigned int total_l, int flag)
-{
-
-    if ((success && total_l == sum) || (!success && ext->count < sum))
+    inode_rdlock(rq->fs, dir);
+    if (!probed && dcache_lookup(&rq->fs->dcache, dir, name, &ino))
     {
-        ext->start = head;
-        ext->count = sum;
-        flag = 0;
+        *pos = ino;
     }
-
-    return flag;
+    else
+    {
+        find_ent_in_ext(get_node(rq->fs, dir), rq, name);
+        load_inode(rq->ent, pos, rq);
+        //Cache the translation while the directory can't change under us
+        if (rq->err_code == 0)
+            dcache_insert(&rq->fs->dcache, dir, name, *pos);
+    }
+    if (rq->err_code == 0 && rq->take_ref)
+        inode_ref(rq->fs, *pos, 1);
+    inode_unlock(rq->fs, dir);
+    return rq->err_code;
 }
+
 /**
- * Loop over each bit to find any free inode
+ * Resolve path to an inode and store it in rq->path_inode.
+ *
+ * Each directory on the way is read-locked only while its entries are being
+ * scanned; the returned inode is not locked.
  */
-int find_free_inode(a1fs_extent *ext, int bit, unsigned char curr, int used_bit, int head, unsigned int count, unsigned int total_l)
+int find_path_inode(const char *path, fs_req *rq)
 {
-    int k = 0;
-    int flag = PROCESS;
-    while (k < bit && flag == PROCESS)
+    int pos = 0;
+    rq->err_code = 0;
+    if (path[0] == '/')
     {
-        int left_shift = 1 << (7 - k);
-        if (curr & left_shift)
+        char new_p[A1FS_PATH_MAX];
+        char *save;
+        char *name = init_path(path, new_p, &save, true);
+        while (name != NULL)
         {
-            update_ext(false, ext, head, count, total_l, flag);
-            flag = PROCESS;
-            count = 0;
+            if (dir_lookup(rq, pos, name, &pos) != 0)
+                break;
+            name = init_path(path, new_p, &save, false);
         }
-        else
+        if (rq->err_code == 0)
         {
-            head = (count == 0) ? used_bit + k : head;
-            count++;
-            flag = update_ext(true, ext, head, count, total_l, flag);
+            rq->path_inode = get_node(rq->fs, pos);
         }
-        k++;
     }
-    return flag;
+    else
+    {
+        //Not an absolute path
+        rq->err_code = -ENASDIR;
+    }
+    return rq->err_code;
 }
 
 void update_bitmap(bool deallocate, int bit_num, unsigned char *bitmap)
@@ -298,478 +337,3312 @@ void update_bitmap(bool deallocate, int bit_num, unsigned char *bitmap)
     }
 }
 /**
- * Update free bit in free blocks and free inodes
- *  
+ * Return Inode based on the inode number
+ *
+ */
+a1fs_inode *cal_inode(fs_req *rq, int pos)
+{
+    a1fs_inode *result = (size_t)pos * rq->fs->inode_size + rq->fs->image + rq->fs->bblk->hz_inode_table * A1FS_BLOCK_SIZE;
+    return result;
+}
+/**
+ * Mark len data blocks starting at start used (or free, if deallocate is
+ * true) in the bitmap, the free block count and the free extent index of
+ * group g, which must hold all of them. The caller must hold g->lock.
  */
-a1fs_blk_t update_free_bit(bool deallocate, bool is_dir, fs_ctx *fs)
+void group_mark_blks(fs_ctx *fs, fs_group *g, uint32_t start, uint32_t len, bool deallocate)
 {
-    int offset = -1;
     if (deallocate)
     {
-        offset = 1;
-    }
-    if (!is_dir)
-    {
-        fs->bblk->num_free_inodes += offset;
-        return fs->bblk->hz_bitmap_inode;
+        bitmap_clear_range(fs->bitmp_data, start, len);
+        *g->free_blocks += len;
+        freemap_free(&g->fm, start, len);
     }
     else
     {
-        fs->bblk->num_free_blocks += offset;
-        return fs->bblk->hz_bitmap_data;
+        bitmap_set_range(fs->bitmp_data, start, len);
+        *g->free_blocks -= len;
+        freemap_alloc(&g->fm, start, len);
     }
-} /**
- * Return Inode based on the inode number and update fs->tbl
- *  
- */
-a1fs_inode *cal_inode(fs_ctx *fs, int pos)
-{
-    a1fs_inode *result = pos * sizeof(a1fs_inode) + fs->image + fs->bblk->hz_inode_table * A1FS_BLOCK_SIZE;
-    return result;
 }
-/**Check are there any free space available for allocation**/
-void check_free_space(fs_ctx *fs, int blk_count)
+
+/**
+ * Take a run of up to len free data blocks from group g, searching from goal
+ * (0 for the cursor of the group). A free block at goal is always taken, with
+ * as many free blocks after it as there are up to len, since it continues the
+ * run that ended there. Otherwise, if full is true, only a run of len blocks
+ * will do. Returns the length of the run; 0 if none.
+ */
+uint32_t group_take_run(fs_ctx *fs, fs_group *g, uint32_t goal, uint32_t len, bool full, uint32_t *start)
 {
+    uint32_t got = 0;
+    uint32_t end = g->blk_start + g->blk_count;
+    pthread_mutex_lock(&g->lock);
+    if (*g->free_blocks > 0)
+    {
+        if (goal != 0 && goal >= g->blk_start && goal < end)
+        {
+            if (g->fm.valid)
+                got = freemap_run_at(&g->fm, goal, len);
+            else
+                got = min(len, bitmap_find_next(fs->bitmp_data, end, goal, true) - goal);
+            *start = goal;
+        }
+        else
+        {
+            goal = *g->cursor;
+            if (goal < g->blk_start || goal >= end)
+                goal = g->blk_start;
+        }
 
-    int free_blk = (int)fs->bblk->num_free_blocks;
-    int temp = A1FS_BLOCK_SIZE / sizeof(a1fs_extent);
-    if (fs->path_inode->hz_extent_size / temp)
-        fs->err_code = -ENOSPC;
-    if (blk_count > free_blk || free_blk == 0)
-        fs->err_code = -ENOSPC;
+        if (got == 0)
+        {
+            if (g->fm.valid)
+            {
+                got = freemap_find(&g->fm, goal, len, start);
+            }
+            else
+            {
+                got = bitmap_find_zero_run(fs->bitmp_data, end, goal, len, start);
+                //Wrap around to the start of the group
+                uint32_t wrap_start, wrapped = 0;
+                if (got < len && goal > g->blk_start)
+                    wrapped = bitmap_find_zero_run(fs->bitmp_data, end, g->blk_start, len, &wrap_start);
+                if (wrapped > got)
+                {
+                    got = wrapped;
+                    *start = wrap_start;
+                }
+            }
+            if (got < len && full)
+                got = 0;
+        }
+        if (got > 0)
+        {
+            group_mark_blks(fs, g, *start, got, false);
+            *g->cursor = *start + got;
+        }
+    }
+    pthread_mutex_unlock(&g->lock);
+    return got;
 }
 
 /**
- * Given length,find extent in the bitmap
- * Store any error in fs->error code
- * **/
-void find_ext_in_bitmap(fs_ctx *fs, bool blk, unsigned int total_l, a1fs_extent *extent)
+ * Allocate a run of up to len data blocks. The search starts at goal in the
+ * given group, and at the cursors of the other groups. A run of len blocks
+ * is looked for in every group; failing that, the longest run of the first
+ * group that has free blocks is taken.
+ *
+ * @param goal   block to start from; 0 for the cursor of the group.
+ * @param start  pointer to the variable that receives the first block.
+ * @return       number of blocks allocated; 0 if there are no free blocks.
+ */
+uint32_t data_blks_alloc(fs_req *rq, uint32_t group, uint32_t goal, uint32_t len, uint32_t *start)
 {
-    unsigned char *bitmap;
-    int num;
-    if (blk)
-    {
-        num = fs->bblk->num_free_blocks;
-        bitmap = fs->bitmp_data;
-    }
-    else
+    fs_ctx *fs = rq->fs;
+    for (int full = 1; full >= 0; full--)
     {
-        num = fs->bblk->num_inodes;
-        bitmap = fs->bitmp_inode;
+        for (uint32_t i = 0; i < fs->num_groups; i++)
+        {
+            fs_group *g = &fs->groups[(group + i) % fs->num_groups];
+            uint32_t got = group_take_run(fs, g, (i == 0) ? goal : 0, len, full, start);
+            if (got > 0)
+                return got;
+        }
     }
+    return 0;
+}
 
-    unsigned int start = 0;
-    unsigned int count = 0;
-
-    int ub = 0;
-    int bit = 0;
-
-    for (int i = 0; i < num / 8 + 1; i++)
+/**
+ * Give the run of len data blocks starting at start back to the groups, and
+ * queue it for discard; it may span groups. Called by the journal once the
+ * transaction that freed them is on disk.
+ */
+void data_blks_release(void *arg, uint32_t start, uint32_t len)
+{
+    fs_ctx *fs = arg;
+    while (len > 0)
     {
-        bit = num - ub;
-        bit = (bit >= 8) ? 8 : bit;
-        fs->err_code = find_free_inode(extent, bit, bitmap[i], ub, start, count, total_l);
-        if (fs->err_code == 0)
-            break;
-
-        ub += bit;
+        fs_group *g = blk_group(fs, start);
+        uint32_t n = min(len, g->blk_start + g->blk_count - start);
+        pthread_mutex_lock(&g->lock);
+        group_mark_blks(fs, g, start, n, true);
+        pthread_mutex_unlock(&g->lock);
+        discard_add(&fs->discard, start, n);
+        start += n;
+        len -= n;
     }
-    if (extent->count == 0)
-        fs->err_code = -ENOSPC;
 }
 
-/**Switching bit to allocate/deallocate bit*/
-void switch_bit(fs_ctx *fs, bool is_dir, int bit_number, bool deallocate)
+/**
+ * Free the run of len data blocks starting at start. With a journal, they
+ * are only given back once the running transaction is on disk.
+ */
+void data_blks_free(fs_req *rq, uint32_t start, uint32_t len)
+{
+    journal_revoke(&rq->fs->journal, start, len);
+    if (!journal_free(&rq->fs->journal, start, len))
+        data_blks_release(rq->fs, start, len);
+}
+
+/**
+ * Whether a request that ran out of space is worth trying again: the blocks
+ * freed by transactions that are not on disk yet are held back, and a commit
+ * gives them back. The caller holds no inode lock; a request is only tried
+ * again once.
+ */
+bool space_retry(fs_req *rq)
 {
-    unsigned char *bitmap = fs->image + update_free_bit(deallocate, is_dir, fs) * A1FS_BLOCK_SIZE;
-    update_bitmap(deallocate, bit_number, bitmap);
+    if (rq->err_code != -ENOSPC || rq->space_retried || journal_held(&rq->fs->journal) == 0)
+        return false;
+    rq->space_retried = true;
+    return journal_force(&rq->fs->journal);
 }
 
-/**Init extent when creating dir/file**/
-int init_ext(fs_ctx *fs, a1fs_extent *ext, unsigned int length, int blk_count, int size, bool is_empty)
+/**
+ * Punch the blocks in [start, start + len) that are still free out of the
+ * image file; called by the discard thread. The lock of the group is held
+ * meanwhile, so that a block can't be allocated and written in between.
+ * Returns the number of blocks punched.
+ */
+uint32_t discard_blks_cb(void *arg, uint32_t start, uint32_t len)
 {
-    int result = 0;
-    //Init extent
-    if (!is_empty || (is_empty && size == -1))
+    fs_ctx *fs = arg;
+    uint32_t done = 0;
+    while (len > 0)
     {
-        ext->count = 0;
-        find_ext_in_bitmap(fs, true, blk_count, ext);
-        unsigned int c = 0;
-        while (c < length)
-        {
-            unsigned char *bitmap = fs->image + update_free_bit(false, true, fs) * A1FS_BLOCK_SIZE;
-            update_bitmap(false, c + ext->start, bitmap);
-            if (!is_empty)
-                memset(update_ext_blk(true, fs, c + ext->start), 0, A1FS_BLOCK_SIZE);
-
-            c++;
-        }
-        if (!is_empty)
-        {
-            fs->ext[size] = *ext;
-            result = size + 1;
-        }
-        else
+        fs_group *g = blk_group(fs, start);
+        uint32_t end = min(start + len, g->blk_start + g->blk_count);
+        pthread_mutex_lock(&g->lock);
+        uint32_t b = bitmap_find_next(fs->bitmp_data, end, start, false);
+        while (b < end)
         {
-            result = ext->start;
+            uint32_t e = bitmap_find_next(fs->bitmp_data, end, b, true);
+            void *addr = fs->image + (size_t)(b + fs->bblk->hz_datablk_head) * A1FS_BLOCK_SIZE;
+            if (madvise(addr, (size_t)(e - b) * A1FS_BLOCK_SIZE, MADV_REMOVE) == 0)
+                done += e - b;
+            b = (e < end) ? bitmap_find_next(fs->bitmp_data, end, e, false) : end;
         }
+        pthread_mutex_unlock(&g->lock);
+        len -= end - start;
+        start = end;
     }
-    return result;
+    return done;
 }
-/**Data Block Allocation**/
-int load_datablock(a1fs_inode *inode, int blk_count, fs_ctx *fs)
+
+/**
+ * Allocate an inode. A file goes into the group of its parent directory; a
+ * directory goes into the group with the most free inodes, so that separate
+ * trees spread out over the groups and their files follow them.
+ *
+ * @return  the inode number; -ENOSPC if there are no free inodes.
+ */
+int64_t inode_alloc(fs_req *rq, a1fs_ino_t parent, bool is_dir)
 {
-    int free_blk = (int)fs->bblk->num_free_blocks;
-    if (blk_count > free_blk || free_blk == 0)
+    fs_ctx *fs = rq->fs;
+    uint32_t first = parent / fs->group_inodes;
+    if (is_dir && fs->num_groups > 1)
     {
-        fs->err_code = -ENOSPC;
-        return -ENOSPC;
+        uint32_t best_inodes = 0, best_blocks = 0;
+        for (uint32_t i = 0; i < fs->num_groups; i++)
+        {
+            fs_group *g = &fs->groups[i];
+            pthread_mutex_lock(&g->lock);
+            uint32_t inodes = *g->free_inodes, blocks = *g->free_blocks;
+            pthread_mutex_unlock(&g->lock);
+            if (inodes > best_inodes || (inodes == best_inodes && blocks > best_blocks))
+            {
+                first = i;
+                best_inodes = inodes;
+                best_blocks = blocks;
+            }
+        }
     }
 
-    if (blk_count > (int)fs->bblk->num_free_blocks || inode->hz_extent_size == A1FS_BLOCK_SIZE / sizeof(a1fs_extent))
+    for (uint32_t i = 0; i < fs->num_groups; i++)
     {
-        fs->err_code = -ENOSPC;
-        return -ENOSPC;
+        fs_group *g = &fs->groups[(first + i) % fs->num_groups];
+        int64_t ino = -ENOSPC;
+        pthread_mutex_lock(&g->lock);
+        if (*g->free_inodes > 0)
+        {
+            uint32_t end = g->ino_start + g->ino_count;
+            uint32_t bit = bitmap_find_next(fs->bitmp_inode, end, g->ino_start, false);
+            if (bit < end)
+            {
+                update_bitmap(false, bit, fs->bitmp_inode);
+                *g->free_inodes -= 1;
+                ino = bit;
+            }
+        }
+        pthread_mutex_unlock(&g->lock);
+        if (ino >= 0)
+            return ino;
     }
+    return -ENOSPC;
+}
 
-    a1fs_extent ext;
-    if (inode->hz_extent_p == -1)
+/**Switching bit to allocate/deallocate bit*/
+void switch_bit(fs_req *rq, bool is_dir, int bit_number, bool deallocate)
+{
+    fs_group *g = is_dir ? blk_group(rq->fs, bit_number) : ino_group(rq->fs, bit_number);
+    if (is_dir && deallocate)
+        journal_revoke(&rq->fs->journal, bit_number, 1);
+    pthread_mutex_lock(&g->lock);
+    if (is_dir)
     {
-        (&ext)->count = 0;
-        find_ext_in_bitmap(fs, true, 1, &ext);
-        unsigned char *bitmap = fs->image + update_free_bit(false, true, fs) * A1FS_BLOCK_SIZE;
-        update_bitmap(false, ext.start, bitmap);
-        inode->hz_extent_p = ext.start;
+        group_mark_blks(rq->fs, g, bit_number, 1, deallocate);
     }
-    update_ext_blk(false, fs, inode->hz_extent_p);
-
-    while (blk_count > 0)
+    else
     {
-        inode->hz_extent_size = init_ext(fs, &ext, blk_count, ext.count, inode->hz_extent_size, false);
-        blk_count -= ext.count;
+        update_bitmap(deallocate, bit_number, rq->fs->bitmp_inode);
+        *g->free_inodes += deallocate ? 1 : -1;
     }
+    pthread_mutex_unlock(&g->lock);
+}
 
-    return 0;
+/** Whether ext is a hole. */
+bool ext_hole(const a1fs_extent *ext)
+{
+    return ext->start == A1FS_EXT_HOLE;
 }
 
-// Get the end of the inode
-void *point_to_end(a1fs_inode *inode, fs_ctx *fs)
+/** Whether extent b can be merged into extent a that comes right before it. */
+bool ext_mergeable(const a1fs_extent *a, const a1fs_extent *b)
 {
-    update_ext_blk(false, fs, inode->hz_extent_p);
-    a1fs_extent ext_last = fs->ext[inode->hz_extent_size - 1];
-    return (void *)update_ext_blk(true, fs, ext_last.start + ext_last.count - 1) + inode->size % A1FS_BLOCK_SIZE;
+    if ((uint64_t)a->count + b->count > A1FS_EXT_COUNT_MAX)
+        return false;
+    if (ext_hole(a) || ext_hole(b))
+        return ext_hole(a) && ext_hole(b);
+    return a->start + a->count == b->start && a->unwritten == b->unwritten;
 }
 
+void switch_all_bits(fs_req *rq, unsigned int length, int blk_num);
+int64_t alloc_blk(fs_req *rq);
+void *btree_blk_cb(void *arg, uint32_t blk);
+int64_t btree_alloc_cb(void *arg);
+void btree_release_cb(void *arg, uint32_t blk);
+void btree_dirty_cb(void *arg, uint32_t blk);
+
 /**
- * Create a directory or a file
- * 
-*/
-int create_file_dir(fs_ctx *fs, const char *path, mode_t mode, bool is_file)
-{ //Clear err_node
-    fs->err_code = 0;
+ * Extent maps.
+ *
+ * The extents of an inode cover its allocated logical blocks back to back.
+ * With large inodes, a file starts out with its extents in the inode itself
+ * (A1FS_INODE_INLINE_EXTENTS), so that most files need no extent block and
+ * finding a block needs no extra memory access. Otherwise, or once they no
+ * longer fit, the extents are an array of up to A1FS_EXTENT_TREE_MIN extents
+ * in the block hz_extent_p. Once a file needs more, the extents move into a
+ * B+tree rooted at hz_extent_p (A1FS_INODE_EXTENT_TREE), keyed by the logical
+ * block each extent starts at, so that finding the extent of a block takes
+ * O(log n) and the number of extents is limited only by free space.
+ * The functions below hide the difference; an extent is named by its
+ * logical start rather than by an index.
+ */
+bool ext_tree(a1fs_inode *inode)
+{
+    return inode->hz_flags & A1FS_INODE_EXTENT_TREE;
+}
 
-    a1fs_extent extent;
-    (&extent)->count = 0;
-    // Find extent
-    find_ext_in_bitmap(fs, false, 1, &extent);
+void ext_tree_open(fs_req *rq, a1fs_inode *inode, btree *bt)
+{
+    bt->root = &inode->hz_extent_p;
+    bt->blk = btree_blk_cb;
+    bt->alloc = btree_alloc_cb;
+    bt->release = btree_release_cb;
+    bt->dirty = btree_dirty_cb;
+    bt->arg = rq;
+}
 
-    if (fs->err_code == 0)
-    {
-        unsigned char *bitmap = fs->image + update_free_bit(false, false, fs) * A1FS_BLOCK_SIZE;
-        update_bitmap(false, extent.start, bitmap);
+uint64_t ext_pack(a1fs_extent e)
+{
+    uint64_t val;
+    memcpy(&val, &e, sizeof(val));
+    return val;
+}
 
-        //Calculate inode
-        a1fs_inode *node = extent.start * sizeof(a1fs_inode) + fs->image + fs->bblk->hz_inode_table * A1FS_BLOCK_SIZE;
-        init_dir(node, mode, extent.start);
+a1fs_extent ext_unpack(uint64_t val)
+{
+    a1fs_extent e;
+    memcpy(&e, &val, sizeof(e));
+    return e;
+}
 
-        //The only different between file and dir is the numeber of link.
-        if (is_file)
-            node->links = 1;
+/** Whether inode has extents: inline, in an extent block or in a tree. */
+bool ext_mapped(a1fs_inode *inode)
+{
+    return inode->hz_extent_p != -1 || (inode->hz_flags & A1FS_INODE_INLINE_EXTENTS);
+}
 
-        //Extract file name and prefix path
-        char file[A1FS_NAME_MAX];
-        char prefix[A1FS_PATH_MAX];
-        strcpy(prefix, path);
-        strncpy(file, basename(prefix), A1FS_NAME_MAX);
-        strncpy(prefix, dirname(prefix), A1FS_PATH_MAX);
-        //Find corresponding inode
-        find_path_inode((const char *)(prefix), fs);
-        //Check whether dir is full
-        int dir_size = fs->path_inode->size;
-        if (dir_size % A1FS_BLOCK_SIZE == 0)
-        {
-            check_free_space(fs, 1);
-            if (fs->err_code == -ENOSPC)
-            {
-                return fs->err_code;
-            }
-            load_datablock(fs->path_inode, 1, fs);
-        }
-        a1fs_dentry *ent = (a1fs_dentry *)(point_to_end(fs->path_inode, fs));
-        ent->ino = node->hz_inode_pos;
-        //Update entry info;
-        fs->path_inode->links += ((node->mode & S_IFDIR) == S_IFDIR) ? 1 : 0;
-        strncpy(ent->name, file, A1FS_NAME_MAX);
-        fs->path_inode->size += sizeof(a1fs_dentry);
-    }
+/**
+ * Note that the extent map of inode is about to change; cursors on it go
+ * stale, and its extent block goes into the journal.
+ */
+void ext_changed(fs_req *rq, a1fs_inode *inode)
+{
+    rq->fs->ext_gens[inode->hz_inode_pos]++;
+    if (inode->hz_extent_p != -1 && !(inode->hz_flags & (A1FS_INODE_INLINE_EXTENTS | A1FS_INODE_EXTENT_TREE)))
+        journal_dirty(&rq->fs->journal, update_ext_blk(true, rq, inode->hz_extent_p));
+}
+
+/** The extent cursor of the request if it is good for inode, or NULL. */
+ext_cursor *ext_cursor_get(fs_req *rq, a1fs_inode *inode)
+{
+    ext_cursor *cur = &rq->cur;
+    if (!cur->valid || cur->ino != inode->hz_inode_pos || cur->gen != rq->fs->ext_gens[cur->ino])
+        return NULL;
+    return cur;
+}
 
-    return fs->err_code;
+/** Point the extent cursor of the request at the extent it is on. */
+void ext_cursor_set(fs_req *rq, const ext_iter *it)
+{
+    rq->cur.valid = true;
+    rq->cur.ino = it->inode->hz_inode_pos;
+    rq->cur.gen = rq->fs->ext_gens[rq->cur.ino];
+    rq->cur.k = it->k;
+    rq->cur.e = it->e;
+    rq->cur.lstart = it->lstart;
 }
 
-void switch_all_bits(fs_ctx *fs, unsigned int length, int blk_num, int offset, bool larger_num_blk)
+/** Number of extents that fit in an inode; 0 without large inodes. */
+int ext_inline_max(fs_ctx *fs)
 {
-    if (larger_num_blk)
-    {
-        blk_num += length - 1;
-        length = offset;
-    }
+    return (fs->inode_size - sizeof(a1fs_inode)) / sizeof(a1fs_extent);
+}
 
-    unsigned int k = 0;
-    while (k < length)
-    {
-        int nums = k;
-        if (larger_num_blk)
-        {
-            nums = -k;
-        }
-        switch_bit(fs, true, blk_num + nums, true);
-        k++;
-    }
+/** The extent array of inode: its inline extents or its extent block. */
+a1fs_extent *ext_array(fs_req *rq, a1fs_inode *inode)
+{
+    if (inode->hz_flags & A1FS_INODE_INLINE_EXTENTS)
+        return (a1fs_extent *)(inode + 1);
+    return (a1fs_extent *)update_ext_blk(true, rq, inode->hz_extent_p);
+}
+
+/** Number of extents the extent array of inode has room for. */
+int ext_array_max(fs_req *rq, a1fs_inode *inode)
+{
+    if (inode->hz_flags & A1FS_INODE_INLINE_EXTENTS)
+        return ext_inline_max(rq->fs);
+    return A1FS_EXTENT_TREE_MIN;
 }
+
 /**
- * Remove a directory or a file
- * 
-*/
-int rm_dir_file(fs_ctx *fs, const char *path, bool is_dir)
+ * Give inode, which has no extents, an empty extent array in the inode
+ * itself. Returns false if inodes have no room for extents.
+ */
+bool ext_map_inline(fs_req *rq, a1fs_inode *inode)
 {
-    fs->err_code = 0;
-    //Extract file name and prefix path
-    char file[A1FS_NAME_MAX];
-    char prefix[A1FS_PATH_MAX];
-    strcpy(prefix, path);
-    strncpy(file, basename(prefix), A1FS_NAME_MAX);
-    strncpy(prefix, dirname(prefix), A1FS_PATH_MAX);
-    //Find corresponding inode
-    find_path_inode((const char *)(prefix), fs);
-    //Find corresponding directory entry
-    find_ent_in_ext(fs->path_inode, fs, file, false);
-    a1fs_inode *dir_inode = cal_inode(fs, fs->ent->ino);
-    if (is_dir && dir_inode->size > 0)
-        fs->err_code = -ENOTEMPTY;
-    if (fs->err_code != -ENOTEMPTY)
+    if (ext_inline_max(rq->fs) == 0)
+        return false;
+    ext_changed(rq, inode);
+    inode->hz_flags |= A1FS_INODE_INLINE_EXTENTS;
+    inode->hz_extent_size = 0;
+    return true;
+}
+
+/**
+ * Index in the extent array of inode of the extent that holds logical block
+ * lblk, and its logical start in *lstart; if lblk is past the extents, the
+ * number of extents, and the number of blocks they cover in *lstart.
+ * Points rq->ext at the array. The scan starts at the extent cursor if it is
+ * not past lblk, so that streaming through a file doesn't rescan the extents
+ * it has gone by.
+ */
+int ext_array_find(fs_req *rq, a1fs_inode *inode, unsigned int lblk, unsigned int *lstart)
+{
+    unsigned int trace = 0;
+    int k = 0;
+    if (ext_mapped(inode))
     {
-        update_ext_blk(false, fs, dir_inode->hz_extent_p);
-        for (int i = 0; i < dir_inode->hz_extent_size; i++)
+        rq->ext = ext_array(rq, inode);
+        ext_cursor *cur = ext_cursor_get(rq, inode);
+        if (cur != NULL && cur->lstart <= lblk && cur->k < inode->hz_extent_size)
         {
-            // Case where we have multiple extent
-            unsigned int k = 0;
-            while (k < fs->ext[i].count)
-            {
-                switch_bit(fs, true, i, true);
-                k++;
-            }
+            k = cur->k;
+            trace = cur->lstart;
         }
-        switch_bit(fs, true, dir_inode->hz_inode_pos, true);
-        a1fs_dentry *last = point_to_end(fs->path_inode, fs) - sizeof(a1fs_dentry);
-        memcpy(fs->ent, last, sizeof(a1fs_dentry));
-        //Update size
-        fs->path_inode->size -= sizeof(a1fs_dentry);
-        //Recheck if path inode is empty
-        if (fs->path_inode->size % A1FS_BLOCK_SIZE == 0)
-        {
-            //Update ext
-            update_ext_blk(false, fs, fs->path_inode->hz_extent_p);
-            a1fs_extent *ext = &fs->ext[fs->path_inode->hz_extent_size - 1];
-            if ((int)ext->count != 1)
-            { //if we need to modify multiple extents
-                bool max_ext_count = (int)ext->count == (int)ext->count;
-                switch_all_bits(fs, ext->count, ext->start, 1, max(1, max_ext_count));
-                fs->path_inode->hz_extent_size -= 1 * (int)!max_ext_count;
-                ext->count -= 1 * (int)max_ext_count;
-            }
-            else
-            {
-                //Delete the extent
-                fs->path_inode->hz_extent_size -= 1;
-            }
+        while (k < inode->hz_extent_size && trace + rq->ext[k].count <= lblk)
+        {
+            trace += rq->ext[k].count;
+            k++;
         }
     }
-    return fs->err_code;
+    *lstart = trace;
+    return k;
 }
 
-int get_free_space(fs_ctx *fs)
+/**
+ * Start a scan at the extent of inode that holds logical block lblk.
+ * Returns false if lblk is past the extents; it->lstart is then the number
+ * of blocks they cover.
+ */
+bool ext_iter_start(fs_req *rq, a1fs_inode *inode, unsigned int lblk, ext_iter *it)
 {
-    size_t blk_size = A1FS_BLOCK_SIZE;
-    int free_space = fs->path_inode->size % blk_size; //current free space in the last block
-    if (free_space != 0)
+    it->inode = inode;
+    it->e = (a1fs_extent){ .start = 0, .count = 0, .unwritten = 0 };
+    it->seek = false;
+    if (!ext_tree(inode))
     {
-        free_space -= blk_size;
-        free_space *= -1;
+        it->k = ext_array_find(rq, inode, lblk, &it->lstart);
+        if (it->k == inode->hz_extent_size)
+            return false;
+        it->e = rq->ext[it->k];
+        return true;
     }
 
-    if (fs->path_inode->hz_extent_size > 0)
+    ext_tree_open(rq, inode, &it->bt);
+    ext_cursor *cur = ext_cursor_get(rq, inode);
+    if (cur != NULL && cur->lstart <= lblk && lblk < cur->lstart + cur->e.count)
     {
-        update_ext_blk(false, fs, fs->path_inode->hz_extent_p);
-        a1fs_extent ext_last = fs->ext[fs->path_inode->hz_extent_size - 1];
-        void *blk = (void *)update_ext_blk(true, fs, ext_last.start + ext_last.count - 1) + fs->path_inode->size % A1FS_BLOCK_SIZE;
-        memset(blk, 0, free_space);
+        //The tree is only searched if the scan goes on to the next extent
+        it->e = cur->e;
+        it->lstart = cur->lstart;
+        it->seek = true;
+        return true;
     }
-
-    return free_space;
+    uint64_t key, val;
+    if (!btree_floor(&it->bt, lblk, &key, &val))
+    {
+        it->lstart = 0;
+        return false;
+    }
+    a1fs_extent e = ext_unpack(val);
+    it->lstart = key;
+    if (lblk >= key + e.count)
+    {
+        it->lstart = key + e.count;
+        return false;
+    }
+    it->e = e;
+    //Leave the iterator on the record after this one
+    btree_seek(&it->bt, key + 1, &it->it);
+    return true;
 }
-void *cal_byte(int num, fs_ctx *fs)
+
+/** Move to the next extent. Returns false past the last one. */
+bool ext_iter_next(fs_req *rq, ext_iter *it)
 {
-    int result_blk = 1;
-    if (num)
+    it->lstart += it->e.count;
+    it->e.count = 0;
+    if (!ext_tree(it->inode))
     {
-        result_blk = 1 + num / A1FS_BLOCK_SIZE;
-        if (num % A1FS_BLOCK_SIZE == 0)
-        {
-            result_blk = result_blk - 1;
-        }
+        it->k++;
+        if (it->k >= it->inode->hz_extent_size)
+            return false;
+        it->e = ext_array(rq, it->inode)[it->k];
+        return true;
     }
-    update_ext_blk(false, fs, fs->path_inode->hz_extent_p);
-    int trace = 0;
-    int k = 0;
-    while (k < fs->path_inode->hz_extent_size && trace < result_blk)
+    uint64_t key, val;
+    if (it->seek)
     {
-        trace += fs->ext[k].count;
-        k++;
+        btree_seek(&it->bt, it->lstart, &it->it);
+        it->seek = false;
     }
-    int db = (k != fs->path_inode->hz_extent_size) ? (int)(fs->ext[k].start + (trace - result_blk)) : -1;
-
-    return (void *)update_ext_blk(true, fs, db) + num % A1FS_BLOCK_SIZE;
+    if (!btree_next(&it->it, &key, &val))
+        return false;
+    it->e = ext_unpack(val);
+    return true;
 }
-/*
-* Deallocate the blocks
-*/
-void blk_deallocation(fs_ctx *fs, off_t size)
+
+/**
+ * Find the extent of inode that holds logical block lblk; *lstart receives
+ * its first logical block. Returns false if lblk is past the extents, and
+ * *lstart is then the number of blocks they cover.
+ */
+bool ext_find(fs_req *rq, a1fs_inode *inode, unsigned int lblk, a1fs_extent *e, unsigned int *lstart)
 {
-    int k = fs->path_inode->size - size;
-    fs->path_inode->size = size;
-    int num_blocks = (k - size % A1FS_BLOCK_SIZE) / A1FS_BLOCK_SIZE;
+    ext_iter it;
+    bool found = ext_iter_start(rq, inode, lblk, &it);
+    *e = it.e;
+    *lstart = it.lstart;
+    return found;
+}
 
-    update_ext_blk(false, fs, fs->path_inode->hz_extent_p);
-    while (num_blocks > 0)
+/** Find the last extent of inode. Returns false if it has none. */
+bool ext_last(fs_req *rq, a1fs_inode *inode, a1fs_extent *e, unsigned int *lstart)
+{
+    if (!ext_mapped(inode))
+        return false;
+    if (!ext_tree(inode))
     {
-        a1fs_extent *ext = &fs->ext[fs->path_inode->hz_extent_size - 1];
+        rq->ext = ext_array(rq, inode);
+        if (inode->hz_extent_size == 0)
+            return false;
+        *e = rq->ext[inode->hz_extent_size - 1];
+        *lstart = 0;
+        for (int i = 0; i < inode->hz_extent_size - 1; i++)
+            *lstart += rq->ext[i].count;
+        return true;
+    }
+    btree bt;
+    ext_tree_open(rq, inode, &bt);
+    uint64_t key, val;
+    if (!btree_floor(&bt, UINT64_MAX, &key, &val))
+        return false;
+    *e = ext_unpack(val);
+    *lstart = key;
+    return true;
+}
 
-        if ((int)ext->count != num_blocks)
-        {
-            bool max_ext_count = (int)ext->count == (int)ext->count;
-            switch_all_bits(fs, ext->count, ext->start, num_blocks, max(num_blocks, max_ext_count));
-            num_blocks = (max_ext_count) ? 0 : num_blocks - ext->count;
-            fs->path_inode->hz_extent_size -= 1 * (int)!max_ext_count;
-            ext->count -= num_blocks * (int)max_ext_count;
+/** Number of logical blocks covered by the extents of inode. */
+unsigned int ext_total(fs_req *rq, a1fs_inode *inode)
+{
+    a1fs_extent e;
+    unsigned int lstart;
+    return ext_last(rq, inode, &e, &lstart) ? lstart + e.count : 0;
+}
+
+/**
+ * Move the extent array of inode into a B+tree. Returns false, changing
+ * nothing, if there is no room for the tree.
+ */
+bool ext_tree_convert(fs_req *rq, a1fs_inode *inode)
+{
+    ext_changed(rq, inode);
+    int32_t root = -1;
+    btree bt;
+    ext_tree_open(rq, inode, &bt);
+    bt.root = &root;
+    a1fs_extent *ext = ext_array(rq, inode);
+    unsigned int lstart = 0;
+    for (int i = 0; i < inode->hz_extent_size; i++)
+    {
+        if (btree_insert(&bt, lstart, ext_pack(ext[i])) != 0)
+        {
+            btree_free(&bt);
+            return false;
+        }
+        lstart += ext[i].count;
+    }
+    if (inode->hz_flags & A1FS_INODE_INLINE_EXTENTS)
+        inode->hz_flags &= ~A1FS_INODE_INLINE_EXTENTS;
+    else
+        switch_bit(rq, true, inode->hz_extent_p, true);
+    inode->hz_extent_p = root;
+    inode->hz_extent_size = 0;
+    inode->hz_flags |= A1FS_INODE_EXTENT_TREE;
+    return true;
+}
+
+/**
+ * Make room for more extents in the extent array of inode: inline extents
+ * move to an extent block, if it holds more of them, and an extent block
+ * moves into a tree. Returns false, changing nothing, if there is no room.
+ */
+bool ext_grow(fs_req *rq, a1fs_inode *inode)
+{
+    ext_changed(rq, inode);
+    if (!(inode->hz_flags & A1FS_INODE_INLINE_EXTENTS) || ext_inline_max(rq->fs) >= A1FS_EXTENT_TREE_MIN)
+        return ext_tree_convert(rq, inode);
+    int64_t blk = alloc_blk(rq);
+    if (blk < 0)
+        return false;
+    memcpy(update_ext_blk(true, rq, blk), inode + 1, inode->hz_extent_size * sizeof(a1fs_extent));
+    inode->hz_flags &= ~A1FS_INODE_INLINE_EXTENTS;
+    inode->hz_extent_p = blk;
+    return true;
+}
+
+/**
+ * Replace the extent of inode that starts at logical block lstart with the n
+ * extents in pieces, which cover the same logical blocks, merging them with
+ * each other and with the extents around it where possible. Returns false,
+ * changing nothing, if the extent map can't grow.
+ */
+bool ext_replace(fs_req *rq, a1fs_inode *inode, unsigned int lstart, const a1fs_extent *pieces, int n)
+{
+    ext_changed(rq, inode);
+    //The extent, with the ones before and after it if any
+    a1fs_extent old[3];
+    unsigned int old_l[3];
+    int nold = 0;
+    if (lstart > 0 && ext_find(rq, inode, lstart - 1, &old[nold], &old_l[nold]))
+        nold++;
+    int k = nold;
+    ext_find(rq, inode, lstart, &old[nold], &old_l[nold]);
+    nold++;
+    if (ext_find(rq, inode, lstart + old[k].count, &old[nold], &old_l[nold]))
+        nold++;
+
+    a1fs_extent tmp[5];
+    unsigned int tmp_l[5];
+    int m = 0;
+    unsigned int pos = old_l[0];
+    for (int i = 0; i < nold; i++)
+    {
+        const a1fs_extent *from = (i == k) ? pieces : &old[i];
+        for (int j = 0; j < ((i == k) ? n : 1); j++)
+        {
+            if (m > 0 && ext_mergeable(&tmp[m - 1], &from[j]))
+            {
+                tmp[m - 1].count += from[j].count;
+            }
+            else
+            {
+                tmp_l[m] = pos;
+                tmp[m++] = from[j];
+            }
+            pos += from[j].count;
+        }
+    }
+
+    while (!ext_tree(inode))
+    {
+        int size = inode->hz_extent_size;
+        if (size - nold + m <= ext_array_max(rq, inode))
+        {
+            unsigned int l;
+            int lo = ext_array_find(rq, inode, old_l[0], &l);
+            int rest = size - lo - nold;
+            memmove(&rq->ext[lo + m], &rq->ext[lo + nold], rest * sizeof(a1fs_extent));
+            memcpy(&rq->ext[lo], tmp, m * sizeof(a1fs_extent));
+            inode->hz_extent_size = lo + m + rest;
+            return true;
+        }
+        if (!ext_grow(rq, inode))
+            return false;
+    }
+
+    btree bt;
+    ext_tree_open(rq, inode, &bt);
+    //Only inserts can fail, so they go first and are undone on error
+    int added[5];
+    int nadd = 0;
+    for (int i = 0; i < m; i++)
+    {
+        bool exists = false;
+        for (int j = 0; j < nold; j++)
+            exists = exists || old_l[j] == tmp_l[i];
+        if (exists)
+            continue;
+        if (btree_insert(&bt, tmp_l[i], ext_pack(tmp[i])) != 0)
+        {
+            while (nadd > 0)
+                btree_delete(&bt, tmp_l[added[--nadd]]);
+            return false;
+        }
+        added[nadd++] = i;
+    }
+    for (int j = 0; j < nold; j++)
+    {
+        int i = 0;
+        while (i < m && tmp_l[i] != old_l[j])
+            i++;
+        if (i < m)
+            btree_update(&bt, tmp_l[i], ext_pack(tmp[i]));
+        else
+            btree_delete(&bt, old_l[j]);
+    }
+    return true;
+}
+
+/**
+ * Add extent e after the last extent of inode, which must have an extent
+ * map (see ext_mapped()), merging the two if possible. Returns false, changing
+ * nothing, if the extent map can't grow.
+ */
+bool ext_append(fs_req *rq, a1fs_inode *inode, a1fs_extent e)
+{
+    ext_changed(rq, inode);
+    a1fs_extent last;
+    unsigned int lstart = 0;
+    bool any = ext_last(rq, inode, &last, &lstart);
+    if (any && ext_mergeable(&last, &e))
+    {
+        last.count += e.count;
+        if (ext_tree(inode))
+        {
+            btree bt;
+            ext_tree_open(rq, inode, &bt);
+            btree_update(&bt, lstart, ext_pack(last));
+        }
+        else
+        {
+            rq->ext[inode->hz_extent_size - 1] = last;
+        }
+        return true;
+    }
+
+    unsigned int total = any ? lstart + last.count : 0;
+    while (!ext_tree(inode) && inode->hz_extent_size >= ext_array_max(rq, inode))
+    {
+        if (!ext_grow(rq, inode))
+            return false;
+    }
+    if (!ext_tree(inode))
+    {
+        rq->ext = ext_array(rq, inode);
+        rq->ext[inode->hz_extent_size++] = e;
+        return true;
+    }
+    btree bt;
+    ext_tree_open(rq, inode, &bt);
+    return btree_insert(&bt, total, ext_pack(e)) == 0;
+}
+
+/**
+ * Free the blocks of inode past the first keep logical blocks and drop
+ * their extents. The extent block or tree goes too once no extents are left.
+ */
+void ext_truncate(fs_req *rq, a1fs_inode *inode, unsigned int keep)
+{
+    ext_changed(rq, inode);
+    btree bt;
+    ext_tree_open(rq, inode, &bt);
+    a1fs_extent e;
+    unsigned int lstart;
+    while (ext_last(rq, inode, &e, &lstart) && lstart + e.count > keep)
+    {
+        unsigned int num_blocks = min(e.count, lstart + e.count - keep);
+        if (!ext_hole(&e))
+            switch_all_bits(rq, num_blocks, e.start + e.count - num_blocks);
+        e.count -= num_blocks;
+        if (ext_tree(inode) && e.count == 0)
+            btree_delete(&bt, lstart);
+        else if (ext_tree(inode))
+            btree_update(&bt, lstart, ext_pack(e));
+        else if (e.count == 0)
+            inode->hz_extent_size--;
+        else
+            rq->ext[inode->hz_extent_size - 1] = e;
+    }
+    if (!ext_mapped(inode) || ext_last(rq, inode, &e, &lstart))
+        return;
+    if (ext_tree(inode))
+    {
+        btree_free(&bt);
+        inode->hz_flags &= ~A1FS_INODE_EXTENT_TREE;
+    }
+    else if (inode->hz_flags & A1FS_INODE_INLINE_EXTENTS)
+    {
+        inode->hz_flags &= ~A1FS_INODE_INLINE_EXTENTS;
+    }
+    else
+    {
+        switch_bit(rq, true, inode->hz_extent_p, true);
+        inode->hz_extent_p = -1;
+    }
+}
+
+/**
+ * Find up to length free blocks, starting at goal in the given group, mark
+ * them used and zero them (or mark them unwritten), and add the run to the
+ * extents of inode. A run that directly follows the last extent and is in
+ * the same state is merged into it.
+ **/
+void init_ext(fs_req *rq, a1fs_inode *inode, a1fs_extent *ext, unsigned int length, uint32_t group, uint32_t goal, bool unwritten)
+{
+    uint32_t start;
+    ext->count = data_blks_alloc(rq, group, goal, length, &start);
+    ext->start = start;
+    ext->unwritten = unwritten;
+    if (ext->count == 0)
+    {
+        rq->err_code = -ENOSPC;
+        return;
+    }
+    if (!ext_append(rq, inode, *ext))
+    {
+        data_blks_free(rq, ext->start, ext->count);
+        rq->err_code = -ENOSPC;
+        return;
+    }
+    if (!unwritten)
+        memset(update_ext_blk(true, rq, ext->start), 0, (size_t)ext->count * A1FS_BLOCK_SIZE);
+}
+
+/**
+ * Where the next blocks of inode should go: right after its last extent that
+ * is not a hole, so that the extent can grow in place, or else where its last
+ * allocation ended. Returns 0 if the inode has no goal yet.
+ */
+uint32_t alloc_goal(fs_req *rq, a1fs_inode *inode)
+{
+    a1fs_extent e;
+    unsigned int lstart;
+    if (!ext_last(rq, inode, &e, &lstart))
+        return inode->hz_alloc_goal;
+    //Adjacent holes are merged, so the extent before a hole is not one
+    if (ext_hole(&e) && (lstart == 0 || !ext_find(rq, inode, lstart - 1, &e, &lstart)))
+        return inode->hz_alloc_goal;
+    return e.start + e.count;
+}
+
+/**
+ * Data Block Allocation: append blk_count zeroed blocks to inode, or blocks
+ * marked unwritten, which are not touched at all. The blocks go right after
+ * the last extent of the inode if they are free, or else come from the group
+ * of the inode if it has room.
+ **/
+int alloc_datablocks(a1fs_inode *inode, int blk_count, fs_req *rq, bool unwritten)
+{
+    rq->err_code = 0;
+    uint32_t data_blks = num_data_blks(rq->fs);
+    uint32_t goal = alloc_goal(rq, inode);
+    if (goal >= data_blks)
+        goal = 0;
+    uint32_t group = (goal != 0) ? goal / rq->fs->group_blocks : inode->hz_inode_pos / rq->fs->group_inodes;
+
+    a1fs_extent ext;
+    if (!ext_mapped(inode) && !ext_map_inline(rq, inode))
+    {
+        uint32_t start;
+        if (data_blks_alloc(rq, group, goal, 1, &start) == 0)
+        {
+            rq->err_code = -ENOSPC;
+            return -ENOSPC;
+        }
+        inode->hz_extent_p = start;
+        inode->hz_extent_size = 0;
+        goal = (start + 1 < data_blks) ? start + 1 : 0;
+        group = start / rq->fs->group_blocks;
+    }
+
+    unsigned int old_total = ext_total(rq, inode);
+    while (blk_count > 0 && rq->err_code == 0)
+    {
+        init_ext(rq, inode, &ext, blk_count, group, goal, unwritten);
+        if (rq->err_code == 0)
+        {
+            blk_count -= ext.count;
+            goal = ext.start + ext.count;
+            group = ext.start / rq->fs->group_blocks;
+            inode->hz_alloc_goal = goal;
+        }
+    }
+
+    //Give back whatever this call managed to allocate
+    if (rq->err_code != 0)
+        ext_truncate(rq, inode, old_total);
+    return rq->err_code;
+}
+
+int load_datablock(a1fs_inode *inode, int blk_count, fs_req *rq)
+{
+    return alloc_datablocks(inode, blk_count, rq, false);
+}
+
+/**
+ * Inline data.
+ *
+ * With A1FS_FEATURE_INLINE_DATA, a regular file of at most inline_data_max()
+ * bytes keeps its contents in the inode itself (A1FS_INODE_INLINE_DATA),
+ * where the inline extents would go, so that reading it touches only the
+ * inode table, and it takes no data block. The bytes of the inline area past
+ * the end of the file are kept zero. Once the file grows past the inline
+ * area, its contents move to a data block and it gets extents like any
+ * other file.
+ */
+bool inline_data(a1fs_inode *inode)
+{
+    return inode->hz_flags & A1FS_INODE_INLINE_DATA;
+}
+
+/** Number of bytes of data that fit in an inode. */
+unsigned int inline_data_max(fs_ctx *fs)
+{
+    return fs->inode_size - sizeof(a1fs_inode);
+}
+
+char *inline_data_ptr(a1fs_inode *inode)
+{
+    return (char *)(inode + 1);
+}
+
+/** Make inode, a new empty regular file, keep its data inline if the file system allows it. */
+void inline_data_init(fs_req *rq, a1fs_inode *inode)
+{
+    if (!(rq->fs->bblk->hz_features & A1FS_FEATURE_INLINE_DATA))
+        return;
+    inode->hz_flags |= A1FS_INODE_INLINE_DATA;
+    memset(inline_data_ptr(inode), 0, inline_data_max(rq->fs));
+}
+
+/**
+ * Fragments.
+ *
+ * With A1FS_FEATURE_FRAGMENTS, a regular file of at most A1FS_FRAG_FILE_MAX
+ * bytes that doesn't fit in its inode keeps its data in a run of fragments
+ * of a data block shared with other small files (A1FS_INODE_FRAGMENTS),
+ * instead of a block of its own. The run has frag_count(size) fragments, and
+ * its bytes past the end of the file are kept zero. Like inline data, the
+ * data moves to a block of its own once the file outgrows the limit.
+ */
+bool frag_data(a1fs_inode *inode)
+{
+    return inode->hz_flags & A1FS_INODE_FRAGMENTS;
+}
+
+/** Number of fragments that hold size bytes. */
+unsigned int frag_count(uint64_t size)
+{
+    return div_round_up(size, A1FS_FRAG_SIZE);
+}
+
+/** The data of inode if it is inline or in fragments; NULL if the file has extents. */
+char *small_data(fs_req *rq, a1fs_inode *inode)
+{
+    if (inline_data(inode))
+        return inline_data_ptr(inode);
+    if (frag_data(inode))
+        return (char *)update_ext_blk(true, rq, inode->hz_frag_blk) + inode->hz_frag_start * A1FS_FRAG_SIZE;
+    return NULL;
+}
+
+/** Free n fragments of data block blk from first on, and the block once none of it is in use. */
+void frag_free(fs_req *rq, uint32_t blk, unsigned int first, unsigned int n)
+{
+    if (n > 0 && fragmap_release(&rq->fs->frags, blk, first, n))
+        data_blks_free(rq, blk, 1);
+}
+
+/**
+ * Whether inode can keep size bytes in fragments: it is a small enough
+ * regular file whose data is inline or in fragments, or that has no data.
+ */
+bool frag_fits(fs_req *rq, a1fs_inode *inode, uint64_t size)
+{
+    if (!(rq->fs->bblk->hz_features & A1FS_FEATURE_FRAGMENTS) || !S_ISREG(inode->mode) || size > A1FS_FRAG_FILE_MAX)
+        return false;
+    return small_data(rq, inode) != NULL || (inode->size == 0 && !ext_mapped(inode));
+}
+
+/**
+ * Make the fragments of inode hold size (> 0) bytes: extend its run in place
+ * if the fragments after it are free, or else take a run that is big enough
+ * and move the data there, from the old run or the inode. The new fragments
+ * are zeroed. Stores any error in rq->err_code.
+ */
+void frag_resize(fs_req *rq, a1fs_inode *inode, uint64_t size)
+{
+    fragmap *fm = &rq->fs->frags;
+    unsigned int want = frag_count(size);
+    unsigned int have = frag_data(inode) ? frag_count(inode->size) : 0;
+    rq->err_code = 0;
+    if (want <= have)
+        return;
+    if (have > 0 && fragmap_grow(fm, inode->hz_frag_blk, inode->hz_frag_start, have, want))
+    {
+        memset(small_data(rq, inode) + have * A1FS_FRAG_SIZE, 0, (want - have) * A1FS_FRAG_SIZE);
+        return;
+    }
+
+    uint32_t blk;
+    unsigned int first;
+    if (!fragmap_take(fm, want, &blk, &first))
+    {
+        if (data_blks_alloc(rq, inode->hz_inode_pos / rq->fs->group_inodes, 0, 1, &blk) == 0)
+        {
+            rq->err_code = -ENOSPC;
+            return;
+        }
+        fragmap_add(fm, blk, want);
+        first = 0;
+    }
+    char *run = (char *)update_ext_blk(true, rq, blk) + first * A1FS_FRAG_SIZE;
+    memset(run, 0, want * A1FS_FRAG_SIZE);
+    char *old = small_data(rq, inode);
+    if (old != NULL)
+        memcpy(run, old, inode->size);
+    if (have > 0)
+        frag_free(rq, inode->hz_frag_blk, inode->hz_frag_start, have);
+    inode->hz_flags = (inode->hz_flags & ~A1FS_INODE_INLINE_DATA) | A1FS_INODE_FRAGMENTS;
+    inode->hz_frag_blk = blk;
+    inode->hz_frag_start = first;
+}
+
+/**
+ * Return a pointer to byte num of the data of rq->path_inode, or NULL if
+ * the block that holds it has not been allocated or is in a hole.
+ */
+void *cal_byte(uint64_t num, fs_req *rq)
+{
+    char *data = small_data(rq, rq->path_inode);
+    if (data != NULL)
+        return data + num;
+    a1fs_extent e;
+    unsigned int lstart;
+    unsigned int lblk = num / A1FS_BLOCK_SIZE;
+    if (!ext_find(rq, rq->path_inode, lblk, &e, &lstart))
+    {
+        //Past the allocated blocks; the block may not have been allocated yet
+        pending *p = delalloc_get(&rq->fs->delalloc, rq->path_inode->hz_inode_pos);
+        if (p == NULL || lblk - lstart >= p->nblks)
+            return NULL;
+        return p->data + (size_t)(lblk - lstart) * A1FS_BLOCK_SIZE + num % A1FS_BLOCK_SIZE;
+    }
+    if (ext_hole(&e))
+        return NULL;
+    int db = e.start + lblk - lstart;
+
+    return (void *)update_ext_blk(true, rq, db) + num % A1FS_BLOCK_SIZE;
+}
+
+/** Number of data blocks allocated to inode, including any past its end. */
+unsigned int inode_blocks(fs_req *rq, a1fs_inode *inode)
+{
+    return ext_total(rq, inode);
+}
+
+/**
+ * Number of data blocks of inode that are on disk or buffered, that is
+ * leaving out holes.
+ */
+unsigned int inode_data_blocks(fs_req *rq, a1fs_inode *inode)
+{
+    pending *p = delalloc_get(&rq->fs->delalloc, inode->hz_inode_pos);
+    unsigned int total = (p != NULL) ? p->nblks : 0;
+    ext_iter it;
+    for (bool more = ext_iter_start(rq, inode, 0, &it); more; more = ext_iter_next(rq, &it))
+    {
+        if (!ext_hole(&it.e))
+            total += it.e.count;
+    }
+    return total;
+}
+
+/** Whether logical block lblk of inode is in a hole or an unwritten extent. */
+bool blk_reads_zero(fs_req *rq, a1fs_inode *inode, unsigned int lblk)
+{
+    a1fs_extent e;
+    unsigned int lstart;
+    return ext_find(rq, inode, lblk, &e, &lstart) && (e.unwritten || ext_hole(&e));
+}
+
+/**
+ * Split extent e at block a into the blocks before it, mid in place of
+ * block a, and the blocks after it. Returns the number of pieces.
+ */
+int ext_split(a1fs_extent e, unsigned int a, a1fs_extent mid, a1fs_extent *pieces)
+{
+    int n = 0;
+    bool hole = ext_hole(&e);
+    if (a > 0)
+        pieces[n++] = (a1fs_extent){ .start = e.start, .count = a, .unwritten = e.unwritten };
+    pieces[n++] = mid;
+    if (a + 1 < e.count)
+        pieces[n++] = (a1fs_extent){ .start = hole ? A1FS_EXT_HOLE : e.start + a + 1,
+                                     .count = e.count - a - 1, .unwritten = e.unwritten };
+    return n;
+}
+
+/**
+ * Make logical block lblk of inode a written block before data is copied
+ * into it: zero it, unless whole is true and the caller overwrites all of it,
+ * and split it off its unwritten extent, merging it into a written neighbour
+ * where they are contiguous. If the extent map has no room for the split,
+ * the whole extent is zeroed and becomes written instead.
+ */
+void unwritten_convert(fs_req *rq, a1fs_inode *inode, unsigned int lblk, bool whole)
+{
+    a1fs_extent e;
+    unsigned int lstart;
+    if (!ext_find(rq, inode, lblk, &e, &lstart) || !e.unwritten)
+        return;
+    unsigned int a = lblk - lstart;
+    if (!whole)
+        memset(update_ext_blk(true, rq, e.start + a), 0, A1FS_BLOCK_SIZE);
+
+    a1fs_extent pieces[3];
+    int n = ext_split(e, a, (a1fs_extent){ .start = e.start + a, .count = 1, .unwritten = 0 }, pieces);
+    if (!ext_replace(rq, inode, lstart, pieces, n))
+    {
+        memset(update_ext_blk(true, rq, e.start), 0, (size_t)e.count * A1FS_BLOCK_SIZE);
+        e.unwritten = 0;
+        ext_replace(rq, inode, lstart, &e, 1);
+    }
+}
+
+/**
+ * Give the blocks of the holes of inode in logical blocks [from, to) disk
+ * blocks, allocated unwritten. Each run goes right after the blocks before
+ * it if they are free. Stores any error in rq->err_code; the runs allocated
+ * before an error are kept.
+ */
+void hole_alloc(fs_req *rq, a1fs_inode *inode, unsigned int from, unsigned int to)
+{
+    rq->err_code = 0;
+    uint32_t data_blks = num_data_blks(rq->fs);
+    while (from < to)
+    {
+        a1fs_extent e;
+        unsigned int lstart;
+        if (!ext_find(rq, inode, from, &e, &lstart))
+            return;
+        unsigned int a = from - lstart;
+        unsigned int len = min(e.count - a, to - from);
+        if (!ext_hole(&e))
+        {
+            from += len;
+            continue;
+        }
+
+        uint32_t goal = inode->hz_alloc_goal;
+        a1fs_extent prev;
+        unsigned int prev_l;
+        if (lstart > 0 && ext_find(rq, inode, lstart - 1, &prev, &prev_l) && !ext_hole(&prev))
+            goal = prev.start + prev.count + a;
+        if (goal >= data_blks)
+            goal = 0;
+        uint32_t group = (goal != 0) ? goal / rq->fs->group_blocks : inode->hz_inode_pos / rq->fs->group_inodes;
+        uint32_t start;
+        uint32_t got = data_blks_alloc(rq, group, goal, len, &start);
+        if (got == 0)
+        {
+            rq->err_code = -ENOSPC;
+            return;
+        }
+
+        //Same as ext_split(), with a run of got blocks in place of block a
+        a1fs_extent pieces[3];
+        int n = 0;
+        if (a > 0)
+            pieces[n++] = (a1fs_extent){ .start = A1FS_EXT_HOLE, .count = a, .unwritten = 0 };
+        pieces[n++] = (a1fs_extent){ .start = start, .count = got, .unwritten = 1 };
+        if (a + got < e.count)
+            pieces[n++] = (a1fs_extent){ .start = A1FS_EXT_HOLE, .count = e.count - a - got, .unwritten = 0 };
+        if (!ext_replace(rq, inode, lstart, pieces, n))
+        {
+            data_blks_free(rq, start, got);
+            rq->err_code = -ENOSPC;
+            return;
+        }
+        inode->hz_alloc_goal = start + got;
+        from += got;
+    }
+}
+
+/**
+ * Turn blocks [a, a + len) of extent e of inode, which starts at logical
+ * block lstart and is not a hole, into a hole and free their disk blocks.
+ * Returns false, changing nothing, if the extent map has no room for the
+ * split.
+ */
+bool ext_punch(fs_req *rq, a1fs_inode *inode, unsigned int lstart, a1fs_extent e, unsigned int a, unsigned int len)
+{
+    a1fs_extent pieces[3];
+    int n = 0;
+    if (a > 0)
+        pieces[n++] = (a1fs_extent){ .start = e.start, .count = a, .unwritten = e.unwritten };
+    pieces[n++] = (a1fs_extent){ .start = A1FS_EXT_HOLE, .count = len, .unwritten = 0 };
+    if (a + len < e.count)
+        pieces[n++] = (a1fs_extent){ .start = e.start + a + len, .count = e.count - a - len, .unwritten = e.unwritten };
+    if (!ext_replace(rq, inode, lstart, pieces, n))
+        return false;
+    data_blks_free(rq, e.start + a, len);
+    return true;
+}
+
+/**
+ * Turn logical block lblk of inode into a hole and free its disk block.
+ * Returns false if the block is not allocated yet (it is buffered) or the
+ * extent map has no room for the split.
+ */
+bool blk_punch(fs_req *rq, a1fs_inode *inode, unsigned int lblk)
+{
+    a1fs_extent e;
+    unsigned int lstart;
+    if (!ext_find(rq, inode, lblk, &e, &lstart))
+        return false;
+    if (ext_hole(&e))
+        return true;
+    return ext_punch(rq, inode, lstart, e, lblk - lstart, 1);
+}
+
+/**
+ * Turn logical blocks [from, to) of inode into holes. Buffered blocks, and
+ * blocks that can't be split off their extent because the extent map can't
+ * grow, are zeroed instead.
+ */
+void range_punch(fs_req *rq, a1fs_inode *inode, unsigned int from, unsigned int to)
+{
+    while (from < to)
+    {
+        a1fs_extent e;
+        unsigned int lstart;
+        bool found = ext_find(rq, inode, from, &e, &lstart);
+        unsigned int a = from - lstart;
+        if (!found)
+        {
+            pending *p = delalloc_get(&rq->fs->delalloc, inode->hz_inode_pos);
+            if (p != NULL && a < p->nblks)
+                memset(p->data + (size_t)a * A1FS_BLOCK_SIZE, 0, (size_t)(min(p->nblks, a + to - from) - a) * A1FS_BLOCK_SIZE);
+            return;
+        }
+        unsigned int len = min(e.count - a, to - from);
+        if (!ext_hole(&e) && !ext_punch(rq, inode, lstart, e, a, len) && !e.unwritten)
+            memset(update_ext_blk(true, rq, e.start + a), 0, (size_t)len * A1FS_BLOCK_SIZE);
+        from += len;
+    }
+}
+
+/** Zero bytes [off, end) of inode, which are in a single block. */
+void zero_bytes(fs_req *rq, a1fs_inode *inode, uint64_t off, uint64_t end)
+{
+    if (off >= end || blk_reads_zero(rq, inode, off / A1FS_BLOCK_SIZE))
+        return;
+    a1fs_inode *saved = rq->path_inode;
+    rq->path_inode = inode;
+    void *p = cal_byte(off, rq);
+    rq->path_inode = saved;
+    if (p != NULL)
+        memset(p, 0, end - off);
+}
+
+/**
+ * Punch a hole in bytes [off, end) of inode: whole blocks in the range are
+ * freed, and the bytes of the blocks at either end are zeroed. The size of
+ * the file does not change.
+ */
+void file_punch(fs_req *rq, a1fs_inode *inode, uint64_t off, uint64_t end)
+{
+    char *data = small_data(rq, inode);
+    if (data != NULL)
+    {
+        if (off < inode->size)
+            memset(data + off, 0, min(end, inode->size) - off);
+        return;
+    }
+    pending *p = delalloc_get(&rq->fs->delalloc, inode->hz_inode_pos);
+    uint64_t limit = (uint64_t)(inode_blocks(rq, inode) + ((p != NULL) ? p->nblks : 0)) * A1FS_BLOCK_SIZE;
+    //The rest of the last block is past EOF and can go too
+    if (end >= inode->size)
+        end = limit;
+    if (off >= end)
+        return;
+
+    uint64_t first = (off + A1FS_BLOCK_SIZE - 1) / A1FS_BLOCK_SIZE;
+    uint64_t last = end / A1FS_BLOCK_SIZE;
+    if (first > last)
+    {
+        zero_bytes(rq, inode, off, end);
+        return;
+    }
+    zero_bytes(rq, inode, off, first * A1FS_BLOCK_SIZE);
+    zero_bytes(rq, inode, last * A1FS_BLOCK_SIZE, end);
+    range_punch(rq, inode, first, last);
+}
+
+/**
+ * Append n blocks of hole to inode. If the extent map can't grow, unwritten
+ * blocks are allocated instead. Stores any error in rq->err_code.
+ */
+void hole_append(fs_req *rq, a1fs_inode *inode, unsigned int n)
+{
+    rq->err_code = 0;
+    if (!ext_mapped(inode) && !ext_map_inline(rq, inode))
+    {
+        int64_t blk = alloc_blk(rq);
+        if (blk < 0)
+        {
+            rq->err_code = -ENOSPC;
+            return;
+        }
+        inode->hz_extent_p = blk;
+        inode->hz_extent_size = 0;
+    }
+    //An extent holds at most A1FS_EXT_COUNT_MAX blocks
+    while (n > 0 && rq->err_code == 0)
+    {
+        unsigned int count = min(n, A1FS_EXT_COUNT_MAX);
+        if (!ext_append(rq, inode, (a1fs_extent){ .start = A1FS_EXT_HOLE, .count = count, .unwritten = 0 }))
+            alloc_datablocks(inode, count, rq, true);
+        n -= count;
+    }
+}
+
+/** Whether the write of size bytes of buf at offset covers whole blocks with zeros. */
+bool blk_all_zero(const char *buf, size_t size, off_t offset)
+{
+    if (size == 0 || size % A1FS_BLOCK_SIZE != 0 || offset % A1FS_BLOCK_SIZE != 0)
+        return false;
+    return buf[0] == 0 && memcmp(buf, buf + 1, size - 1) == 0;
+}
+
+/**
+ * Offset of the first byte at or after off in inode that is data (if data
+ * is true) or in a hole. Unwritten extents count as holes, and the end of
+ * the file is a hole. Returns -ENXIO if off is past the end of the file, or
+ * there is no data after it.
+ */
+off_t seek_data_hole(fs_req *rq, a1fs_inode *inode, off_t off, bool data)
+{
+    if (off < 0 || (uint64_t)off >= inode->size)
+        return -ENXIO;
+    ext_iter it;
+    bool more = ext_iter_start(rq, inode, off / A1FS_BLOCK_SIZE, &it);
+    for (; more && (uint64_t)it.lstart * A1FS_BLOCK_SIZE < inode->size; more = ext_iter_next(rq, &it))
+    {
+        if (!(ext_hole(&it.e) || it.e.unwritten) == data)
+            return max((uint64_t)off, (uint64_t)it.lstart * A1FS_BLOCK_SIZE);
+    }
+    //Whatever is past the extents is buffered data
+    uint64_t pos = max((uint64_t)off, (uint64_t)it.lstart * A1FS_BLOCK_SIZE);
+    if (data && pos < inode->size)
+        return pos;
+    return data ? -ENXIO : (off_t)inode->size;
+}
+
+/**
+ * Allocate disk blocks for the buffered blocks of inode and copy them out.
+ * If speculative is true, the file is still growing, so as many blocks
+ * again as it has (up to DELALLOC_PREALLOC_MAX) are allocated past its end,
+ * unwritten; they are used by the next writes, and trimmed when the file is
+ * released.
+ * Returns 0 or -errno; nothing is lost if the allocation fails.
+ */
+int delalloc_flush(fs_req *rq, a1fs_inode *inode, bool speculative)
+{
+    pending *p = delalloc_get(&rq->fs->delalloc, inode->hz_inode_pos);
+    rq->err_code = 0;
+    if (p == NULL || p->nblks == 0)
+        return 0;
+
+    a1fs_inode *saved = rq->path_inode;
+    rq->path_inode = inode;
+    unsigned int have = inode_blocks(rq, inode);
+    unsigned int n = p->nblks;
+    if (load_datablock(inode, n, rq) == 0)
+    {
+        for (unsigned int i = 0; i < n; i++)
+            memcpy(cal_byte((uint64_t)(have + i) * A1FS_BLOCK_SIZE, rq), p->data + (size_t)i * A1FS_BLOCK_SIZE, A1FS_BLOCK_SIZE);
+        delalloc_truncate(&rq->fs->delalloc, inode->hz_inode_pos, 0);
+        //Failing to allocate past EOF is not an error
+        if (speculative && alloc_datablocks(inode, min(have + n, DELALLOC_PREALLOC_MAX), rq, true) != 0)
+            rq->err_code = 0;
+    }
+    rq->path_inode = saved;
+    return rq->err_code;
+}
+
+/** Flush the buffered blocks of all files; used at unmount. */
+void delalloc_flush_all(fs_ctx *fs)
+{
+    fs_req rq;
+    fs_req_init(&rq, fs);
+    for (uint32_t ino = 0; ino < fs->delalloc.count; ino++)
+    {
+        if (delalloc_get(&fs->delalloc, ino) == NULL)
+            continue;
+        inode_wrlock(fs, ino);
+        delalloc_flush(&rq, cal_inode(&rq, ino), false);
+        inode_unlock(fs, ino);
+    }
+}
+
+/**
+ * Make inode have need blocks, allocated or buffered. New blocks of regular
+ * files are buffered, and given disk blocks only when the file is flushed,
+ * or its buffer is full; directories get disk blocks right away. Stores any
+ * error in rq->err_code.
+ */
+void file_grow(fs_req *rq, a1fs_inode *inode, unsigned int need)
+{
+    delalloc_table *dt = &rq->fs->delalloc;
+    pending *p = delalloc_get(dt, inode->hz_inode_pos);
+    unsigned int buffered = (p != NULL) ? p->nblks : 0;
+    unsigned int have = inode_blocks(rq, inode);
+    if (need <= have + buffered)
+        return;
+
+    if (S_ISREG(inode->mode) && need - have > DELALLOC_MAX_BLKS && buffered > 0)
+    {
+        //The buffer is full: allocate it, with room to grow past EOF
+        if (delalloc_flush(rq, inode, true) != 0)
+            return;
+        buffered = 0;
+        have = inode_blocks(rq, inode);
+        if (need <= have)
+            return;
+    }
+
+    if (S_ISREG(inode->mode) && need - have <= DELALLOC_MAX_BLKS)
+    {
+        uint64_t free_blks, free_inodes;
+        fs_count_free(rq->fs, &free_blks, &free_inodes);
+        //One block may be needed for the extent block
+        if (!delalloc_reserve(dt, (free_blks > 0) ? free_blks - 1 : 0, need - have - buffered))
+        {
+            rq->err_code = -ENOSPC;
+            return;
+        }
+        if (delalloc_grow(dt, inode->hz_inode_pos, need - have - buffered) == NULL)
+        {
+            delalloc_unreserve(dt, need - have - buffered);
+            rq->err_code = -ENOMEM;
+        }
+        return;
+    }
+    load_datablock(inode, need - have, rq);
+}
+
+/**
+ * Make inode have need blocks, like file_grow(), for a range that reads as
+ * zeros. Regular files get a hole, so that the time taken does not depend on
+ * the length of the range; a small range after buffered blocks is buffered
+ * along with them.
+ */
+void file_zero_grow(fs_req *rq, a1fs_inode *inode, unsigned int need)
+{
+    pending *p = delalloc_get(&rq->fs->delalloc, inode->hz_inode_pos);
+    unsigned int buffered = (p != NULL) ? p->nblks : 0;
+    unsigned int have = inode_blocks(rq, inode);
+    if (need <= have + buffered)
+        return;
+    if (!S_ISREG(inode->mode) || (buffered > 0 && need - have <= DELALLOC_MAX_BLKS))
+    {
+        file_grow(rq, inode, need);
+        return;
+    }
+    //Allocated blocks come before buffered ones
+    if (delalloc_flush(rq, inode, false) != 0)
+        return;
+    have = inode_blocks(rq, inode);
+    if (need > have)
+        hole_append(rq, inode, need - have);
+}
+
+/**
+ * Move the data of inode from the inode or its fragments into a (buffered)
+ * data block of its own; the file has extents from then on. Stores any error
+ * in rq->err_code; the data stays where it was then.
+ */
+void small_data_evict(fs_req *rq, a1fs_inode *inode)
+{
+    char data[A1FS_FRAG_FILE_MAX];
+    size_t len = inode->size;
+    uint32_t flags = inode->hz_flags;
+    memcpy(data, small_data(rq, inode), len);
+    inode->hz_flags &= ~(A1FS_INODE_INLINE_DATA | A1FS_INODE_FRAGMENTS);
+    rq->err_code = 0;
+    if (len > 0)
+    {
+        file_grow(rq, inode, 1);
+        if (rq->err_code != 0)
+        {
+            inode->hz_flags = flags;
+            return;
+        }
+        a1fs_inode *saved = rq->path_inode;
+        rq->path_inode = inode;
+        memcpy(cal_byte(0, rq), data, len);
+        rq->path_inode = saved;
+    }
+    if (flags & A1FS_INODE_FRAGMENTS)
+        frag_free(rq, inode->hz_frag_blk, inode->hz_frag_start, frag_count(len));
+}
+
+/**
+ * Grow the data of inode to size bytes if it is inline or in fragments and
+ * still fits there, or can go into fragments; otherwise move it to a block
+ * of its own first. Returns true if there is nothing left to do (or there
+ * was an error, stored in rq->err_code); false if the file needs blocks.
+ */
+bool small_data_grow(fs_req *rq, a1fs_inode *inode, uint64_t size)
+{
+    rq->err_code = 0;
+    if (inline_data(inode) && size <= inline_data_max(rq->fs))
+        return true;
+    if (frag_fits(rq, inode, size))
+    {
+        frag_resize(rq, inode, size);
+        return true;
+    }
+    if (small_data(rq, inode) != NULL)
+        small_data_evict(rq, inode);
+    return rq->err_code != 0;
+}
+
+/**
+ * Make sure logical blocks [from, to) of inode have disk blocks: holes in
+ * the range and new blocks past the end get unwritten blocks. Stores any
+ * error in rq->err_code.
+ */
+void file_prealloc(fs_req *rq, a1fs_inode *inode, unsigned int from, unsigned int to)
+{
+    rq->err_code = 0;
+    if (small_data(rq, inode) != NULL)
+        small_data_evict(rq, inode);
+    if (rq->err_code != 0)
+        return;
+    unsigned int have = inode_blocks(rq, inode);
+    hole_alloc(rq, inode, from, min(to, have));
+    pending *p = delalloc_get(&rq->fs->delalloc, inode->hz_inode_pos);
+    unsigned int buffered = (p != NULL) ? p->nblks : 0;
+    if (rq->err_code != 0 || to <= have + buffered)
+        return;
+    if (delalloc_flush(rq, inode, false) != 0)
+        return;
+    have = inode_blocks(rq, inode);
+    //Blocks between the end and the range are left a hole
+    if (from > have)
+    {
+        hole_append(rq, inode, from - have);
+        have = from;
+    }
+    if (rq->err_code == 0 && to > have)
+        alloc_datablocks(inode, to - have, rq, true);
+}
+
+/**
+ * Allocate a single zeroed data block for metadata. The search starts from
+ * the top of the data region, so that metadata blocks don't land between the
+ * blocks of a growing file or directory and split it into many extents.
+ * Returns the block number or -ENOSPC.
+ */
+int64_t alloc_blk(fs_req *rq)
+{
+    fs_ctx *fs = rq->fs;
+    int64_t blk = -ENOSPC;
+    for (int64_t i = (int64_t)fs->num_groups - 1; i >= 0 && blk < 0; i--)
+    {
+        fs_group *g = &fs->groups[i];
+        pthread_mutex_lock(&g->lock);
+        if (*g->free_blocks > 0)
+        {
+            int64_t last;
+            if (g->fm.valid)
+                last = freemap_last(&g->fm);
+            else
+                last = bitmap_find_last_zero(fs->bitmp_data, g->blk_start, g->blk_start + g->blk_count);
+            if (last >= 0)
+            {
+                group_mark_blks(fs, g, last, 1, false);
+                blk = last;
+            }
+        }
+        pthread_mutex_unlock(&g->lock);
+    }
+    if (blk >= 0)
+    {
+        journal_dirty(&fs->journal, update_ext_blk(true, rq, blk));
+        memset(update_ext_blk(true, rq, blk), 0, A1FS_BLOCK_SIZE);
+    }
+    return blk;
+}
+
+/* Callbacks that let the B+tree code keep its nodes in data blocks */
+void *btree_blk_cb(void *arg, uint32_t blk)
+{
+    return update_ext_blk(true, (fs_req *)arg, blk);
+}
+int64_t btree_alloc_cb(void *arg)
+{
+    return alloc_blk((fs_req *)arg);
+}
+void btree_release_cb(void *arg, uint32_t blk)
+{
+    switch_bit((fs_req *)arg, true, blk, true);
+}
+void btree_dirty_cb(void *arg, uint32_t blk)
+{
+    journal_dirty(&((fs_req *)arg)->fs->journal, update_ext_blk(true, (fs_req *)arg, blk));
+}
+
+/**
+ * Walk over the blocks of a directory in order.
+ */
+typedef struct dir_walk
+{
+    //Current extent, and block inside it
+    ext_iter it;
+    unsigned int a;
+    //The extents ended; nothing maps the block at pos
+    bool unmapped;
+    //Byte offset of the next block inside the directory
+    uint64_t pos;
+} dir_walk;
+
+/** Start a walk at logical block lblk of a directory. */
+void dir_walk_start(fs_req *rq, a1fs_inode *dir, dir_walk *w, unsigned int lblk)
+{
+    w->unmapped = !ext_iter_start(rq, dir, lblk, &w->it);
+    w->a = w->unmapped ? 0 : lblk - w->it.lstart;
+    w->pos = (uint64_t)lblk * A1FS_BLOCK_SIZE;
+}
+
+/**
+ * Return the next block of a directory, or NULL at the end. *len receives
+ * the number of bytes of the block that are in use. If the extents end
+ * before the size of the directory does, the map is corrupt: the walk stops
+ * with rq->err_code set to -EIO.
+ */
+char *dir_walk_next(fs_req *rq, a1fs_inode *dir, dir_walk *w, size_t *len)
+{
+    if (w->pos >= dir->size)
+        return NULL;
+    while (!w->unmapped && w->a == w->it.e.count)
+    {
+        w->unmapped = !ext_iter_next(rq, &w->it);
+        w->a = 0;
+    }
+    if (w->unmapped)
+    {
+        rq->err_code = -EIO;
+        return NULL;
+    }
+    char *blk = (char *)update_ext_blk(true, rq, w->it.e.start + w->a);
+    w->a++;
+    *len = min((uint64_t)A1FS_BLOCK_SIZE, dir->size - w->pos);
+    w->pos += A1FS_BLOCK_SIZE;
+    return blk;
+}
+
+/** Whether a walk that dir_walk_next() ended stopped short on a corrupt map. */
+bool dir_walk_failed(a1fs_inode *dir, dir_walk *w)
+{
+    return w->pos < dir->size;
+}
+
+/** Return a pointer to byte pos of the data of directory dir. */
+void *dir_byte(fs_req *rq, a1fs_inode *dir, uint64_t pos)
+{
+    a1fs_inode *saved = rq->path_inode;
+    rq->path_inode = dir;
+    void *p = cal_byte(pos, rq);
+    rq->path_inode = saved;
+    return p;
+}
+
+/** Return the entry in the given slot of a directory of fixed size entries. */
+a1fs_dentry *get_dentry(fs_req *rq, a1fs_inode *dir, unsigned int slot)
+{
+    return dir_byte(rq, dir, (uint64_t)slot * sizeof(a1fs_dentry));
+}
+
+/**
+ * Call visit on every entry of directory dir in order, until it returns
+ * false. pos is the position of the entry: its slot for fixed size entries,
+ * its byte offset for compact ones.
+ *
+ * Returns false if the walk was stopped by visit, or by a corrupt map.
+ */
+typedef bool (*dir_visit_t)(fs_req *rq, const char *name, a1fs_ino_t ino, uint32_t pos, void *arg);
+
+bool dir_for_each(fs_req *rq, a1fs_inode *dir, dir_visit_t visit, void *arg)
+{
+    dir_walk w;
+    size_t len;
+    char *blk;
+    dir_walk_start(rq, dir, &w, 0);
+    while ((blk = dir_walk_next(rq, dir, &w, &len)) != NULL)
+    {
+        uint64_t blk_pos = w.pos - A1FS_BLOCK_SIZE;
+        if (dir_compact(rq))
+        {
+            size_t off = 0;
+            while (off < len)
+            {
+                a1fs_cdentry *rec = (a1fs_cdentry *)(blk + off);
+                if (rec->name_len > 0 && !visit(rq, rec->name, rec->ino, blk_pos + off, arg))
+                    return false;
+                off += rec->rec_len;
+            }
+        }
+        else
+        {
+            a1fs_dentry *ents = (a1fs_dentry *)blk;
+            for (size_t d = 0; d < len / sizeof(a1fs_dentry); d++)
+            {
+                if (ents[d].name[0] != '\0' && !visit(rq, ents[d].name, ents[d].ino, blk_pos / sizeof(a1fs_dentry) + d, arg))
+                    return false;
+            }
+        }
+    }
+    return !dir_walk_failed(dir, &w);
+}
+
+/**
+ * Readdir offsets. 0 starts a listing and 1 and 2 follow "." and "..". Any
+ * other offset is DIR_COOKIE_BASE plus the position of the next entry to
+ * return: logical block lblk of the directory and byte offset off in the
+ * block. Resuming only needs a lookup in the extent map, not a walk over the
+ * directory.
+ */
+#define DIR_COOKIE_BASE 3
+
+off_t dir_cookie(unsigned int lblk, size_t off)
+{
+    return DIR_COOKIE_BASE + (((off_t)lblk << 13) | off);
+}
+
+/** Inode number passed to a dir_fill_t for "..": directories don't record their parent. */
+#define DIR_INO_UNKNOWN ((a1fs_ino_t)-1)
+
+/**
+ * Receives the entries of a directory from fill_dir(): the name, the inode
+ * number and the readdir offset of the entry after it. Returns true once
+ * buf is full; the entry is not taken then.
+ */
+typedef bool (*dir_fill_t)(void *buf, const char *name, a1fs_ino_t ino, off_t next);
+
+/**
+ * Pass the entries of a directory to filler, starting from readdir offset
+ * offset, until filler's buffer is full. Each entry is passed with the offset
+ * of the entry after it. The caller must hold the lock of dir.
+ *
+ * Returns 0, or -EIO if the extents of dir end before its size does.
+ */
+int fill_dir(fs_req *rq, a1fs_inode *dir, void *buf, dir_fill_t filler, off_t offset)
+{
+    if (offset < 1 && filler(buf, ".", dir->hz_inode_pos, 1))
+        return 0;
+    if (offset < 2 && filler(buf, "..", DIR_INO_UNKNOWN, 2))
+        return 0;
+    uint64_t cookie = (offset < DIR_COOKIE_BASE) ? 0 : offset - DIR_COOKIE_BASE;
+    unsigned int lblk = cookie >> 13;
+    size_t off = cookie & 0x1fff;
+
+    //The block may be gone if the directory shrank since; the walk is over then
+    dir_walk w;
+    dir_walk_start(rq, dir, &w, lblk);
+
+    size_t len;
+    char *blk = dir_walk_next(rq, dir, &w, &len);
+    //Entries may have changed since the cookie was made; go to an entry boundary
+    if (blk != NULL && dir_compact(rq))
+    {
+        size_t o = 0;
+        while (o < off)
+            o += ((a1fs_cdentry *)(blk + o))->rec_len;
+        off = o;
+    }
+    else
+    {
+        off = align_up(off, sizeof(a1fs_dentry));
+    }
+    while (blk != NULL)
+    {
+        while (off < len)
+        {
+            const char *name;
+            a1fs_ino_t ino;
+            size_t next;
+            if (dir_compact(rq))
+            {
+                a1fs_cdentry *rec = (a1fs_cdentry *)(blk + off);
+                name = (rec->name_len > 0) ? rec->name : NULL;
+                ino = rec->ino;
+                next = off + rec->rec_len;
+            }
+            else
+            {
+                a1fs_dentry *ent = (a1fs_dentry *)(blk + off);
+                name = (ent->name[0] != '\0') ? ent->name : NULL;
+                ino = ent->ino;
+                next = off + sizeof(a1fs_dentry);
+            }
+            if (name != NULL && filler(buf, name, ino, dir_cookie(w.pos / A1FS_BLOCK_SIZE - 1, next)))
+                return 0;
+            off = next;
+        }
+        off = 0;
+        blk = dir_walk_next(rq, dir, &w, &len);
+    }
+    return dir_walk_failed(dir, &w) ? -EIO : 0;
+}
+
+/**
+ * Compact directory entries.
+ *
+ * With A1FS_FEATURE_COMPACT_DIRS, directories hold variable-length
+ * a1fs_cdentry records (see a1fs.h) instead of 256-byte a1fs_dentry ones, so
+ * a block holds about ten times more entries with typical names. Entries
+ * never move once created: a removed entry is merged into the one before it.
+ * The position of an entry is its byte offset in the directory.
+ */
+bool dir_compact(fs_req *rq)
+{
+    return rq->fs->bblk->hz_features & A1FS_FEATURE_COMPACT_DIRS;
+}
+
+/**
+ * Look up name in a directory of compact entries; *pos receives the byte
+ * offset of the entry. The hash and length of the name are checked before
+ * the names are compared, so only likely matches touch the name bytes.
+ * rq->err_code is set to 0, -ENOENT, or -EIO if the map is corrupt.
+ */
+a1fs_cdentry *cdentry_find(fs_req *rq, a1fs_inode *dir, const char *name, uint32_t *pos)
+{
+    size_t name_len = strlen(name);
+    uint32_t hash = name_hash(name, name_len);
+    dir_walk w;
+    size_t len;
+    char *blk;
+    rq->err_code = 0;
+    dir_walk_start(rq, dir, &w, 0);
+    while ((blk = dir_walk_next(rq, dir, &w, &len)) != NULL)
+    {
+        size_t off = 0;
+        while (off < len)
+        {
+            a1fs_cdentry *rec = (a1fs_cdentry *)(blk + off);
+            if (rec->hash == hash && rec->name_len == name_len && !memcmp(rec->name, name, name_len))
+            {
+                *pos = w.pos - A1FS_BLOCK_SIZE + off;
+                return rec;
+            }
+            off += rec->rec_len;
+        }
+    }
+    if (rq->err_code == 0)
+        rq->err_code = -ENOENT;
+    return NULL;
+}
+
+/**
+ * Make room for a record of need bytes in a block of compact entries, by
+ * taking an unused record or splitting the free space off the end of one.
+ * Returns the offset of the new record in the block, or -1 if it is full.
+ */
+int cdentry_fit(char *blk, size_t need)
+{
+    size_t off = 0;
+    while (off < A1FS_BLOCK_SIZE)
+    {
+        a1fs_cdentry *rec = (a1fs_cdentry *)(blk + off);
+        size_t used = (rec->name_len > 0) ? A1FS_CDENTRY_LEN(rec->name_len) : 0;
+        if (rec->rec_len - used >= need)
+        {
+            if (used == 0)
+                return off;
+            a1fs_cdentry *next = (a1fs_cdentry *)(blk + off + used);
+            next->rec_len = rec->rec_len - used;
+            rec->rec_len = used;
+            return off + used;
+        }
+        off += rec->rec_len;
+    }
+    return -1;
+}
+
+/**
+ * Add an entry to a directory of compact entries, in the first block from
+ * hz_dir_free on that has room, or in a new block at the end. *pos receives
+ * the byte offset of the entry. Returns 0, -ENOSPC, or -EIO if the map is
+ * corrupt.
+ */
+int cdentry_add(fs_req *rq, a1fs_inode *dir, const char *name, a1fs_ino_t ino, uint32_t *pos)
+{
+    size_t name_len = strlen(name);
+    size_t need = A1FS_CDENTRY_LEN(name_len);
+    dir_walk w;
+    size_t len;
+    char *blk;
+    uint64_t blk_pos = 0;
+    int off = -1;
+    dir_walk_start(rq, dir, &w, dir->hz_dir_free);
+    while (off < 0 && (blk = dir_walk_next(rq, dir, &w, &len)) != NULL)
+    {
+        blk_pos = w.pos - A1FS_BLOCK_SIZE;
+        off = cdentry_fit(blk, need);
+    }
+    if (off < 0 && dir_walk_failed(dir, &w))
+        return rq->err_code;
+
+    if (off < 0)
+    {
+        //Every block is full; grow the directory
+        if (load_datablock(dir, 1, rq) != 0)
+            return rq->err_code;
+        blk_pos = dir->size;
+        dir->size += A1FS_BLOCK_SIZE;
+        blk = dir_byte(rq, dir, blk_pos);
+        journal_dirty(&rq->fs->journal, blk);
+        ((a1fs_cdentry *)blk)->rec_len = A1FS_BLOCK_SIZE;
+        off = 0;
+    }
+    else
+    {
+        journal_dirty(&rq->fs->journal, blk);
+    }
+    dir->hz_dir_free = blk_pos / A1FS_BLOCK_SIZE;
+
+    a1fs_cdentry *rec = (a1fs_cdentry *)(blk + off);
+    rec->ino = ino;
+    rec->hash = name_hash(name, name_len);
+    rec->name_len = name_len;
+    memcpy(rec->name, name, name_len + 1);
+    *pos = blk_pos + off;
+    return 0;
+}
+
+void blk_deallocation(fs_req *rq, a1fs_inode *inode, off_t size);
+
+/**
+ * Remove the compact entry at byte offset pos of a directory, and give back
+ * the blocks at the end of the directory that are left without entries.
+ */
+void cdentry_remove(fs_req *rq, a1fs_inode *dir, uint32_t pos)
+{
+    char *blk = dir_byte(rq, dir, pos - pos % A1FS_BLOCK_SIZE);
+    journal_dirty(&rq->fs->journal, blk);
+    size_t off = 0;
+    a1fs_cdentry *prev = NULL;
+    while (off < pos % A1FS_BLOCK_SIZE)
+    {
+        prev = (a1fs_cdentry *)(blk + off);
+        off += prev->rec_len;
+    }
+    a1fs_cdentry *rec = (a1fs_cdentry *)(blk + off);
+    if (prev != NULL)
+        prev->rec_len += rec->rec_len;
+    else
+        rec->name_len = 0;
+    if (pos / A1FS_BLOCK_SIZE < dir->hz_dir_free)
+        dir->hz_dir_free = pos / A1FS_BLOCK_SIZE;
+
+    while (dir->size > 0)
+    {
+        a1fs_cdentry *first = dir_byte(rq, dir, dir->size - A1FS_BLOCK_SIZE);
+        if (first->name_len > 0 || first->rec_len != A1FS_BLOCK_SIZE)
+            break;
+        blk_deallocation(rq, dir, dir->size - A1FS_BLOCK_SIZE);
+    }
+}
+
+/**
+ * Look up name in a directory of fixed size entries; *pos receives the slot
+ * of the entry. rq->err_code is set to 0, -ENOENT, or -EIO if the map is
+ * corrupt.
+ */
+a1fs_dentry *dentry_find(fs_req *rq, a1fs_inode *dir, const char *name, uint32_t *pos)
+{
+    dir_walk w;
+    size_t len;
+    char *blk;
+    rq->err_code = 0;
+    dir_walk_start(rq, dir, &w, 0);
+    while ((blk = dir_walk_next(rq, dir, &w, &len)) != NULL)
+    {
+        a1fs_dentry *ents = (a1fs_dentry *)blk;
+        for (size_t d = 0; d < len / sizeof(a1fs_dentry); d++)
+        {
+            if (ents[d].name[0] != '\0' && !strcmp(ents[d].name, name))
+            {
+                *pos = (w.pos - A1FS_BLOCK_SIZE) / sizeof(a1fs_dentry) + d;
+                return &ents[d];
+            }
+        }
+    }
+    if (rq->err_code == 0)
+        rq->err_code = -ENOENT;
+    return NULL;
+}
+
+/**
+ * Add a fixed size entry to a directory, in the first unused slot from block
+ * hz_dir_free on, or at the end; *pos receives its slot. Returns 0, -ENOSPC,
+ * or -EIO if the map is corrupt.
+ */
+int dentry_add(fs_req *rq, a1fs_inode *dir, const char *name, a1fs_ino_t ino, uint32_t *pos)
+{
+    const uint32_t end = dir->size / sizeof(a1fs_dentry);
+    uint32_t slot = end;
+    dir_walk w;
+    size_t len;
+    char *blk = NULL;
+    dir_walk_start(rq, dir, &w, dir->hz_dir_free);
+    while (slot == end && (blk = dir_walk_next(rq, dir, &w, &len)) != NULL)
+    {
+        a1fs_dentry *ents = (a1fs_dentry *)blk;
+        for (size_t d = 0; d < len / sizeof(a1fs_dentry); d++)
+        {
+            if (ents[d].name[0] == '\0')
+            {
+                slot = (w.pos - A1FS_BLOCK_SIZE) / sizeof(a1fs_dentry) + d;
+                break;
+            }
+        }
+    }
+    if (blk == NULL && dir_walk_failed(dir, &w))
+        return rq->err_code;
+
+    if (slot == end)
+    {
+        if (dir->size % A1FS_BLOCK_SIZE == 0 && load_datablock(dir, 1, rq) != 0)
+            return rq->err_code;
+        dir->size += sizeof(a1fs_dentry);
+    }
+    dir->hz_dir_free = slot / (A1FS_BLOCK_SIZE / sizeof(a1fs_dentry));
+    a1fs_dentry *ent = get_dentry(rq, dir, slot);
+    journal_dirty(&rq->fs->journal, ent);
+    ent->ino = ino;
+    strncpy(ent->name, name, A1FS_NAME_MAX);
+    *pos = slot;
+    return 0;
+}
+
+/**
+ * Remove the fixed size entry in slot pos of a directory. The slot is left
+ * unused, so that no entry moves behind the offset of a readdir in progress;
+ * unused slots at the end are given back, and the last block once it is
+ * left without entries.
+ */
+void dentry_remove(fs_req *rq, a1fs_inode *dir, uint32_t pos)
+{
+    a1fs_dentry *ent = get_dentry(rq, dir, pos);
+    journal_dirty(&rq->fs->journal, ent);
+    ent->ino = 0;
+    ent->name[0] = '\0';
+    if (pos / (A1FS_BLOCK_SIZE / sizeof(a1fs_dentry)) < dir->hz_dir_free)
+        dir->hz_dir_free = pos / (A1FS_BLOCK_SIZE / sizeof(a1fs_dentry));
+
+    while (dir->size > 0 && get_dentry(rq, dir, dir->size / sizeof(a1fs_dentry) - 1)->name[0] == '\0')
+        blk_deallocation(rq, dir, dir->size - sizeof(a1fs_dentry));
+}
+
+/**
+ * Hashed directory index.
+ *
+ * With A1FS_FEATURE_DIR_INDEX, a directory that grows past one block gets a
+ * B+tree rooted at hz_dir_index with one record per entry. The key is the
+ * name hash in the upper 32 bits and the entry's position (see dir_for_each())
+ * in the lower 32 bits, so a lookup is a range scan over a single hash. The
+ * entries themselves are unchanged; the index only points into them. Whenever the index can't be
+ * updated (out of space) it is dropped and lookups fall back to scanning.
+ */
+bool dir_indexed(fs_req *rq, a1fs_inode *dir)
+{
+    return (rq->fs->bblk->hz_features & A1FS_FEATURE_DIR_INDEX) && dir->hz_dir_index != -1;
+}
+
+void dir_index_open(fs_req *rq, a1fs_inode *dir, btree *bt)
+{
+    bt->root = &dir->hz_dir_index;
+    bt->blk = btree_blk_cb;
+    bt->alloc = btree_alloc_cb;
+    bt->release = btree_release_cb;
+    bt->dirty = btree_dirty_cb;
+    bt->arg = rq;
+}
+
+uint64_t dir_index_key(const char *name, unsigned int slot)
+{
+    return ((uint64_t)name_hash(name, strlen(name)) << 32) | slot;
+}
+
+/**
+ * Look up name through the index; *key receives the key of its record.
+ * Returns the a1fs_dentry or a1fs_cdentry of the entry, or NULL.
+ */
+void *dir_index_find(fs_req *rq, a1fs_inode *dir, const char *name, uint64_t *key)
+{
+    btree bt;
+    btree_iter it;
+    uint64_t val;
+    uint64_t hash = dir_index_key(name, 0) >> 32;
+    dir_index_open(rq, dir, &bt);
+    btree_seek(&bt, hash << 32, &it);
+    while (btree_next(&it, key, &val) && (*key >> 32) == hash)
+    {
+        if (dir_compact(rq))
+        {
+            a1fs_cdentry *rec = dir_byte(rq, dir, (uint32_t)*key);
+            if (rec->name_len > 0 && !strcmp(rec->name, name))
+                return rec;
+        }
+        else
+        {
+            a1fs_dentry *ent = get_dentry(rq, dir, (uint32_t)*key);
+            if (!strcmp(ent->name, name))
+                return ent;
+        }
+    }
+    return NULL;
+}
+
+/** Drop the index of a directory; lookups go back to scanning. */
+void dir_index_drop(fs_req *rq, a1fs_inode *dir)
+{
+    btree bt;
+    dir_index_open(rq, dir, &bt);
+    btree_free(&bt);
+}
+
+bool dir_index_build_visit(fs_req *rq, const char *name, a1fs_ino_t ino, uint32_t pos, void *arg)
+{
+    (void)rq;
+    (void)ino;
+    return btree_insert((btree *)arg, dir_index_key(name, pos), 0) == 0;
+}
+
+/**
+ * Build the index of a directory from its current entries. Without a whole
+ * index the directory is searched entry by entry, which reports a corrupt
+ * map itself, so the error of the walk is not kept.
+ */
+void dir_index_build(fs_req *rq, a1fs_inode *dir)
+{
+    btree bt;
+    int err = rq->err_code;
+    dir_index_open(rq, dir, &bt);
+    if (!dir_for_each(rq, dir, dir_index_build_visit, &bt))
+        btree_free(&bt);
+    rq->err_code = err;
+}
+
+/** Record that name was added to the directory in the given slot. */
+void dir_index_add(fs_req *rq, a1fs_inode *dir, const char *name, unsigned int slot)
+{
+    if (!(rq->fs->bblk->hz_features & A1FS_FEATURE_DIR_INDEX))
+        return;
+    if (dir->hz_dir_index == -1)
+    {
+        //Small directories are cheap to scan and don't get an index
+        if (dir->size > A1FS_BLOCK_SIZE)
+            dir_index_build(rq, dir);
+        return;
+    }
+    btree bt;
+    dir_index_open(rq, dir, &bt);
+    if (btree_insert(&bt, dir_index_key(name, slot), 0) != 0)
+        btree_free(&bt);
+}
+
+/** Record that the entry with the given key was removed; no other entry moves. */
+void dir_index_remove(fs_req *rq, a1fs_inode *dir, uint64_t key)
+{
+    btree bt;
+    dir_index_open(rq, dir, &bt);
+    btree_delete(&bt, key);
+}
+
+bool dir_filter_visit(fs_req *rq, const char *name, a1fs_ino_t ino, uint32_t pos, void *arg)
+{
+    (void)rq;
+    (void)ino;
+    (void)pos;
+    bloom_add((bloom *)arg, name);
+    return true;
+}
+
+/**
+ * Check the negative lookup filter of a directory, building it first if the
+ * directory is big enough to have one. Directories that fit in a block are
+ * cheap to scan and don't get a filter.
+ *
+ * The caller must hold the lock of dir. Returns true if name is definitely
+ * not in dir.
+ */
+bool dir_filter_absent(fs_req *rq, a1fs_inode *dir, const char *name)
+{
+    bloom_table *bt = &rq->fs->bloom;
+    if (dir->size <= A1FS_BLOCK_SIZE)
+        return false;
+    if (!bloom_present(bt, dir->hz_inode_pos))
+    {
+        //An upper bound on the number of entries of a compact directory
+        unsigned int n = dir->size / (dir_compact(rq) ? A1FS_CDENTRY_LEN(1) : sizeof(a1fs_dentry));
+        bloom *bf = bloom_new(n);
+        if (bf == NULL)
+            return false;
+        if (!dir_for_each(rq, dir, dir_filter_visit, bf))
+        {
+            free(bf);
+            return false;
+        }
+        bloom_install(bt, dir->hz_inode_pos, bf);
+    }
+    return bloom_absent(bt, dir->hz_inode_pos, name);
+}
+
+/**
+ * Create a directory or a file named file in directory dir. On success,
+ * rq->path_inode is the new inode.
+ */
+int create_in_dir(fs_req *rq, a1fs_inode *dir, const char *file, mode_t mode, bool is_file)
+{
+    rq->err_code = 0;
+    inode_wrlock(rq->fs, dir->hz_inode_pos);
+
+    a1fs_extent extent;
+    // Find a free inode, unless dir itself has been removed
+    int64_t ino = (dir->links == 0) ? -ENOENT : inode_alloc(rq, dir->hz_inode_pos, S_ISDIR(mode));
+    rq->err_code = (ino < 0) ? ino : 0;
+    extent.start = ino;
+
+    if (rq->err_code == 0)
+    {
+        //Calculate inode
+        a1fs_inode *node = cal_inode(rq, extent.start);
+        init_dir(node, mode, extent.start);
+
+        //The only different between file and dir is the numeber of link.
+        if (is_file)
+            node->links = 1;
+        if (S_ISREG(mode))
+            inline_data_init(rq, node);
+
+        //Add the entry, growing dir if it is full
+        uint32_t pos;
+        if (dir_compact(rq))
+            cdentry_add(rq, dir, file, node->hz_inode_pos, &pos);
+        else
+            dentry_add(rq, dir, file, node->hz_inode_pos, &pos);
+        if (rq->err_code != 0)
+        {
+            switch_bit(rq, false, extent.start, true);
+        }
+        else
+        {
+            //Update entry info;
+            dir->links += ((node->mode & S_IFDIR) == S_IFDIR) ? 1 : 0;
+            dir_index_add(rq, dir, file, pos);
+            bloom_insert(&rq->fs->bloom, dir->hz_inode_pos, file);
+            dcache_insert(&rq->fs->dcache, dir->hz_inode_pos, file, node->hz_inode_pos);
+            clock_gettime(CLOCK_REALTIME, &(dir->mtime));
+            notify_inode(&rq->fs->notify, dir->hz_inode_pos, -1);
+            rq->path_inode = node;
+            if (rq->take_ref)
+                inode_ref(rq->fs, node->hz_inode_pos, 1);
         }
+    }
+
+    inode_unlock(rq->fs, dir->hz_inode_pos);
+    if (space_retry(rq))
+        return create_in_dir(rq, dir, file, mode, is_file);
+    return rq->err_code;
+}
+
+/**
+ * Split path into the path of its directory, in prefix, and its last
+ * component, in file.
+ */
+void split_path(const char *path, char *prefix, char *file)
+{
+    char base[A1FS_PATH_MAX];
+    strncpy(prefix, path, A1FS_PATH_MAX - 1);
+    prefix[A1FS_PATH_MAX - 1] = '\0';
+    strcpy(base, prefix);
+    strncpy(file, basename(base), A1FS_NAME_MAX - 1);
+    file[A1FS_NAME_MAX - 1] = '\0';
+    //dirname() may return a static string instead of modifying its argument
+    char *dir = dirname(prefix);
+    memmove(prefix, dir, strlen(dir) + 1);
+}
+
+/**
+ * Create a directory or a file
+ *
+*/
+int create_file_dir(fs_req *rq, const char *path, mode_t mode, bool is_file)
+{ //Clear err_node
+    rq->err_code = 0;
+
+    //Extract file name and prefix path
+    char file[A1FS_NAME_MAX];
+    char prefix[A1FS_PATH_MAX];
+    split_path(path, prefix, file);
+    //Find corresponding inode
+    if (find_path_inode(prefix, rq) != 0)
+        return rq->err_code;
+    return create_in_dir(rq, rq->path_inode, file, mode, is_file);
+}
+
+/** Free the run of length data blocks starting at blk_num. */
+void switch_all_bits(fs_req *rq, unsigned int length, int blk_num)
+{
+    data_blks_free(rq, blk_num, length);
+}
+/*
+* Deallocate the blocks past size and set the size of inode
+* Frees the extent block too once no data blocks are left.
+*/
+void blk_deallocation(fs_req *rq, a1fs_inode *inode, off_t size)
+{
+    char *data = small_data(rq, inode);
+    if (data != NULL)
+    {
+        if ((uint64_t)size < inode->size)
+            memset(data + size, 0, inode->size - size);
+        //The fragments past the new end are freed, and all of them at size 0
+        unsigned int have = frag_data(inode) ? frag_count(inode->size) : 0;
+        if (frag_count(size) < have)
+            frag_free(rq, inode->hz_frag_blk, inode->hz_frag_start + frag_count(size), have - frag_count(size));
+        if (size == 0)
+            inode->hz_flags &= ~A1FS_INODE_FRAGMENTS;
+        inode->size = size;
+        return;
+    }
+    inode->size = size;
+    unsigned int keep = div_round_up(size, A1FS_BLOCK_SIZE);
+    unsigned int total = inode_blocks(rq, inode);
+    delalloc_truncate(&rq->fs->delalloc, inode->hz_inode_pos, (keep > total) ? keep - total : 0);
+    ext_truncate(rq, inode, keep);
+}
+
+/** Release the data blocks and the extent block of an inode that is being freed. */
+void inode_drop_data(fs_req *rq, a1fs_inode *inode)
+{
+    if (dir_indexed(rq, inode))
+        dir_index_drop(rq, inode);
+    blk_deallocation(rq, inode, 0);
+}
+
+/**
+ * Drop n references taken with inode_ref(), and free the inode if it was an
+ * orphan and they were the last ones.
+ */
+void inode_unref(fs_req *rq, a1fs_ino_t ino, uint64_t n)
+{
+    if (__atomic_sub_fetch(&rq->fs->inode_refs[ino], n, __ATOMIC_SEQ_CST) > 0)
+        return;
+    //The inode is freed only after its lock is dropped, in the same transaction
+    journal_begin(&rq->fs->journal);
+    inode_wrlock(rq->fs, ino);
+    a1fs_inode *inode = get_node(rq->fs, ino);
+    //rm_in_dir() may not have made it an orphan yet; it frees it itself then
+    bool orphan = inode->links == 0 && __atomic_load_n(&rq->fs->inode_refs[ino], __ATOMIC_SEQ_CST) == 0;
+    if (orphan)
+        inode_drop_data(rq, inode);
+    inode_unlock(rq->fs, ino);
+    if (orphan)
+        switch_bit(rq, false, ino, true);
+    journal_end(&rq->fs->journal);
+}
+
+/**
+ * Free every orphan, whatever its references: the ones a crash left on disk
+ * when mounting, and the ones the kernel never forgot when unmounting.
+ */
+void orphans_free(fs_ctx *fs)
+{
+    fs_req rq;
+    fs_req_init(&rq, fs);
+    uint32_t n = fs->bblk->num_inodes;
+    for (uint32_t ino = bitmap_find_next(fs->bitmp_inode, n, 0, true); ino < n;
+         ino = bitmap_find_next(fs->bitmp_inode, n, ino + 1, true))
+    {
+        a1fs_inode *inode = get_node(fs, ino);
+        if (inode->links != 0)
+            continue;
+        journal_begin(&fs->journal);
+        inode_wrlock(fs, ino);
+        inode_drop_data(&rq, inode);
+        inode_unlock(fs, ino);
+        switch_bit(&rq, false, ino, true);
+        journal_end(&fs->journal);
+    }
+}
+
+/**
+ * Remove the directory or the file named file from directory dir. An inode
+ * the kernel still has references to is left as an orphan; see inode_ref().
+ */
+int rm_in_dir(fs_req *rq, a1fs_inode *dir, const char *file, bool is_dir)
+{
+    rq->err_code = 0;
+    inode_wrlock(rq->fs, dir->hz_inode_pos);
+    //Find corresponding directory entry
+    uint64_t key = 0;
+    uint32_t pos = 0;
+    if (dir_indexed(rq, dir))
+    {
+        rq->ent = dir_index_find(rq, dir, file, &key);
+        rq->err_code = (rq->ent == NULL) ? -ENOENT : 0;
+        pos = (uint32_t)key;
+    }
+    else if (dir_compact(rq))
+    {
+        rq->ent = (a1fs_dentry *)cdentry_find(rq, dir, file, &pos);
+    }
+    else
+    {
+        rq->ent = dentry_find(rq, dir, file, &pos);
+    }
+    if (rq->err_code != 0)
+    {
+        inode_unlock(rq->fs, dir->hz_inode_pos);
+        return rq->err_code;
+    }
+    a1fs_dentry *ent = rq->ent;
+    a1fs_ino_t ino = ent->ino;
+    a1fs_inode *dir_inode = cal_inode(rq, ino);
+    inode_wrlock(rq->fs, ino);
+    if (is_dir && dir_inode->size > 0)
+        rq->err_code = -ENOTEMPTY;
+    //References are taken under the lock of dir, so no new one can come now
+    bool orphan = __atomic_load_n(&rq->fs->inode_refs[ino], __ATOMIC_SEQ_CST) > 0;
+    if (rq->err_code != -ENOTEMPTY)
+    {
+        dcache_remove(&rq->fs->dcache, dir->hz_inode_pos, file);
+        bloom_remove(&rq->fs->bloom, dir->hz_inode_pos);
+        if (is_dir)
+            bloom_drop(&rq->fs->bloom, ino);
+        if (orphan)
+            dir_inode->links = 0;
         else
-        {
-            fs->path_inode->hz_extent_size -= 1;
-            num_blocks = 0;
-        }
+            inode_drop_data(rq, dir_inode);
+        if (dir_indexed(rq, dir))
+            dir_index_remove(rq, dir, key);
+        if (dir_compact(rq))
+            cdentry_remove(rq, dir, pos);
+        else
+            dentry_remove(rq, dir, pos);
+        dir->links -= is_dir ? 1 : 0;
+        if (dir_indexed(rq, dir) && dir->size <= A1FS_BLOCK_SIZE)
+            dir_index_drop(rq, dir);
+        clock_gettime(CLOCK_REALTIME, &(dir->mtime));
+        notify_entry(&rq->fs->notify, dir->hz_inode_pos, file);
+        notify_inode(&rq->fs->notify, dir->hz_inode_pos, -1);
     }
+    inode_unlock(rq->fs, ino);
+    //The inode can be handed out again only once nobody holds its lock
+    if (rq->err_code == 0 && !orphan)
+        switch_bit(rq, false, ino, true);
+    inode_unlock(rq->fs, dir->hz_inode_pos);
+    return rq->err_code;
 }
-void byte_addition(fs_ctx *fs, a1fs_inode *node, int sizess)
+
+/**
+ * Remove a directory or a file
+ *
+*/
+int rm_dir_file(fs_req *rq, const char *path, bool is_dir)
+{
+    rq->err_code = 0;
+    //Extract file name and prefix path
+    char file[A1FS_NAME_MAX];
+    char prefix[A1FS_PATH_MAX];
+    split_path(path, prefix, file);
+    //Find corresponding inode
+    if (find_path_inode(prefix, rq) != 0)
+        return rq->err_code;
+    return rm_in_dir(rq, rq->path_inode, file, is_dir);
+}
+
+/** Zero the unused tail of the last block and return its length. */
+int get_free_space(fs_req *rq)
 {
     size_t blk_size = A1FS_BLOCK_SIZE;
-    int free_space = fs->path_inode->size % blk_size; //current free space in the last block
+    int free_space = rq->path_inode->size % blk_size; //current free space in the last block
     if (free_space != 0)
     {
         free_space -= blk_size;
         free_space *= -1;
+        //A block in a hole is zero already
+        void *tail = cal_byte(rq->path_inode->size, rq);
+        if (tail != NULL)
+            memset(tail, 0, free_space);
+    }
+
+    return free_space;
+}
+/** Grow rq->path_inode by sizess bytes that are about to be written. */
+void byte_addition(fs_req *rq, a1fs_inode *node, uint64_t sizess)
+{
+    if (!small_data_grow(rq, rq->path_inode, rq->path_inode->size + sizess))
+    {
+        get_free_space(rq);
+        file_grow(rq, rq->path_inode, div_round_up(rq->path_inode->size + sizess, A1FS_BLOCK_SIZE));
+    }
+    if (node && rq->err_code == 0)
+    {
+        node->size += sizess;
+    }
+}
+/** Grow rq->path_inode by sizess bytes of zeros. */
+void zero_addition(fs_req *rq, a1fs_inode *node, uint64_t sizess)
+{
+    if (!small_data_grow(rq, rq->path_inode, rq->path_inode->size + sizess))
+    {
+        get_free_space(rq);
+        file_zero_grow(rq, rq->path_inode, div_round_up(rq->path_inode->size + sizess, A1FS_BLOCK_SIZE));
+    }
+    if (node && rq->err_code == 0)
+    {
+        node->size += sizess;
+    }
+}
+/**
+ * Called by range_map() for each piece of a byte range of a file, in order:
+ * len bytes at data, or len bytes that read as zeros if data is NULL.
+ */
+typedef void (*range_fn)(void *arg, char *data, size_t len);
+
+/**
+ * Walk bytes [pos, end) of inode, within its size. Each extent is one piece,
+ * since its blocks are contiguous in the image, and so are the buffered
+ * blocks past the extents, and data kept inline or in fragments. Holes and
+ * unwritten blocks are pieces of zeros.
+ */
+void range_map(fs_req *rq, a1fs_inode *inode, uint64_t pos, uint64_t end, range_fn fn, void *arg)
+{
+    char *data = small_data(rq, inode);
+    if (data != NULL)
+    {
+        fn(arg, data + pos, end - pos);
+        return;
+    }
+    ext_iter it;
+    bool more = ext_iter_start(rq, inode, pos / A1FS_BLOCK_SIZE, &it);
+    for (; more && pos < end; more = ext_iter_next(rq, &it))
+    {
+        uint64_t run_end = min(end, (uint64_t)(it.lstart + it.e.count) * A1FS_BLOCK_SIZE);
+        if (ext_hole(&it.e) || it.e.unwritten)
+            fn(arg, NULL, run_end - pos);
+        else
+            fn(arg, (char *)update_ext_blk(true, rq, it.e.start + (pos / A1FS_BLOCK_SIZE - it.lstart)) + pos % A1FS_BLOCK_SIZE,
+               run_end - pos);
+        ext_cursor_set(rq, &it);
+        pos = run_end;
+    }
+    if (pos < end)
+    {
+        pending *p = delalloc_get(&rq->fs->delalloc, inode->hz_inode_pos);
+        fn(arg, (p != NULL) ? p->data + (pos - (uint64_t)it.lstart * A1FS_BLOCK_SIZE) : NULL, end - pos);
     }
+}
 
-    if (fs->path_inode->hz_extent_size > 0)
+/**
+ * Get bytes [pos, end) of inode ready to be written in place: holes in the
+ * range get disk blocks, and its unwritten blocks are converted, zeroing the
+ * ones only partly covered. Stores any error in rq->err_code.
+ */
+void range_write_prepare(fs_req *rq, a1fs_inode *inode, uint64_t pos, uint64_t end)
+{
+    unsigned int to = (end + A1FS_BLOCK_SIZE - 1) / A1FS_BLOCK_SIZE;
+    hole_alloc(rq, inode, pos / A1FS_BLOCK_SIZE, to);
+    for (unsigned int lblk = pos / A1FS_BLOCK_SIZE; rq->err_code == 0 && lblk < to;)
     {
-        update_ext_blk(false, fs, fs->path_inode->hz_extent_p);
-        a1fs_extent ext_last = fs->ext[fs->path_inode->hz_extent_size - 1];
-        void *blk = (void *)update_ext_blk(true, fs, ext_last.start + ext_last.count - 1) + fs->path_inode->size % A1FS_BLOCK_SIZE;
-        memset(blk, 0, free_space);
+        a1fs_extent e;
+        unsigned int lstart;
+        if (!ext_find(rq, inode, lblk, &e, &lstart))
+            return;
+        if (!e.unwritten)
+        {
+            lblk = lstart + e.count;
+            continue;
+        }
+        bool whole = pos <= (uint64_t)lblk * A1FS_BLOCK_SIZE && (uint64_t)(lblk + 1) * A1FS_BLOCK_SIZE <= end;
+        unwritten_convert(rq, inode, lblk, whole);
+        lblk++;
     }
+}
+
+/** range_fn that copies the pieces out to a buffer, or in from it. */
+typedef struct range_copy {
+    char *buf;
+    bool out;
+} range_copy;
+
+void range_copy_fn(void *arg, char *data, size_t len)
+{
+    range_copy *c = arg;
+    if (!c->out)
+        memcpy(data, c->buf, len);
+    else if (data != NULL)
+        memcpy(c->buf, data, len);
+    else
+        memset(c->buf, 0, len);
+    c->buf += len;
+}
 
-    if (sizess - free_space > 0)
+/**
+ * Copy size bytes between buf and the data of rq->path_inode at offset.
+ * The range may span any number of blocks and extents. Reads stop at the end
+ * of the file; writes must be within it. With -o zero_holes, whole blocks of
+ * zeros that are written become holes. Returns the number of bytes copied,
+ * or -ENOSPC.
+ */
+int read_write_IO(bool is_read, fs_req *rq, char *buf, size_t size, off_t offset)
+{
+    a1fs_inode *inode = rq->path_inode;
+    rq->err_code = 0;
+    if (is_read)
+        //Never read past the end of the file
+        size = min(inode->size - offset, size);
+    uint64_t end = (uint64_t)offset + size;
+    range_copy c = { .buf = buf, .out = is_read };
+    if (is_read)
+        range_map(rq, inode, offset, end, range_copy_fn, &c);
+    else if (!rq->fs->zero_holes || small_data(rq, inode) != NULL)
     {
-        unsigned int result = 1 + (sizess - free_space) / blk_size;
-        if ((sizess - free_space) % blk_size == 0)
+        range_write_prepare(rq, inode, offset, end);
+        if (rq->err_code == 0)
+            range_map(rq, inode, offset, end, range_copy_fn, &c);
+    }
+    else
+    {
+        //A block of zeros becomes (or stays) a hole
+        for (uint64_t pos = offset; pos < end && rq->err_code == 0; pos = (pos / A1FS_BLOCK_SIZE + 1) * A1FS_BLOCK_SIZE)
         {
-            result = result - 1;
+            uint64_t blk_end = min(end, (pos / A1FS_BLOCK_SIZE + 1) * A1FS_BLOCK_SIZE);
+            c.buf = buf + (pos - offset);
+            if (blk_all_zero(c.buf, blk_end - pos, pos) && blk_punch(rq, inode, pos / A1FS_BLOCK_SIZE))
+                continue;
+            range_write_prepare(rq, inode, pos, blk_end);
+            if (rq->err_code == 0)
+                range_map(rq, inode, pos, blk_end, range_copy_fn, &c);
         }
-        load_datablock(fs->path_inode, result, fs);
     }
-    if (node)
+    return (rq->err_code == 0) ? (int)size : rq->err_code;
+}
+
+/** Number of bytes from the end of rq->path_inode to offset_size; negative if it is before the end. */
+int64_t get_num_byte(fs_req *rq, uint64_t offset_size)
+{
+    return (int64_t)(offset_size - rq->path_inode->size);
+}
+
+/** Extend rq->path_inode with sizes bytes of zeros if condition holds. */
+void check_byte(fs_req *rq, int64_t sizes, int64_t condition)
+{
+    if (condition > 0)
+    {
+        zero_addition(rq, rq->path_inode, sizes);
+    }
+}
+
+/*
+ * Operations on a resolved inode, shared by the two frontends: a1fs.c, which
+ * is given paths, and a1fs_ll.c, which is given inode numbers. Each takes
+ * the lock of the inode itself and points rq->path_inode at it for the
+ * helpers above. They return -errno on error.
+ */
+
+/**
+ * Map the image and set up the file system context for mounting.
+ *
+ * @return  true on success; false on failure.
+ */
+bool fs_mount(fs_ctx *fs, a1fs_opts *opts)
+{
+    size_t size;
+    void *image = map_file(opts->img_path, A1FS_BLOCK_SIZE, &size);
+    if (!image)
+        return false;
+
+    //Metadata left half written by a crash is put back first
+    int replayed = journal_replay(image, size);
+    if (replayed < 0)
+    {
+        fprintf(stderr, "The journal is corrupt\n");
+        munmap(image, size);
+        return false;
+    }
+    if (replayed > 0)
+        fprintf(stderr, "Replayed %d journal transactions\n", replayed);
+
+    //Without it, read_buf() and write_buf() copy all the data in memory
+    int fd = open(opts->img_path, O_RDWR);
+    if (!fs_ctx_init(fs, image, size) || !journal_open(&fs->journal, image, size, fd, data_blks_release, fs))
+    {
+        if (fd >= 0)
+            close(fd);
+        fs_ctx_destroy(fs);
+        munmap(image, size);
+        return false;
+    }
+    fs->image_fd = fd;
+    //Files that were still open when the file system went down
+    orphans_free(fs);
+    fs->zero_holes = opts->zero_holes;
+    fs->online_discard = opts->discard;
+    fs->cache_timeout = opts->cache_timeout;
+    fs->writeback_cache = opts->writeback_cache;
+    return true;
+}
+
+/** Write out everything still in memory and release what fs_mount() set up. */
+void fs_unmount(fs_ctx *fs)
+{
+    if (fs->image)
+    {
+        void *image = fs->image;
+        size_t size = fs->size;
+        orphans_free(fs);
+        delalloc_flush_all(fs);
+        //Gives back the blocks the journal holds while there are groups to take them
+        journal_force(&fs->journal);
+        notify_stop(&fs->notify);
+        discard_stop(&fs->discard);
+        int fd = fs->image_fd;
+        fs_ctx_destroy(fs);
+        //Takes in what fs_ctx_destroy() wrote back, such as the free counters
+        journal_close(&fs->journal);
+        if (fd >= 0)
+            close(fd);
+        munmap(image, size);
+    }
+}
+
+/** Fill in the statvfs() fields that a1fs keeps. */
+void fs_statfs(fs_ctx *fs, struct statvfs *st)
+{
+    memset(st, 0, sizeof(*st));
+    st->f_bsize = A1FS_BLOCK_SIZE;
+    st->f_frsize = A1FS_BLOCK_SIZE;
+    uint64_t free_blocks, free_inodes;
+    fs_count_free(fs, &free_blocks, &free_inodes);
+    //Blocks freed by transactions that are not on disk yet are free at the next commit
+    free_blocks += journal_held(&fs->journal);
+    //Blocks promised to data that is not on disk yet are not free
+    uint64_t reserved = delalloc_reserved(&fs->delalloc);
+    free_blocks = (free_blocks > reserved) ? free_blocks - reserved : 0;
+    st->f_ffree = free_inodes;
+    st->f_favail = free_inodes;
+    st->f_blocks = fs->size / A1FS_BLOCK_SIZE;
+    st->f_bfree = free_blocks;
+    st->f_bavail = free_blocks;
+    st->f_files = fs->bblk->num_inodes;
+    st->f_namemax = A1FS_NAME_MAX;
+}
+
+/**
+ * Get one of the read-only user.a1fs.* statistics attributes as a decimal
+ * number without a trailing newline.
+ *
+ * @return  size of the value on success; -ENODATA or -ERANGE on error.
+ */
+int fs_getxattr(fs_ctx *fs, const char *name, char *value, size_t size)
+{
+    uint64_t stat;
+
+    if (strcmp(name, "user.a1fs.dcache_hits") == 0)
+        stat = __atomic_load_n(&fs->dcache.hits, __ATOMIC_RELAXED);
+    else if (strcmp(name, "user.a1fs.dcache_misses") == 0)
+        stat = __atomic_load_n(&fs->dcache.misses, __ATOMIC_RELAXED);
+    else if (strcmp(name, "user.a1fs.bloom_negatives") == 0)
+        stat = __atomic_load_n(&fs->bloom.negatives, __ATOMIC_RELAXED);
+    else if (strcmp(name, "user.a1fs.discarded_blocks") == 0)
+        stat = discard_count(&fs->discard);
+    else
+        return -ENODATA;
+
+    char str[32];
+    int len = snprintf(str, sizeof(str), "%lu", (unsigned long)stat);
+    if (size == 0)
+        return len;
+    if ((size_t)len > size)
+        return -ERANGE;
+    memcpy(value, str, len);
+    return len;
+}
+
+/**
+ * Fill in the lstat() fields that a1fs keeps. st_ino is the inode number.
+ * The caller must hold the lock of inode.
+ */
+void inode_stat(fs_req *rq, a1fs_inode *inode, struct stat *st)
+{
+    memset(st, 0, sizeof(*st));
+    st->st_nlink = inode->links;
+    st->st_size = inode->size;
+    st->st_mtim = inode->mtime;
+    st->st_ino = inode->hz_inode_pos;
+    st->st_mode = inode->mode;
+    //Holes take no space, and small files only their fragments
+    st->st_blocks = (blkcnt_t)inode_data_blocks(rq, inode) * (A1FS_BLOCK_SIZE / 512);
+    if (frag_data(inode))
+        st->st_blocks = ((blkcnt_t)frag_count(inode->size) * A1FS_FRAG_SIZE + 511) / 512;
+}
+
+/** Set the mtime of inode as utimensat() would; UTIME_NOW and UTIME_OMIT are honoured. */
+void inode_set_mtime(fs_req *rq, a1fs_inode *inode, const struct timespec *mtime)
+{
+    inode_wrlock(rq->fs, inode->hz_inode_pos);
+    if (mtime->tv_nsec == UTIME_NOW)
+        clock_gettime(CLOCK_REALTIME, &(inode->mtime));
+    else if (mtime->tv_nsec != UTIME_OMIT)
+        inode->mtime = *mtime;
+    notify_inode(&rq->fs->notify, inode->hz_inode_pos, -1);
+    inode_unlock(rq->fs, inode->hz_inode_pos);
+}
+
+/** Change the size of a file; a file that grows is filled with zeros. */
+int file_truncate(fs_req *rq, a1fs_inode *inode, off_t size)
+{
+    rq->err_code = 0;
+    rq->path_inode = inode;
+    if (size < 0)
+        return -EINVAL;
+    if ((uint64_t)size > A1FS_FILE_SIZE_MAX)
+        return -EFBIG;
+    inode_wrlock(rq->fs, inode->hz_inode_pos);
+    inode->hz_flags &= ~A1FS_INODE_KEEP_PREALLOC;
+    //Cached pages past the smaller of the two sizes are stale
+    off_t changed = ((uint64_t)size < inode->size) ? size : (off_t)inode->size;
+    if ((uint64_t)size > inode->size)
+    {
+        check_byte(rq, size - inode->size, size - inode->size);
+    }
+    else if ((uint64_t)size < inode->size)
+    {
+        blk_deallocation(rq, inode, size);
+    }
+    if (rq->err_code == 0)
+    {
+        clock_gettime(CLOCK_REALTIME, &(inode->mtime));
+        notify_inode(&rq->fs->notify, inode->hz_inode_pos, changed);
+    }
+    inode_unlock(rq->fs, inode->hz_inode_pos);
+    if (space_retry(rq))
+        return file_truncate(rq, inode, size);
+
+    return rq->err_code;
+}
+
+/**
+ * An open file, kept in fi->fh: the inode is resolved once, at open(), and
+ * the extent cursor and the position of the last access carry over from one
+ * read or write to the next.
+ */
+typedef struct fhandle {
+    a1fs_inode *inode;
+    /** Protects the fields below; reads through one handle may run at once. */
+    pthread_mutex_t lock;
+    ext_cursor cur;
+    /** Where the last read or write ended. */
+    off_t next;
+    /** Number of reads and writes in a row that started where the last one ended. */
+    unsigned int seq;
+
+} fhandle;
+
+/** Open inode; returns NULL if out of memory. */
+fhandle *handle_new(a1fs_inode *inode)
+{
+    fhandle *fh = malloc(sizeof(fhandle));
+    if (fh == NULL)
+        return NULL;
+    fh->inode = inode;
+    pthread_mutex_init(&fh->lock, NULL);
+    fh->cur.valid = false;
+    fh->next = 0;
+    fh->seq = 0;
+    return fh;
+}
+
+void handle_free(fhandle *fh)
+{
+    pthread_mutex_destroy(&fh->lock);
+    free(fh);
+}
+
+/**
+ * Start a read or write of size bytes at offset through fh: rq gets the
+ * cursor of the handle. Returns true if the access is sequential, that is
+ * it starts where the last one ended.
+ */
+bool handle_get(fs_req *rq, fhandle *fh, off_t offset, size_t size)
+{
+    pthread_mutex_lock(&fh->lock);
+    rq->cur = fh->cur;
+    fh->seq = (offset == fh->next) ? fh->seq + 1 : 0;
+    fh->next = offset + size;
+    bool seq = fh->seq > 0;
+    pthread_mutex_unlock(&fh->lock);
+    return seq;
+}
+
+/** Finish an access started with handle_get(): fh keeps where rq left the cursor. */
+void handle_put(fs_req *rq, fhandle *fh)
+{
+    pthread_mutex_lock(&fh->lock);
+    if (rq->cur.valid)
+        fh->cur = rq->cur;
+    pthread_mutex_unlock(&fh->lock);
+}
+
+/** range_fn that asks for the pieces in the image to be read in. */
+void range_advise_fn(void *arg, char *data, size_t len)
+{
+    fs_ctx *fs = arg;
+    if (data == NULL || data < (char *)fs->image || data >= (char *)fs->image + fs->size)
+        return;
+    size_t skew = (uintptr_t)data % sysconf(_SC_PAGESIZE);
+    madvise(data - skew, len + skew, MADV_WILLNEED);
+}
+
+/**
+ * Start reading in the size bytes of inode past end, which a sequential
+ * reader is going to ask for next. The extent cursor of the request stays
+ * where the read left it. The caller must hold the lock of inode.
+ */
+void file_readahead(fs_req *rq, a1fs_inode *inode, uint64_t end, size_t size)
+{
+    if (end >= inode->size || small_data(rq, inode) != NULL)
+        return;
+    ext_cursor cur = rq->cur;
+    range_map(rq, inode, end, min(inode->size, end + size), range_advise_fn, rq->fs);
+    rq->cur = cur;
+}
+
+/**
+ * Read up to size bytes of a file at offset; returns the number of bytes
+ * read. Sequential reads also start reading in what comes next.
+ */
+int file_read(fs_req *rq, fhandle *fh, char *buf, size_t size, off_t offset)
+{
+    a1fs_inode *inode = fh->inode;
+    rq->path_inode = inode;
+    bool seq = handle_get(rq, fh, offset, size);
+    inode_rdlock(rq->fs, inode->hz_inode_pos);
+    int result_size = 0;
+    if (offset < (off_t)inode->size)
     {
+        //One memcpy per extent in the range
+        result_size = read_write_IO(true, rq, buf, size, offset);
+        if (seq)
+            file_readahead(rq, inode, offset + result_size, size);
+    }
+    inode_unlock(rq->fs, inode->hz_inode_pos);
+    handle_put(rq, fh);
 
-        fs->path_inode->size += sizess;
+    return result_size;
+}
+
+/**
+ * Leave a hole between the end of inode and offset, then make room for size
+ * bytes at offset, as zeros if zero is true. Stores any error in
+ * rq->err_code; -EFBIG if the file would be larger than A1FS_FILE_SIZE_MAX.
+ */
+void write_extend(fs_req *rq, a1fs_inode *inode, off_t offset, size_t size, bool zero)
+{
+    if ((uint64_t)offset + size > A1FS_FILE_SIZE_MAX)
+    {
+        rq->err_code = -EFBIG;
+        return;
+    }
+    check_byte(rq, get_num_byte(rq, offset), get_num_byte(rq, offset));
+    if (rq->err_code == 0 && get_num_byte(rq, offset + size) > 0)
+    {
+        if (zero)
+            zero_addition(rq, inode, get_num_byte(rq, offset + size));
+        else
+            byte_addition(rq, inode, get_num_byte(rq, offset + size));
     }
 }
-int read_write_IO(bool is_read, fs_ctx *fs, char *buf, size_t size, off_t offset)
+
+/** Write size bytes to a file at offset; returns size on success. */
+int file_write(fs_req *rq, fhandle *fh, const char *buf, size_t size, off_t offset)
+{
+    a1fs_inode *inode = fh->inode;
+    rq->err_code = 0;
+    rq->path_inode = inode;
+    //Check if size is empty
+    if (size == 0)
+        return 0;
+    handle_get(rq, fh, offset, size);
+    inode_wrlock(rq->fs, inode->hz_inode_pos);
+
+    //Blocks of zeros become (or stay) holes if the mount option is set
+    write_extend(rq, inode, offset, size, rq->fs->zero_holes && blk_all_zero(buf, size, offset));
+    if (rq->err_code == 0)
+        read_write_IO(false, rq, (char *)buf, size, offset);
+    if (rq->err_code == 0)
+        clock_gettime(CLOCK_REALTIME, &(inode->mtime));
+    inode_unlock(rq->fs, inode->hz_inode_pos);
+    handle_put(rq, fh);
+    if (space_retry(rq))
+        return file_write(rq, fh, buf, size, offset);
+
+    return (rq->err_code == 0) ? (int)size : rq->err_code;
+}
+
+/** The pieces of a byte range of a file as FUSE buffers; see range_map(). */
+typedef struct buf_list {
+    fs_ctx *fs;
+    /** Copy the pieces that are not in the image (and zeros) to new memory. */
+    bool copy;
+    /** Describe the pieces in the image by their place in the image file. */
+    bool fd;
+    struct fuse_bufvec *vec;
+    size_t cap;
+    /** Set if memory ran out; the pieces after it are missing. */
+    bool nomem;
+
+} buf_list;
+
+bool buf_list_init(buf_list *l, fs_ctx *fs, bool copy, bool fd)
+{
+    l->fs = fs;
+    l->copy = copy;
+    l->fd = fd;
+    l->cap = 4;
+    l->nomem = false;
+    l->vec = malloc(sizeof(struct fuse_bufvec) + (l->cap - 1) * sizeof(struct fuse_buf));
+    if (l->vec == NULL)
+        return false;
+    *l->vec = FUSE_BUFVEC_INIT(0);
+    l->vec->count = 0;
+    return true;
+}
+
+void buf_list_free(buf_list *l)
+{
+    for (size_t i = 0; l->copy && i < l->vec->count; i++)
+        if (!(l->vec->buf[i].flags & FUSE_BUF_IS_FD))
+            free(l->vec->buf[i].mem);
+    free(l->vec);
+}
+
+void buf_list_add(void *arg, char *data, size_t len)
 {
-    //Calculate the start/offset byte
-    int result_blk = 1;
-    if (offset)
+    buf_list *l = arg;
+    fs_ctx *fs = l->fs;
+    if (l->nomem)
+        return;
+    if (l->vec->count == l->cap)
     {
-        result_blk = 1 + offset / A1FS_BLOCK_SIZE;
-        if (offset % A1FS_BLOCK_SIZE == 0)
+        struct fuse_bufvec *vec = realloc(l->vec, sizeof(struct fuse_bufvec) + (2 * l->cap - 1) * sizeof(struct fuse_buf));
+        if (vec == NULL)
         {
-            result_blk = result_blk - 1;
+            l->nomem = true;
+            return;
         }
+        l->vec = vec;
+        l->cap *= 2;
     }
-    //Update extent
-    update_ext_blk(false, fs, fs->path_inode->hz_extent_p);
-    int trace = 0;
-    int k = 0;
-    //Loop over extent until find the target block
-    while (k < fs->path_inode->hz_extent_size && trace < result_blk)
+    struct fuse_buf *b = &l->vec->buf[l->vec->count];
+    *b = (struct fuse_buf){ .size = len, .flags = 0, .mem = data, .fd = -1, .pos = 0 };
+    if (data != NULL && l->fd && fs->image_fd >= 0 && data >= (char *)fs->image && data < (char *)fs->image + fs->size
+        && !journal_private(&fs->journal, data))
     {
-        trace += fs->ext[k].count;
-        k++;
+        //Blocks on disk are described by their place in the image file
+        b->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+        b->mem = NULL;
+        b->fd = fs->image_fd;
+        b->pos = data - (char *)fs->image;
     }
-    //Get Data block
-    int db = (k != fs->path_inode->hz_extent_size) ? (int)(fs->ext[k].start + (trace - result_blk)) : -1;
-
-    void *byte = (void *)update_ext_blk(true, fs, db) + offset % A1FS_BLOCK_SIZE;
-    //Check if is read or write
-    if (is_read)
+    else if (l->copy)
     {
-        //Get the byte
-        int rest_byte = point_to_end(fs->path_inode, fs) - byte;
-        int result_size = max(rest_byte, (int)size);
-        //Using memcpy to improve efficiency
-        memcpy(buf, byte, result_size);
-        if (result_size != (int)size)
+        b->mem = (data != NULL) ? malloc(len) : calloc(1, len);
+        if (b->mem == NULL)
         {
-            unsigned int temp = size - rest_byte;
-            memset(buf + rest_byte, 0, temp);
+            l->nomem = true;
+            return;
         }
-        return result_size;
+        if (data != NULL)
+            memcpy(b->mem, data, len);
     }
-    else
+    l->vec->count++;
+}
+
+/**
+ * Describe up to size bytes of a file at offset as a list of buffers in l.
+ * With splice, the data is sent without copying: the extents in the range
+ * are ranges of the image file, and only holes and data not on disk yet are
+ * copied to memory. The lock of the file is then still held, so that the
+ * blocks are not freed and reused before they are sent, and the caller calls
+ * file_read_buf_done() once they are. Without splice, all the data is copied
+ * to memory, and the caller frees the list with buf_list_free(). Past the
+ * end of the file, the list is one empty buffer.
+ */
+int file_read_buf(fs_req *rq, fhandle *fh, buf_list *l, size_t size, off_t offset, bool splice)
+{
+    a1fs_inode *inode = fh->inode;
+    rq->path_inode = inode;
+    if (!buf_list_init(l, rq->fs, true, splice))
+        return -ENOMEM;
+    bool seq = handle_get(rq, fh, offset, size);
+    inode_rdlock(rq->fs, inode->hz_inode_pos);
+    if (offset < (off_t)inode->size)
     {
-        memcpy(byte, buf, size);
+        uint64_t end = offset + min(inode->size - offset, size);
+        range_map(rq, inode, offset, end, buf_list_add, l);
+        if (seq)
+            file_readahead(rq, inode, end, size);
     }
+    if (!splice || l->nomem)
+        inode_unlock(rq->fs, inode->hz_inode_pos);
+    handle_put(rq, fh);
+
+    if (l->nomem)
+    {
+        buf_list_free(l);
+        return -ENOMEM;
+    }
+    //Past the end of the file: one empty buffer
+    if (l->vec->count == 0)
+        *l->vec = FUSE_BUFVEC_INIT(0);
     return 0;
 }
 
-int get_num_byte(fs_ctx *fs, unsigned int offset_size)
+/** Finish a read with file_read_buf() with splice once the data is sent. */
+void file_read_buf_done(fs_req *rq, fhandle *fh, buf_list *l)
 {
-    return offset_size - fs->path_inode->size;
+    inode_unlock(rq->fs, fh->inode->hz_inode_pos);
+    buf_list_free(l);
 }
 
-void check_byte(fs_ctx *fs, int sizes, int condition)
+/**
+ * Write the data in buf to a file at offset without copying it: the file is
+ * extended and the range given disk blocks as for file_write(), and then
+ * the data is spliced straight into the extents in the image file. With
+ * -o zero_holes, the data has to be looked at, so it is copied to memory
+ * and written with file_write(). Returns the number of bytes written.
+ */
+int file_write_buf(fs_req *rq, fhandle *fh, struct fuse_bufvec *buf, off_t offset)
 {
-    if (condition > 0)
+    a1fs_inode *inode = fh->inode;
+    rq->err_code = 0;
+    rq->path_inode = inode;
+    size_t size = fuse_buf_size(buf);
+    if (size == 0)
+        return 0;
+    if (rq->fs->zero_holes)
+    {
+        struct fuse_bufvec mem = FUSE_BUFVEC_INIT(size);
+        mem.buf[0].mem = malloc(size);
+        if (mem.buf[0].mem == NULL)
+            return -ENOMEM;
+        ssize_t got = fuse_buf_copy(&mem, buf, 0);
+        int ret = (got < 0) ? (int)got : file_write(rq, fh, mem.buf[0].mem, got, offset);
+        free(mem.buf[0].mem);
+        return ret;
+    }
+
+    handle_get(rq, fh, offset, size);
+    inode_wrlock(rq->fs, inode->hz_inode_pos);
+    ssize_t got = 0;
+    write_extend(rq, inode, offset, size, false);
+    if (rq->err_code == 0)
+        range_write_prepare(rq, inode, offset, offset + size);
+    buf_list l;
+    if (rq->err_code == 0 && !buf_list_init(&l, rq->fs, false, true))
+        rq->err_code = -ENOMEM;
+    if (rq->err_code == 0)
+    {
+        range_map(rq, inode, offset, offset + size, buf_list_add, &l);
+        got = l.nomem ? -ENOMEM : fuse_buf_copy(l.vec, buf, FUSE_BUF_SPLICE_MOVE);
+        rq->err_code = (got < 0) ? (int)got : 0;
+        buf_list_free(&l);
+    }
+    if (rq->err_code == 0)
+        clock_gettime(CLOCK_REALTIME, &(inode->mtime));
+    inode_unlock(rq->fs, inode->hz_inode_pos);
+    handle_put(rq, fh);
+    //Nothing was taken from buf yet
+    if (got == 0 && space_retry(rq))
+        return file_write_buf(rq, fh, buf, offset);
+
+    return (rq->err_code == 0) ? (int)got : rq->err_code;
+}
+
+/** Write the pieces of a file in l that are in the image to disk. */
+bool buf_list_flush(buf_list *l)
+{
+    fs_ctx *fs = l->fs;
+    //Pieces are missing; flush them all
+    if (l->nomem)
+        return msync(fs->image, fs->size, MS_SYNC) == 0;
+    long page = sysconf(_SC_PAGESIZE);
+    for (size_t i = 0; i < l->vec->count; i++)
+    {
+        struct fuse_buf *b = &l->vec->buf[i];
+        char *data = (b->flags & FUSE_BUF_IS_FD) ? (char *)fs->image + b->pos : b->mem;
+        if (data == NULL || data < (char *)fs->image || data >= (char *)fs->image + fs->size)
+            continue;
+        size_t skew = (uintptr_t)data % page;
+        if (msync(data - skew, b->size + skew, MS_SYNC) != 0)
+            return false;
+    }
+    return true;
+}
+
+/** What file_sync() does: for flush(), for release() and for fsync(). */
+#define SYNC_FLUSH 0
+#define SYNC_RELEASE 1
+#define SYNC_FSYNC 2
+
+/**
+ * Allocate the blocks written to a file that only exist in memory so far.
+ * SYNC_RELEASE also trims the blocks allocated past its end. With
+ * SYNC_FSYNC, an image with a journal also gets the data of the file on disk,
+ * and then the metadata of everything done so far, with the commit that
+ * other fsync() calls may be waiting for too.
+ */
+int file_sync(fs_req *rq, a1fs_inode *inode, int mode)
+{
+    rq->err_code = 0;
+    rq->path_inode = inode;
+    inode_wrlock(rq->fs, inode->hz_inode_pos);
+    delalloc_flush(rq, inode, false);
+    if (rq->err_code == 0 && mode == SYNC_RELEASE && S_ISREG(inode->mode)
+        && !(inode->hz_flags & A1FS_INODE_KEEP_PREALLOC))
+        blk_deallocation(rq, inode, inode->size);
+    //The data is flushed once the lock is dropped, so as not to hold up commits
+    buf_list l;
+    bool flush = mode == SYNC_FSYNC && rq->err_code == 0 && rq->fs->journal.enabled;
+    if (flush && !buf_list_init(&l, rq->fs, false, true))
+    {
+        flush = false;
+        rq->err_code = -ENOMEM;
+    }
+    if (flush)
+        range_map(rq, inode, 0, inode->size, buf_list_add, &l);
+    inode_unlock(rq->fs, inode->hz_inode_pos);
+
+    if (flush)
+    {
+        if (!buf_list_flush(&l) || !journal_force(&rq->fs->journal))
+            rq->err_code = -EIO;
+        buf_list_free(&l);
+    }
+    if (space_retry(rq))
+        return file_sync(rq, inode, mode);
+    return rq->err_code;
+}
+
+/**
+ * Allocate space for a file, or punch a hole in it, as fallocate() does for
+ * mode 0, FALLOC_FL_KEEP_SIZE and FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE.
+ */
+int file_fallocate(fs_req *rq, a1fs_inode *inode, int mode, off_t offset, off_t length)
+{
+    rq->err_code = 0;
+    rq->path_inode = inode;
+    if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE))
+        return -EOPNOTSUPP;
+    //A hole can't be punched past the end of the file
+    if ((mode & FALLOC_FL_PUNCH_HOLE) && !(mode & FALLOC_FL_KEEP_SIZE))
+        return -EOPNOTSUPP;
+    if (offset < 0 || length <= 0)
+        return -EINVAL;
+    uint64_t end = (uint64_t)offset + length;
+    if (end > A1FS_FILE_SIZE_MAX && !(mode & FALLOC_FL_PUNCH_HOLE))
+        return -EFBIG;
+    inode_wrlock(rq->fs, inode->hz_inode_pos);
+    if (mode & FALLOC_FL_PUNCH_HOLE)
     {
-        int free_space = get_free_space(fs);
-        if (sizes - free_space > 0)
+        if (S_ISREG(inode->mode))
         {
-            size_t blk_size = A1FS_BLOCK_SIZE;
-            unsigned int result = 1 + (sizes - free_space) / blk_size;
-            if ((sizes - free_space) % blk_size == 0)
-            {
-                result = result - 1;
-            }
-            load_datablock(fs->path_inode, result, fs);
+            file_punch(rq, inode, offset, end);
+            clock_gettime(CLOCK_REALTIME, &(inode->mtime));
         }
-        fs->path_inode->size += sizes;
+        inode_unlock(rq->fs, inode->hz_inode_pos);
+        return 0;
+    }
+    file_prealloc(rq, inode, offset / A1FS_BLOCK_SIZE, div_round_up(end, A1FS_BLOCK_SIZE));
+    if (rq->err_code == 0 && (mode & FALLOC_FL_KEEP_SIZE))
+    {
+        if (end > inode->size)
+            inode->hz_flags |= A1FS_INODE_KEEP_PREALLOC;
+    }
+    else if (rq->err_code == 0 && end > inode->size)
+    {
+        //The blocks are there already; this only zeroes the tail of the last one
+        zero_addition(rq, inode, end - inode->size);
+        clock_gettime(CLOCK_REALTIME, &(inode->mtime));
     }
+    inode_unlock(rq->fs, inode->hz_inode_pos);
+    if (space_retry(rq))
+        return file_fallocate(rq, inode, mode, offset, length);
+
+    return rq->err_code;
+}
+
+/** Find data (or a hole, if data is false) in a file, as lseek() does. */
+off_t file_seek(fs_req *rq, a1fs_inode *inode, off_t off, bool data)
+{
+    rq->path_inode = inode;
+    inode_rdlock(rq->fs, inode->hz_inode_pos);
+    off_t res = seek_data_hole(rq, inode, off, data);
+    inode_unlock(rq->fs, inode->hz_inode_pos);
+
+    return res;
 }
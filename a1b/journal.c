@@ -0,0 +1,1015 @@
+/**
+ * a1fs metadata journal implementation.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bitmap.h"
+#include "journal.h"
+
+
+/** Number of handles the calling thread has open. */
+static __thread unsigned int handle_depth;
+
+#define SUM_INIT 0xcbf29ce484222325ul
+
+/** Fold a block into a running checksum, a word at a time. */
+static uint64_t blk_sum(uint64_t sum, const void *blk)
+{
+	const uint64_t *w = blk;
+	for (size_t i = 0; i < A1FS_BLOCK_SIZE / sizeof(uint64_t); i++)
+		sum = (sum ^ w[i]) * 0x100000001b3ul;
+	return sum;
+}
+
+/** Write bytes [p, p + len) of the mapping to disk and wait for them. */
+static bool flush(void *p, size_t len)
+{
+	size_t skew = (uintptr_t)p % sysconf(_SC_PAGESIZE);
+	return msync((char *)p - skew, len + skew, MS_SYNC) == 0;
+}
+
+/** Write len bytes of buf at offset off of a file. */
+static bool write_at(int fd, const char *buf, size_t len, off_t off)
+{
+	while (len > 0)
+	{
+		ssize_t n = pwrite(fd, buf, len, off);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		buf += n;
+		len -= n;
+		off += n;
+	}
+	return true;
+}
+
+/** Map blocks [blk, blk + n) of the image private, or shared again, where they are. */
+static bool blk_remap(journal *j, uint32_t blk, uint32_t n, bool private)
+{
+	int flags = (private ? MAP_PRIVATE : MAP_SHARED) | MAP_FIXED;
+	return mmap(j->image + (size_t)blk * A1FS_BLOCK_SIZE, (size_t)n * A1FS_BLOCK_SIZE, PROT_READ | PROT_WRITE,
+	            flags, j->fd, (off_t)blk * A1FS_BLOCK_SIZE) != MAP_FAILED;
+}
+
+/** Number of data-area blocks, the bits of j->private_map. */
+static uint32_t data_blocks(journal *j)
+{
+	return j->size / A1FS_BLOCK_SIZE - j->data_head;
+}
+
+/**
+ * Write a committed image of blk to its place in the image file. A data-area
+ * block that is not private any more has been freed, and may hold file data
+ * already, so it is left alone.
+ */
+static bool blk_write(journal *j, uint32_t blk, const char *img)
+{
+	bool ok = true;
+	pthread_mutex_lock(&j->lock);
+	if (blk < j->start || (blk >= j->data_head && bitmap_test(j->private_map, blk - j->data_head)))
+		ok = write_at(j->fd, img, A1FS_BLOCK_SIZE, (off_t)blk * A1FS_BLOCK_SIZE);
+	pthread_mutex_unlock(&j->lock);
+	return ok;
+}
+
+static a1fs_journal_block *log_blk(char *log, uint32_t pos)
+{
+	return (a1fs_journal_block *)(log + (size_t)pos * A1FS_BLOCK_SIZE);
+}
+
+/**
+ * Number of blocks, commit block included, of transaction seq if it starts
+ * at block pos of the log and is complete; 0 otherwise.
+ *
+ * @param nblocks    number of blocks of the journal.
+ * @param jstart     first block of the journal in the image.
+ * @param fs_blocks  number of blocks of the image.
+ */
+static uint32_t txn_check(char *log, uint32_t nblocks, uint32_t pos, uint64_t seq,
+                          uint32_t jstart, uint64_t fs_blocks)
+{
+	uint64_t sum = SUM_INIT;
+	uint32_t p = pos;
+	for (;;)
+	{
+		if (p >= nblocks)
+			return 0;
+		a1fs_journal_block *b = log_blk(log, p);
+		if (b->magic != A1FS_JOURNAL_MAGIC || b->seq != seq)
+			return 0;
+		if (b->type == A1FS_JOURNAL_COMMIT)
+			return (p > pos && b->count == p - pos && b->sum == sum) ? p + 1 - pos : 0;
+		if (b->type != A1FS_JOURNAL_DESC || b->count > A1FS_JOURNAL_TAGS)
+			return 0;
+		sum = blk_sum(sum, b);
+		a1fs_journal_tag *tags = (a1fs_journal_tag *)(b + 1);
+		uint32_t count = b->count;
+		p++;
+		for (uint32_t i = 0; i < count; i++)
+		{
+			//Images never go over the journal itself
+			if (tags[i].blk >= fs_blocks || (tags[i].blk >= jstart && tags[i].blk < jstart + nblocks))
+				return 0;
+			if (tags[i].flags & A1FS_JOURNAL_REVOKE)
+				continue;
+			if (p >= nblocks)
+				return 0;
+			sum = blk_sum(sum, log_blk(log, p));
+			p++;
+		}
+	}
+}
+
+/** Called for each tag of a transaction, with the image; NULL for a revoke. */
+typedef void (*tag_fn)(void *arg, const a1fs_journal_tag *tag, const char *img, uint64_t seq);
+
+/** Call fn for each tag of the complete transaction at block pos of the log. */
+static void txn_for_each(char *log, uint32_t pos, tag_fn fn, void *arg)
+{
+	a1fs_journal_block *b = log_blk(log, pos);
+	while (b->type == A1FS_JOURNAL_DESC)
+	{
+		const a1fs_journal_tag *tags = (const a1fs_journal_tag *)(b + 1);
+		const char *img = (const char *)b + A1FS_BLOCK_SIZE;
+		for (uint32_t i = 0; i < b->count; i++)
+		{
+			if (tags[i].flags & A1FS_JOURNAL_REVOKE)
+			{
+				fn(arg, &tags[i], NULL, b->seq);
+				continue;
+			}
+			fn(arg, &tags[i], img, b->seq);
+			img += A1FS_BLOCK_SIZE;
+		}
+		b = (a1fs_journal_block *)img;
+	}
+}
+
+/** A block revoked by a transaction in the log. */
+typedef struct revoke_rec {
+	uint32_t blk;
+	uint64_t seq;
+
+} revoke_rec;
+
+typedef struct replay_state {
+	char *image;
+	/** Journal of the mounted image, whose file the images go to; NULL at mount. */
+	journal *j;
+	bool failed;
+	/** Revoked blocks; sorted by block, then transaction, before the images are copied. */
+	revoke_rec *revokes;
+	uint32_t count;
+	uint32_t cap;
+	bool nomem;
+
+} replay_state;
+
+static int revoke_cmp(const void *a, const void *b)
+{
+	const revoke_rec *x = a, *y = b;
+	if (x->blk != y->blk)
+		return (x->blk > y->blk) - (x->blk < y->blk);
+	return (x->seq > y->seq) - (x->seq < y->seq);
+}
+
+static void replay_revoke_fn(void *arg, const a1fs_journal_tag *tag, const char *img, uint64_t seq)
+{
+	replay_state *rs = arg;
+	if (img != NULL || rs->nomem)
+		return;
+	if (rs->count == rs->cap)
+	{
+		uint32_t cap = (rs->cap > 0) ? rs->cap * 2 : 64;
+		revoke_rec *revokes = realloc(rs->revokes, cap * sizeof(revoke_rec));
+		if (revokes == NULL)
+		{
+			rs->nomem = true;
+			return;
+		}
+		rs->revokes = revokes;
+		rs->cap = cap;
+	}
+	rs->revokes[rs->count++] = (revoke_rec){ .blk = tag->blk, .seq = seq };
+}
+
+/** Whether blk is revoked by transaction seq or a later one. */
+static bool replay_revoked(replay_state *rs, uint32_t blk, uint64_t seq)
+{
+	//Last record of blk, which has its latest transaction
+	uint32_t lo = 0, hi = rs->count;
+	while (lo < hi)
+	{
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (rs->revokes[mid].blk <= blk)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo > 0 && rs->revokes[lo - 1].blk == blk && rs->revokes[lo - 1].seq >= seq;
+}
+
+static void replay_image_fn(void *arg, const a1fs_journal_tag *tag, const char *img, uint64_t seq)
+{
+	replay_state *rs = arg;
+	if (img == NULL || replay_revoked(rs, tag->blk, seq))
+		return;
+	if (rs->j == NULL)
+		memcpy(rs->image + (size_t)tag->blk * A1FS_BLOCK_SIZE, img, A1FS_BLOCK_SIZE);
+	else if (!blk_write(rs->j, tag->blk, img))
+		rs->failed = true;
+}
+
+/**
+ * Copy the images of the complete transactions in the log, from the one its
+ * header names on, to their place: in rs->image, or in the image file of
+ * rs->j. Returns the number of transactions; -1 if the log can't be read
+ * for lack of memory, or if writing failed.
+ */
+static int log_apply(char *log, uint32_t nblocks, uint32_t jstart, uint64_t fs_blocks, replay_state *rs)
+{
+	//Find the complete transactions and the blocks they revoke
+	a1fs_journal_block *hdr = log_blk(log, 0);
+	uint64_t seq = hdr->seq;
+	uint32_t pos = 1, len;
+	while ((len = txn_check(log, nblocks, pos, seq, jstart, fs_blocks)) > 0)
+	{
+		txn_for_each(log, pos, replay_revoke_fn, rs);
+		pos += len;
+		seq++;
+	}
+	if (rs->nomem)
+	{
+		free(rs->revokes);
+		return -1;
+	}
+	if (rs->count > 0)
+		qsort(rs->revokes, rs->count, sizeof(revoke_rec), revoke_cmp);
+
+	//Copy the images in order
+	pos = 1;
+	for (uint64_t s = hdr->seq; s < seq; s++)
+	{
+		len = txn_check(log, nblocks, pos, s, jstart, fs_blocks);
+		txn_for_each(log, pos, replay_image_fn, rs);
+		pos += len;
+	}
+	free(rs->revokes);
+	return rs->failed ? -1 : (int)(seq - hdr->seq);
+}
+
+int journal_replay(void *image, size_t size)
+{
+	a1fs_superblock *sb = image;
+	if (sb->magic != A1FS_MAGIC || !(sb->hz_features & A1FS_FEATURE_JOURNAL))
+		return 0;
+	uint64_t fs_blocks = size / A1FS_BLOCK_SIZE;
+	uint32_t nblocks = sb->hz_journal_blocks;
+	if (nblocks < 2 || (uint64_t)sb->hz_journal + nblocks > fs_blocks)
+		return -1;
+	char *log = (char *)image + (size_t)sb->hz_journal * A1FS_BLOCK_SIZE;
+	a1fs_journal_block *hdr = log_blk(log, 0);
+	if (hdr->magic != A1FS_JOURNAL_MAGIC || hdr->type != A1FS_JOURNAL_HEADER)
+		return -1;
+
+	//The images must be on disk before the log is emptied
+	replay_state rs = { .image = image };
+	int count = log_apply(log, nblocks, sb->hz_journal, fs_blocks, &rs);
+	if (count <= 0)
+		return count;
+	if (!flush(image, size))
+		return -1;
+	hdr->seq += count;
+	return flush(hdr, A1FS_BLOCK_SIZE) ? count : -1;
+}
+
+bool journal_open(journal *j, void *image, size_t size, int fd, journal_free_fn free_fn, void *arg)
+{
+	memset(j, 0, sizeof(*j));
+	j->free_fn = free_fn;
+	j->free_arg = arg;
+	a1fs_superblock *sb = image;
+	if (!(sb->hz_features & A1FS_FEATURE_JOURNAL))
+		return true;
+	if (fd < 0 || sysconf(_SC_PAGESIZE) != A1FS_BLOCK_SIZE)
+	{
+		fprintf(stderr, "The journal needs the image file mapped a block at a time\n");
+		return false;
+	}
+	j->image = image;
+	j->size = size;
+	j->fd = fd;
+	j->start = sb->hz_journal;
+	j->nblocks = sb->hz_journal_blocks;
+	j->data_head = sb->hz_datablk_head;
+	j->shadow = malloc((size_t)j->start * A1FS_BLOCK_SIZE);
+	//Whole words, for the bitmap functions
+	j->private_map = calloc((data_blocks(j) + 63) / 64, sizeof(uint64_t));
+	if (j->shadow == NULL || j->private_map == NULL)
+		return false;
+	memcpy(j->shadow, j->image, (size_t)j->start * A1FS_BLOCK_SIZE);
+	//Changes before the journal reach the image file only from the log
+	if (!blk_remap(j, 0, j->start, true))
+		return false;
+	j->seq = log_blk(j->image + (size_t)j->start * A1FS_BLOCK_SIZE, 0)->seq;
+	j->head = 1;
+	j->running = 1;
+	j->committed = 0;
+	pthread_mutex_init(&j->lock, NULL);
+	pthread_cond_init(&j->cond, NULL);
+	j->enabled = true;
+	return true;
+}
+
+static uint32_t entry_slot(journal *j, uint32_t blk)
+{
+	uint32_t i = (blk * 2654435761u) & (j->cap - 1);
+	while (j->entries[i].blk != 0 && j->entries[i].blk != blk)
+		i = (i + 1) & (j->cap - 1);
+	return i;
+}
+
+/**
+ * Entry of blk in the running transaction, added with state 0 if absent and
+ * add is true. Returns NULL if absent, or if out of memory.
+ */
+static journal_entry *entry_get(journal *j, uint32_t blk, bool add)
+{
+	if (j->cap > 0)
+	{
+		journal_entry *e = &j->entries[entry_slot(j, blk)];
+		if (e->blk == blk)
+			return e;
+	}
+	if (!add)
+		return NULL;
+	if (2 * (j->nentries + 1) > j->cap)
+	{
+		uint32_t cap = (j->cap > 0) ? j->cap * 2 : 64;
+		journal_entry *entries = calloc(cap, sizeof(journal_entry));
+		if (entries == NULL)
+			return NULL;
+		journal_entry *old = j->entries;
+		uint32_t old_cap = j->cap;
+		j->entries = entries;
+		j->cap = cap;
+		for (uint32_t i = 0; i < old_cap; i++)
+			if (old[i].blk != 0)
+				j->entries[entry_slot(j, old[i].blk)] = old[i];
+		free(old);
+	}
+	journal_entry *e = &j->entries[entry_slot(j, blk)];
+	e->blk = blk;
+	e->state = 0;
+	j->nentries++;
+	return e;
+}
+
+/** Index of the first logged block >= blk. */
+static uint32_t logged_find(journal *j, uint32_t blk)
+{
+	uint32_t lo = 0, hi = j->nlogged;
+	while (lo < hi)
+	{
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (j->logged[mid] < blk)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static bool logged_has(journal *j, uint32_t blk)
+{
+	uint32_t i = logged_find(j, blk);
+	return i < j->nlogged && j->logged[i] == blk;
+}
+
+static int blk_cmp(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+	return (x > y) - (x < y);
+}
+
+/**
+ * Note the data-area blocks of the commit buffers as logged, keeping the
+ * list sorted. Returns false if out of memory.
+ */
+static bool logged_add_commit(journal *j)
+{
+	uint32_t n = j->nlogged;
+	for (uint32_t i = 0; i < j->ntags; i++)
+	{
+		if (j->tags[i].blk < j->data_head || (j->tags[i].flags & A1FS_JOURNAL_REVOKE))
+			continue;
+		if (n == j->logged_cap)
+		{
+			uint32_t cap = (j->logged_cap > 0) ? j->logged_cap * 2 : 64;
+			uint32_t *logged = realloc(j->logged, cap * sizeof(uint32_t));
+			if (logged == NULL)
+				return false;
+			j->logged = logged;
+			j->logged_cap = cap;
+		}
+		j->logged[n++] = j->tags[i].blk;
+	}
+	if (n == 0)
+		return true;
+	qsort(j->logged, n, sizeof(uint32_t), blk_cmp);
+	j->nlogged = 0;
+	for (uint32_t i = 0; i < n; i++)
+		if (j->nlogged == 0 || j->logged[j->nlogged - 1] != j->logged[i])
+			j->logged[j->nlogged++] = j->logged[i];
+	return true;
+}
+
+/** Add a tag to the commit buffers, with the image of blk unless it is a revoke. */
+static bool tag_add(journal *j, uint32_t blk, uint32_t flags)
+{
+	if (j->ntags == j->tags_cap)
+	{
+		uint32_t cap = (j->tags_cap > 0) ? j->tags_cap * 2 : 64;
+		a1fs_journal_tag *tags = realloc(j->tags, cap * sizeof(a1fs_journal_tag));
+		if (tags == NULL)
+			return false;
+		j->tags = tags;
+		char *images = realloc(j->images, (size_t)cap * A1FS_BLOCK_SIZE);
+		if (images == NULL)
+			return false;
+		j->images = images;
+		j->tags_cap = cap;
+	}
+	j->tags[j->ntags] = (a1fs_journal_tag){ .blk = blk, .flags = flags };
+	if (!(flags & A1FS_JOURNAL_REVOKE))
+		memcpy(j->images + (size_t)j->ntags * A1FS_BLOCK_SIZE, j->image + (size_t)blk * A1FS_BLOCK_SIZE, A1FS_BLOCK_SIZE);
+	j->ntags++;
+	return true;
+}
+
+/**
+ * Copy the blocks changed by the running transaction to the commit buffers,
+ * with revokes for the freed blocks that are in the log. Called with j->lock
+ * held and no handle open. Returns false if memory ran out, leaving the
+ * buffers incomplete.
+ */
+static bool txn_copy(journal *j)
+{
+	bool ok = true;
+	j->ntags = 0;
+	for (uint32_t b = 0; b < j->start; b++)
+	{
+		char *cur = j->image + (size_t)b * A1FS_BLOCK_SIZE;
+		char *old = j->shadow + (size_t)b * A1FS_BLOCK_SIZE;
+		if (memcmp(cur, old, A1FS_BLOCK_SIZE) != 0)
+		{
+			memcpy(old, cur, A1FS_BLOCK_SIZE);
+			ok = tag_add(j, b, 0) && ok;
+		}
+	}
+	for (uint32_t i = 0; i < j->cap; i++)
+	{
+		journal_entry *e = &j->entries[i];
+		if (e->blk == 0)
+			continue;
+		if (e->state == JOURNAL_DIRTY)
+			ok = tag_add(j, e->blk, 0) && ok;
+		else if (logged_has(j, e->blk))
+			ok = tag_add(j, e->blk, A1FS_JOURNAL_REVOKE) && ok;
+	}
+	if (j->cap > 0)
+		memset(j->entries, 0, j->cap * sizeof(journal_entry));
+	j->nentries = 0;
+	//From now on, freeing one of these blocks has to revoke it
+	return logged_add_commit(j) && ok;
+}
+
+/**
+ * Hand the blocks freed by the running transaction to the commit being
+ * written, after those of commits that failed. Called with j->lock held. If
+ * memory runs out, they stay with the running transaction, and are given
+ * back after the next commit instead.
+ */
+static void frees_take(journal *j)
+{
+	if (j->nfrees == 0)
+		return;
+	if (j->ncommit_frees == 0)
+	{
+		//Swap the lists, keeping both buffers
+		journal_range *frees = j->commit_frees;
+		uint32_t cap = j->commit_frees_cap;
+		j->commit_frees = j->frees;
+		j->commit_frees_cap = j->frees_cap;
+		j->ncommit_frees = j->nfrees;
+		j->frees = frees;
+		j->frees_cap = cap;
+		j->nfrees = 0;
+		return;
+	}
+	uint32_t n = j->ncommit_frees + j->nfrees;
+	if (n > j->commit_frees_cap)
+	{
+		journal_range *frees = realloc(j->commit_frees, n * sizeof(journal_range));
+		if (frees == NULL)
+			return;
+		j->commit_frees = frees;
+		j->commit_frees_cap = n;
+	}
+	memcpy(j->commit_frees + j->ncommit_frees, j->frees, j->nfrees * sizeof(journal_range));
+	j->ncommit_frees = n;
+	j->nfrees = 0;
+}
+
+/** Give back the blocks freed by the commit just written; called without j->lock. */
+static void frees_release(journal *j)
+{
+	uint64_t n = 0;
+	for (uint32_t i = 0; i < j->ncommit_frees; i++)
+	{
+		if (j->free_fn != NULL)
+			j->free_fn(j->free_arg, j->commit_frees[i].start, j->commit_frees[i].len);
+		n += j->commit_frees[i].len;
+	}
+	j->ncommit_frees = 0;
+	__atomic_sub_fetch(&j->held, n, __ATOMIC_RELAXED);
+}
+
+/**
+ * Write the committed images in the log to their place and empty it. Called
+ * by the committing thread without j->lock. The blocks of the commit buffers
+ * stay noted as logged, since they go into the emptied log next.
+ */
+static bool checkpoint(journal *j)
+{
+	char *log = j->image + (size_t)j->start * A1FS_BLOCK_SIZE;
+	replay_state rs = { .image = j->image, .j = j };
+	if (log_apply(log, j->nblocks, j->start, j->size / A1FS_BLOCK_SIZE, &rs) < 0 || fdatasync(j->fd) != 0)
+		return false;
+	a1fs_journal_block *hdr = log_blk(log, 0);
+	hdr->seq = j->seq;
+	if (!flush(hdr, A1FS_BLOCK_SIZE))
+		return false;
+	j->head = 1;
+
+	pthread_mutex_lock(&j->lock);
+	//The list had room for these already, so this doesn't fail
+	j->nlogged = 0;
+	logged_add_commit(j);
+	pthread_mutex_unlock(&j->lock);
+	return true;
+}
+
+/**
+ * Write the images of the commit buffers straight to their place, which is
+ * not atomic; for a transaction bigger than the whole log.
+ */
+static bool tags_write(journal *j)
+{
+	for (uint32_t i = 0; i < j->ntags; i++)
+	{
+		if (j->tags[i].flags & A1FS_JOURNAL_REVOKE)
+			continue;
+		if (!blk_write(j, j->tags[i].blk, j->images + (size_t)i * A1FS_BLOCK_SIZE))
+			return false;
+	}
+	return fdatasync(j->fd) == 0;
+}
+
+/**
+ * Call fn for each run of private data-area blocks, by number from
+ * data_head, stopping if it returns false.
+ */
+static bool private_for_each(journal *j, bool (*fn)(journal *j, uint32_t first, uint32_t n))
+{
+	uint32_t nbits = data_blocks(j);
+	for (uint32_t b = bitmap_find_next(j->private_map, nbits, 0, true); b < nbits;)
+	{
+		uint32_t end = bitmap_find_next(j->private_map, nbits, b, false);
+		if (!fn(j, b, end - b))
+			return false;
+		b = bitmap_find_next(j->private_map, nbits, end, true);
+	}
+	return true;
+}
+
+static bool private_write_fn(journal *j, uint32_t first, uint32_t n)
+{
+	size_t off = (size_t)(first + j->data_head) * A1FS_BLOCK_SIZE;
+	return write_at(j->fd, j->image + off, (size_t)n * A1FS_BLOCK_SIZE, off);
+}
+
+static bool private_share_fn(journal *j, uint32_t first, uint32_t n)
+{
+	if (!blk_remap(j, first + j->data_head, n, false))
+		return false;
+	bitmap_clear_range(j->private_map, first, n);
+	j->nprivate -= n;
+	return true;
+}
+
+/**
+ * Write every metadata block as it is now to its place and empty the log,
+ * which is all a commit can do without the copy of the changes. Called with
+ * no handle open.
+ */
+static bool write_through(journal *j)
+{
+	if (!write_at(j->fd, j->image, (size_t)j->start * A1FS_BLOCK_SIZE, 0)
+		|| !private_for_each(j, private_write_fn) || fdatasync(j->fd) != 0)
+		return false;
+	a1fs_journal_block *hdr = log_blk(j->image + (size_t)j->start * A1FS_BLOCK_SIZE, 0);
+	hdr->seq = j->seq;
+	if (!flush(hdr, A1FS_BLOCK_SIZE))
+		return false;
+	j->head = 1;
+	pthread_mutex_lock(&j->lock);
+	j->nlogged = 0;
+	pthread_mutex_unlock(&j->lock);
+	return true;
+}
+
+/**
+ * Write the commit buffers to the log as transaction j->seq, with a single
+ * flush, checkpointing first if the log has no room. A transaction bigger
+ * than the whole log is flushed straight to its place instead, which is not
+ * atomic.
+ */
+static bool log_write(journal *j)
+{
+	if (j->ntags == 0)
+		return true;
+	uint32_t nimg = 0;
+	for (uint32_t i = 0; i < j->ntags; i++)
+		nimg += (j->tags[i].flags & A1FS_JOURNAL_REVOKE) ? 0 : 1;
+	uint32_t need = (j->ntags + A1FS_JOURNAL_TAGS - 1) / A1FS_JOURNAL_TAGS + nimg + 1;
+	if (j->head + need > j->nblocks && !checkpoint(j))
+		return false;
+	if (j->head + need > j->nblocks)
+		return tags_write(j);
+
+	char *log = j->image + (size_t)j->start * A1FS_BLOCK_SIZE;
+	uint32_t pos = j->head;
+	uint64_t sum = SUM_INIT;
+	for (uint32_t t = 0; t < j->ntags;)
+	{
+		uint32_t n = j->ntags - t;
+		if (n > A1FS_JOURNAL_TAGS)
+			n = A1FS_JOURNAL_TAGS;
+		a1fs_journal_block *d = log_blk(log, pos++);
+		memset(d, 0, A1FS_BLOCK_SIZE);
+		d->magic = A1FS_JOURNAL_MAGIC;
+		d->seq = j->seq;
+		d->type = A1FS_JOURNAL_DESC;
+		d->count = n;
+		memcpy(d + 1, &j->tags[t], n * sizeof(a1fs_journal_tag));
+		sum = blk_sum(sum, d);
+		for (uint32_t i = t; i < t + n; i++)
+		{
+			if (j->tags[i].flags & A1FS_JOURNAL_REVOKE)
+				continue;
+			char *img = (char *)log_blk(log, pos++);
+			memcpy(img, j->images + (size_t)i * A1FS_BLOCK_SIZE, A1FS_BLOCK_SIZE);
+			sum = blk_sum(sum, img);
+		}
+		t += n;
+	}
+	a1fs_journal_block *c = log_blk(log, pos);
+	memset(c, 0, A1FS_BLOCK_SIZE);
+	c->magic = A1FS_JOURNAL_MAGIC;
+	c->seq = j->seq;
+	c->type = A1FS_JOURNAL_COMMIT;
+	c->count = pos - j->head;
+	c->sum = sum;
+	pos++;
+	if (!flush(log_blk(log, j->head), (size_t)(pos - j->head) * A1FS_BLOCK_SIZE))
+		return false;
+	j->head = pos;
+	j->seq++;
+	__atomic_fetch_add(&j->commits, 1, __ATOMIC_RELAXED);
+	return true;
+}
+
+/**
+ * Commit the running transaction: wait for the handles to close, copy out
+ * what it changed, start the next one, and write the copy to the log. Called
+ * and returns with j->lock held, by the thread that set j->committing; the
+ * lock is dropped while the log is written.
+ */
+static bool journal_commit(journal *j)
+{
+	__atomic_store_n(&j->locked, true, __ATOMIC_SEQ_CST);
+	while (__atomic_load_n(&j->updates, __ATOMIC_SEQ_CST) > 0)
+		pthread_cond_wait(&j->cond, &j->lock);
+	bool copied = txn_copy(j);
+	frees_take(j);
+	uint64_t tid = j->running++;
+	//Blocks written in place as they are now, or shared again, must not change meanwhile
+	bool hold = !copied || j->nprivate >= JOURNAL_PRIVATE_MAX;
+	if (!hold)
+	{
+		__atomic_store_n(&j->locked, false, __ATOMIC_SEQ_CST);
+		pthread_cond_broadcast(&j->cond);
+	}
+	pthread_mutex_unlock(&j->lock);
+
+	//Without the whole copy, everything goes straight to its place
+	bool ok = copied ? log_write(j) : write_through(j);
+	//What the transaction freed can be given out now that it is on disk
+	if (ok)
+		frees_release(j);
+	if (ok && hold && copied)
+		ok = checkpoint(j);
+	//In place, the private blocks hold what they hold in memory now
+	if (ok && hold)
+		ok = private_for_each(j, private_share_fn);
+	j->ntags = 0;
+
+	pthread_mutex_lock(&j->lock);
+	if (hold)
+	{
+		__atomic_store_n(&j->locked, false, __ATOMIC_SEQ_CST);
+		pthread_cond_broadcast(&j->cond);
+	}
+	if (ok)
+		j->committed = tid;
+	if (j->head > j->nblocks / 2)
+		j->full = true;
+	return ok;
+}
+
+static void *journal_thread(void *arg)
+{
+	journal *j = arg;
+	pthread_mutex_lock(&j->lock);
+	while (!j->stop)
+	{
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += JOURNAL_INTERVAL_MS / 1000;
+		deadline.tv_nsec += (JOURNAL_INTERVAL_MS % 1000) * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L)
+		{
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+		while (!j->stop && !j->full)
+		{
+			if (pthread_cond_timedwait(&j->cond, &j->lock, &deadline) == ETIMEDOUT)
+				break;
+		}
+		while (!j->stop && j->committing)
+			pthread_cond_wait(&j->cond, &j->lock);
+		if (j->stop)
+			break;
+
+		j->committing = true;
+		journal_commit(j);
+		if (j->full)
+		{
+			j->full = false;
+			pthread_mutex_unlock(&j->lock);
+			checkpoint(j);
+			pthread_mutex_lock(&j->lock);
+		}
+		j->committing = false;
+		pthread_cond_broadcast(&j->cond);
+	}
+	pthread_mutex_unlock(&j->lock);
+	return NULL;
+}
+
+bool journal_start(journal *j)
+{
+	if (!j->enabled)
+		return true;
+	j->stop = false;
+	if (pthread_create(&j->thread, NULL, journal_thread, j) != 0)
+		return false;
+	j->running_thread = true;
+	return true;
+}
+
+void journal_close(journal *j)
+{
+	if (!j->enabled)
+		return;
+	if (j->running_thread)
+	{
+		pthread_mutex_lock(&j->lock);
+		j->stop = true;
+		pthread_cond_broadcast(&j->cond);
+		pthread_mutex_unlock(&j->lock);
+		pthread_join(j->thread, NULL);
+		j->running_thread = false;
+	}
+
+	pthread_mutex_lock(&j->lock);
+	while (j->committing)
+		pthread_cond_wait(&j->cond, &j->lock);
+	j->committing = true;
+	j->free_fn = NULL;
+	bool ok = journal_commit(j);
+	pthread_mutex_unlock(&j->lock);
+	if (!ok || !checkpoint(j))
+		fprintf(stderr, "Failed to write the journal\n");
+
+	j->enabled = false;
+	pthread_cond_destroy(&j->cond);
+	pthread_mutex_destroy(&j->lock);
+	free(j->shadow);
+	free(j->private_map);
+	free(j->entries);
+	free(j->logged);
+	free(j->frees);
+	free(j->commit_frees);
+	free(j->tags);
+	free(j->images);
+}
+
+/** Count a handle as closed, waking up a commit that waits for the last one. */
+static void update_done(journal *j)
+{
+	if (__atomic_sub_fetch(&j->updates, 1, __ATOMIC_SEQ_CST) == 0
+		&& __atomic_load_n(&j->locked, __ATOMIC_SEQ_CST))
+	{
+		pthread_mutex_lock(&j->lock);
+		pthread_cond_broadcast(&j->cond);
+		pthread_mutex_unlock(&j->lock);
+	}
+}
+
+void journal_begin(journal *j)
+{
+	if (!j->enabled || handle_depth++ > 0)
+		return;
+	for (;;)
+	{
+		__atomic_add_fetch(&j->updates, 1, __ATOMIC_SEQ_CST);
+		if (!__atomic_load_n(&j->locked, __ATOMIC_SEQ_CST))
+			return;
+		//A commit is waiting for the open handles; back off until it is done
+		update_done(j);
+		pthread_mutex_lock(&j->lock);
+		while (__atomic_load_n(&j->locked, __ATOMIC_SEQ_CST))
+			pthread_cond_wait(&j->cond, &j->lock);
+		pthread_mutex_unlock(&j->lock);
+	}
+}
+
+void journal_end(journal *j)
+{
+	if (!j->enabled || --handle_depth > 0)
+		return;
+	update_done(j);
+}
+
+void journal_dirty(journal *j, const void *p)
+{
+	if (!j->enabled || (const char *)p < j->image || (const char *)p >= j->image + j->size)
+		return;
+	uint32_t blk = ((const char *)p - j->image) / A1FS_BLOCK_SIZE;
+	if (blk < j->start + j->nblocks)
+		return;
+	pthread_mutex_lock(&j->lock);
+	//Until it is committed, the change must not reach the image file
+	if (!bitmap_test(j->private_map, blk - j->data_head))
+	{
+		if (blk_remap(j, blk, 1, true))
+		{
+			bitmap_set_range(j->private_map, blk - j->data_head, 1);
+			j->nprivate++;
+		}
+		//Out of mappings, or soon to be: the next commit shares them all again
+		if (j->nprivate >= JOURNAL_PRIVATE_MAX || !bitmap_test(j->private_map, blk - j->data_head))
+		{
+			j->full = true;
+			pthread_cond_broadcast(&j->cond);
+		}
+	}
+	journal_entry *e = entry_get(j, blk, true);
+	if (e != NULL)
+		e->state = JOURNAL_DIRTY;
+	pthread_mutex_unlock(&j->lock);
+}
+
+void journal_revoke(journal *j, uint32_t start, uint32_t len)
+{
+	if (!j->enabled)
+		return;
+	uint32_t first = start + j->data_head, end = first + len;
+	pthread_mutex_lock(&j->lock);
+	//Blocks changed by the running transaction, looked up the cheaper way
+	if (len <= j->nentries)
+	{
+		for (uint32_t b = first; b < end; b++)
+		{
+			journal_entry *e = entry_get(j, b, false);
+			if (e != NULL)
+				e->state = JOURNAL_REVOKED;
+		}
+	}
+	else
+	{
+		for (uint32_t i = 0; i < j->cap; i++)
+			if (j->entries[i].blk >= first && j->entries[i].blk < end)
+				j->entries[i].state = JOURNAL_REVOKED;
+	}
+	//Blocks with images in the log
+	for (uint32_t i = logged_find(j, first); i < j->nlogged && j->logged[i] < end; i++)
+	{
+		journal_entry *e = entry_get(j, j->logged[i], true);
+		if (e != NULL)
+			e->state = JOURNAL_REVOKED;
+	}
+	//File data goes through the image file
+	for (uint32_t b = bitmap_find_next(j->private_map, start + len, start, true); b < start + len;
+		 b = bitmap_find_next(j->private_map, start + len, b + 1, true))
+	{
+		if (blk_remap(j, b + j->data_head, 1, false))
+		{
+			bitmap_clear_range(j->private_map, b, 1);
+			j->nprivate--;
+		}
+	}
+	pthread_mutex_unlock(&j->lock);
+}
+
+bool journal_free(journal *j, uint32_t start, uint32_t len)
+{
+	if (!j->enabled)
+		return false;
+	pthread_mutex_lock(&j->lock);
+	journal_range *last = (j->nfrees > 0) ? &j->frees[j->nfrees - 1] : NULL;
+	if (last != NULL && last->start + last->len == start)
+	{
+		last->len += len;
+	}
+	else
+	{
+		if (j->nfrees == j->frees_cap)
+		{
+			uint32_t cap = (j->frees_cap > 0) ? j->frees_cap * 2 : 64;
+			journal_range *frees = realloc(j->frees, cap * sizeof(journal_range));
+			if (frees == NULL)
+			{
+				pthread_mutex_unlock(&j->lock);
+				return false;
+			}
+			j->frees = frees;
+			j->frees_cap = cap;
+		}
+		j->frees[j->nfrees++] = (journal_range){ .start = start, .len = len };
+	}
+	__atomic_add_fetch(&j->held, len, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&j->lock);
+	return true;
+}
+
+uint64_t journal_held(journal *j)
+{
+	return __atomic_load_n(&j->held, __ATOMIC_RELAXED);
+}
+
+bool journal_force(journal *j)
+{
+	if (!j->enabled)
+		return true;
+	pthread_mutex_lock(&j->lock);
+	uint64_t target = j->running;
+	bool ok = true;
+	while (ok && j->committed < target)
+	{
+		//Whoever commits next takes the changes of every waiter along
+		if (j->committing)
+		{
+			pthread_cond_wait(&j->cond, &j->lock);
+			continue;
+		}
+		j->committing = true;
+		ok = journal_commit(j);
+		j->committing = false;
+		pthread_cond_broadcast(&j->cond);
+	}
+	pthread_mutex_unlock(&j->lock);
+	return ok;
+}
+
+uint64_t journal_commits(journal *j)
+{
+	return __atomic_load_n(&j->commits, __ATOMIC_RELAXED);
+}
+
+bool journal_private(journal *j, const void *p)
+{
+	return j->enabled && (const char *)p >= j->image && (const char *)p < j->image + (size_t)j->start * A1FS_BLOCK_SIZE;
+}
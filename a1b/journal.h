@@ -0,0 +1,246 @@
+/**
+ * a1fs metadata journal header file.
+ *
+ * Metadata is changed in place in the mapping of the image, and the kernel
+ * writes the pages back whenever and in whatever order it likes, so a crash
+ * can leave an operation half done on disk. With A1FS_FEATURE_JOURNAL, the
+ * metadata blocks changed since the last commit are first written to the
+ * journal (see a1fs_journal_block), and mounting replays the log.
+ *
+ * The blocks from the superblock to the inode table are found by comparing
+ * them with a copy made at the last commit; directory, extent and B+tree
+ * blocks in the data area are named by the code that changes them, with
+ * journal_dirty(), before they are changed. A thread holds a handle while it
+ * holds any inode lock, and a commit waits for the handles to close, so that
+ * it never copies an operation halfway through.
+ *
+ * Metadata must not reach its place in the image file before it is in the
+ * log, so the blocks before the journal are mapped private, and so is each
+ * data-area block from the first time it is noted until it is freed: the
+ * kernel never writes them back. A checkpoint writes the committed images in
+ * the log to their place, and empties it. Data blocks freed by a transaction
+ * go back to the allocator only once it is on disk.
+ *
+ * fsync() commits and waits for the commit; fsync() calls that come while a
+ * commit is being written are all covered by the next one. A background
+ * thread commits every JOURNAL_INTERVAL_MS and checkpoints the log once it is
+ * half full: it flushes the blocks in the log to their place and empties it.
+ * No commit can be written meanwhile, so an fsync() that comes during a
+ * checkpoint also waits for it, and one whose commit doesn't fit in the log
+ * does a checkpoint itself.
+ */
+
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "a1fs.h"
+
+
+/** How long a change may wait for a commit, in milliseconds. */
+#define JOURNAL_INTERVAL_MS 5000
+
+/**
+ * Number of private data-area blocks after which a checkpoint maps them all
+ * shared again, keeping the handles out meanwhile; each private block may
+ * split the mapping of the image.
+ */
+#define JOURNAL_PRIVATE_MAX 4096
+
+/** A data-area block changed or freed by the running transaction. */
+typedef struct journal_entry {
+	/** Block number in the image; 0 for an unused slot. */
+	uint32_t blk;
+	/** JOURNAL_DIRTY or JOURNAL_REVOKED. */
+	uint32_t state;
+
+} journal_entry;
+
+#define JOURNAL_DIRTY 1
+#define JOURNAL_REVOKED 2
+
+/** A run of data blocks freed by a transaction that is not on disk yet. */
+typedef struct journal_range {
+	uint32_t start;
+	uint32_t len;
+
+} journal_range;
+
+/**
+ * Give data blocks [start, start + len) back to the allocator, once the
+ * transaction that freed them is on disk.
+ */
+typedef void (*journal_free_fn)(void *arg, uint32_t start, uint32_t len);
+
+/** Runtime state of the journal of a mounted image. */
+typedef struct journal {
+	/** False if the image has no journal; every call does nothing then. */
+	bool enabled;
+	char *image;
+	size_t size;
+	/** Image file, which checkpoints write to. */
+	int fd;
+	/** First block and number of blocks of the journal. */
+	uint32_t start;
+	uint32_t nblocks;
+	/** First data block; the data block numbers of the callers count from it. */
+	uint32_t data_head;
+	/** Blocks [0, start) as of the last commit. */
+	char *shadow;
+
+	/** Number of open handles; changed with atomics. */
+	uint32_t updates;
+	/** Set while a commit waits for the handles to close; none open then. */
+	bool locked;
+
+	/** Protects the fields below, except where noted. */
+	pthread_mutex_t lock;
+	/**
+	 * Broadcast when the last handle closes during a commit, when the
+	 * commit is over, and when the thread has work to do.
+	 */
+	pthread_cond_t cond;
+	/** Data-area blocks of the running transaction, hashed by number. */
+	journal_entry *entries;
+	uint32_t nentries;
+	uint32_t cap;
+	/** Data-area blocks with an image in the log, sorted. */
+	uint32_t *logged;
+	uint32_t nlogged;
+	uint32_t logged_cap;
+	/** Data-area blocks mapped private, by number from data_head. */
+	unsigned char *private_map;
+	uint32_t nprivate;
+	/** Data blocks freed by the running transaction, held back until it is on disk. */
+	journal_range *frees;
+	uint32_t nfrees;
+	uint32_t frees_cap;
+	/** Running transaction, and the last one that is on disk. */
+	uint64_t running;
+	uint64_t committed;
+	/** A commit or a checkpoint is in progress; only one thread does either. */
+	bool committing;
+	/** The log is more than half full; the thread checkpoints it. */
+	bool full;
+
+	/** Owned by the committing thread: the commit being written. */
+	a1fs_journal_tag *tags;
+	char *images;
+	uint32_t ntags;
+	uint32_t tags_cap;
+	/** Owned by the committing thread: next transaction and where it goes. */
+	uint64_t seq;
+	uint32_t head;
+	/**
+	 * Owned by the committing thread: data blocks freed by the commit being
+	 * written, and by those that failed to be.
+	 */
+	journal_range *commit_frees;
+	uint32_t ncommit_frees;
+	uint32_t commit_frees_cap;
+	journal_free_fn free_fn;
+	void *free_arg;
+	/** Number of data blocks held back in either list; read with atomics. */
+	uint64_t held;
+
+	/** Number of transactions written to the log so far; read with atomics. */
+	uint64_t commits;
+	/** True while the thread is running. */
+	bool running_thread;
+	/** Tells the thread to exit. */
+	bool stop;
+	pthread_t thread;
+
+} journal;
+
+/**
+ * Replay the journal of an image, if it has one, before it is used.
+ *
+ * @return  number of transactions replayed; -1 if the journal is corrupt.
+ */
+int journal_replay(void *image, size_t size);
+
+/**
+ * Set up the journal of a mounted image; enabled is false if it has none.
+ * The blocks before the journal are mapped private from fd from now on.
+ *
+ * @param fd       the image file, open for writing.
+ * @param free_fn  called with the data blocks freed by each transaction once
+ *                 it is on disk; see journal_free().
+ * @return         true on success; false if out of memory, or if the image
+ *                 can't be mapped a block at a time.
+ */
+bool journal_open(journal *j, void *image, size_t size, int fd, journal_free_fn free_fn, void *arg);
+
+/**
+ * Start the thread that commits and checkpoints in the background.
+ *
+ * @return  true on success or without a journal; false if the thread could
+ *          not be created.
+ */
+bool journal_start(journal *j);
+
+/**
+ * Stop the thread, commit what is left, checkpoint the log and free the
+ * resources created in journal_open(). Blocks freed since the last
+ * journal_force() stay allocated, as free_fn may no longer be called; the
+ * caller forces the journal first.
+ */
+void journal_close(journal *j);
+
+/**
+ * Open a handle for the calling thread, waiting for a commit in progress;
+ * handles nest. Called when an inode is locked.
+ */
+void journal_begin(journal *j);
+
+/** Close a handle opened with journal_begin(). */
+void journal_end(journal *j);
+
+/**
+ * Note that the block of the image that holds p is about to be changed by
+ * the running transaction. Blocks before the journal need no note, and
+ * neither does memory outside the image.
+ */
+void journal_dirty(journal *j, const void *p);
+
+/**
+ * Note that data blocks [start, start + len) are about to be freed, so that
+ * older images of them in the log are not replayed over what they hold next.
+ * They are mapped shared again, since they may be given to file data.
+ */
+void journal_revoke(journal *j, uint32_t start, uint32_t len);
+
+/**
+ * Hold back data blocks [start, start + len), freed by the running
+ * transaction, until it is on disk: if they were given to another file
+ * before, a crash could leave the last committed metadata pointing at what
+ * that file wrote. They are handed to free_fn after the commit.
+ *
+ * @return  true if the blocks are held back; false without a journal, or if
+ *          out of memory, and then the caller frees them right away.
+ */
+bool journal_free(journal *j, uint32_t start, uint32_t len);
+
+/** Number of data blocks held back by journal_free() that are not given back yet. */
+uint64_t journal_held(journal *j);
+
+/**
+ * Commit everything done so far and wait for it to be on disk. The caller
+ * must hold no handle.
+ *
+ * @return  true on success; false on an I/O error.
+ */
+bool journal_force(journal *j);
+
+/** Number of transactions written to the log so far. */
+uint64_t journal_commits(journal *j);
+
+/**
+ * Whether p is in the blocks before the journal, which are mapped private,
+ * so that the image file doesn't have what they hold now.
+ */
+bool journal_private(journal *j, const void *p);
@@ -40,6 +40,18 @@ typedef struct mkfs_opts {
 	bool force;
 	/** Zero out image contents. */
 	bool zero;
+	/** Index large directories by name hash. */
+	bool dir_index;
+	/** Use variable-length directory entries. */
+	bool compact_dirs;
+	/** Data blocks per allocation group; 0 for no groups. */
+	size_t group_blocks;
+	/** Size of an inode in bytes; 0 for the default. */
+	size_t inode_size;
+	/** Pack small files into shared fragment blocks. */
+	bool fragments;
+	/** Number of blocks of the metadata journal; 0 for none. */
+	size_t journal_blocks;
 
 } mkfs_opts;
 
@@ -54,17 +66,33 @@ Options:\n\
     -h      print help and exit\n\
     -f      force format - overwrite existing a1fs file system\n\
     -z      zero out image contents\n\
+    -x      keep an on-disk hash index for large directories\n\
+    -c      use compact variable-length directory entries\n\
+    -g num  split the file system into allocation groups of num data\n\
+            blocks (rounded up to a multiple of 64), each with its own\n\
+            inodes, free counters and lock\n\
+    -I size inode size in bytes: a power of 2 from 64 to 1024; inodes\n\
+            larger than 64 bytes keep the first extents of a file,\n\
+            or the whole data of a file that fits, in the inode\n\
+    -F      pack files of up to half a block into shared blocks, in\n\
+            fragments of %d bytes\n\
+    -j num  log metadata changes to a journal of num blocks (at least\n\
+            %d) before they are made in place, so that a crash leaves\n\
+            no operation half done\n\
 ";
 
+/** Smallest journal: the header and room for a few transactions. */
+#define MKFS_JOURNAL_MIN 16
+
 static void print_help(FILE *f, const char *progname)
 {
-	fprintf(f, help_str, progname, A1FS_BLOCK_SIZE);
+	fprintf(f, help_str, progname, A1FS_BLOCK_SIZE, A1FS_FRAG_SIZE, MKFS_JOURNAL_MIN);
 }
 
 static bool parse_args(int argc, char *argv[], mkfs_opts *opts)
 {
 	char o;
-	while ((o = getopt(argc, argv, "i:hfvz")) != -1)
+	while ((o = getopt(argc, argv, "i:hfvzxcg:I:Fj:")) != -1)
 	{
 		switch (o)
 		{
@@ -81,6 +109,40 @@ static bool parse_args(int argc, char *argv[], mkfs_opts *opts)
 		case 'z':
 			opts->zero = true;
 			break;
+		case 'x':
+			opts->dir_index = true;
+			break;
+		case 'c':
+			opts->compact_dirs = true;
+			break;
+		case 'g':
+			opts->group_blocks = strtoul(optarg, NULL, 10);
+			if (opts->group_blocks == 0)
+			{
+				fprintf(stderr, "Invalid group size\n");
+				return false;
+			}
+			break;
+		case 'I':
+			opts->inode_size = strtoul(optarg, NULL, 10);
+			if (opts->inode_size < sizeof(a1fs_inode) || opts->inode_size > A1FS_INODE_SIZE_MAX
+			    || (opts->inode_size & (opts->inode_size - 1)) != 0)
+			{
+				fprintf(stderr, "Invalid inode size\n");
+				return false;
+			}
+			break;
+		case 'F':
+			opts->fragments = true;
+			break;
+		case 'j':
+			opts->journal_blocks = strtoul(optarg, NULL, 10);
+			if (opts->journal_blocks < MKFS_JOURNAL_MIN)
+			{
+				fprintf(stderr, "Invalid journal size\n");
+				return false;
+			}
+			break;
 
 		case '?':
 			return false;
@@ -135,14 +197,31 @@ static bool mkfs(void *image, size_t size, mkfs_opts *opts)
 
 	unsigned int num_blocks = size / A1FS_BLOCK_SIZE;
 	unsigned int num_i_nodes = opts->n_inodes;
-	unsigned int blk_inodes_each = A1FS_BLOCK_SIZE / sizeof(a1fs_inode);
+
+	//Groups: every group gets the same number of inodes, a multiple of 64 so
+	//that groups never share a word of a bitmap
+	unsigned int groups = 1, group_blocks = 0, group_inodes = 0, desc_blk = 0;
+	if (opts->group_blocks > 0)
+	{
+		group_blocks = (opts->group_blocks + 63) / 64 * 64;
+		groups = mkfs_helper(group_blocks, num_blocks);
+		group_inodes = (mkfs_helper(groups, num_i_nodes) + 63) / 64 * 64;
+		num_i_nodes = groups * group_inodes;
+		desc_blk = mkfs_helper(A1FS_BLOCK_SIZE, groups * sizeof(a1fs_group));
+	}
+	size_t inode_size = (opts->inode_size > 0) ? opts->inode_size : sizeof(a1fs_inode);
+	unsigned int blk_inodes_each = A1FS_BLOCK_SIZE / inode_size;
 
 	unsigned int arr_bitmap[3] = {blk_inodes_each, (unsigned int)(A1FS_BLOCK_SIZE), num_i_nodes};
 	dr_arr(arr_bitmap);
 	unsigned int inode_tbl = arr_bitmap[0];
 	unsigned int blk_ibmp = arr_bitmap[1];
 
-	int remained_block = num_blocks - inode_tbl - blk_ibmp;
+	unsigned int journal_blk = opts->journal_blocks;
+	int remained_block = num_blocks - inode_tbl - blk_ibmp - desc_blk - journal_blk;
+	//The fragment map has a word for each block that may be a data block
+	unsigned int frag_blk = (opts->fragments && remained_block > 0) ? mkfs_helper(A1FS_BLOCK_SIZE, remained_block * sizeof(uint16_t)) : 0;
+	remained_block -= frag_blk;
 
 	if ((remained_block = check_blk_err(remained_block)) == -1)
 	{
@@ -154,26 +233,76 @@ static bool mkfs(void *image, size_t size, mkfs_opts *opts)
 	bblk->magic = A1FS_MAGIC;
 	bblk->num_inodes = num_i_nodes;
 	bblk->num_blocks = num_blocks;
+	bblk->hz_features = (opts->dir_index ? A1FS_FEATURE_DIR_INDEX : 0) |
+	                    (opts->compact_dirs ? A1FS_FEATURE_COMPACT_DIRS : 0);
+	if (inode_size > sizeof(a1fs_inode))
+	{
+		bblk->hz_features |= A1FS_FEATURE_LARGE_INODES | A1FS_FEATURE_INLINE_DATA;
+		bblk->hz_inode_size = inode_size;
+	}
 
 	unsigned int databitmap_blk = mkfs_helper(A1FS_BLOCK_SIZE, remained_block);
 	int useless_bit = databitmap_blk / A1FS_BLOCK_SIZE;
 	databitmap_blk -= useless_bit;
 
-	bblk->num_free_blocks = num_blocks - 1 - blk_ibmp - inode_tbl - databitmap_blk;
-	bblk->num_free_inodes = opts->n_inodes - 1;
+	bblk->num_free_blocks = num_blocks - 1 - desc_blk - blk_ibmp - inode_tbl - databitmap_blk - frag_blk - journal_blk;
+	bblk->num_free_inodes = num_i_nodes - 1;
+	bblk->hz_alloc_cursor = 0;
 
-	a1fs_blk_t d_bmap = 1;
+	a1fs_blk_t d_bmap = 1 + desc_blk;
 	bblk->hz_bitmap_data = d_bmap;
-	a1fs_ino_t inode_table = 1 + databitmap_blk + blk_ibmp;
+	a1fs_ino_t inode_table = d_bmap + databitmap_blk + frag_blk + blk_ibmp;
 	bblk->hz_inode_table = inode_table;
 	a1fs_ino_t inode_bmp = inode_table - blk_ibmp;
 	bblk->hz_bitmap_inode = inode_bmp;
-	a1fs_blk_t d_blk_first = inode_table + inode_tbl;
+	a1fs_blk_t d_blk_first = inode_table + inode_tbl + journal_blk;
 	bblk->hz_datablk_head = d_blk_first;
 
+	if (opts->fragments)
+	{
+		bblk->hz_features |= A1FS_FEATURE_FRAGMENTS;
+		bblk->hz_frag_map = d_bmap + databitmap_blk;
+	}
+
+	//Clear the group descriptors, both bitmaps, the fragment map, the inode
+	//table and the journal, so that nothing left there passes for a transaction
+	memset(image + A1FS_BLOCK_SIZE, 0, (d_blk_first - 1) * A1FS_BLOCK_SIZE);
+
+	if (journal_blk > 0)
+	{
+		bblk->hz_features |= A1FS_FEATURE_JOURNAL;
+		bblk->hz_journal = inode_table + inode_tbl;
+		bblk->hz_journal_blocks = journal_blk;
+		a1fs_journal_block *hdr = image + bblk->hz_journal * A1FS_BLOCK_SIZE;
+		hdr->magic = A1FS_JOURNAL_MAGIC;
+		hdr->seq = 1;
+		hdr->type = A1FS_JOURNAL_HEADER;
+	}
+
+	if (opts->group_blocks > 0)
+	{
+		bblk->hz_features |= A1FS_FEATURE_GROUPS;
+		bblk->hz_group_desc = 1;
+		bblk->hz_groups = groups;
+		bblk->hz_group_blocks = group_blocks;
+		bblk->hz_group_inodes = group_inodes;
+		a1fs_group *desc = image + A1FS_BLOCK_SIZE;
+		unsigned int data_blks = bblk->num_free_blocks;
+		for (unsigned int i = 0; i < groups; i++)
+		{
+			unsigned int first = i * group_blocks;
+			desc[i].free_blocks = (first >= data_blks) ? 0 : min(group_blocks, data_blks - first);
+			desc[i].free_inodes = group_inodes;
+			desc[i].alloc_cursor = first;
+		}
+		//The root directory
+		desc[0].free_inodes--;
+	}
+
 	//init root dir
 	a1fs_inode *head_node = image + bblk->hz_inode_table * A1FS_BLOCK_SIZE;
 	init_dir(head_node, S_IFDIR | 0777, 0);
+	update_bitmap(false, 0, image + bblk->hz_bitmap_inode * A1FS_BLOCK_SIZE);
 
 	return true;
 }
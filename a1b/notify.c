@@ -0,0 +1,60 @@
+/**
+ * a1fs kernel cache invalidation implementation.
+ */
+
+#include <string.h>
+
+#include "notify.h"
+
+
+static void notify_batch(void *arg, void *items, uint32_t count)
+{
+	notify_queue *nq = arg;
+	notice *notices = items;
+	for (uint32_t i = 0; i < count; i++)
+		nq->fn(nq->arg, &notices[i]);
+	__atomic_fetch_add(&nq->sent, count, __ATOMIC_RELAXED);
+}
+
+/** Many changes in a row to one directory or file need one notice. */
+static bool notify_merge(void *last, const void *item)
+{
+	const notice *l = last, *n = item;
+	return l->entry == n->entry && l->ino == n->ino && l->off == n->off && strcmp(l->name, n->name) == 0;
+}
+
+bool notify_start(notify_queue *nq, notify_fn fn, void *arg)
+{
+	nq->sent = 0;
+	nq->fn = fn;
+	nq->arg = arg;
+	return workq_start(&nq->q, sizeof(notice), 1, 0, notify_batch, notify_merge, nq);
+}
+
+void notify_stop(notify_queue *nq)
+{
+	workq_stop(&nq->q);
+}
+
+void notify_inode(notify_queue *nq, a1fs_ino_t ino, off_t off)
+{
+	if (!workq_running(&nq->q))
+		return;
+	notice n = { .entry = false, .ino = ino, .off = off, .name = "" };
+	workq_add(&nq->q, &n, 1);
+}
+
+void notify_entry(notify_queue *nq, a1fs_ino_t dir, const char *name)
+{
+	if (!workq_running(&nq->q))
+		return;
+	notice n = { .entry = true, .ino = dir, .off = -1 };
+	strncpy(n.name, name, A1FS_NAME_MAX - 1);
+	n.name[A1FS_NAME_MAX - 1] = '\0';
+	workq_add(&nq->q, &n, 1);
+}
+
+uint64_t notify_count(notify_queue *nq)
+{
+	return __atomic_load_n(&nq->sent, __ATOMIC_RELAXED);
+}
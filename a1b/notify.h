@@ -0,0 +1,71 @@
+/**
+ * a1fs kernel cache invalidation header file.
+ *
+ * With long entry and attribute timeouts, the kernel has to be told when a
+ * name or the attributes of an inode it may have cached change. The notices
+ * are queued by the requests that make the changes and sent by a background
+ * thread: the kernel may hold the lock of a directory while it waits for the
+ * request that changes it, so sending a notice from that request could
+ * deadlock.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "a1fs.h"
+#include "workq.h"
+
+
+/** A change the kernel has to be told about. */
+typedef struct notice {
+	/** Invalidate the name in directory ino instead of inode ino itself. */
+	bool entry;
+	a1fs_ino_t ino;
+	/** Cached data of the inode from this offset on is dropped too; -1 for none. */
+	off_t off;
+	char name[A1FS_NAME_MAX];
+
+} notice;
+
+/** Send a notice to the kernel; called from the notify thread. */
+typedef void (*notify_fn)(void *arg, const notice *n);
+
+/** Queue of notices and the thread that sends them. */
+typedef struct notify_queue {
+	/** Queued notices, in the order they were made. */
+	workq q;
+	/** Total number of notices sent so far. */
+	uint64_t sent;
+	notify_fn fn;
+	void *arg;
+
+} notify_queue;
+
+/**
+ * Start the notify thread.
+ *
+ * @return  true on success; false if the thread could not be created.
+ */
+bool notify_start(notify_queue *nq, notify_fn fn, void *arg);
+
+/**
+ * Send the queued notices, stop the thread and free the resources created in
+ * notify_start(). Does nothing if the thread is not running.
+ */
+void notify_stop(notify_queue *nq);
+
+/**
+ * Tell the kernel that the attributes of inode ino changed, and its data
+ * from offset off on if off is not negative. Does nothing if the thread is
+ * not running; a notice just like the last one queued is dropped.
+ */
+void notify_inode(notify_queue *nq, a1fs_ino_t ino, off_t off);
+
+/** Tell the kernel that name in directory dir changed; see notify_inode(). */
+void notify_entry(notify_queue *nq, a1fs_ino_t dir, const char *name);
+
+/** Total number of notices sent so far. */
+uint64_t notify_count(notify_queue *nq);
@@ -31,6 +31,11 @@
 static const struct fuse_opt opt_spec[] = {
 	A1FS_OPT("-h"    , help),
 	A1FS_OPT("--help", help),
+	A1FS_OPT("zero_holes", zero_holes),
+	A1FS_OPT("discard", discard),
+	A1FS_OPT("cache_timeout=%lf", cache_timeout),
+	A1FS_OPT("writeback_cache", writeback_cache),
+	A1FS_OPT("pin_workers", pin_workers),
 	FUSE_OPT_END
 };
 
@@ -38,12 +43,23 @@ static const char *help_str = "\
 Usage: %s image mountpoint [options]\n\
 \n\
 Mount a1fs image file under mount point directory. Use fusermount(1) to \n\
-unmount. Only single-threaded mount is supported; -s FUSE option is implied.\n\
+unmount. Requests are served by multiple threads unless -s is given.\n\
 \n\
 general options:\n\
     -o opt,[opt...]        mount options\n\
     -h   --help            print help\n\
 \n\
+a1fs options:\n\
+    -o zero_holes          store written blocks of zeros as holes\n\
+    -o discard             punch freed blocks out of the image file\n\
+    -o cache_timeout=T     let the kernel cache names and attributes for\n\
+                           T seconds (default: 1); a1fs_ll tells the kernel\n\
+                           when they change, so T can be long\n\
+    -o writeback_cache     let the kernel cache written data and write it\n\
+                           back later (a1fs_ll only)\n\
+    -o pin_workers         give each worker thread its own /dev/fuse and\n\
+                           pin it to a CPU (a1fs_ll only)\n\
+\n\
 ";
 
 // Callback for fuse_opt_parse()
@@ -62,6 +78,7 @@ static int opt_proc(void *data, const char *arg, int key, struct fuse_args *out)
 
 bool a1fs_opt_parse(struct fuse_args *args, a1fs_opts *opts)
 {
+	opts->cache_timeout = A1FS_CACHE_TIMEOUT;
 	if (fuse_opt_parse(args, opts, opt_spec, opt_proc) != 0) return false;
 
 	//NOTE: printing to stderr to keep it consistent with FUSE
@@ -74,13 +91,5 @@ bool a1fs_opt_parse(struct fuse_args *args, a1fs_opts *opts)
 		return false;
 	}
 
-	// Only single-threaded mount is supported
-	fuse_opt_add_arg(args, "-s");
-	// Limit the size of reads and writes to 4K
-	fuse_opt_add_arg(args, "-o");
-	fuse_opt_add_arg(args, "max_read=4096");
-	fuse_opt_add_arg(args, "-o");
-	fuse_opt_add_arg(args, "max_write=4096");
-
 	return true;
 }
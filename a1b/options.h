@@ -23,12 +23,29 @@
 #include <fuse_opt.h>
 
 
+/** Seconds the kernel caches names and attributes for by default. */
+#define A1FS_CACHE_TIMEOUT 1.0
+
+/** Largest read or write request, in bytes (1 MiB). */
+#define A1FS_IO_MAX (1 << 20)
+#define A1FS_IO_MAX_STR "1048576"
+
 /** a1fs command line options. */
 typedef struct a1fs_opts {
 	/** a1fs image file path. */
 	const char *img_path;
 	/** Print help and exit. FUSE option. */
 	int help;
+	/** Store written blocks of zeros as holes. */
+	int zero_holes;
+	/** Punch freed blocks out of the image file. */
+	int discard;
+	/** Seconds the kernel may cache names and attributes. */
+	double cache_timeout;
+	/** Let the kernel cache written data and write it back later. */
+	int writeback_cache;
+	/** Give each worker thread its own /dev/fuse and pin it to a CPU. */
+	int pin_workers;
 
 } a1fs_opts;
 
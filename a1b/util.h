@@ -21,6 +21,7 @@
 #include <assert.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 
 
 /** Check if x is a power of 2. */
@@ -42,3 +43,21 @@ static inline size_t align_up(size_t x, size_t alignment)
 	assert(is_powerof2(alignment));
 	return (x + alignment - 1) & (~alignment + 1);
 }
+
+/** Number of units of the given size that hold x bytes. */
+static inline uint64_t div_round_up(uint64_t x, uint64_t unit)
+{
+	return (x + unit - 1) / unit;
+}
+
+/** 32-bit FNV-1a hash of a file name of len bytes. */
+static inline uint32_t name_hash(const char *name, size_t len)
+{
+	uint32_t h = 2166136261u;
+	for (size_t i = 0; i < len; i++)
+	{
+		h ^= (unsigned char)name[i];
+		h *= 16777619u;
+	}
+	return h;
+}
@@ -0,0 +1,130 @@
+/**
+ * a1fs background work queue implementation.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "workq.h"
+
+
+static void *workq_thread(void *arg)
+{
+	workq *q = arg;
+	pthread_mutex_lock(&q->lock);
+	for (;;)
+	{
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += q->interval_ms / 1000;
+		deadline.tv_nsec += (q->interval_ms % 1000) * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L)
+		{
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+		while (!q->stop && q->weight < q->batch)
+		{
+			if (q->interval_ms == 0)
+				pthread_cond_wait(&q->cond, &q->lock);
+			else if (pthread_cond_timedwait(&q->cond, &q->lock, &deadline) == ETIMEDOUT)
+				break;
+		}
+
+		//Take the whole queue, so that the callback runs without the lock
+		char *items = q->items;
+		uint32_t count = q->count;
+		bool stop = q->stop;
+		q->items = NULL;
+		q->count = q->cap = 0;
+		q->weight = 0;
+		pthread_mutex_unlock(&q->lock);
+		if (count > 0)
+			q->fn(q->arg, items, count);
+		free(items);
+		if (stop)
+			return NULL;
+		pthread_mutex_lock(&q->lock);
+	}
+}
+
+bool workq_start(workq *q, size_t item_size, uint64_t batch, unsigned int interval_ms,
+                 workq_fn fn, workq_merge_fn merge, void *arg)
+{
+	q->items = NULL;
+	q->count = q->cap = 0;
+	q->item_size = item_size;
+	q->weight = 0;
+	q->batch = batch;
+	q->interval_ms = interval_ms;
+	q->stop = false;
+	q->fn = fn;
+	q->merge = merge;
+	q->arg = arg;
+	if (pthread_mutex_init(&q->lock, NULL) != 0)
+		return false;
+	if (pthread_cond_init(&q->cond, NULL) != 0)
+	{
+		pthread_mutex_destroy(&q->lock);
+		return false;
+	}
+	if (pthread_create(&q->thread, NULL, workq_thread, q) != 0)
+	{
+		pthread_cond_destroy(&q->cond);
+		pthread_mutex_destroy(&q->lock);
+		return false;
+	}
+	__atomic_store_n(&q->running, true, __ATOMIC_RELEASE);
+	return true;
+}
+
+void workq_stop(workq *q)
+{
+	if (!workq_running(q))
+		return;
+	pthread_mutex_lock(&q->lock);
+	q->stop = true;
+	pthread_cond_signal(&q->cond);
+	pthread_mutex_unlock(&q->lock);
+	pthread_join(q->thread, NULL);
+	__atomic_store_n(&q->running, false, __ATOMIC_RELEASE);
+	free(q->items);
+	q->items = NULL;
+	pthread_cond_destroy(&q->cond);
+	pthread_mutex_destroy(&q->lock);
+}
+
+bool workq_running(workq *q)
+{
+	return __atomic_load_n(&q->running, __ATOMIC_ACQUIRE);
+}
+
+void workq_add(workq *q, const void *item, uint64_t weight)
+{
+	if (!workq_running(q))
+		return;
+	pthread_mutex_lock(&q->lock);
+	if (q->count > 0 && q->merge != NULL && q->merge(q->items + (size_t)(q->count - 1) * q->item_size, item))
+		goto queued;
+	if (q->count == q->cap)
+	{
+		uint32_t cap = (q->cap > 0) ? q->cap * 2 : 64;
+		char *items = realloc(q->items, cap * q->item_size);
+		if (items == NULL)
+		{
+			pthread_mutex_unlock(&q->lock);
+			return;
+		}
+		q->items = items;
+		q->cap = cap;
+	}
+	memcpy(q->items + (size_t)q->count * q->item_size, item, q->item_size);
+	q->count++;
+queued:
+	q->weight += weight;
+	if (q->weight >= q->batch)
+		pthread_cond_signal(&q->cond);
+	pthread_mutex_unlock(&q->lock);
+}
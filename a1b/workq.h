@@ -0,0 +1,82 @@
+/**
+ * a1fs background work queue header file.
+ *
+ * Requests queue small fixed-size items, and a thread of the queue takes them
+ * all at once and hands them to a callback, without the lock, so that the
+ * requests never wait for the work. Used for online discard and for the
+ * notices sent to the kernel.
+ */
+
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+/**
+ * Do the work of count items, in the order they were queued; called from the
+ * thread of the queue. The items are freed when it returns.
+ */
+typedef void (*workq_fn)(void *arg, void *items, uint32_t count);
+
+/**
+ * Fold item into last, the item queued last, if it can be; returns false if
+ * item has to be queued by itself.
+ */
+typedef bool (*workq_merge_fn)(void *last, const void *item);
+
+/** Queue of items and the thread that works on them. */
+typedef struct workq {
+	/** Protects all the fields below except the callbacks. */
+	pthread_mutex_t lock;
+	/** Signalled when the batch is full or the thread must stop. */
+	pthread_cond_t cond;
+	/** Queued items, in the order they were queued. */
+	char *items;
+	uint32_t count;
+	uint32_t cap;
+	size_t item_size;
+	/** Weight of the queued items, and the weight that wakes the thread up. */
+	uint64_t weight;
+	uint64_t batch;
+	/** How long items may wait for a batch, in milliseconds; 0 for no limit. */
+	unsigned int interval_ms;
+	/** True while the thread is running; items are only queued then. */
+	bool running;
+	/** Tells the thread to work on what is left and exit. */
+	bool stop;
+	workq_fn fn;
+	workq_merge_fn merge;
+	void *arg;
+	pthread_t thread;
+
+} workq;
+
+/**
+ * Start the thread of the queue.
+ *
+ * @param batch        queued weight that wakes the thread up.
+ * @param interval_ms  how long items may wait for a batch; 0 for no limit.
+ * @param merge        NULL if items are never folded together.
+ * @return             true on success; false if the thread could not be
+ *                     created.
+ */
+bool workq_start(workq *q, size_t item_size, uint64_t batch, unsigned int interval_ms,
+                 workq_fn fn, workq_merge_fn merge, void *arg);
+
+/**
+ * Work on the queued items, stop the thread and free the resources created
+ * in workq_start(). Does nothing if the thread is not running.
+ */
+void workq_stop(workq *q);
+
+/** Whether the thread is running, so that items would be queued. */
+bool workq_running(workq *q);
+
+/**
+ * Queue a copy of item, of the given weight. Does nothing if the thread is
+ * not running; if out of memory, the item is dropped.
+ */
+void workq_add(workq *q, const void *item, uint64_t weight);